@@ -29,6 +29,10 @@
 .equ BCBP_MODTYPE_EFI, 0x06
 .equ BCBP_MODTYPE_CONFIG, 0x07
 .equ BCBP_MODTYPE_DRIVER, 0x08
+.equ BCBP_MODTYPE_SMP, 0x09
+.equ BCBP_MODTYPE_PAGING, 0x0A
+.equ BCBP_MODTYPE_FRAMEBUFFER, 0x0B
+.equ BCBP_MODTYPE_MEMMAP, 0x0C
 
 // Magic number for BCBP header
 .equ BCBP_MAGIC, 0x424C4348  // 'BLCH'
@@ -0,0 +1,213 @@
+/*
+ * BloodHorn Bootloader
+ *
+ * This file is part of BloodHorn and is licensed under the MIT License.
+ * See the root of the repository for license details.
+ */
+#include <stdint.h>
+#include "compat.h"
+#include <string.h>
+#include "bcbp_loader.h"
+#include "../memmap.h"
+#include "../kfile.h"
+#include "../elf.h"
+#include "../paging.h"
+#include "../fwinfo.h"
+#include "../smp.h"
+#include "../../secure.h"
+
+static struct kfile bcbp_file;
+static struct smp_info bcbp_smp;
+static struct paging_ctx bcbp_pt;
+static struct bcbp_paging bcbp_paging_info;
+static struct bcbp_framebuffer bcbp_fb;
+static struct bcbp_mmap_entry bcbp_mmap[MEMMAP_MAX_ENTRIES];
+
+// Reads the whole of kf into pages placed by memmap; pref 0 means anywhere.
+static int bcbp_load_flat(struct kfile* kf, uint64_t pref, uint64_t* addr) {
+    struct memmap_request req = {0};
+    req.size = kf->size;
+    req.align = MEMMAP_PAGE_SIZE;
+    req.pref_addr = pref;
+    req.min_addr = 0x100000;
+    req.top_down = pref == 0;
+    req.kernel = 1;
+    if (kf->size == 0 || memmap_place(&req, addr) != 0) return -1;
+    if (kfile_read(kf, 0, (void*)(uintptr_t)*addr, kf->size) != 0) {
+        memmap_free(*addr, kf->size);
+        return -1;
+    }
+    return 0;
+}
+
+// ELF kernels get page tables. Higher-half images are mapped at their link
+// address; anything linked low is loaded there and runs from the identity
+// view, which would otherwise collide with the kernel mapping.
+static int bcbp_load_elf(struct kfile* kf, const struct elf64_header* eh, struct elf_image* img) {
+    int levels = paging_levels_active();
+    int high = (eh->e_entry >> 63) != 0;
+    if (paging_init(&bcbp_pt, levels) != 0 ||
+        elf_load(kf, ELF_MACHINE_NATIVE, 0, high ? &bcbp_pt : NULL, img) != 0) {
+        return -1;
+    }
+
+    struct bcbp_paging* p = &bcbp_paging_info;
+    memset(p, 0, sizeof(*p));
+    p->cr3 = bcbp_pt.root;
+    p->levels = (uint32_t)levels;
+    p->hhdm_offset = levels == 5 ? BCBP_HHDM_5LEVEL : BCBP_HHDM_4LEVEL;
+    p->kernel_virt = img->virt_base;
+    p->kernel_phys = img->phys_base;
+    p->kernel_size = img->size;
+    if (bcbp_pt.have_1g) p->flags |= BCBP_PAGING_1G;
+    if (bcbp_pt.have_nx) p->flags |= BCBP_PAGING_NX;
+    return 0;
+}
+
+// Both physical views cover the memory map, the low 4 GiB of MMIO and the
+// framebuffer. This runs last so loader allocations made after the kernel
+// was loaded are inside the range.
+static int bcbp_map_physical(struct bcbp_paging* p) {
+    struct fwinfo_fb fb = {0};
+    int count = 0;
+    const struct memmap_entry* map = memmap_get(&count);
+    uint64_t top = BCBP_LOW_MAP;
+    for (int i = 0; i < count; i++) {
+        if (map[i].base + map[i].length > top) top = map[i].base + map[i].length;
+    }
+    if (fwinfo_framebuffer(&fb) == 0 && fb.base + fb.size > top) top = fb.base + fb.size;
+    top = (top + PAGING_1G - 1) & ~(PAGING_1G - 1);
+    if (paging_map(&bcbp_pt, 0, 0, top, PAGING_WRITE | PAGING_EXEC) != 0 ||
+        paging_map(&bcbp_pt, p->hhdm_offset, 0, top, PAGING_WRITE) != 0) {
+        return -1;
+    }
+    p->hhdm_size = top;
+    return 0;
+}
+
+static int bcbp_describe_framebuffer(struct bcbp_framebuffer* out) {
+    struct fwinfo_fb fb;
+    if (fwinfo_framebuffer(&fb) != 0) return -1;
+    memset(out, 0, sizeof(*out));
+    out->address = fb.base;
+    out->size = fb.size;
+    out->width = fb.width;
+    out->height = fb.height;
+    out->pitch = fb.pitch;
+    out->bpp = fb.bpp;
+    out->memory_model = BCBP_FB_RGB;
+    out->red_mask_size = fb.red_size;
+    out->red_mask_shift = fb.red_shift;
+    out->green_mask_size = fb.green_size;
+    out->green_mask_shift = fb.green_shift;
+    out->blue_mask_size = fb.blue_size;
+    out->blue_mask_shift = fb.blue_shift;
+    out->reserved_mask_size = fb.reserved_size;
+    out->reserved_mask_shift = fb.reserved_shift;
+    return 0;
+}
+
+// memmap keeps its cache sorted and merged and BCBP_MEM_* shares its type
+// numbering, so the final map is a straight copy.
+static uint64_t bcbp_fill_memmap(void) {
+    int count = 0;
+    const struct memmap_entry* map = memmap_get(&count);
+    for (int i = 0; i < count; i++) {
+        bcbp_mmap[i].base = map[i].base;
+        bcbp_mmap[i].length = map[i].length;
+        bcbp_mmap[i].type = map[i].type;
+        bcbp_mmap[i].reserved = 0;
+    }
+    return (uint64_t)count * sizeof(bcbp_mmap[0]);
+}
+
+int bcbp_load_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline) {
+    struct kfile* kf = &bcbp_file;
+    struct elf_image img;
+    uint64_t kernel_addr, kernel_size, entry;
+    uint64_t initrd_addr = 0, initrd_size = 0;
+    struct bcbp_header* hdr;
+
+    if (kfile_open(kf, kernel_path) != 0) return -1;
+    const struct elf64_header* eh = kfile_at(kf, 0, sizeof(struct elf64_header));
+    int paged = eh && elf_validate(eh, kf->size, ELF_MACHINE_NATIVE) == 0;
+    if (paged) {
+        if (bcbp_load_elf(kf, eh, &img) != 0) {
+            kfile_close(kf);
+            return -1;
+        }
+        kernel_addr = img.phys_base;
+        kernel_size = img.size;
+        entry = img.entry;
+    } else {
+        if (bcbp_load_flat(kf, BCBP_KERNEL_BASE, &kernel_addr) != 0) {
+            kfile_close(kf);
+            return -1;
+        }
+        kernel_size = kf->size;
+        entry = kernel_addr;
+    }
+    kfile_close(kf);
+
+    // The initrd is optional
+    if (initrd_path && kfile_open(kf, initrd_path) == 0) {
+        if (bcbp_load_flat(kf, 0, &initrd_addr) == 0) initrd_size = kf->size;
+        kfile_close(kf);
+    }
+
+    // APs are started after ExitBootServices; their records go in as a module
+    int smp = smp_prepare(&bcbp_smp, SMP_AP_STACK_SIZE) > 1;
+
+    int have_fb = bcbp_describe_framebuffer(&bcbp_fb) == 0;
+
+    // Every module and string is known now, so the block is sized exactly
+    if (!cmdline) cmdline = "";
+    uint32_t modules = 2 + (initrd_size > 0) + smp + paged + have_fb;
+    uint64_t strings = sizeof("kernel") + strlen(cmdline) + 1 + sizeof("initrd") + sizeof("smp") +
+                       sizeof("paging") + sizeof("framebuffer") + sizeof("memmap");
+    uint64_t size = bcbp_size(modules, strings);
+    hdr = size ? memmap_alloc(size, MEMMAP_PAGE_SIZE, UINTPTR_MAX) : NULL;
+    if (!hdr || bcbp_init(hdr, size, modules, entry, 0) != 0) return -1;
+
+    if (bcbp_add_module(hdr, kernel_addr, kernel_size, "kernel", BCBP_MODTYPE_KERNEL, cmdline) != 0) return -1;
+    if (initrd_size && bcbp_add_module(hdr, initrd_addr, initrd_size, "initrd", BCBP_MODTYPE_INITRD, NULL) != 0) return -1;
+    if (smp && bcbp_add_module(hdr, (uintptr_t)bcbp_smp.cpus, bcbp_smp.cpu_count * sizeof(struct bcbp_cpu),
+                               "smp", BCBP_MODTYPE_SMP, NULL) != 0) {
+        return -1;
+    }
+    if (paged && (bcbp_map_physical(&bcbp_paging_info) != 0 ||
+                  bcbp_add_module(hdr, (uintptr_t)&bcbp_paging_info, sizeof(bcbp_paging_info),
+                                  "paging", BCBP_MODTYPE_PAGING, NULL) != 0)) {
+        return -1;
+    }
+    if (have_fb && bcbp_add_module(hdr, (uintptr_t)&bcbp_fb, sizeof(bcbp_fb), "framebuffer",
+                                   BCBP_MODTYPE_FRAMEBUFFER, NULL) != 0) {
+        return -1;
+    }
+
+    // The map is only final once boot services are gone; the module is
+    // sized for the worst case now and trimmed after the exit
+    uint64_t mmap_idx = hdr->module_count;
+    if (bcbp_add_module(hdr, (uintptr_t)bcbp_mmap, sizeof(bcbp_mmap), "memmap", BCBP_MODTYPE_MEMMAP, NULL) != 0) {
+        return -1;
+    }
+
+    uint64_t smbios32 = 0, smbios64 = 0;
+    uint64_t rsdp = fwinfo_acpi_rsdp(1);
+    bcbp_set_acpi_rsdp(hdr, rsdp ? rsdp : fwinfo_acpi_rsdp(0));
+    if (fwinfo_smbios(&smbios32, &smbios64) == 0) bcbp_set_smbios(hdr, smbios32 ? smbios32 : smbios64);
+    if (have_fb) bcbp_set_framebuffer(hdr, bcbp_fb.address);
+    hdr->secure_boot = IsSecureBootEnabled() ? 1 : 0;
+    hdr->uefi_64bit = sizeof(uintptr_t) == 8;
+    if (bcbp_validate(hdr) != 0) return -1;
+
+    // Retries on EFI_INVALID_PARAMETER with a fresh map, as the spec asks
+    if (memmap_exit_boot_services() != 0) return -1;
+    uint64_t mmap_size = bcbp_fill_memmap();
+    if (mmap_size == 0 || bcbp_update_module(hdr, mmap_idx, mmap_size) != 0) return -1;
+    smp_start(&bcbp_smp, paged ? bcbp_pt.root : paging_active_root(), 0);
+    if (paged && paging_activate(&bcbp_pt) != 0) return -1;
+
+    ((void (*)(struct bcbp_header*))(uintptr_t)entry)(hdr);
+    return -1;
+}
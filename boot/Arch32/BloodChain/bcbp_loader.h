@@ -0,0 +1,23 @@
+/*
+ * BloodHorn Bootloader
+ *
+ * This file is part of BloodHorn and is licensed under the MIT License.
+ * See the root of the repository for license details.
+ */
+#ifndef BLOODHORN_BCBP_LOADER_H
+#define BLOODHORN_BCBP_LOADER_H
+#include <stdint.h>
+#include "compat.h"
+#include "bloodchain.h"
+
+// Flat kernels are loaded here and entered at their first byte
+#define BCBP_KERNEL_BASE 0x100000ULL
+// Physical memory always mapped, whatever the memory map reports
+#define BCBP_LOW_MAP 0x100000000ULL
+// ELF kernels declare the protocol with a section of this name; its
+// contents are not interpreted
+#define BCBP_ELF_SECTION ".bloodchain"
+
+int bcbp_load_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline);
+
+#endif // BLOODHORN_BCBP_LOADER_H
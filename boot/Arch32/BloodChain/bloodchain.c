@@ -1,172 +1,238 @@
 #include "bloodchain.h"
 #include <string.h>
+#include "../../../security/crypto.h"
 
-// Internal function to calculate required memory for modules and strings
-static size_t calculate_required_memory(const struct bcbp_header *hdr) {
-    if (!hdr || hdr->magic != BCBP_MAGIC) return 0;
-    
-    size_t total = sizeof(struct bcbp_header);
+// Size a 1.0 block implies: header, modules and every string after them.
+// Only the 1.0 validator needs this; 2.0 blocks declare their size.
+static uint64_t calculate_required_memory_v1(const struct bcbp_header *hdr) {
+    uint64_t total = BCBP_HEADER_SIZE_V1;
     total += hdr->module_count * sizeof(struct bcbp_module);
     
-    // Add space for module names and command lines
     const struct bcbp_module *mod = (const struct bcbp_module *)hdr->modules;
     for (uint64_t i = 0; i < hdr->module_count; i++) {
         if (mod[i].name) {
-            total += strlen((const char *)mod[i].name) + 1;
+            total += strnlen((const char *)mod[i].name, BCBP_MAX_NAME) + 1;
         }
         if (mod[i].cmdline) {
-            total += strlen((const char *)mod[i].cmdline) + 1;
+            total += strnlen((const char *)mod[i].cmdline, BCBP_MAX_CMDLINE) + 1;
         }
     }
     
     return total;
 }
 
-void bcbp_init(struct bcbp_header *hdr, uint64_t entry_point, uint64_t boot_device) {
-    if (!hdr) return;
+uint64_t bcbp_size(uint32_t max_modules, uint64_t string_bytes) {
+    if (max_modules > BCBP_MAX_MODULES) return 0;
+    
+    // One extra byte for the empty string at offset 0
+    uint64_t total = BCBP_HEADER_SIZE + (uint64_t)max_modules * (BCBP_MODULE_SIZE + BCBP_MODULE_EXT_SIZE);
+    total += string_bytes + 1;
+    return total > UINT32_MAX ? 0 : total;
+}
+
+int bcbp_init(struct bcbp_header *hdr, uint64_t size, uint32_t max_modules,
+              uint64_t entry_point, uint64_t boot_device) {
+    uint64_t fixed = bcbp_size(max_modules, 0);
+    if (!hdr || !fixed || size < fixed || size > UINT32_MAX) return -1;
     
-    // Clear the entire header
-    memset(hdr, 0, sizeof(struct bcbp_header));
+    // Clear the header and both module tables; strings are written as added
+    memset(hdr, 0, fixed);
     
-    // Set magic and version
     hdr->magic = BCBP_MAGIC;
     hdr->version = BCBP_VERSION;
-    
-    // Set entry point and boot device
     hdr->entry_point = entry_point;
     hdr->boot_device = boot_device;
     
-    // Initialize module list (starts right after the header)
-    hdr->modules = (uint64_t)(hdr + 1);
+    // Lay out the regions back to back inside the caller's block
+    hdr->header_size = BCBP_HEADER_SIZE;
+    hdr->total_size = (uint32_t)size;
+    hdr->module_capacity = max_modules;
+    hdr->module_offset = BCBP_HEADER_SIZE;
+    hdr->ext_offset = hdr->module_offset + max_modules * BCBP_MODULE_SIZE;
+    hdr->string_offset = hdr->ext_offset + max_modules * BCBP_MODULE_EXT_SIZE;
+    hdr->string_size = (uint32_t)size - hdr->string_offset;
+    hdr->string_used = 1;
+    
+    // 1.0 readers find the module table through the absolute pointer
+    hdr->modules = (uint64_t)(uintptr_t)hdr + hdr->module_offset;
     hdr->module_count = 0;
-    
-    // Initialize security features (to be set by bootloader)
-    hdr->secure_boot = 0;
-    hdr->tpm_available = 0;
-    hdr->uefi_64bit = 0;
+    return 0;
+}
+
+// Appends at the tracked tail, so adding a module never rescans the table.
+static uint32_t bcbp_add_string(struct bcbp_header *hdr, const char *str, size_t limit) {
+    size_t len = strnlen(str, limit);
+    if (len == limit || len + 1 > hdr->string_size - hdr->string_used) return 0;
+    
+    uint32_t off = hdr->string_used;
+    memcpy((uint8_t *)hdr + hdr->string_offset + off, str, len + 1);
+    hdr->string_used += (uint32_t)len + 1;
+    return off;
 }
 
-void bcbp_add_module(struct bcbp_header *hdr, uint64_t start, uint64_t size,
+static void bcbp_hash(const struct bcbp_module *mod, struct bcbp_module_ext *ext) {
+    struct sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, (const uint8_t *)(uintptr_t)mod->start, mod->size);
+    sha256_final(&ctx, ext->sha256);
+}
+
+int bcbp_add_module(struct bcbp_header *hdr, uint64_t start, uint64_t size,
                     const char *name, uint8_t type, const char *cmdline) {
-    if (!hdr || hdr->magic != BCBP_MAGIC || !name || size == 0) return;
-    
-    // Get module array
-    struct bcbp_module *mods = (struct bcbp_module *)hdr->modules;
-    
-    // Calculate where the string data starts (after all module structures)
-    char *str_ptr = (char *)(mods + hdr->module_count + 1);
-    
-    // Find the end of the current string data
-    for (uint64_t i = 0; i < hdr->module_count; i++) {
-        if (mods[i].name) {
-            const char *name_str = (const char *)mods[i].name;
-            size_t len = strlen(name_str) + 1;
-            if ((char *)name_str + len > str_ptr) {
-                str_ptr = (char *)name_str + len;
-            }
-        }
-        if (mods[i].cmdline) {
-            const char *cmd_str = (const char *)mods[i].cmdline;
-            size_t len = strlen(cmd_str) + 1;
-            if ((char *)cmd_str + len > str_ptr) {
-                str_ptr = (char *)cmd_str + len;
-            }
-        }
+    if (!hdr || hdr->magic != BCBP_MAGIC || hdr->version < BCBP_VERSION_2 || !name || size == 0) return -1;
+    if (hdr->module_count >= hdr->module_capacity) return -1;
+    
+    // Strings go in first so a full table leaves the module list untouched
+    uint32_t used = hdr->string_used;
+    uint32_t name_off = bcbp_add_string(hdr, name, BCBP_MAX_NAME);
+    uint32_t cmdline_off = 0;
+    if (name_off && cmdline && *cmdline) {
+        cmdline_off = bcbp_add_string(hdr, cmdline, BCBP_MAX_CMDLINE);
+        if (!cmdline_off) name_off = 0;
+    }
+    if (!name_off) {
+        hdr->string_used = used;
+        return -1;
     }
     
-    // Add new module
-    struct bcbp_module *mod = &mods[hdr->module_count++];
+    uint64_t idx = hdr->module_count++;
+    struct bcbp_module *mod = bcbp_get_module(hdr, idx);
+    struct bcbp_module_ext *ext = bcbp_get_module_ext(hdr, idx);
+    uint64_t strings = (uint64_t)(uintptr_t)hdr + hdr->string_offset;
     
-    // Set module fields
     mod->start = start;
     mod->size = size;
     mod->type = type;
-    
-    // Store name
-    mod->name = (uint64_t)str_ptr;
-    strcpy(str_ptr, name);
-    str_ptr += strlen(name) + 1;
-    
-    // Store command line if provided
-    if (cmdline && *cmdline) {
-        mod->cmdline = (uint64_t)str_ptr;
-        strcpy(str_ptr, cmdline);
-        str_ptr += strlen(cmdline) + 1;
-    } else {
-        mod->cmdline = 0;
+    mod->name = strings + name_off;
+    mod->cmdline = cmdline_off ? strings + cmdline_off : 0;
+    
+    ext->name = name_off;
+    ext->cmdline = cmdline_off;
+    ext->flags = 0;
+    
+    // SMP records are rewritten by the APs and the kernel; a digest of
+    // them would be stale by the time anyone checked it
+    if (type != BCBP_MODTYPE_SMP) {
+        bcbp_hash(mod, ext);
+        ext->flags |= BCBP_MODULE_HASHED;
     }
+    return 0;
+}
+
+int bcbp_update_module(struct bcbp_header *hdr, uint64_t idx, uint64_t size) {
+    if (!hdr || hdr->magic != BCBP_MAGIC || size == 0) return -1;
+    
+    struct bcbp_module *mod = bcbp_get_module(hdr, idx);
+    if (!mod) return -1;
+    mod->size = size;
+    
+    struct bcbp_module_ext *ext = bcbp_get_module_ext(hdr, idx);
+    if (ext && (ext->flags & BCBP_MODULE_HASHED)) bcbp_hash(mod, ext);
+    return 0;
 }
 
 struct bcbp_module *bcbp_find_module(struct bcbp_header *hdr, const char *name) {
     if (!hdr || hdr->magic != BCBP_MAGIC || !name) return NULL;
     
-    struct bcbp_module *mod = (struct bcbp_module *)hdr->modules;
-    
     for (uint64_t i = 0; i < hdr->module_count; i++) {
-        if (mod[i].name && strcmp((const char *)mod[i].name, name) == 0) {
-            return &mod[i];
+        const char *mod_name = bcbp_module_name(hdr, i);
+        if (mod_name && strcmp(mod_name, name) == 0) {
+            return bcbp_get_module(hdr, i);
         }
     }
     
     return NULL;
 }
 
-int bcbp_validate(const struct bcbp_header *hdr) {
-    // Check pointer
-    if (!hdr) return -1;
-    
-    // Check magic number
-    if (hdr->magic != BCBP_MAGIC) return -2;
+// A string table offset is good if the string starts and ends inside the
+// used part of the table.
+static int bcbp_check_string(const struct bcbp_header *hdr, uint32_t off, size_t limit) {
+    if (off == 0 || off >= hdr->string_used) return -1;
+    
+    size_t room = hdr->string_used - off;
+    if (room > limit) room = limit;
+    return memchr((const uint8_t *)hdr + hdr->string_offset + off, 0, room) ? 0 : -1;
+}
+
+static int bcbp_validate_v2(const struct bcbp_header *hdr) {
+    uint64_t cap = hdr->module_capacity;
+    
+    // Regions must be in order and inside the declared size
+    if (hdr->header_size < BCBP_HEADER_SIZE || hdr->total_size < hdr->header_size) return -5;
+    if (cap > BCBP_MAX_MODULES || hdr->module_count > cap) return -4;
+    if (hdr->module_offset < hdr->header_size ||
+        hdr->ext_offset < hdr->module_offset + cap * BCBP_MODULE_SIZE ||
+        hdr->string_offset < hdr->ext_offset + cap * BCBP_MODULE_EXT_SIZE ||
+        (uint64_t)hdr->string_offset + hdr->string_size > hdr->total_size ||
+        hdr->string_used > hdr->string_size) {
+        return -5;
+    }
+    if (hdr->modules != (uint64_t)(uintptr_t)hdr + hdr->module_offset) return -5;
     
-    // Check version compatibility (only major version matters for compatibility)
-    if ((hdr->version >> 16) > (BCBP_VERSION >> 16)) {
-        return -3; // Major version is higher than supported
+    uint64_t strings = (uint64_t)(uintptr_t)hdr + hdr->string_offset;
+    const struct bcbp_module *mod = (const struct bcbp_module *)((const uint8_t *)hdr + hdr->module_offset);
+    const struct bcbp_module_ext *ext = (const struct bcbp_module_ext *)((const uint8_t *)hdr + hdr->ext_offset);
+    for (uint64_t i = 0; i < hdr->module_count; i++) {
+        if (mod[i].type < BCBP_MODTYPE_KERNEL || mod[i].type > BCBP_MODTYPE_LAST) {
+            return -6;
+        }
+        if (bcbp_check_string(hdr, ext[i].name, BCBP_MAX_NAME) != 0 ||
+            mod[i].name != strings + ext[i].name) {
+            return -7;
+        }
+        if (ext[i].cmdline) {
+            if (bcbp_check_string(hdr, ext[i].cmdline, BCBP_MAX_CMDLINE) != 0 ||
+                mod[i].cmdline != strings + ext[i].cmdline) {
+                return -9;
+            }
+        } else if (mod[i].cmdline) {
+            return -9;
+        }
     }
     
-    // Check for reasonable module count
-    if (hdr->module_count > 1024) return -4;
+    return 0;
+}
+
+static int bcbp_validate_v1(const struct bcbp_header *hdr) {
+    if (hdr->module_count > BCBP_MAX_MODULES) return -4;
+    if (hdr->module_count == 0) return 0;
+    
+    // Modules must start after the header
+    uint64_t base = (uint64_t)(uintptr_t)hdr;
+    if (hdr->modules < base + BCBP_HEADER_SIZE_V1) return -5;
     
-    // If we have modules, verify the modules pointer is valid
-    if (hdr->module_count > 0) {
-        // Modules must start after the header
-        if (hdr->modules <= (uint64_t)hdr || 
-            hdr->modules >= (uint64_t)hdr + calculate_required_memory(hdr)) {
-            return -5; // Invalid modules pointer
+    // Everything the block holds has to end by here
+    uint64_t end = base + calculate_required_memory_v1(hdr);
+    if (hdr->modules >= end) return -5;
+    
+    const struct bcbp_module *mod = (const struct bcbp_module *)hdr->modules;
+    for (uint64_t i = 0; i < hdr->module_count; i++) {
+        if (mod[i].type < BCBP_MODTYPE_KERNEL || mod[i].type > BCBP_MODTYPE_LAST) {
+            return -6;
         }
-        
-        // Verify each module
-        const struct bcbp_module *mod = (const struct bcbp_module *)hdr->modules;
-        for (uint64_t i = 0; i < hdr->module_count; i++) {
-            // Check module type is valid
-            if (mod[i].type < BCBP_MODTYPE_KERNEL || mod[i].type > BCBP_MODTYPE_DRIVER) {
-                return -6; // Invalid module type
-            }
-            
-            // Check name pointer is valid
-            if (mod[i].name) {
-                if (mod[i].name < (uint64_t)hdr || 
-                    mod[i].name >= (uint64_t)hdr + calculate_required_memory(hdr)) {
-                    return -7; // Invalid name pointer
-                }
-                if (strnlen((const char *)mod[i].name, 256) == 256) {
-                    return -8; // Name too long or not null-terminated
-                }
-            }
-            
-            // Check command line pointer if present
-            if (mod[i].cmdline) {
-                if (mod[i].cmdline < (uint64_t)hdr || 
-                    mod[i].cmdline >= (uint64_t)hdr + calculate_required_memory(hdr)) {
-                    return -9; // Invalid command line pointer
-                }
-                if (strnlen((const char *)mod[i].cmdline, 4096) == 4096) {
-                    return -10; // Command line too long or not null-terminated
-                }
-            }
+        if (mod[i].name) {
+            if (mod[i].name < base || mod[i].name >= end) return -7;
+            if (strnlen((const char *)mod[i].name, BCBP_MAX_NAME) == BCBP_MAX_NAME) return -8;
         }
+        if (mod[i].cmdline) {
+            if (mod[i].cmdline < base || mod[i].cmdline >= end) return -9;
+            if (strnlen((const char *)mod[i].cmdline, BCBP_MAX_CMDLINE) == BCBP_MAX_CMDLINE) return -10;
+        }
+    }
+    
+    return 0;
+}
+
+int bcbp_validate(const struct bcbp_header *hdr) {
+    if (!hdr) return -1;
+    if (hdr->magic != BCBP_MAGIC) return -2;
+    
+    // Only the major version matters for compatibility
+    if ((hdr->version >> 16) > (BCBP_VERSION >> 16)) {
+        return -3;
     }
     
-    return 0; // Valid
+    return (hdr->version >> 16) >= 2 ? bcbp_validate_v2(hdr) : bcbp_validate_v1(hdr);
 }
 
 void bcbp_set_acpi_rsdp(struct bcbp_header *hdr, uint64_t rsdp) {
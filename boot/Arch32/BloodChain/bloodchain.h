@@ -2,10 +2,21 @@
 #define BLOODCHAIN_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 // BloodChain Boot Protocol (BCBP) Specification
-// Version: 1.0
+// Version: 2.0
 // Magic: 0x424C4348 ("BLCH" in ASCII)
+//
+// A 2.0 block is one contiguous allocation of total_size bytes:
+//
+//   header | module table | module extension table | string table
+//
+// Everything past the 1.0 header is located by offsets from the header, so
+// a kernel may copy the block elsewhere and keep using it. The 1.0 fields
+// (including the absolute module, name and cmdline pointers) are still
+// filled in and the module table keeps its 40-byte stride, so a 1.0 kernel
+// reads a 2.0 block unchanged as long as it is not moved.
 
 // Module Types
 #define BCBP_MODTYPE_KERNEL     0x01  // OS Kernel
@@ -16,6 +27,11 @@
 #define BCBP_MODTYPE_EFI        0x06  // EFI runtime services
 #define BCBP_MODTYPE_CONFIG     0x07  // Configuration file
 #define BCBP_MODTYPE_DRIVER     0x08  // Hardware driver
+#define BCBP_MODTYPE_SMP        0x09  // Parked application processors
+#define BCBP_MODTYPE_PAGING     0x0A  // Page tables the loader built (struct bcbp_paging)
+#define BCBP_MODTYPE_FRAMEBUFFER 0x0B // Linear framebuffer (struct bcbp_framebuffer)
+#define BCBP_MODTYPE_MEMMAP     0x0C  // Memory map (struct bcbp_mmap_entry[])
+#define BCBP_MODTYPE_LAST       BCBP_MODTYPE_MEMMAP
 
 // Boot Information Structure
 struct bcbp_header {
@@ -34,6 +50,15 @@ struct bcbp_header {
     uint8_t uefi_64bit;      // 64-bit UEFI (0=no, 1=yes)
     uint8_t reserved[5];     // Reserved for future use
     uint8_t signature[64];   // Cryptographic signature (optional)
+    // 2.0 and later
+    uint32_t header_size;      // sizeof(struct bcbp_header)
+    uint32_t total_size;       // Bytes in the whole block, strings included
+    uint32_t module_offset;    // Module table
+    uint32_t module_capacity;  // Entries reserved in both module tables
+    uint32_t ext_offset;       // struct bcbp_module_ext, one per module
+    uint32_t string_offset;    // String table
+    uint32_t string_size;      // Bytes reserved for strings
+    uint32_t string_used;      // Bytes written so far (the table's tail)
 } __attribute__((packed));
 
 // Module Information Structure
@@ -46,22 +71,143 @@ struct bcbp_module {
     uint8_t reserved[7];     // Reserved for future use
 } __attribute__((packed));
 
+// 2.0 per-module data, parallel to the module table. Names and command
+// lines are offsets into the string table; 0 means none, which is why the
+// table starts with an empty string.
+struct bcbp_module_ext {
+    uint32_t name;           // String table offset of the name
+    uint32_t cmdline;        // String table offset of the command line
+    uint32_t flags;          // BCBP_MODULE_*
+    uint32_t reserved;
+    uint8_t sha256[32];      // Digest of the module contents at load time
+} __attribute__((packed));
+
+#define BCBP_MODULE_HASHED  0x1  // sha256 is valid
+
+// SMP module entry, one per CPU (BSP included). APs are parked by the
+// bootloader spinning on goto_address; writing it releases the CPU, which
+// jumps there with RDI pointing at its own entry and RSP at a loader stack.
+struct bcbp_cpu {
+    uint32_t processor_id;   // Loader-assigned index
+    uint32_t lapic_id;       // Local APIC ID
+    uint64_t flags;          // BCBP_CPU_*
+    uint64_t goto_address;   // Written by the kernel to start the CPU
+    uint64_t extra_argument; // Free for the kernel's use
+} __attribute__((packed));
+
+#define BCBP_CPU_BSP     0x1  // Bootstrap processor (the one running the kernel)
+#define BCBP_CPU_PARKED  0x2  // Waiting on goto_address
+
+// Paging module. Present when the kernel is an ELF image: the loader maps
+// all physical memory twice (identity and at hhdm_offset) plus the kernel
+// at its link address, and enters the kernel with CR3 already holding cr3.
+// The tables live in loader data pages the kernel may reclaim once it has
+// its own.
+struct bcbp_paging {
+    uint64_t cr3;            // Physical address of the top-level table
+    uint64_t hhdm_offset;    // Virtual address of physical address 0
+    uint64_t hhdm_size;      // Bytes covered by the identity and HHDM views
+    uint64_t kernel_virt;    // Lowest virtual address of the kernel image
+    uint64_t kernel_phys;    // Physical address backing kernel_virt
+    uint64_t kernel_size;    // Image size in memory, BSS included
+    uint32_t levels;         // 4 or 5
+    uint32_t flags;          // BCBP_PAGING_*
+} __attribute__((packed));
+
+#define BCBP_PAGING_1G  0x1  // Physical views use 1 GiB pages
+#define BCBP_PAGING_NX  0x2  // Non-executable mappings are enforced
+
+// Framebuffer module. header->framebuffer still carries the base address
+// for 1.0 kernels.
+struct bcbp_framebuffer {
+    uint64_t address;        // Physical address of the first pixel
+    uint64_t size;           // Bytes from address to the end of the last line
+    uint32_t width;          // Visible pixels per line
+    uint32_t height;         // Lines
+    uint32_t pitch;          // Bytes per line, padding included
+    uint16_t bpp;            // Bits per pixel
+    uint8_t memory_model;    // BCBP_FB_*
+    uint8_t red_mask_size;
+    uint8_t red_mask_shift;
+    uint8_t green_mask_size;
+    uint8_t green_mask_shift;
+    uint8_t blue_mask_size;
+    uint8_t blue_mask_shift;
+    uint8_t reserved_mask_size;
+    uint8_t reserved_mask_shift;
+    uint8_t reserved;
+} __attribute__((packed));
+
+#define BCBP_FB_RGB  1  // Direct colour, described by the mask fields
+
+// Memory map module: the map as it stood when boot services exited,
+// sorted by base with adjacent entries of the same type merged, so one
+// pass over size / sizeof(struct bcbp_mmap_entry) entries reads it.
+struct bcbp_mmap_entry {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;           // BCBP_MEM_*
+    uint32_t reserved;
+} __attribute__((packed));
+
+// E820 numbering, plus the two ranges a kernel may want to tell apart
+#define BCBP_MEM_USABLE            1
+#define BCBP_MEM_RESERVED          2
+#define BCBP_MEM_ACPI_RECLAIMABLE  3
+#define BCBP_MEM_ACPI_NVS          4
+#define BCBP_MEM_BAD               5
+#define BCBP_MEM_PERSISTENT        7
+#define BCBP_MEM_LOADER_RECLAIMABLE  0x100  // Loader data, this block included
+#define BCBP_MEM_KERNEL_AND_MODULES  0x101
+
+#define BCBP_HHDM_4LEVEL  0xffff800000000000ULL
+#define BCBP_HHDM_5LEVEL  0xff00000000000000ULL
+
+// Constants
+#define BCBP_MAGIC     0x424C4348  // "BLCH"
+#define BCBP_VERSION_1 0x00010000  // 1.0
+#define BCBP_VERSION_2 0x00020000  // 2.0
+#define BCBP_VERSION   BCBP_VERSION_2
+#define BCBP_HEADER_SIZE  sizeof(struct bcbp_header)
+#define BCBP_HEADER_SIZE_V1  offsetof(struct bcbp_header, header_size)
+#define BCBP_MODULE_SIZE  sizeof(struct bcbp_module)
+#define BCBP_MODULE_EXT_SIZE  sizeof(struct bcbp_module_ext)
+#define BCBP_MAX_MODULES  1024
+#define BCBP_MAX_NAME     256
+#define BCBP_MAX_CMDLINE  4096
+
 // Bootloader Interface (for bootloader implementation)
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * Bytes needed for a block holding up to max_modules modules
+ * 
+ * @param max_modules   Module table capacity
+ * @param string_bytes  Total length of all names and command lines,
+ *                      terminating NULs included
+ * @return              Size to pass to bcbp_init, or 0 if it overflows
+ */
+uint64_t bcbp_size(uint32_t max_modules, uint64_t string_bytes);
+
 /**
  * Initialize the BCBP header structure
  * 
- * @param hdr          Pointer to the header structure to initialize
+ * @param hdr          Start of a block of at least bcbp_size() bytes
+ * @param size         Size of that block in bytes
+ * @param max_modules  Module table capacity
  * @param entry_point  Kernel entry point address
  * @param boot_device  Boot device identifier
+ * @return             0 on success, -1 if the tables do not fit in size
  */
-void bcbp_init(struct bcbp_header *hdr, uint64_t entry_point, uint64_t boot_device);
+int bcbp_init(struct bcbp_header *hdr, uint64_t size, uint32_t max_modules,
+              uint64_t entry_point, uint64_t boot_device);
 
 /**
- * Add a module to the BCBP structure
+ * Add a module to the BCBP structure and record its SHA-256
+ * 
+ * SMP modules are not hashed; their records change once the APs run.
  * 
  * @param hdr      Pointer to the BCBP header
  * @param start    Physical start address of the module
@@ -69,10 +215,22 @@ void bcbp_init(struct bcbp_header *hdr, uint64_t entry_point, uint64_t boot_devi
  * @param name     Name of the module (will be copied)
  * @param type     Module type (BCBP_MODTYPE_*)
  * @param cmdline  Command line string for the module (optional, can be NULL)
+ * @return         0 on success, -1 if the block is full or not a 2.0 block
  */
-void bcbp_add_module(struct bcbp_header *hdr, uint64_t start, uint64_t size,
+int bcbp_add_module(struct bcbp_header *hdr, uint64_t start, uint64_t size,
                     const char *name, uint8_t type, const char *cmdline);
 
+/**
+ * Change a module's size after its contents were written, refreshing the
+ * digest if the module has one
+ * 
+ * @param hdr   Pointer to the BCBP header
+ * @param idx   Module index (0-based)
+ * @param size  New size in bytes
+ * @return      0 on success, -1 on a bad header, index or size
+ */
+int bcbp_update_module(struct bcbp_header *hdr, uint64_t idx, uint64_t size);
+
 /**
  * Find a module by name
  * 
@@ -85,6 +243,9 @@ struct bcbp_module *bcbp_find_module(struct bcbp_header *hdr, const char *name);
 /**
  * Validate the BCBP structure
  * 
+ * 2.0 blocks are checked against their declared size in one pass over the
+ * modules; 1.0 blocks against the size their strings imply.
+ * 
  * @param hdr  Pointer to the BCBP header
  * @return     0 if valid, negative error code otherwise
  */
@@ -143,17 +304,40 @@ static inline struct bcbp_header *bcbp_get_boot_info(void) {
  */
 static inline struct bcbp_module *bcbp_get_module(struct bcbp_header *hdr, uint64_t idx) {
     if (idx >= hdr->module_count) return NULL;
+    if (hdr->version >= BCBP_VERSION_2)
+        return (struct bcbp_module *)((uint8_t *)hdr + hdr->module_offset) + idx;
     return ((struct bcbp_module *)hdr->modules) + idx;
 }
 
+/**
+ * Get the 2.0 extension entry of a module
+ * 
+ * @return  Pointer to the entry, or NULL for 1.0 blocks and bad indices
+ */
+static inline struct bcbp_module_ext *bcbp_get_module_ext(struct bcbp_header *hdr, uint64_t idx) {
+    if (hdr->version < BCBP_VERSION_2 || idx >= hdr->module_count) return NULL;
+    return (struct bcbp_module_ext *)((uint8_t *)hdr + hdr->ext_offset) + idx;
+}
+
+/**
+ * Get a module's name or command line without using absolute pointers
+ * 
+ * @return  The string, or NULL if the module has none
+ */
+static inline const char *bcbp_module_name(struct bcbp_header *hdr, uint64_t idx) {
+    struct bcbp_module_ext *ext = bcbp_get_module_ext(hdr, idx);
+    if (!ext) return idx < hdr->module_count ? (const char *)bcbp_get_module(hdr, idx)->name : NULL;
+    return ext->name ? (const char *)hdr + hdr->string_offset + ext->name : NULL;
+}
+
+static inline const char *bcbp_module_cmdline(struct bcbp_header *hdr, uint64_t idx) {
+    struct bcbp_module_ext *ext = bcbp_get_module_ext(hdr, idx);
+    if (!ext) return idx < hdr->module_count ? (const char *)bcbp_get_module(hdr, idx)->cmdline : NULL;
+    return ext->cmdline ? (const char *)hdr + hdr->string_offset + ext->cmdline : NULL;
+}
+
 #ifdef __cplusplus
 }
 #endif
 
-// Constants for bootloader use
-#define BCBP_MAGIC     0x424C4348  // "BLCH"
-#define BCBP_VERSION   0x00010000  // 1.0
-#define BCBP_HEADER_SIZE  sizeof(struct bcbp_header)
-#define BCBP_MODULE_SIZE  sizeof(struct bcbp_module)
-
 #endif // BLOODCHAIN_H
@@ -8,155 +8,134 @@
 #include "compat.h"
 #include <string.h>
 #include "aarch64.h"
+#include "memmap.h"
+#include "kfile.h"
+#include "loader.h"
+#include "fdt.h"
 
-extern void* allocate_memory(uint32_t size);
-extern int load_file(const char* path, uint8_t** data, uint32_t* size);
+// The image runs at a 2 MiB-aligned base plus text_offset and needs
+// image_size bytes there (BSS included), wherever RAM actually is. Images
+// older than 3.17 leave image_size zero and assume a text_offset of
+// 0x80000. The core places bottom-up, keeping the base as close to the
+// start of RAM as possible, which kernels without AARCH64_FLAG_PHYS_ANY
+// require.
+static int aarch64_probe(struct kfile* kf, struct loader_image* img) {
+    const struct aarch64_linux_header* header = kfile_at(kf, 0, sizeof(struct aarch64_linux_header));
+    if (!header || header->magic != AARCH64_IMAGE_MAGIC) {
+        return -1;
+    }
+    if (header->image_size && (header->flags & AARCH64_FLAG_BE)) {
+        return -1;
+    }
+    img->offset = header->image_size ? header->text_offset : AARCH64_LEGACY_TEXT_OFFSET;
+    img->mem_size = header->image_size;
+    img->align = AARCH64_IMAGE_ALIGN;
+    return 0;
+}
 
-struct aarch64_boot_params {
-    uint64_t dtb_addr;
-    uint64_t initrd_addr;
-    uint64_t initrd_size;
-    uint64_t cmdline_addr;
-    uint64_t cmdline_size;
-    uint64_t kernel_addr;
-    uint64_t kernel_size;
-    uint64_t mem_start;
-    uint64_t mem_size;
-};
+#if defined(__aarch64__)
+static uint64_t aarch64_current_el(void) {
+    uint64_t el;
+    __asm__ __volatile__("mrs %0, CurrentEL" : "=r"(el));
+    return (el >> 2) & 3;
+}
 
-struct aarch64_linux_header {
-    uint32_t code0;
-    uint32_t code1;
-    uint64_t text_offset;
-    uint64_t image_size;
-    uint64_t flags;
-    uint64_t res2;
-    uint64_t res3;
-    uint64_t res4;
-    uint32_t magic;
-    uint32_t hdr_offset;
-    uint32_t hdr_size;
-    uint32_t end_offset;
-    uint32_t end_size;
-    uint64_t hdr_version;
-    uint64_t comp_version;
-    uint64_t name_offset;
-    uint64_t name_size;
-    uint64_t id_offset;
-    uint64_t id_size;
-    uint64_t hdr_string_offset;
-    uint64_t hdr_string_size;
-};
+// Clean to the point of coherency and invalidate the I-cache by VA over
+// just the ranges the kernel will touch with its MMU and caches off,
+// rather than walking every set and way of every level.
+static void aarch64_sync_range(uint64_t base, uint64_t size) {
+    uint64_t ctr;
+    if (!size) return;
+    __asm__ __volatile__("mrs %0, ctr_el0" : "=r"(ctr));
+    uint64_t dline = 4ULL << ((ctr >> 16) & 0xF);
+    uint64_t iline = 4ULL << (ctr & 0xF);
+    uint64_t end = base + size;
+    for (uint64_t p = base & ~(dline - 1); p < end; p += dline) {
+        __asm__ __volatile__("dc cvac, %0" : : "r"(p) : "memory");
+    }
+    __asm__ __volatile__("dsb sy" : : : "memory");
+    for (uint64_t p = base & ~(iline - 1); p < end; p += iline) {
+        __asm__ __volatile__("ic ivau, %0" : : "r"(p) : "memory");
+    }
+    __asm__ __volatile__("dsb sy\n\tisb" : : : "memory");
+}
+#endif
 
-int aarch64_load_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline) {
-    uint8_t* kernel_data = NULL;
-    uint64_t kernel_size = 0;
-    
-    if (load_file(kernel_path, &kernel_data, (uint32_t*)&kernel_size) != 0) {
+// arm64 boot protocol: MMU and D-cache off, interrupts masked, x0 = DTB,
+// x1-x3 zero. The kernel is entered at EL2 when firmware left us there so
+// it can use virtualisation, otherwise at EL1. UEFI memory is identity
+// mapped, so turning the MMU off under the running code is safe.
+static int aarch64_handoff(const struct loader_handoff* h) {
+    uint64_t dtb_addr = fdt_prepare(h->dtb_path, h->overlays, h->cmdline, h->initrd_addr, h->initrd_size, NULL);
+    if (!dtb_addr) {
+        return -1;
+    }
+#if defined(__aarch64__)
+    uint64_t el = aarch64_current_el();
+    if (el != 1 && el != 2) {
+        return -1;
+    }
+    if (memmap_exit_boot_services() != 0) {
         return -1;
     }
-    
-    struct aarch64_linux_header* header = (struct aarch64_linux_header*)kernel_data;
-    
-    if (header->magic == 0x644d5241) {
-        return aarch64_boot_linux(kernel_data, kernel_size, initrd_path, cmdline);
+    aarch64_sync_range(h->load_addr, h->mem_size);
+    aarch64_sync_range(dtb_addr, fdt_totalsize((const void*)(uintptr_t)dtb_addr));
+    aarch64_sync_range(h->initrd_addr, h->initrd_size);
+
+    register uint64_t x0 __asm__("x0") = dtb_addr;
+    register uint64_t x4 __asm__("x4") = h->entry;
+    if (el == 2) {
+        __asm__ __volatile__(
+            "msr daifset, #0xf\n\t"
+            "mrs x5, sctlr_el2\n\t"
+            "bic x5, x5, #1\n\t"
+            "bic x5, x5, #4\n\t"
+            "msr sctlr_el2, x5\n\t"
+            "isb\n\t"
+            "tlbi alle2\n\t"
+            "dsb sy\n\t"
+            "isb\n\t"
+            "mov x1, xzr\n\t"
+            "mov x2, xzr\n\t"
+            "mov x3, xzr\n\t"
+            "br x4"
+            : : "r"(x0), "r"(x4) : "x1", "x2", "x3", "x5", "memory");
+    } else {
+        __asm__ __volatile__(
+            "msr daifset, #0xf\n\t"
+            "mrs x5, sctlr_el1\n\t"
+            "bic x5, x5, #1\n\t"
+            "bic x5, x5, #4\n\t"
+            "msr sctlr_el1, x5\n\t"
+            "isb\n\t"
+            "tlbi vmalle1\n\t"
+            "dsb sy\n\t"
+            "isb\n\t"
+            "mov x1, xzr\n\t"
+            "mov x2, xzr\n\t"
+            "mov x3, xzr\n\t"
+            "br x4"
+            : : "r"(x0), "r"(x4) : "x1", "x2", "x3", "x5", "memory");
     }
-    
+#endif
     return -1;
 }
 
+const struct loader_format aarch64_image_format = { "arm64 Image", aarch64_probe, NULL, aarch64_handoff };
+
+int aarch64_load_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline) {
+    return loader_load(kernel_path, initrd_path, cmdline, &aarch64_image_format);
+}
+
+// Buffer entry point for callers that already hold the whole image.
 int aarch64_boot_linux(uint8_t* kernel_data, uint64_t kernel_size, const char* initrd_path, const char* cmdline) {
-    struct aarch64_linux_header* header = (struct aarch64_linux_header*)kernel_data;
-    
-    uint64_t kernel_load_addr = 0x40000000;
-    uint64_t dtb_addr = 0x40000000 + kernel_size;
-    uint64_t initrd_addr = 0;
-    uint64_t initrd_size = 0;
-    
-    if (initrd_path && strlen(initrd_path) > 0) {
-        uint8_t* initrd_data = NULL;
-        uint32_t initrd_size32 = 0;
-        if (load_file(initrd_path, &initrd_data, &initrd_size32) == 0) {
-            initrd_size = initrd_size32;
-            initrd_addr = dtb_addr + 0x10000;
-            memcpy((void*)initrd_addr, initrd_data, initrd_size);
-        }
-    }
-    
-    uint64_t cmdline_addr = 0;
-    uint64_t cmdline_size = 0;
-    if (cmdline && strlen(cmdline) > 0) {
-        cmdline_addr = initrd_addr + initrd_size + 0x1000;
-        cmdline_size = strlen(cmdline) + 1;
-        strcpy((char*)cmdline_addr, cmdline);
-    }
-    
-    memcpy((void*)kernel_load_addr, kernel_data, kernel_size);
-    
-    struct aarch64_boot_params* params = (struct aarch64_boot_params*)0x40000000 - 0x1000;
-    memset(params, 0, sizeof(struct aarch64_boot_params));
-    
-    params->dtb_addr = dtb_addr;
-    params->initrd_addr = initrd_addr;
-    params->initrd_size = initrd_size;
-    params->cmdline_addr = cmdline_addr;
-    params->cmdline_size = cmdline_size;
-    params->kernel_addr = kernel_load_addr;
-    params->kernel_size = kernel_size;
-    params->mem_start = 0x40000000;
-    params->mem_size = 0x80000000;
-    
-    uint64_t entry_point = kernel_load_addr + header->text_offset;
-    void (*kernel_entry)(uint64_t, uint64_t, uint64_t) = (void*)entry_point;
-    kernel_entry(0, dtb_addr, (uint64_t)params);
-    
-    return 0;
+    return loader_load_mem(kernel_data, kernel_size, initrd_path, cmdline, &aarch64_image_format);
 }
 
 int aarch64_boot_uefi(uint8_t* kernel_data, uint64_t kernel_size, const char* cmdline) {
-    uint64_t kernel_load_addr = 0x40000000;
-    uint64_t dtb_addr = 0x40000000 + kernel_size;
-    
-    uint64_t cmdline_addr = 0;
-    uint64_t cmdline_size = 0;
-    if (cmdline && strlen(cmdline) > 0) {
-        cmdline_addr = dtb_addr + 0x10000;
-        cmdline_size = strlen(cmdline) + 1;
-        strcpy((char*)cmdline_addr, cmdline);
-    }
-    
-    memcpy((void*)kernel_load_addr, kernel_data, kernel_size);
-    
-    struct aarch64_boot_params* params = (struct aarch64_boot_params*)0x40000000 - 0x1000;
-    memset(params, 0, sizeof(struct aarch64_boot_params));
-    
-    params->dtb_addr = dtb_addr;
-    params->cmdline_addr = cmdline_addr;
-    params->cmdline_size = cmdline_size;
-    params->kernel_addr = kernel_load_addr;
-    params->kernel_size = kernel_size;
-    params->mem_start = 0x40000000;
-    params->mem_size = 0x80000000;
-    
-    void (*kernel_entry)(uint64_t, uint64_t, uint64_t) = (void*)kernel_load_addr;
-    kernel_entry(0, dtb_addr, (uint64_t)params);
-    
-    return 0;
+    return aarch64_boot_linux(kernel_data, kernel_size, NULL, cmdline);
 }
 
 int aarch64_verify_kernel(const char* kernel_path) {
-    uint8_t* kernel_data = NULL;
-    uint32_t kernel_size = 0;
-    
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
-        return -1;
-    }
-    
-    struct aarch64_linux_header* header = (struct aarch64_linux_header*)kernel_data;
-    
-    if (header->magic == 0x644d5241) {
-        return 0;
-    }
-    
-    return -1;
-} 
\ No newline at end of file
+    return loader_verify(kernel_path, &aarch64_image_format);
+}
@@ -8,6 +8,14 @@
 #define BLOODHORN_AARCH64_H
 #include <stdint.h>
 #include "compat.h"
+#include "loader.h"
+
+#define AARCH64_IMAGE_MAGIC 0x644d5241
+#define AARCH64_IMAGE_ALIGN 0x200000
+#define AARCH64_LEGACY_TEXT_OFFSET 0x80000
+// Image header flags
+#define AARCH64_FLAG_BE (1ULL << 0)
+#define AARCH64_FLAG_PHYS_ANY (1ULL << 3)
 
 struct aarch64_boot_params {
     uint64_t dtb_addr;
@@ -45,6 +53,8 @@ struct aarch64_linux_header {
     uint64_t hdr_string_size;
 };
 
+extern const struct loader_format aarch64_image_format;
+
 int aarch64_load_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline);
 int aarch64_boot_linux(uint8_t* kernel_data, uint64_t kernel_size, const char* initrd_path, const char* cmdline);
 int aarch64_boot_uefi(uint8_t* kernel_data, uint64_t kernel_size, const char* cmdline);
@@ -0,0 +1,346 @@
+/*
+ * BloodHorn Bootloader
+ *
+ * This file is part of BloodHorn and is licensed under the MIT License.
+ * See the root of the repository for license details.
+ */
+#include <stdint.h>
+#include "compat.h"
+#include <string.h>
+#include "elf.h"
+#include "memmap.h"
+
+static struct elf64_phdr elf_phdrs[ELF_MAX_PHDRS];
+static struct elf32_phdr elf32_phdrs[ELF_MAX_PHDRS];
+static struct elf64_shdr elf_shdrs[ELF_MAX_SHDRS];
+static char elf_shstrtab[ELF_MAX_SHSTRTAB];
+
+int elf_validate(const struct elf64_header* eh, uint64_t file_size, uint16_t machine) {
+    if (!eh || file_size < sizeof(*eh)) return -1;
+    if (memcmp(eh->e_ident, ELF_MAGIC, 4) != 0) return -1;
+    if (eh->e_ident[EI_CLASS] != ELFCLASS64 || eh->e_ident[EI_DATA] != ELFDATA2LSB || eh->e_ident[EI_VERSION] != EV_CURRENT) return -1;
+    if (eh->e_type != ET_EXEC && eh->e_type != ET_DYN) return -1;
+    if (machine && eh->e_machine != machine) return -1;
+    if (eh->e_phentsize != sizeof(struct elf64_phdr) || eh->e_phnum == 0 || eh->e_phnum > ELF_MAX_PHDRS) return -1;
+    if (eh->e_phoff > file_size || (uint64_t)eh->e_phnum * sizeof(struct elf64_phdr) > file_size - eh->e_phoff) return -1;
+    return 0;
+}
+
+// Every PT_LOAD must lie inside the file, not wrap, and not overlap another;
+// returns the page-rounded virtual span and the largest alignment asked for.
+static int elf_check_segments(const struct elf64_phdr* ph, int n, uint64_t file_size, uint64_t* lo, uint64_t* hi, uint64_t* align) {
+    int loads = 0;
+    *lo = ~0ULL;
+    *hi = 0;
+    *align = PAGING_4K;
+    for (int i = 0; i < n; ++i) {
+        if (ph[i].p_type != PT_LOAD || ph[i].p_memsz == 0) continue;
+        if (ph[i].p_filesz > ph[i].p_memsz) return -1;
+        if (ph[i].p_offset > file_size || ph[i].p_filesz > file_size - ph[i].p_offset) return -1;
+        if (ph[i].p_vaddr + ph[i].p_memsz < ph[i].p_vaddr) return -1;
+        if (ph[i].p_align & (ph[i].p_align - 1)) return -1;
+        for (int j = 0; j < i; ++j) {
+            if (ph[j].p_type != PT_LOAD || ph[j].p_memsz == 0) continue;
+            if (ph[i].p_vaddr < ph[j].p_vaddr + ph[j].p_memsz && ph[j].p_vaddr < ph[i].p_vaddr + ph[i].p_memsz) return -1;
+        }
+        if (ph[i].p_vaddr < *lo) *lo = ph[i].p_vaddr;
+        if (ph[i].p_vaddr + ph[i].p_memsz > *hi) *hi = ph[i].p_vaddr + ph[i].p_memsz;
+        if (ph[i].p_align > *align && ph[i].p_align <= PAGING_1G) *align = ph[i].p_align;
+        loads++;
+    }
+    if (!loads) return -1;
+    *lo &= ~(PAGING_4K - 1);
+    *hi = (*hi + PAGING_4K - 1) & ~(PAGING_4K - 1);
+    return 0;
+}
+
+// Looks a section up by name through the section header string table;
+// stripped or oversized tables simply report it missing.
+int elf_find_section(struct kfile* kf, const char* name, uint64_t* addr, uint64_t* size) {
+    const struct elf64_header* eh = kfile_at(kf, 0, sizeof(struct elf64_header));
+    if (!eh || !eh->e_shoff || eh->e_shentsize != sizeof(struct elf64_shdr)) return -1;
+    if (eh->e_shnum == 0 || eh->e_shnum > ELF_MAX_SHDRS || eh->e_shstrndx >= eh->e_shnum) return -1;
+    uint64_t sh_len = (uint64_t)eh->e_shnum * sizeof(struct elf64_shdr);
+    if (eh->e_shoff > kf->size || sh_len > kf->size - eh->e_shoff) return -1;
+    if (kfile_read(kf, eh->e_shoff, elf_shdrs, sh_len) != 0) return -1;
+    const struct elf64_shdr* strtab = &elf_shdrs[eh->e_shstrndx];
+    uint64_t str_len = strtab->sh_size < ELF_MAX_SHSTRTAB ? strtab->sh_size : ELF_MAX_SHSTRTAB;
+    if (strtab->sh_offset > kf->size || str_len > kf->size - strtab->sh_offset) return -1;
+    if (kfile_read(kf, strtab->sh_offset, elf_shstrtab, str_len) != 0) return -1;
+    uint64_t name_len = strlen(name) + 1;
+    for (int i = 0; i < eh->e_shnum; ++i) {
+        if (elf_shdrs[i].sh_name >= str_len || str_len - elf_shdrs[i].sh_name < name_len) continue;
+        if (memcmp(elf_shstrtab + elf_shdrs[i].sh_name, name, name_len) != 0) continue;
+        *addr = elf_shdrs[i].sh_addr;
+        *size = elf_shdrs[i].sh_size;
+        return 0;
+    }
+    return -1;
+}
+
+uint64_t elf_virt_to_phys(const struct elf_image* img, uint64_t vaddr) {
+    return img->phys_base + (vaddr - img->virt_base);
+}
+
+// Zeroing a large BSS with regular stores would pull every line into the
+// cache only to be evicted unread; streaming stores bypass it.
+void elf_zero_nt(void* dst, uint64_t len) {
+    uint8_t* p = dst;
+#if defined(__x86_64__)
+    uint64_t zero = 0;
+    while (len && ((uintptr_t)p & 7)) { *p++ = 0; len--; }
+    while (len >= 8) {
+        __asm__ __volatile__("movnti %1, %0" : "=m"(*(uint64_t*)p) : "r"(zero));
+        p += 8;
+        len -= 8;
+    }
+    __asm__ __volatile__("sfence" : : : "memory");
+#elif defined(__aarch64__)
+    while (len && ((uintptr_t)p & 15)) { *p++ = 0; len--; }
+    while (len >= 16) {
+        __asm__ __volatile__("stnp xzr, xzr, [%0]" : : "r"(p) : "memory");
+        p += 16;
+        len -= 16;
+    }
+#endif
+    memset(p, 0, len);
+}
+
+static uint32_t elf_relative_type(uint16_t machine) {
+    switch (machine) {
+    case EM_X86_64: return R_X86_64_RELATIVE;
+    case EM_AARCH64: return R_AARCH64_RELATIVE;
+    case EM_RISCV: return R_RISCV_RELATIVE;
+    case EM_LOONGARCH: return R_LARCH_RELATIVE;
+    default: return 0;
+    }
+}
+
+static int elf_in_image(const struct elf_image* img, uint64_t vaddr, uint64_t len) {
+    return vaddr >= img->virt_base && len <= img->size && vaddr - img->virt_base <= img->size - len;
+}
+
+// Applies the DT_RELA table of a PIE image; anything but RELATIVE (and
+// x86-64 R_X86_64_64) is refused rather than silently left unrelocated.
+static int elf_relocate(const struct elf_image* img, const struct elf64_phdr* dynamic) {
+    uint64_t rela = 0, relasz = 0, relaent = sizeof(struct elf64_rela), symtab = 0, syment = sizeof(struct elf64_sym);
+    uint32_t relative = elf_relative_type(img->machine);
+    if (!elf_in_image(img, dynamic->p_vaddr + img->slide, dynamic->p_memsz)) return -1;
+    const struct elf64_dyn* dyn = (const struct elf64_dyn*)(uintptr_t)elf_virt_to_phys(img, dynamic->p_vaddr + img->slide);
+    for (uint64_t i = 0; i < dynamic->p_memsz / sizeof(*dyn) && dyn[i].d_tag != DT_NULL; ++i) {
+        switch (dyn[i].d_tag) {
+        case DT_RELA: rela = dyn[i].d_val; break;
+        case DT_RELASZ: relasz = dyn[i].d_val; break;
+        case DT_RELAENT: relaent = dyn[i].d_val; break;
+        case DT_SYMTAB: symtab = dyn[i].d_val; break;
+        case DT_SYMENT: syment = dyn[i].d_val; break;
+        }
+    }
+    if (!rela || !relasz) return 0;
+    if (relaent != sizeof(struct elf64_rela) || !elf_in_image(img, rela + img->slide, relasz)) return -1;
+    const struct elf64_rela* r = (const struct elf64_rela*)(uintptr_t)elf_virt_to_phys(img, rela + img->slide);
+    for (uint64_t i = 0; i < relasz / relaent; ++i) {
+        uint32_t type = (uint32_t)r[i].r_info;
+        uint32_t sym = (uint32_t)(r[i].r_info >> 32);
+        uint64_t where = r[i].r_offset + img->slide;
+        uint64_t value;
+        if (type == 0) continue;
+        if (!elf_in_image(img, where, 8)) return -1;
+        if (type == relative) {
+            value = img->slide + r[i].r_addend;
+        } else if (img->machine == EM_X86_64 && type == R_X86_64_64 && symtab && syment == sizeof(struct elf64_sym)) {
+            uint64_t sym_addr = symtab + img->slide + (uint64_t)sym * syment;
+            if (!elf_in_image(img, sym_addr, syment)) return -1;
+            const struct elf64_sym* s = (const struct elf64_sym*)(uintptr_t)elf_virt_to_phys(img, sym_addr);
+            value = (s->st_shndx ? s->st_value + img->slide : s->st_value) + r[i].r_addend;
+        } else {
+            return -1;
+        }
+        memcpy((void*)(uintptr_t)elf_virt_to_phys(img, where), &value, 8);
+    }
+    return 0;
+}
+
+// Program headers usually sit in the cached head; otherwise they are read.
+static int elf_read_table(struct kfile* kf, uint64_t offset, void* dst, uint64_t len) {
+    const void* head = kfile_at(kf, offset, len);
+    if (head) {
+        memcpy(dst, head, len);
+        return 0;
+    }
+    return kfile_read(kf, offset, dst, len);
+}
+
+// One forward sweep of the file reads every PT_LOAD in elf_phdrs to
+// phys_base + (p_vaddr - lo). Walking them in address order afterwards,
+// BSS tails and the page slack between segments are zeroed; nothing
+// mapped keeps stale contents.
+static int elf_place_segments(struct kfile* kf, int n, uint64_t lo, uint64_t hi, uint64_t phys_base) {
+    struct kfile_plan plan = { 0 };
+    for (int i = 0; i < n; ++i) {
+        const struct elf64_phdr* ph = &elf_phdrs[i];
+        if (ph->p_type != PT_LOAD || ph->p_memsz == 0) continue;
+        uint64_t dest = phys_base + (ph->p_vaddr - lo);
+        if (kfile_plan_add(&plan, ph->p_offset, ph->p_filesz, dest, ph->p_filesz) != 0) return -1;
+    }
+    if (kfile_plan_run(kf, &plan) != 0) return -1;
+
+    int order[ELF_MAX_PHDRS];
+    int loads = 0;
+    for (int i = 0; i < n; ++i) {
+        if (elf_phdrs[i].p_type != PT_LOAD || elf_phdrs[i].p_memsz == 0) continue;
+        int j = loads++;
+        while (j > 0 && elf_phdrs[order[j - 1]].p_vaddr > elf_phdrs[i].p_vaddr) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+    uint8_t* base = (uint8_t*)(uintptr_t)phys_base;
+    uint64_t cursor = lo;
+    for (int k = 0; k < loads; ++k) {
+        const struct elf64_phdr* ph = &elf_phdrs[order[k]];
+        if (ph->p_vaddr > cursor) elf_zero_nt(base + (cursor - lo), ph->p_vaddr - cursor);
+        if (ph->p_memsz > ph->p_filesz) elf_zero_nt(base + (ph->p_vaddr - lo) + ph->p_filesz, ph->p_memsz - ph->p_filesz);
+        cursor = ph->p_vaddr + ph->p_memsz;
+    }
+    if (hi > cursor) elf_zero_nt(base + (cursor - lo), hi - cursor);
+    return 0;
+}
+
+// Loads an ELF64 image from kf. With page tables the image may sit anywhere
+// physically and is mapped at its link address (PIE images at pie_base);
+// without them it runs identity-mapped, at its link address unless PIE.
+int elf_load(struct kfile* kf, uint16_t machine, uint64_t pie_base, struct paging_ctx* pt, struct elf_image* out) {
+    const struct elf64_header* eh = kfile_at(kf, 0, sizeof(struct elf64_header));
+    const struct elf64_phdr* dynamic = NULL;
+    uint64_t lo, hi, align;
+
+    if (elf_validate(eh, kf->size, machine) != 0) return -1;
+    if (elf_read_table(kf, eh->e_phoff, elf_phdrs, (uint64_t)eh->e_phnum * sizeof(struct elf64_phdr)) != 0) return -1;
+    if (elf_check_segments(elf_phdrs, eh->e_phnum, kf->size, &lo, &hi, &align) != 0) return -1;
+
+    memset(out, 0, sizeof(*out));
+    out->machine = eh->e_machine;
+    out->pie = eh->e_type == ET_DYN;
+    out->size = hi - lo;
+
+    struct memmap_request req = { 0 };
+    req.size = out->size;
+    req.align = align > PAGING_2M ? align : PAGING_2M;
+    req.min_addr = PAGING_2M;
+    req.kernel = 1;
+    if (pt) {
+        if (memmap_place(&req, &out->phys_base) != 0) return -1;
+        out->slide = out->pie ? (pie_base ? pie_base : ELF_PIE_DEFAULT_BASE) - lo : 0;
+    } else if (out->pie) {
+        if (memmap_place(&req, &out->phys_base) != 0) return -1;
+        out->slide = out->phys_base - lo;
+    } else {
+        if (memmap_claim(lo, out->size) != 0) return -1;
+        out->phys_base = lo;
+    }
+    out->virt_base = lo + out->slide;
+    out->entry = eh->e_entry + out->slide;
+
+    if (elf_place_segments(kf, eh->e_phnum, lo, hi, out->phys_base) != 0) return -1;
+    for (int i = 0; i < eh->e_phnum; ++i) {
+        if (elf_phdrs[i].p_type == PT_DYNAMIC) dynamic = &elf_phdrs[i];
+    }
+
+    if (out->pie && out->slide && dynamic && elf_relocate(out, dynamic) != 0) return -1;
+
+    if (pt) {
+        for (int i = 0; i < eh->e_phnum; ++i) {
+            const struct elf64_phdr* ph = &elf_phdrs[i];
+            if (ph->p_type != PT_LOAD || ph->p_memsz == 0) continue;
+            uint64_t vstart = ph->p_vaddr & ~(PAGING_4K - 1);
+            uint64_t vend = (ph->p_vaddr + ph->p_memsz + PAGING_4K - 1) & ~(PAGING_4K - 1);
+            uint32_t flags = 0;
+            if (ph->p_flags & PF_W) flags |= PAGING_WRITE;
+            if (ph->p_flags & PF_X) flags |= PAGING_EXEC;
+            if (paging_map(pt, vstart + out->slide, out->phys_base + (vstart - lo), vend - vstart, flags) != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+static int elf32_validate(const struct elf32_header* eh, uint64_t file_size) {
+    if (!eh || file_size < sizeof(*eh) || eh->e_ident[EI_VERSION] != EV_CURRENT || eh->e_type != ET_EXEC) return -1;
+    if (eh->e_phentsize != sizeof(struct elf32_phdr) || eh->e_phnum == 0 || eh->e_phnum > ELF_MAX_PHDRS) return -1;
+    if (eh->e_phoff > file_size || (uint64_t)eh->e_phnum * sizeof(struct elf32_phdr) > file_size - eh->e_phoff) return -1;
+    return 0;
+}
+
+// Multiboot kernels, ELF32 or ELF64, are loaded by physical address and
+// run with paging off. The headers are kept in elf_phdrs with p_vaddr and
+// p_paddr swapped, so the checks and placement above work on physical
+// addresses unchanged. With place set the image moves as a whole to
+// wherever that request allows. The entry is a link address and is
+// translated through the segment that holds it.
+int elf_load_phys(struct kfile* kf, const struct memmap_request* place, struct elf_image* out) {
+    const uint8_t* ident = kfile_at(kf, 0, EI_NIDENT);
+    uint64_t lo, hi, align, entry;
+    int n;
+
+    if (!ident || memcmp(ident, ELF_MAGIC, 4) != 0 || ident[EI_DATA] != ELFDATA2LSB) return -1;
+    memset(out, 0, sizeof(*out));
+    if (ident[EI_CLASS] == ELFCLASS64) {
+        const struct elf64_header* eh = kfile_at(kf, 0, sizeof(struct elf64_header));
+        if (elf_validate(eh, kf->size, 0) != 0 || eh->e_type != ET_EXEC ||
+            elf_read_table(kf, eh->e_phoff, elf_phdrs, (uint64_t)eh->e_phnum * sizeof(struct elf64_phdr)) != 0) return -1;
+        n = eh->e_phnum;
+        entry = eh->e_entry;
+        out->machine = eh->e_machine;
+        for (int i = 0; i < n; ++i) {
+            uint64_t vaddr = elf_phdrs[i].p_vaddr;
+            elf_phdrs[i].p_vaddr = elf_phdrs[i].p_paddr;
+            elf_phdrs[i].p_paddr = vaddr;
+        }
+    } else if (ident[EI_CLASS] == ELFCLASS32) {
+        const struct elf32_header* eh = kfile_at(kf, 0, sizeof(struct elf32_header));
+        if (elf32_validate(eh, kf->size) != 0 ||
+            elf_read_table(kf, eh->e_phoff, elf32_phdrs, (uint64_t)eh->e_phnum * sizeof(struct elf32_phdr)) != 0) return -1;
+        n = eh->e_phnum;
+        entry = eh->e_entry;
+        out->machine = eh->e_machine;
+        for (int i = 0; i < n; ++i) {
+            const struct elf32_phdr* ph = &elf32_phdrs[i];
+            elf_phdrs[i].p_type = ph->p_type;
+            elf_phdrs[i].p_flags = ph->p_flags;
+            elf_phdrs[i].p_offset = ph->p_offset;
+            elf_phdrs[i].p_vaddr = ph->p_paddr;
+            elf_phdrs[i].p_paddr = ph->p_vaddr;
+            elf_phdrs[i].p_filesz = ph->p_filesz;
+            elf_phdrs[i].p_memsz = ph->p_memsz;
+            elf_phdrs[i].p_align = ph->p_align;
+        }
+    } else {
+        return -1;
+    }
+    if (elf_check_segments(elf_phdrs, n, kf->size, &lo, &hi, &align) != 0) return -1;
+
+    out->size = hi - lo;
+    if (place) {
+        struct memmap_request req = *place;
+        req.size = out->size;
+        if (align > req.align) req.align = align;
+        req.kernel = 1;
+        if (memmap_place(&req, &out->phys_base) != 0) return -1;
+    } else {
+        if (memmap_claim(lo, out->size) != 0) return -1;
+        out->phys_base = lo;
+    }
+    out->slide = out->phys_base - lo;
+    out->virt_base = out->phys_base;
+    out->entry = entry;
+    for (int i = 0; i < n; ++i) {
+        const struct elf64_phdr* ph = &elf_phdrs[i];
+        if (ph->p_type == PT_LOAD && entry >= ph->p_paddr && entry - ph->p_paddr < ph->p_memsz) {
+            out->entry = ph->p_vaddr + (entry - ph->p_paddr);
+            break;
+        }
+    }
+    out->entry += out->slide;
+    return elf_place_segments(kf, n, lo, hi, out->phys_base);
+}
@@ -0,0 +1,180 @@
+/*
+ * BloodHorn Bootloader
+ *
+ * This file is part of BloodHorn and is licensed under the MIT License.
+ * See the root of the repository for license details.
+ */
+#ifndef BLOODHORN_ELF_H
+#define BLOODHORN_ELF_H
+#include <stdint.h>
+#include "compat.h"
+#include "kfile.h"
+#include "paging.h"
+#include "memmap.h"
+
+#define ELF_MAGIC "\x7f\x45\x4c\x46"
+#define EI_NIDENT 16
+#define EI_CLASS 4
+#define EI_DATA 5
+#define EI_VERSION 6
+#define ELFCLASS32 1
+#define ELFCLASS64 2
+#define ELFDATA2LSB 1
+#define EV_CURRENT 1
+
+#define ET_EXEC 2
+#define ET_DYN 3
+
+#define EM_386 3
+#define EM_X86_64 62
+#define EM_AARCH64 183
+#define EM_RISCV 243
+#define EM_LOONGARCH 258
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define ELF_MACHINE_NATIVE EM_X86_64
+#elif defined(__aarch64__)
+#define ELF_MACHINE_NATIVE EM_AARCH64
+#elif defined(__riscv)
+#define ELF_MACHINE_NATIVE EM_RISCV
+#elif defined(__loongarch__)
+#define ELF_MACHINE_NATIVE EM_LOONGARCH
+#else
+#define ELF_MACHINE_NATIVE EM_X86_64
+#endif
+
+#define PT_LOAD 1
+#define PT_DYNAMIC 2
+
+#define PF_X 1
+#define PF_W 2
+#define PF_R 4
+
+#define DT_NULL 0
+#define DT_SYMTAB 6
+#define DT_RELA 7
+#define DT_RELASZ 8
+#define DT_RELAENT 9
+#define DT_SYMENT 11
+
+// Relocation types handled for PIE kernels: the RELATIVE form of each
+// supported machine, plus x86-64's absolute 64-bit form.
+#define R_X86_64_64 1
+#define R_X86_64_RELATIVE 8
+#define R_AARCH64_RELATIVE 1027
+#define R_RISCV_RELATIVE 3
+#define R_LARCH_RELATIVE 3
+
+#define ELF_MAX_PHDRS 64
+#define ELF_MAX_SHDRS 128
+#define ELF_MAX_SHSTRTAB 0x4000
+#define ELF_PIE_DEFAULT_BASE 0xffffffff80000000ULL
+
+struct elf64_header {
+    uint8_t e_ident[16];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint64_t e_entry;
+    uint64_t e_phoff;
+    uint64_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+};
+
+struct elf64_phdr {
+    uint32_t p_type;
+    uint32_t p_flags;
+    uint64_t p_offset;
+    uint64_t p_vaddr;
+    uint64_t p_paddr;
+    uint64_t p_filesz;
+    uint64_t p_memsz;
+    uint64_t p_align;
+};
+
+struct elf32_header {
+    uint8_t e_ident[16];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint32_t e_entry;
+    uint32_t e_phoff;
+    uint32_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+};
+
+struct elf32_phdr {
+    uint32_t p_type;
+    uint32_t p_offset;
+    uint32_t p_vaddr;
+    uint32_t p_paddr;
+    uint32_t p_filesz;
+    uint32_t p_memsz;
+    uint32_t p_flags;
+    uint32_t p_align;
+};
+
+struct elf64_shdr {
+    uint32_t sh_name;
+    uint32_t sh_type;
+    uint64_t sh_flags;
+    uint64_t sh_addr;
+    uint64_t sh_offset;
+    uint64_t sh_size;
+    uint32_t sh_link;
+    uint32_t sh_info;
+    uint64_t sh_addralign;
+    uint64_t sh_entsize;
+};
+
+struct elf64_dyn {
+    int64_t d_tag;
+    uint64_t d_val;
+};
+
+struct elf64_rela {
+    uint64_t r_offset;
+    uint64_t r_info;
+    int64_t r_addend;
+};
+
+struct elf64_sym {
+    uint32_t st_name;
+    uint8_t st_info;
+    uint8_t st_other;
+    uint16_t st_shndx;
+    uint64_t st_value;
+    uint64_t st_size;
+};
+
+// Result of elf_load: where the image ended up, virtually and physically.
+struct elf_image {
+    uint16_t machine;
+    int pie;
+    uint64_t entry;
+    uint64_t virt_base;
+    uint64_t phys_base;
+    uint64_t size;
+    uint64_t slide;
+};
+
+int elf_validate(const struct elf64_header* eh, uint64_t file_size, uint16_t machine);
+int elf_load(struct kfile* kf, uint16_t machine, uint64_t pie_base, struct paging_ctx* pt, struct elf_image* out);
+int elf_find_section(struct kfile* kf, const char* name, uint64_t* addr, uint64_t* size);
+int elf_load_phys(struct kfile* kf, const struct memmap_request* place, struct elf_image* out);
+uint64_t elf_virt_to_phys(const struct elf_image* img, uint64_t vaddr);
+void elf_zero_nt(void* dst, uint64_t len);
+
+#endif // BLOODHORN_ELF_H
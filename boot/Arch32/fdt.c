@@ -0,0 +1,773 @@
+/*
+ * BloodHorn Bootloader
+ *
+ * This file is part of BloodHorn and is licensed under the MIT License.
+ * See the root of the repository for license details.
+ */
+#include <stdint.h>
+#include "compat.h"
+#include <string.h>
+#include "fdt.h"
+#include "memmap.h"
+#include "kfile.h"
+#include "fwinfo.h"
+
+#define FDT_ALIGN(x) (((x) + 3) & ~3U)
+#define FDT_HDR(fdt, field) fdt_rd32(&((const struct fdt_header*)(fdt))->field)
+#define FDT_SET(fdt, field, v) fdt_wr32(&((struct fdt_header*)(fdt))->field, (v))
+#define FDT_MAX_OVERLAYS 8
+
+// Its head buffer is too large for the firmware stack.
+static struct kfile fdt_file;
+
+uint32_t fdt_rd32(const void* p) {
+    const uint8_t* b = p;
+    return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
+
+uint64_t fdt_rd64(const void* p) {
+    return ((uint64_t)fdt_rd32(p) << 32) | fdt_rd32((const uint8_t*)p + 4);
+}
+
+void fdt_wr32(void* p, uint32_t v) {
+    uint8_t* b = p;
+    b[0] = (uint8_t)(v >> 24);
+    b[1] = (uint8_t)(v >> 16);
+    b[2] = (uint8_t)(v >> 8);
+    b[3] = (uint8_t)v;
+}
+
+void fdt_wr64(void* p, uint64_t v) {
+    fdt_wr32(p, (uint32_t)(v >> 32));
+    fdt_wr32((uint8_t*)p + 4, (uint32_t)v);
+}
+
+static uint8_t* fdt_struct(const void* fdt) {
+    return (uint8_t*)fdt + FDT_HDR(fdt, off_dt_struct);
+}
+
+static char* fdt_strings(const void* fdt) {
+    return (char*)fdt + FDT_HDR(fdt, off_dt_strings);
+}
+
+uint32_t fdt_totalsize(const void* fdt) {
+    return FDT_HDR(fdt, totalsize);
+}
+
+// Every block has to lie inside totalsize; max_size, when non-zero, bounds
+// totalsize itself for trees whose buffer size is known.
+int fdt_check(const void* fdt, uint64_t max_size) {
+    if (!fdt || FDT_HDR(fdt, magic) != FDT_MAGIC) return -1;
+    uint32_t total = FDT_HDR(fdt, totalsize);
+    uint32_t off_struct = FDT_HDR(fdt, off_dt_struct);
+    uint32_t size_struct = FDT_HDR(fdt, size_dt_struct);
+    uint32_t off_strings = FDT_HDR(fdt, off_dt_strings);
+    uint32_t size_strings = FDT_HDR(fdt, size_dt_strings);
+    uint32_t off_rsv = FDT_HDR(fdt, off_mem_rsvmap);
+    if (FDT_HDR(fdt, version) < FDT_VERSION || FDT_HDR(fdt, last_comp_version) > FDT_VERSION) return -1;
+    if (total < sizeof(struct fdt_header) || (max_size && total > max_size)) return -1;
+    if ((off_struct & 3) || (off_rsv & 7) || off_rsv < sizeof(struct fdt_header) || off_rsv > total) return -1;
+    if (off_struct > total || size_struct > total - off_struct || size_struct < 8) return -1;
+    if (off_strings > total || size_strings > total - off_strings) return -1;
+    return fdt_rd32((const uint8_t*)fdt + off_struct) == FDT_BEGIN_NODE ? 0 : -1;
+}
+
+// Returns the tag at offset and sets *next to the one after it, or -1 on
+// anything malformed or outside the structure block.
+static int fdt_next_tag(const void* fdt, int offset, int* next) {
+    uint32_t size = FDT_HDR(fdt, size_dt_struct);
+    const uint8_t* s = fdt_struct(fdt);
+    if (offset < 0 || (offset & 3) || (uint32_t)offset + 4 > size) return -1;
+    uint32_t tag = fdt_rd32(s + offset);
+    uint32_t p = (uint32_t)offset + 4;
+    switch (tag) {
+    case FDT_BEGIN_NODE: {
+        const uint8_t* nul = memchr(s + p, 0, size - p);
+        if (!nul) return -1;
+        p = (uint32_t)(nul - s) + 1;
+        break;
+    }
+    case FDT_PROP: {
+        if (p + 8 > size) return -1;
+        uint32_t len = fdt_rd32(s + p);
+        if (len > size - p - 8) return -1;
+        p += 8 + len;
+        break;
+    }
+    case FDT_END_NODE:
+    case FDT_NOP:
+    case FDT_END:
+        break;
+    default:
+        return -1;
+    }
+    *next = (int)FDT_ALIGN(p);
+    return (int)tag;
+}
+
+// Next node in document order. depth goes up by one entering a node and
+// down by one leaving it; the walk stops once it drops below zero.
+int fdt_next_node(const void* fdt, int offset, int* depth) {
+    int next, tag;
+    if (fdt_next_tag(fdt, offset, &next) != FDT_BEGIN_NODE) return -1;
+    offset = next;
+    for (;;) {
+        tag = fdt_next_tag(fdt, offset, &next);
+        if (tag < 0 || tag == FDT_END) return -1;
+        if (tag == FDT_BEGIN_NODE) {
+            if (depth) (*depth)++;
+            return offset;
+        }
+        if (tag == FDT_END_NODE && depth && --(*depth) < 0) return -1;
+        offset = next;
+    }
+}
+
+int fdt_first_subnode(const void* fdt, int parent) {
+    int depth = 0;
+    int offset = fdt_next_node(fdt, parent, &depth);
+    return offset >= 0 && depth == 1 ? offset : -1;
+}
+
+int fdt_next_subnode(const void* fdt, int offset) {
+    int depth = 1;
+    do {
+        offset = fdt_next_node(fdt, offset, &depth);
+        if (offset < 0 || depth < 1) return -1;
+    } while (depth > 1);
+    return offset;
+}
+
+static int fdt_prop_from(const void* fdt, int offset) {
+    int next, tag;
+    while ((tag = fdt_next_tag(fdt, offset, &next)) == FDT_NOP) offset = next;
+    return tag == FDT_PROP ? offset : -1;
+}
+
+int fdt_first_property(const void* fdt, int node) {
+    int next;
+    if (fdt_next_tag(fdt, node, &next) != FDT_BEGIN_NODE) return -1;
+    return fdt_prop_from(fdt, next);
+}
+
+int fdt_next_property(const void* fdt, int offset) {
+    int next;
+    if (fdt_next_tag(fdt, offset, &next) != FDT_PROP) return -1;
+    return fdt_prop_from(fdt, next);
+}
+
+// The value points into the tree itself; nothing is copied.
+const void* fdt_property(const void* fdt, int offset, const char** name, int* len) {
+    const uint8_t* p = fdt_struct(fdt) + offset;
+    uint32_t nameoff = fdt_rd32(p + 8);
+    uint32_t size = FDT_HDR(fdt, size_dt_strings);
+    if (nameoff >= size || !memchr(fdt_strings(fdt) + nameoff, 0, size - nameoff)) return NULL;
+    *name = fdt_strings(fdt) + nameoff;
+    *len = (int)fdt_rd32(p + 4);
+    return p + 12;
+}
+
+const char* fdt_get_name(const void* fdt, int node, int* len) {
+    const char* name = (const char*)fdt_struct(fdt) + node + 4;
+    if (len) *len = (int)strlen(name);
+    return name;
+}
+
+// A name without a unit address also matches "name@unit".
+int fdt_subnode_offset(const void* fdt, int parent, const char* name, int namelen) {
+    int has_unit = memchr(name, '@', namelen) != NULL;
+    for (int node = fdt_first_subnode(fdt, parent); node >= 0; node = fdt_next_subnode(fdt, node)) {
+        int len;
+        const char* n = fdt_get_name(fdt, node, &len);
+        if (len < namelen || memcmp(n, name, namelen) != 0) continue;
+        if (len == namelen || (!has_unit && n[namelen] == '@')) return node;
+    }
+    return -1;
+}
+
+// Unit address included, for editing where "cpu" and "cpu@0" differ.
+static int fdt_subnode_exact(const void* fdt, int parent, const char* name, int namelen) {
+    for (int node = fdt_first_subnode(fdt, parent); node >= 0; node = fdt_next_subnode(fdt, node)) {
+        int len;
+        const char* n = fdt_get_name(fdt, node, &len);
+        if (len == namelen && memcmp(n, name, namelen) == 0) return node;
+    }
+    return -1;
+}
+
+const void* fdt_getprop(const void* fdt, int node, const char* name, int* len) {
+    for (int p = fdt_first_property(fdt, node); p >= 0; p = fdt_next_property(fdt, p)) {
+        const char* pname;
+        int plen;
+        const void* val = fdt_property(fdt, p, &pname, &plen);
+        if (val && strcmp(pname, name) == 0) {
+            if (len) *len = plen;
+            return val;
+        }
+    }
+    return NULL;
+}
+
+static int fdt_find_prop(const void* fdt, int node, const char* name) {
+    for (int p = fdt_first_property(fdt, node); p >= 0; p = fdt_next_property(fdt, p)) {
+        const char* pname;
+        int plen;
+        if (fdt_property(fdt, p, &pname, &plen) && strcmp(pname, name) == 0) return p;
+    }
+    return -1;
+}
+
+// Paths may start with an alias from /aliases instead of '/'.
+int fdt_path_offset(const void* fdt, const char* path) {
+    int node = 0;
+    if (*path != '/') {
+        const char* slash = strchr(path, '/');
+        int n = slash ? (int)(slash - path) : (int)strlen(path);
+        char alias[64];
+        int len;
+        if (n <= 0 || n >= (int)sizeof(alias)) return -1;
+        memcpy(alias, path, n);
+        alias[n] = 0;
+        int aliases = fdt_subnode_offset(fdt, 0, "aliases", 7);
+        const char* target = aliases >= 0 ? fdt_getprop(fdt, aliases, alias, &len) : NULL;
+        if (!target || len < 2 || *target != '/' || !memchr(target, 0, len)) return -1;
+        node = fdt_path_offset(fdt, target);
+        if (node < 0) return -1;
+        path += n;
+    }
+    while (*path) {
+        while (*path == '/') path++;
+        if (!*path) break;
+        const char* slash = strchr(path, '/');
+        int n = slash ? (int)(slash - path) : (int)strlen(path);
+        node = fdt_subnode_offset(fdt, node, path, n);
+        if (node < 0) return -1;
+        path += n;
+    }
+    return node;
+}
+
+uint32_t fdt_get_phandle(const void* fdt, int node) {
+    int len;
+    const void* p = fdt_getprop(fdt, node, "phandle", &len);
+    if (!p || len != 4) p = fdt_getprop(fdt, node, "linux,phandle", &len);
+    return p && len == 4 ? fdt_rd32(p) : 0;
+}
+
+int fdt_node_offset_by_phandle(const void* fdt, uint32_t phandle) {
+    if (phandle == 0 || phandle == 0xFFFFFFFFU) return -1;
+    for (int node = 0, depth = 0; node >= 0; node = fdt_next_node(fdt, node, &depth)) {
+        if (fdt_get_phandle(fdt, node) == phandle) return node;
+    }
+    return -1;
+}
+
+// Edits need the layout fdt_open_into produces: structure block, then
+// strings, then all of the free space.
+static uint32_t fdt_free_space(const void* fdt) {
+    uint32_t struct_end = FDT_HDR(fdt, off_dt_struct) + FDT_HDR(fdt, size_dt_struct);
+    uint32_t end = FDT_HDR(fdt, off_dt_strings) + FDT_HDR(fdt, size_dt_strings);
+    if (struct_end != FDT_HDR(fdt, off_dt_strings) || end > FDT_HDR(fdt, totalsize)) return 0;
+    return FDT_HDR(fdt, totalsize) - end;
+}
+
+// Resizes the structure block at offset; everything after it, strings
+// included, moves and the free space takes up the difference.
+static int fdt_splice_struct(void* fdt, int offset, uint32_t oldlen, uint32_t newlen) {
+    uint32_t room = fdt_free_space(fdt);
+    uint32_t end = FDT_HDR(fdt, off_dt_strings) + FDT_HDR(fdt, size_dt_strings);
+    uint8_t* p = fdt_struct(fdt) + offset;
+    if (newlen > oldlen && newlen - oldlen > room) return -1;
+    memmove(p + newlen, p + oldlen, (uint8_t*)fdt + end - (p + oldlen));
+    FDT_SET(fdt, size_dt_struct, FDT_HDR(fdt, size_dt_struct) + newlen - oldlen);
+    FDT_SET(fdt, off_dt_strings, FDT_HDR(fdt, off_dt_strings) + newlen - oldlen);
+    return 0;
+}
+
+// Names are shared: any existing copy, including the tail of a longer
+// name, is reused before the table grows.
+static int fdt_find_add_string(void* fdt, const char* name) {
+    char* tab = fdt_strings(fdt);
+    uint32_t size = FDT_HDR(fdt, size_dt_strings);
+    uint32_t len = (uint32_t)strlen(name) + 1;
+    for (char* p = tab; len <= size && p <= tab + size - len; p++) {
+        p = memchr(p, name[0], tab + size - len + 1 - p);
+        if (!p) break;
+        if (memcmp(p, name, len) == 0) return (int)(p - tab);
+    }
+    if (len > fdt_free_space(fdt)) return -1;
+    memcpy(tab + size, name, len);
+    FDT_SET(fdt, size_dt_strings, size + len);
+    return (int)size;
+}
+
+// val must not point into fdt; the splice may move it.
+int fdt_setprop(void* fdt, int node, const char* name, const void* val, int len) {
+    int prop = fdt_find_prop(fdt, node, name);
+    if (len < 0) return -1;
+    if (prop >= 0) {
+        uint32_t oldlen = fdt_rd32(fdt_struct(fdt) + prop + 4);
+        if (fdt_splice_struct(fdt, prop + 12, FDT_ALIGN(oldlen), FDT_ALIGN((uint32_t)len)) != 0) return -1;
+    } else {
+        int next;
+        if (fdt_next_tag(fdt, node, &next) != FDT_BEGIN_NODE) return -1;
+        // Check both allocations up front so a failure leaves no stray name
+        if (12 + FDT_ALIGN((uint32_t)len) + strlen(name) + 1 > fdt_free_space(fdt)) return -1;
+        int nameoff = fdt_find_add_string(fdt, name);
+        if (nameoff < 0 || fdt_splice_struct(fdt, next, 0, 12 + FDT_ALIGN((uint32_t)len)) != 0) return -1;
+        prop = next;
+        fdt_wr32(fdt_struct(fdt) + prop, FDT_PROP);
+        fdt_wr32(fdt_struct(fdt) + prop + 8, (uint32_t)nameoff);
+    }
+    uint8_t* p = fdt_struct(fdt) + prop;
+    fdt_wr32(p + 4, (uint32_t)len);
+    if (len) memcpy(p + 12, val, len);
+    memset(p + 12 + len, 0, FDT_ALIGN((uint32_t)len) - len);
+    return 0;
+}
+
+int fdt_setprop_u32(void* fdt, int node, const char* name, uint32_t val) {
+    uint8_t buf[4];
+    fdt_wr32(buf, val);
+    return fdt_setprop(fdt, node, name, buf, sizeof(buf));
+}
+
+int fdt_setprop_u64(void* fdt, int node, const char* name, uint64_t val) {
+    uint8_t buf[8];
+    fdt_wr64(buf, val);
+    return fdt_setprop(fdt, node, name, buf, sizeof(buf));
+}
+
+int fdt_setprop_string(void* fdt, int node, const char* name, const char* str) {
+    return fdt_setprop(fdt, node, name, str, (int)strlen(str) + 1);
+}
+
+int fdt_delprop(void* fdt, int node, const char* name) {
+    int prop = fdt_find_prop(fdt, node, name);
+    if (prop < 0) return 0;
+    return fdt_splice_struct(fdt, prop, 12 + FDT_ALIGN(fdt_rd32(fdt_struct(fdt) + prop + 4)), 0);
+}
+
+// New nodes go after the parent's properties, ahead of its other children.
+int fdt_add_subnode(void* fdt, int parent, const char* name) {
+    int offset, next, tag;
+    uint32_t namelen = (uint32_t)strlen(name) + 1;
+    uint32_t nodelen = 8 + FDT_ALIGN(namelen);
+    if (fdt_subnode_exact(fdt, parent, name, (int)namelen - 1) >= 0) return -1;
+    if (fdt_next_tag(fdt, parent, &offset) != FDT_BEGIN_NODE) return -1;
+    while ((tag = fdt_next_tag(fdt, offset, &next)) == FDT_PROP || tag == FDT_NOP) offset = next;
+    if (tag < 0 || fdt_splice_struct(fdt, offset, 0, nodelen) != 0) return -1;
+    uint8_t* p = fdt_struct(fdt) + offset;
+    fdt_wr32(p, FDT_BEGIN_NODE);
+    memset(p + 4, 0, FDT_ALIGN(namelen));
+    memcpy(p + 4, name, namelen);
+    fdt_wr32(p + nodelen - 4, FDT_END_NODE);
+    return offset;
+}
+
+int fdt_del_node(void* fdt, int node) {
+    int depth = 0, offset = node, next, tag;
+    do {
+        tag = fdt_next_tag(fdt, offset, &next);
+        if (tag < 0 || tag == FDT_END) return -1;
+        if (tag == FDT_BEGIN_NODE) depth++;
+        else if (tag == FDT_END_NODE) depth--;
+        offset = next;
+    } while (depth > 0);
+    return fdt_splice_struct(fdt, node, (uint32_t)(offset - node), 0);
+}
+
+// Copies the tree into buf laid out for editing -- reserve map, structure,
+// strings, free space -- with totalsize set to bufsize.
+int fdt_open_into(const void* fdt, void* buf, uint32_t bufsize) {
+    if (fdt_check(fdt, 0) != 0) return -1;
+    uint32_t total = FDT_HDR(fdt, totalsize);
+    uint32_t off_rsv = FDT_HDR(fdt, off_mem_rsvmap);
+    uint32_t rsv = 0;
+    for (;;) {
+        if (off_rsv + rsv + 16 > total) return -1;
+        rsv += 16;
+        const uint8_t* e = (const uint8_t*)fdt + off_rsv + rsv - 16;
+        if (fdt_rd64(e) == 0 && fdt_rd64(e + 8) == 0) break;
+    }
+    uint32_t size_struct = FDT_HDR(fdt, size_dt_struct);
+    uint32_t size_strings = FDT_HDR(fdt, size_dt_strings);
+    uint32_t new_rsv = sizeof(struct fdt_header);
+    uint32_t new_struct = new_rsv + rsv;
+    uint32_t new_strings = new_struct + size_struct;
+    if ((uint64_t)new_strings + size_strings > bufsize) return -1;
+    if ((const uint8_t*)buf < (const uint8_t*)fdt + total && (const uint8_t*)fdt < (const uint8_t*)buf + bufsize) return -1;
+
+    uint8_t* out = buf;
+    memcpy(out + new_rsv, (const uint8_t*)fdt + off_rsv, rsv);
+    memcpy(out + new_struct, fdt_struct(fdt), size_struct);
+    memcpy(out + new_strings, fdt_strings(fdt), size_strings);
+    FDT_SET(buf, magic, FDT_MAGIC);
+    FDT_SET(buf, totalsize, bufsize);
+    FDT_SET(buf, off_dt_struct, new_struct);
+    FDT_SET(buf, off_dt_strings, new_strings);
+    FDT_SET(buf, off_mem_rsvmap, new_rsv);
+    FDT_SET(buf, version, FDT_VERSION);
+    FDT_SET(buf, last_comp_version, FDT_LAST_COMP_VERSION);
+    FDT_SET(buf, boot_cpuid_phys, FDT_HDR(fdt, boot_cpuid_phys));
+    FDT_SET(buf, size_dt_strings, size_strings);
+    FDT_SET(buf, size_dt_struct, size_struct);
+    return 0;
+}
+
+// A root node and nothing else, for machines whose firmware has no tree.
+int fdt_create_empty(void* buf, uint32_t bufsize) {
+    uint32_t off_struct = sizeof(struct fdt_header) + 16;
+    uint32_t size_struct = 16;
+    if (bufsize < off_struct + size_struct) return -1;
+    memset(buf, 0, off_struct + size_struct);
+    uint8_t* s = (uint8_t*)buf + off_struct;
+    fdt_wr32(s, FDT_BEGIN_NODE);
+    fdt_wr32(s + 8, FDT_END_NODE);
+    fdt_wr32(s + 12, FDT_END);
+    FDT_SET(buf, magic, FDT_MAGIC);
+    FDT_SET(buf, totalsize, bufsize);
+    FDT_SET(buf, off_dt_struct, off_struct);
+    FDT_SET(buf, off_dt_strings, off_struct + size_struct);
+    FDT_SET(buf, off_mem_rsvmap, sizeof(struct fdt_header));
+    FDT_SET(buf, version, FDT_VERSION);
+    FDT_SET(buf, last_comp_version, FDT_LAST_COMP_VERSION);
+    FDT_SET(buf, size_dt_struct, size_struct);
+    return 0;
+}
+
+void fdt_pack(void* fdt) {
+    FDT_SET(fdt, totalsize, FDT_HDR(fdt, off_dt_strings) + FDT_HDR(fdt, size_dt_strings));
+}
+
+static uint32_t fdt_max_phandle(const void* fdt) {
+    uint32_t max = 0;
+    for (int node = 0, depth = 0; node >= 0; node = fdt_next_node(fdt, node, &depth)) {
+        uint32_t ph = fdt_get_phandle(fdt, node);
+        if (ph != 0xFFFFFFFFU && ph > max) max = ph;
+    }
+    return max;
+}
+
+// Overlay phandles are moved above every phandle the base tree uses.
+static void fdt_overlay_adjust_phandles(void* ovl, uint32_t delta) {
+    for (int node = 0, depth = 0; node >= 0; node = fdt_next_node(ovl, node, &depth)) {
+        for (int p = fdt_first_property(ovl, node); p >= 0; p = fdt_next_property(ovl, p)) {
+            const char* name;
+            int len;
+            uint8_t* val = (uint8_t*)fdt_property(ovl, p, &name, &len);
+            if (val && len == 4 && (strcmp(name, "phandle") == 0 || strcmp(name, "linux,phandle") == 0)) {
+                fdt_wr32(val, fdt_rd32(val) + delta);
+            }
+        }
+    }
+}
+
+// __local_fixups__ mirrors the overlay tree; each of its properties lists
+// the offsets of phandle cells in the same-named property of the same node.
+static int fdt_overlay_local_fixups(void* ovl, int fix, int node, uint32_t delta, int depth) {
+    if (depth > FDT_MAX_DEPTH) return -1;
+    for (int p = fdt_first_property(ovl, fix); p >= 0; p = fdt_next_property(ovl, p)) {
+        const char* name;
+        int fixlen, len;
+        const uint8_t* offs = fdt_property(ovl, p, &name, &fixlen);
+        uint8_t* val = (uint8_t*)fdt_getprop(ovl, node, name, &len);
+        if (!offs || !val || (fixlen & 3)) return -1;
+        for (int i = 0; i < fixlen; i += 4) {
+            uint32_t off = fdt_rd32(offs + i);
+            if (off > (uint32_t)len - 4 || len < 4) return -1;
+            fdt_wr32(val + off, fdt_rd32(val + off) + delta);
+        }
+    }
+    for (int c = fdt_first_subnode(ovl, fix); c >= 0; c = fdt_next_subnode(ovl, c)) {
+        int len;
+        const char* name = fdt_get_name(ovl, c, &len);
+        int target = fdt_subnode_exact(ovl, node, name, len);
+        if (target < 0 || fdt_overlay_local_fixups(ovl, c, target, delta, depth + 1) != 0) return -1;
+    }
+    return 0;
+}
+
+// Each __fixups__ property names a label of the base tree and lists
+// "path:property:offset" cells in the overlay that need its phandle.
+static int fdt_overlay_fixups(const void* fdt, void* ovl) {
+    int fixups = fdt_subnode_offset(ovl, 0, "__fixups__", 10);
+    int symbols = fdt_subnode_offset(fdt, 0, "__symbols__", 11);
+    if (fixups < 0) return 0;
+    for (int p = fdt_first_property(ovl, fixups); p >= 0; p = fdt_next_property(ovl, p)) {
+        const char* label;
+        int len, tlen;
+        const char* refs = fdt_property(ovl, p, &label, &len);
+        const char* target = symbols >= 0 ? fdt_getprop(fdt, symbols, label, &tlen) : NULL;
+        if (!refs || !target || !memchr(target, 0, tlen)) return -1;
+        uint32_t phandle = fdt_get_phandle(fdt, fdt_path_offset(fdt, target));
+        if (!phandle) return -1;
+
+        for (const char* r = refs; r < refs + len; r += strlen(r) + 1) {
+            char path[FDT_MAX_PATH], prop[FDT_MAX_PATH];
+            const char* end = memchr(r, 0, refs + len - r);
+            const char* c1 = end ? memchr(r, ':', end - r) : NULL;
+            const char* c2 = c1 ? memchr(c1 + 1, ':', end - c1 - 1) : NULL;
+            if (!c2 || c1 - r >= FDT_MAX_PATH || c2 - c1 - 1 >= FDT_MAX_PATH) return -1;
+            memcpy(path, r, c1 - r);
+            path[c1 - r] = 0;
+            memcpy(prop, c1 + 1, c2 - c1 - 1);
+            prop[c2 - c1 - 1] = 0;
+            uint32_t off = 0;
+            for (const char* d = c2 + 1; d < end; d++) {
+                if (*d < '0' || *d > '9') return -1;
+                off = off * 10 + (uint32_t)(*d - '0');
+            }
+            int vlen;
+            int node = fdt_path_offset(ovl, path);
+            uint8_t* val = node >= 0 ? (uint8_t*)fdt_getprop(ovl, node, prop, &vlen) : NULL;
+            if (!val || vlen < 4 || off > (uint32_t)vlen - 4) return -1;
+            fdt_wr32(val + off, phandle);
+        }
+    }
+    return 0;
+}
+
+static int fdt_overlay_merge(void* fdt, int target, const void* ovl, int node, int depth) {
+    if (depth > FDT_MAX_DEPTH) return -1;
+    for (int p = fdt_first_property(ovl, node); p >= 0; p = fdt_next_property(ovl, p)) {
+        const char* name;
+        int len;
+        const void* val = fdt_property(ovl, p, &name, &len);
+        if (!val || fdt_setprop(fdt, target, name, val, len) != 0) return -1;
+    }
+    for (int c = fdt_first_subnode(ovl, node); c >= 0; c = fdt_next_subnode(ovl, c)) {
+        int len;
+        const char* name = fdt_get_name(ovl, c, &len);
+        int sub = fdt_subnode_exact(fdt, target, name, len);
+        if (sub < 0) sub = fdt_add_subnode(fdt, target, name);
+        if (sub < 0 || fdt_overlay_merge(fdt, sub, ovl, c, depth + 1) != 0) return -1;
+    }
+    return 0;
+}
+
+// Applies a compiled overlay (dtc -@) the way libfdt does: renumber its
+// phandles, resolve local and external references, then merge each
+// fragment's __overlay__ into its target. The overlay is modified; the
+// base tree must have been opened with room to grow.
+int fdt_overlay_apply(void* fdt, void* ovl) {
+    if (fdt_check(ovl, 0) != 0) return -1;
+    uint32_t delta = fdt_max_phandle(fdt);
+    fdt_overlay_adjust_phandles(ovl, delta);
+    int fix = fdt_subnode_offset(ovl, 0, "__local_fixups__", 16);
+    if (fix >= 0 && fdt_overlay_local_fixups(ovl, fix, 0, delta, 0) != 0) return -1;
+    if (fdt_overlay_fixups(fdt, ovl) != 0) return -1;
+
+    for (int frag = fdt_first_subnode(ovl, 0); frag >= 0; frag = fdt_next_subnode(ovl, frag)) {
+        int ov = fdt_subnode_offset(ovl, frag, "__overlay__", 11);
+        int len, target = -1;
+        if (ov < 0) continue;
+        const void* ph = fdt_getprop(ovl, frag, "target", &len);
+        if (ph && len == 4) {
+            target = fdt_node_offset_by_phandle(fdt, fdt_rd32(ph));
+        } else {
+            const char* path = fdt_getprop(ovl, frag, "target-path", &len);
+            if (path && memchr(path, 0, len)) target = fdt_path_offset(fdt, path);
+        }
+        if (target < 0 || fdt_overlay_merge(fdt, target, ovl, ov, 0) != 0) return -1;
+    }
+    return 0;
+}
+
+// Anything the firmware left in /chosen about an initrd is stale; the
+// seeds are refreshed whenever the firmware has an RNG.
+int fdt_fixup_chosen(void* fdt, const char* cmdline, uint64_t initrd_start, uint64_t initrd_size) {
+    uint8_t seed[FDT_RNG_SEED_SIZE];
+    int chosen = fdt_subnode_offset(fdt, 0, "chosen", 6);
+    if (chosen < 0) chosen = fdt_add_subnode(fdt, 0, "chosen");
+    if (chosen < 0) return -1;
+    if (cmdline && *cmdline && fdt_setprop_string(fdt, chosen, "bootargs", cmdline) != 0) return -1;
+    if (initrd_size) {
+        if (fdt_setprop_u64(fdt, chosen, "linux,initrd-start", initrd_start) != 0 ||
+            fdt_setprop_u64(fdt, chosen, "linux,initrd-end", initrd_start + initrd_size) != 0) {
+            return -1;
+        }
+    } else if (fdt_delprop(fdt, chosen, "linux,initrd-start") != 0 ||
+               fdt_delprop(fdt, chosen, "linux,initrd-end") != 0) {
+        return -1;
+    }
+    if (fwinfo_random(seed, sizeof(seed)) == 0) {
+        int r = fdt_setprop(fdt, chosen, "rng-seed", seed, sizeof(seed));
+        if (r == 0 && fwinfo_random(seed, 8) == 0) r = fdt_setprop(fdt, chosen, "kaslr-seed", seed, 8);
+        memset(seed, 0, sizeof(seed));
+        if (r != 0) return -1;
+    }
+    return 0;
+}
+
+static int fdt_is_ram(uint32_t type) {
+    return type == MEMMAP_USABLE || type == MEMMAP_LOADER_RECLAIMABLE || type == MEMMAP_KERNEL_AND_MODULES;
+}
+
+static int fdt_put_cells(uint8_t* p, uint64_t v, uint32_t cells) {
+    if (cells == 2) {
+        fdt_wr64(p, v);
+        return 8;
+    }
+    fdt_wr32(p, (uint32_t)v);
+    return 4;
+}
+
+// Appends reg entries for [base, end). A single address cell cannot
+// describe anything above 4 GiB, so the run is clipped there; a single
+// size cell cannot hold 4 GiB, so longer runs become several page-aligned
+// entries. Returns -1 when reg is full.
+static int fdt_put_range(uint8_t* reg, uint32_t* used, uint32_t max, uint64_t base, uint64_t end,
+                         uint32_t acells, uint32_t scells) {
+    if (acells == 1 && end > 0x100000000ULL) end = 0x100000000ULL;
+    while (base < end) {
+        uint64_t size = end - base;
+        if (scells == 1 && size > 0xFFFFFFFFULL) size = 0x100000000ULL - MEMMAP_PAGE_SIZE;
+        if (*used + (acells + scells) * 4 > max) return -1;
+        *used += fdt_put_cells(reg + *used, base, acells);
+        *used += fdt_put_cells(reg + *used, size, scells);
+        base += size;
+    }
+    return 0;
+}
+
+// Memory nodes are rebuilt from the UEFI map as one node listing every RAM
+// run, in the root's cell sizes.
+int fdt_fixup_memory(void* fdt) {
+    static uint8_t reg[MEMMAP_MAX_ENTRIES * 16];
+    int len, count = 0, node, depth;
+    const void* v;
+
+    for (node = 0, depth = 0; node >= 0;) {
+        const char* type = fdt_getprop(fdt, node, "device_type", &len);
+        if (node && type && len == 7 && memcmp(type, "memory", 7) == 0) {
+            if (fdt_del_node(fdt, node) != 0) return -1;
+            node = 0;
+            depth = 0;
+            continue;
+        }
+        node = fdt_next_node(fdt, node, &depth);
+    }
+
+    v = fdt_getprop(fdt, 0, "#address-cells", &len);
+    uint32_t acells = v && len == 4 ? fdt_rd32(v) : 2;
+    v = fdt_getprop(fdt, 0, "#size-cells", &len);
+    uint32_t scells = v && len == 4 ? fdt_rd32(v) : 1;
+    if (acells < 1 || acells > 2 || scells < 1 || scells > 2) return -1;
+
+    // Adjacent RAM of different sub-types is one run to the kernel
+    const struct memmap_entry* map = memmap_get(&count);
+    uint64_t first = 0, base = 0, end = 0;
+    uint32_t used = 0;
+    for (int i = 0; i < count; i++) {
+        if (!fdt_is_ram(map[i].type)) continue;
+        if (end && map[i].base == end) {
+            end += map[i].length;
+            continue;
+        }
+        if (end && fdt_put_range(reg, &used, sizeof(reg), base, end, acells, scells) != 0) return -1;
+        base = map[i].base;
+        end = base + map[i].length;
+        if (!first) first = base;
+    }
+    if (end && fdt_put_range(reg, &used, sizeof(reg), base, end, acells, scells) != 0) return -1;
+    if (!used) return -1;
+
+    char name[32] = "memory@";
+    int n = 7;
+    for (int shift = 60; shift >= 0; shift -= 4) {
+        int digit = (int)((first >> shift) & 0xF);
+        if (digit || n > 7 || shift == 0) name[n++] = "0123456789abcdef"[digit];
+    }
+    name[n] = 0;
+    node = fdt_add_subnode(fdt, 0, name);
+    if (node < 0 || fdt_setprop_string(fdt, node, "device_type", "memory") != 0 ||
+        fdt_setprop(fdt, node, "reg", reg, (int)used) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void* fdt_load_file(const char* path, uint32_t* size) {
+    void* buf;
+    if (kfile_open(&fdt_file, path) != 0) return NULL;
+    if (fdt_file.size < sizeof(struct fdt_header) || fdt_file.size > FDT_MAX_SIZE ||
+        !(buf = memmap_alloc(fdt_file.size, MEMMAP_PAGE_SIZE, 0))) {
+        kfile_close(&fdt_file);
+        return NULL;
+    }
+    if (kfile_read(&fdt_file, 0, buf, fdt_file.size) != 0 || fdt_check(buf, fdt_file.size) != 0) {
+        memmap_free((uintptr_t)buf, fdt_file.size);
+        kfile_close(&fdt_file);
+        return NULL;
+    }
+    *size = (uint32_t)fdt_file.size;
+    kfile_close(&fdt_file);
+    return buf;
+}
+
+// Builds the tree a kernel gets: dtb_path if it loads, else the firmware's
+// tree, else an empty one; then the overlays (a space- or comma-separated
+// path list), the /chosen and /memory fixups and the caller's fixup, if
+// any. The result is packed into pages of its own and its address
+// returned, or 0 on failure.
+uint64_t fdt_prepare(const char* dtb_path, const char* overlays, const char* cmdline,
+                     uint64_t initrd_addr, uint64_t initrd_size, fdt_fixup_fn fixup) {
+    void* ovl[FDT_MAX_OVERLAYS];
+    uint32_t ovl_size[FDT_MAX_OVERLAYS];
+    int ovl_count = 0;
+    uint32_t file_size = 0;
+    const void* src = dtb_path ? fdt_load_file(dtb_path, &file_size) : NULL;
+    const void* file = src;
+    uint64_t result = 0;
+
+    if (!src) {
+        uint64_t fw = fwinfo_dtb();
+        if (fw && fdt_check((const void*)(uintptr_t)fw, FDT_MAX_SIZE) == 0) src = (const void*)(uintptr_t)fw;
+    }
+
+    uint64_t size = (src ? fdt_totalsize(src) : 0) + FDT_SLACK + sizeof(uint64_t) * 2 * MEMMAP_MAX_ENTRIES;
+    if (cmdline) size += strlen(cmdline) + 1;
+    for (const char* p = overlays; p && *p && ovl_count < FDT_MAX_OVERLAYS;) {
+        char path[FDT_MAX_PATH];
+        int n = 0;
+        while (*p == ' ' || *p == ',') p++;
+        while (*p && *p != ' ' && *p != ',') {
+            if (n < FDT_MAX_PATH - 1) path[n++] = *p;
+            p++;
+        }
+        path[n] = 0;
+        if (n && (ovl[ovl_count] = fdt_load_file(path, &ovl_size[ovl_count])) != NULL) {
+            size += ovl_size[ovl_count++];
+        }
+    }
+    size = (size + MEMMAP_PAGE_SIZE - 1) & ~(MEMMAP_PAGE_SIZE - 1);
+    if (size > FDT_MAX_SIZE) size = FDT_MAX_SIZE;
+
+    struct memmap_request req = {0};
+    uint64_t addr;
+    req.size = size;
+    req.align = MEMMAP_PAGE_SIZE;
+    req.kernel = 1;
+    if (memmap_place(&req, &addr) == 0) {
+        void* fdt = (void*)(uintptr_t)addr;
+        int r = src ? fdt_open_into(src, fdt, (uint32_t)size) : fdt_create_empty(fdt, (uint32_t)size);
+        if (r == 0 && !src) {
+            r = fdt_setprop_u32(fdt, 0, "#address-cells", 2) != 0 || fdt_setprop_u32(fdt, 0, "#size-cells", 2) != 0 ? -1 : 0;
+        }
+        for (int i = 0; r == 0 && i < ovl_count; i++) r = fdt_overlay_apply(fdt, ovl[i]);
+        if (r == 0) r = fdt_fixup_chosen(fdt, cmdline, initrd_addr, initrd_size);
+        if (r == 0) r = fdt_fixup_memory(fdt);
+        if (r == 0 && fixup) r = fixup(fdt);
+        if (r == 0) {
+            fdt_pack(fdt);
+            result = addr;
+        } else {
+            memmap_free(addr, size);
+        }
+    }
+
+    for (int i = 0; i < ovl_count; i++) memmap_free((uintptr_t)ovl[i], ovl_size[i]);
+    if (file) memmap_free((uintptr_t)file, file_size);
+    return result;
+}
@@ -0,0 +1,92 @@
+/*
+ * BloodHorn Bootloader
+ *
+ * This file is part of BloodHorn and is licensed under the MIT License.
+ * See the root of the repository for license details.
+ */
+#ifndef BLOODHORN_FDT_H
+#define BLOODHORN_FDT_H
+#include <stdint.h>
+#include "compat.h"
+
+// Flattened device tree, read and edited in place. Node and property
+// offsets are byte offsets into the structure block, as in libfdt; any
+// edit may move everything after the point it touched, so offsets taken
+// before an edit are only good for nodes that precede it.
+#define FDT_MAGIC 0xd00dfeedU
+#define FDT_VERSION 17
+#define FDT_LAST_COMP_VERSION 16
+
+#define FDT_BEGIN_NODE 0x1
+#define FDT_END_NODE 0x2
+#define FDT_PROP 0x3
+#define FDT_NOP 0x4
+#define FDT_END 0x9
+
+#define FDT_MAX_DEPTH 32
+#define FDT_MAX_PATH 256
+// Room added to the firmware tree for fixups and overlays
+#define FDT_SLACK 0x4000
+// The arm64 boot protocol caps the tree at 2 MiB
+#define FDT_MAX_SIZE 0x200000
+#define FDT_RNG_SEED_SIZE 64
+
+// All fields are big-endian
+struct fdt_header {
+    uint32_t magic;
+    uint32_t totalsize;
+    uint32_t off_dt_struct;
+    uint32_t off_dt_strings;
+    uint32_t off_mem_rsvmap;
+    uint32_t version;
+    uint32_t last_comp_version;
+    uint32_t boot_cpuid_phys;
+    uint32_t size_dt_strings;
+    uint32_t size_dt_struct;
+};
+
+uint32_t fdt_rd32(const void* p);
+uint64_t fdt_rd64(const void* p);
+void fdt_wr32(void* p, uint32_t v);
+void fdt_wr64(void* p, uint64_t v);
+
+int fdt_check(const void* fdt, uint64_t max_size);
+uint32_t fdt_totalsize(const void* fdt);
+int fdt_open_into(const void* fdt, void* buf, uint32_t bufsize);
+int fdt_create_empty(void* buf, uint32_t bufsize);
+void fdt_pack(void* fdt);
+
+int fdt_next_node(const void* fdt, int offset, int* depth);
+int fdt_first_subnode(const void* fdt, int parent);
+int fdt_next_subnode(const void* fdt, int offset);
+int fdt_first_property(const void* fdt, int node);
+int fdt_next_property(const void* fdt, int offset);
+const void* fdt_property(const void* fdt, int offset, const char** name, int* len);
+const char* fdt_get_name(const void* fdt, int node, int* len);
+
+int fdt_subnode_offset(const void* fdt, int parent, const char* name, int namelen);
+int fdt_path_offset(const void* fdt, const char* path);
+int fdt_node_offset_by_phandle(const void* fdt, uint32_t phandle);
+const void* fdt_getprop(const void* fdt, int node, const char* name, int* len);
+uint32_t fdt_get_phandle(const void* fdt, int node);
+
+int fdt_setprop(void* fdt, int node, const char* name, const void* val, int len);
+int fdt_setprop_u32(void* fdt, int node, const char* name, uint32_t val);
+int fdt_setprop_u64(void* fdt, int node, const char* name, uint64_t val);
+int fdt_setprop_string(void* fdt, int node, const char* name, const char* str);
+int fdt_delprop(void* fdt, int node, const char* name);
+int fdt_add_subnode(void* fdt, int parent, const char* name);
+int fdt_del_node(void* fdt, int node);
+
+int fdt_overlay_apply(void* fdt, void* overlay);
+int fdt_fixup_chosen(void* fdt, const char* cmdline, uint64_t initrd_start, uint64_t initrd_size);
+int fdt_fixup_memory(void* fdt);
+
+// Architecture-specific edits, run after the generic fixups and before
+// the tree is packed.
+typedef int (*fdt_fixup_fn)(void* fdt);
+
+uint64_t fdt_prepare(const char* dtb_path, const char* overlays, const char* cmdline,
+                     uint64_t initrd_addr, uint64_t initrd_size, fdt_fixup_fn fixup);
+
+#endif // BLOODHORN_FDT_H
@@ -0,0 +1,193 @@
+/*
+ * BloodHorn Bootloader
+ *
+ * This file is part of BloodHorn and is licensed under the MIT License.
+ * See the root of the repository for license details.
+ */
+#include <stdint.h>
+#include "compat.h"
+#include <string.h>
+#include <Uefi.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/UefiRuntimeServicesTableLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Protocol/GraphicsOutput.h>
+#include <Protocol/Rng.h>
+#include <Guid/Acpi.h>
+#include <Guid/SmBios.h>
+#include "fwinfo.h"
+
+// EmbeddedPkg's gFdtTableGuid; spelled out so we don't pull in that package
+static EFI_GUID fwinfo_fdt_guid = { 0xb1b621d5, 0xf19c, 0x41a5, { 0x83, 0x0b, 0xd9, 0x15, 0x2c, 0x69, 0xaa, 0xe0 } };
+
+// RISCV_EFI_BOOT_PROTOCOL, from the RISC-V UEFI protocol specification
+static EFI_GUID fwinfo_riscv_boot_guid = { 0xccd15fec, 0x6f73, 0x4eec, { 0x83, 0x95, 0x3e, 0x69, 0xe4, 0xb9, 0x40, 0xbf } };
+
+struct fwinfo_riscv_boot_protocol {
+    uint64_t revision;
+    EFI_STATUS (EFIAPI *get_boot_hartid)(struct fwinfo_riscv_boot_protocol* self, UINTN* hartid);
+};
+
+static uint64_t fwinfo_config_table(EFI_GUID* guid) {
+    for (UINTN i = 0; i < gST->NumberOfTableEntries; ++i) {
+        if (CompareGuid(&gST->ConfigurationTable[i].VendorGuid, guid)) {
+            return (uintptr_t)gST->ConfigurationTable[i].VendorTable;
+        }
+    }
+    return 0;
+}
+
+static void fwinfo_mask(uint32_t mask, uint8_t* size, uint8_t* shift) {
+    *size = 0;
+    *shift = 0;
+    if (!mask) return;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        (*shift)++;
+    }
+    while (mask & 1) {
+        mask >>= 1;
+        (*size)++;
+    }
+}
+
+// Describes the current GOP mode as a linear framebuffer; BLT-only modes
+// have no framebuffer a kernel could draw to, so they report none.
+int fwinfo_framebuffer(struct fwinfo_fb* fb) {
+    EFI_GRAPHICS_OUTPUT_PROTOCOL* gop = NULL;
+    memset(fb, 0, sizeof(*fb));
+    if (EFI_ERROR(gBS->LocateProtocol(&gEfiGraphicsOutputProtocolGuid, NULL, (VOID**)&gop)) || !gop || !gop->Mode || !gop->Mode->Info) {
+        return -1;
+    }
+    EFI_GRAPHICS_OUTPUT_MODE_INFORMATION* info = gop->Mode->Info;
+    switch (info->PixelFormat) {
+    case PixelRedGreenBlueReserved8BitPerColor:
+        fwinfo_mask(0x000000ff, &fb->red_size, &fb->red_shift);
+        fwinfo_mask(0x0000ff00, &fb->green_size, &fb->green_shift);
+        fwinfo_mask(0x00ff0000, &fb->blue_size, &fb->blue_shift);
+        fwinfo_mask(0xff000000, &fb->reserved_size, &fb->reserved_shift);
+        fb->bpp = 32;
+        break;
+    case PixelBlueGreenRedReserved8BitPerColor:
+        fwinfo_mask(0x00ff0000, &fb->red_size, &fb->red_shift);
+        fwinfo_mask(0x0000ff00, &fb->green_size, &fb->green_shift);
+        fwinfo_mask(0x000000ff, &fb->blue_size, &fb->blue_shift);
+        fwinfo_mask(0xff000000, &fb->reserved_size, &fb->reserved_shift);
+        fb->bpp = 32;
+        break;
+    case PixelBitMask: {
+        EFI_PIXEL_BITMASK* m = &info->PixelInformation;
+        uint32_t all = m->RedMask | m->GreenMask | m->BlueMask | m->ReservedMask;
+        fwinfo_mask(m->RedMask, &fb->red_size, &fb->red_shift);
+        fwinfo_mask(m->GreenMask, &fb->green_size, &fb->green_shift);
+        fwinfo_mask(m->BlueMask, &fb->blue_size, &fb->blue_shift);
+        fwinfo_mask(m->ReservedMask, &fb->reserved_size, &fb->reserved_shift);
+        while (all) {
+            all >>= 1;
+            fb->bpp++;
+        }
+        fb->bpp = (fb->bpp + 7) & ~7;
+        break;
+    }
+    default:
+        return -1;
+    }
+    fb->base = gop->Mode->FrameBufferBase;
+    fb->size = gop->Mode->FrameBufferSize;
+    fb->width = info->HorizontalResolution;
+    fb->height = info->VerticalResolution;
+    fb->pitch = info->PixelsPerScanLine * (fb->bpp / 8);
+    return fb->base ? 0 : -1;
+}
+
+uint64_t fwinfo_acpi_rsdp(int v2) {
+    return fwinfo_config_table(v2 ? &gEfiAcpi20TableGuid : &gEfiAcpi10TableGuid);
+}
+
+int fwinfo_smbios(uint64_t* entry32, uint64_t* entry64) {
+    *entry32 = fwinfo_config_table(&gEfiSmbiosTableGuid);
+    *entry64 = fwinfo_config_table(&gEfiSmbios3TableGuid);
+    return *entry32 || *entry64 ? 0 : -1;
+}
+
+uint64_t fwinfo_dtb(void) {
+    return fwinfo_config_table(&fwinfo_fdt_guid);
+}
+
+int fwinfo_boot_hartid(uint64_t* hartid) {
+    struct fwinfo_riscv_boot_protocol* proto = NULL;
+    UINTN id;
+    if (EFI_ERROR(gBS->LocateProtocol(&fwinfo_riscv_boot_guid, NULL, (VOID**)&proto)) || !proto ||
+        EFI_ERROR(proto->get_boot_hartid(proto, &id))) {
+        return -1;
+    }
+    *hartid = id;
+    return 0;
+}
+
+// Publishes a table for the kernel in the system table's configuration
+// table list; it stays there after ExitBootServices.
+int fwinfo_install_table(const struct fwinfo_guid* guid, void* table) {
+    return EFI_ERROR(gBS->InstallConfigurationTable((EFI_GUID*)guid, table)) ? -1 : 0;
+}
+
+uint64_t fwinfo_system_table(void) {
+    return (uintptr_t)gST;
+}
+
+uint64_t fwinfo_image_handle(void) {
+    return (uintptr_t)gImageHandle;
+}
+
+// Seconds since the Unix epoch from the RTC (local = UTC + TimeZone),
+// treating it as UTC when the zone is unspecified; 0 if it can't be read.
+int64_t fwinfo_unix_time(void) {
+    EFI_TIME t;
+    if (EFI_ERROR(gRT->GetTime(&t, NULL)) || t.Month < 1 || t.Month > 12) return 0;
+    int64_t y = t.Year - (t.Month <= 2);
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (t.Month + (t.Month > 2 ? -3 : 9)) + 2) / 5 + t.Day - 1;
+    int64_t days = era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+    int64_t secs = days * 86400 + t.Hour * 3600 + t.Minute * 60 + t.Second;
+    if (t.TimeZone != 2047) secs -= (int64_t)t.TimeZone * 60;
+    return secs;
+}
+
+#if defined(__x86_64__)
+static int fwinfo_rdrand(uint64_t* out) {
+    uint8_t ok;
+    for (int tries = 0; tries < 10; ++tries) {
+        asm volatile ("rdrand %0; setc %1" : "=r"(*out), "=qm"(ok));
+        if (ok) return 0;
+    }
+    return -1;
+}
+#endif
+
+// Fills buf from EFI_RNG_PROTOCOL, falling back to RDRAND where the
+// firmware has no RNG driver. Must be called before ExitBootServices.
+int fwinfo_random(void* buf, uint32_t len) {
+    EFI_RNG_PROTOCOL* rng = NULL;
+    if (!EFI_ERROR(gBS->LocateProtocol(&gEfiRngProtocolGuid, NULL, (VOID**)&rng)) && rng &&
+        !EFI_ERROR(rng->GetRNG(rng, NULL, len, (UINT8*)buf))) {
+        return 0;
+    }
+#if defined(__x86_64__)
+    uint32_t cpuid_ecx;
+    asm volatile ("cpuid" : "=c"(cpuid_ecx) : "a"(1), "c"(0) : "ebx", "edx");
+    if (!(cpuid_ecx & (1u << 30))) return -1;
+    uint8_t* p = buf;
+    while (len) {
+        uint64_t v;
+        uint32_t n = len < sizeof(v) ? len : sizeof(v);
+        if (fwinfo_rdrand(&v) != 0) return -1;
+        memcpy(p, &v, n);
+        p += n;
+        len -= n;
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
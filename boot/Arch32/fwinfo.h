@@ -0,0 +1,50 @@
+/*
+ * BloodHorn Bootloader
+ *
+ * This file is part of BloodHorn and is licensed under the MIT License.
+ * See the root of the repository for license details.
+ */
+#ifndef BLOODHORN_FWINFO_H
+#define BLOODHORN_FWINFO_H
+#include <stdint.h>
+#include "compat.h"
+
+// Firmware state every boot protocol hands to its kernel, gathered once
+// here instead of each loader poking GOP and the configuration table.
+struct fwinfo_fb {
+    uint64_t base;
+    uint64_t size;
+    uint32_t width;
+    uint32_t height;
+    uint32_t pitch;
+    uint8_t bpp;
+    uint8_t red_size;
+    uint8_t red_shift;
+    uint8_t green_size;
+    uint8_t green_shift;
+    uint8_t blue_size;
+    uint8_t blue_shift;
+    uint8_t reserved_size;
+    uint8_t reserved_shift;
+};
+
+// Same layout as EFI_GUID, for callers that do not include the UEFI headers
+struct fwinfo_guid {
+    uint32_t data1;
+    uint16_t data2;
+    uint16_t data3;
+    uint8_t data4[8];
+};
+
+int fwinfo_framebuffer(struct fwinfo_fb* fb);
+uint64_t fwinfo_acpi_rsdp(int v2);
+int fwinfo_smbios(uint64_t* entry32, uint64_t* entry64);
+uint64_t fwinfo_dtb(void);
+int fwinfo_boot_hartid(uint64_t* hartid);
+int fwinfo_install_table(const struct fwinfo_guid* guid, void* table);
+uint64_t fwinfo_system_table(void);
+uint64_t fwinfo_image_handle(void);
+int64_t fwinfo_unix_time(void);
+int fwinfo_random(void* buf, uint32_t len);
+
+#endif // BLOODHORN_FWINFO_H
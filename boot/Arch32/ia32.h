@@ -93,30 +93,6 @@ struct linux_boot_params {
     uint32_t ext_mem_k;
 };
 
-struct multiboot2_info {
-    uint32_t total_size;
-    uint32_t reserved;
-    uint8_t tags[];
-};
-
-struct multiboot2_tag {
-    uint32_t type;
-    uint32_t size;
-};
-
-struct multiboot2_tag_string {
-    uint32_t type;
-    uint32_t size;
-    char string[];
-};
-
-struct multiboot2_tag_basic_meminfo {
-    uint32_t type;
-    uint32_t size;
-    uint32_t mem_lower;
-    uint32_t mem_upper;
-};
-
 int ia32_load_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline);
 int ia32_boot_linux(uint8_t* kernel_data, uint32_t kernel_size, const char* initrd_path, const char* cmdline);
 int ia32_boot_multiboot1(uint8_t* kernel_data, uint32_t kernel_size, const char* cmdline);
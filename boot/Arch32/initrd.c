@@ -0,0 +1,201 @@
+/*
+ * BloodHorn Bootloader
+ *
+ * This file is part of BloodHorn and is licensed under the MIT License.
+ * See the root of the repository for license details.
+ */
+#include <stdint.h>
+#include "compat.h"
+#include <string.h>
+#include "initrd.h"
+#include "kfile.h"
+
+#define CPIO_HEADER_SIZE 110
+#define CPIO_MODE_FILE 0100644
+#define CPIO_MODE_DIR 040755
+#define CPIO_TRAILER "TRAILER!!!"
+
+static struct kfile initrd_file;
+
+static uint64_t initrd_align(uint64_t v) {
+    return (v + INITRD_ALIGN - 1) & ~(uint64_t)(INITRD_ALIGN - 1);
+}
+
+static const char* initrd_store(struct initrd_list* list, const char* s, uint32_t len) {
+    if (list->names_used + len + 1 > sizeof(list->names)) return NULL;
+    char* out = list->names + list->names_used;
+    memcpy(out, s, len);
+    out[len] = 0;
+    list->names_used += len + 1;
+    return out;
+}
+
+int initrd_add(struct initrd_list* list, const char* path, const char* cpio_name) {
+    if (list->count == INITRD_MAX_ITEMS || !path || !*path) return -1;
+    struct initrd_item* item = &list->items[list->count];
+    item->path = initrd_store(list, path, strlen(path));
+    item->cpio_name = NULL;
+    item->size = 0;
+    if (!item->path) return -1;
+    if (cpio_name) {
+        while (*cpio_name == '/') cpio_name++;
+        if (!*cpio_name || !(item->cpio_name = initrd_store(list, cpio_name, strlen(cpio_name)))) return -1;
+    }
+    list->count++;
+    return 0;
+}
+
+int initrd_parse(struct initrd_list* list, const char* spec) {
+    list->count = 0;
+    list->size = 0;
+    list->names_used = 0;
+    if (!spec) return 0;
+    while (*spec) {
+        while (*spec == ' ' || *spec == ',' || *spec == '\t') spec++;
+        const char* end = spec;
+        const char* eq = NULL;
+        while (*end && *end != ' ' && *end != ',' && *end != '\t') {
+            if (*end == '=' && !eq) eq = end;
+            end++;
+        }
+        if (end == spec) break;
+        char path[256];
+        char name[256];
+        const char* src = eq ? eq + 1 : spec;
+        uint32_t src_len = (uint32_t)(end - src);
+        if (src_len >= sizeof(path) || (eq && (uint32_t)(eq - spec) >= sizeof(name))) return -1;
+        memcpy(path, src, src_len);
+        path[src_len] = 0;
+        if (eq) {
+            memcpy(name, spec, eq - spec);
+            name[eq - spec] = 0;
+        }
+        if (initrd_add(list, path, eq ? name : NULL) != 0) return -1;
+        spec = end;
+    }
+    return 0;
+}
+
+static uint64_t cpio_entry_size(uint32_t name_len, uint64_t data_len) {
+    return initrd_align(CPIO_HEADER_SIZE + name_len + 1) + initrd_align(data_len);
+}
+
+// Directory entries for every parent of name; the kernel's unpacker does
+// not create missing parents, and repeating one it already has is harmless.
+static uint64_t cpio_parents_size(const char* name) {
+    uint64_t size = 0;
+    for (const char* p = name; *p; ++p) {
+        if (*p == '/') size += cpio_entry_size((uint32_t)(p - name), 0);
+    }
+    return size;
+}
+
+// Sizes every item; the archives are laid end to end at 4-byte boundaries
+// and the generated cpio, if any, follows them.
+int initrd_measure(struct initrd_list* list) {
+    uint64_t size = 0;
+    int cpio = 0;
+    for (int i = 0; i < list->count; ++i) {
+        struct initrd_item* item = &list->items[i];
+        if (kfile_open(&initrd_file, item->path) != 0) return -1;
+        item->size = initrd_file.size;
+        kfile_close(&initrd_file);
+        if (item->cpio_name) {
+            if (item->size > 0xFFFFFFFF) return -1;
+            cpio = 1;
+            continue;
+        }
+        size = initrd_align(size) + item->size;
+    }
+    if (cpio) {
+        size = initrd_align(size);
+        for (int i = 0; i < list->count; ++i) {
+            struct initrd_item* item = &list->items[i];
+            if (!item->cpio_name) continue;
+            size += cpio_parents_size(item->cpio_name);
+            size += cpio_entry_size(strlen(item->cpio_name), item->size);
+        }
+        size += cpio_entry_size(strlen(CPIO_TRAILER), 0);
+    }
+    list->size = initrd_align(size);
+    return 0;
+}
+
+static void cpio_hex(uint8_t* out, uint32_t v) {
+    static const char digits[] = "0123456789ABCDEF";
+    for (int i = 7; i >= 0; --i) {
+        out[i] = digits[v & 0xF];
+        v >>= 4;
+    }
+}
+
+// Writes a newc header and name at out; returns where the data goes.
+static uint8_t* cpio_header(uint8_t* out, uint32_t ino, uint32_t mode, const char* name, uint32_t name_len, uint32_t data_len) {
+    uint32_t fields[13] = { ino, mode, 0, 0, (mode & 040000) ? 2 : 1, 0, data_len, 0, 0, 0, 0, name_len + 1, 0 };
+    memcpy(out, "070701", 6);
+    for (int i = 0; i < 13; ++i) cpio_hex(out + 6 + i * 8, fields[i]);
+    memcpy(out + CPIO_HEADER_SIZE, name, name_len);
+    uint64_t end = initrd_align(CPIO_HEADER_SIZE + name_len + 1);
+    memset(out + CPIO_HEADER_SIZE + name_len, 0, end - CPIO_HEADER_SIZE - name_len);
+    return out + end;
+}
+
+// Streams every archive to its slot in [dest, dest + size) and builds the
+// generated cpio in place, reading file bodies straight into it.
+int initrd_load(struct initrd_list* list, uint64_t dest) {
+    uint8_t* base = (uint8_t*)(uintptr_t)dest;
+    uint64_t off = 0;
+    int cpio = 0;
+    for (int i = 0; i < list->count; ++i) {
+        struct initrd_item* item = &list->items[i];
+        if (item->cpio_name) {
+            cpio = 1;
+            continue;
+        }
+        uint64_t start = initrd_align(off);
+        memset(base + off, 0, start - off);
+        if (kfile_open(&initrd_file, item->path) != 0) return -1;
+        if (initrd_file.size != item->size || kfile_read(&initrd_file, 0, base + start, item->size) != 0) {
+            kfile_close(&initrd_file);
+            return -1;
+        }
+        kfile_close(&initrd_file);
+        off = start + item->size;
+    }
+    uint64_t start = initrd_align(off);
+    memset(base + off, 0, start - off);
+    uint8_t* out = base + start;
+    if (cpio) {
+        uint32_t ino = 1;
+        for (int i = 0; i < list->count; ++i) {
+            struct initrd_item* item = &list->items[i];
+            if (!item->cpio_name) continue;
+            const char* name = item->cpio_name;
+            for (const char* p = name; *p; ++p) {
+                if (*p == '/') out = cpio_header(out, ino++, CPIO_MODE_DIR, name, (uint32_t)(p - name), 0);
+            }
+            uint8_t* data = cpio_header(out, ino++, CPIO_MODE_FILE, name, strlen(name), (uint32_t)item->size);
+            if (kfile_open(&initrd_file, item->path) != 0) return -1;
+            if (initrd_file.size != item->size || kfile_read(&initrd_file, 0, data, item->size) != 0) {
+                kfile_close(&initrd_file);
+                return -1;
+            }
+            kfile_close(&initrd_file);
+            out = data + initrd_align(item->size);
+            memset(data + item->size, 0, out - data - item->size);
+        }
+        out = cpio_header(out, 0, 0, CPIO_TRAILER, strlen(CPIO_TRAILER), 0);
+    }
+    uint64_t used = out - base;
+    if (used > list->size) return -1;
+    memset(out, 0, list->size - used);
+    return 0;
+}
+
+// Parses and sizes a spec in one go; *size is 0 when it names nothing.
+int initrd_prepare(struct initrd_list* list, const char* spec, uint64_t* size) {
+    *size = 0;
+    if (initrd_parse(list, spec) != 0 || initrd_measure(list) != 0) return -1;
+    *size = list->size;
+    return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * BloodHorn Bootloader
+ *
+ * This file is part of BloodHorn and is licensed under the MIT License.
+ * See the root of the repository for license details.
+ */
+#ifndef BLOODHORN_INITRD_H
+#define BLOODHORN_INITRD_H
+#include <stdint.h>
+#include "compat.h"
+
+#define INITRD_MAX_ITEMS 16
+#define INITRD_NAMES_SIZE 1024
+#define INITRD_ALIGN 4
+
+// An initrd spec is a list of paths separated by spaces or commas. Plain
+// paths are cpio archives concatenated in the order given (microcode
+// first, as the kernel wants); an "archive/path=/file/on/disk" item is
+// instead wrapped into a cpio generated at load time and appended last.
+struct initrd_item {
+    const char* path;
+    const char* cpio_name;
+    uint64_t size;
+};
+
+struct initrd_list {
+    struct initrd_item items[INITRD_MAX_ITEMS];
+    int count;
+    uint64_t size;
+    uint32_t names_used;
+    char names[INITRD_NAMES_SIZE];
+};
+
+int initrd_parse(struct initrd_list* list, const char* spec);
+int initrd_add(struct initrd_list* list, const char* path, const char* cpio_name);
+int initrd_measure(struct initrd_list* list);
+int initrd_load(struct initrd_list* list, uint64_t dest);
+int initrd_prepare(struct initrd_list* list, const char* spec, uint64_t* size);
+
+#endif // BLOODHORN_INITRD_H
@@ -0,0 +1,179 @@
+/*
+ * BloodHorn Bootloader
+ *
+ * This file is part of BloodHorn and is licensed under the MIT License.
+ * See the root of the repository for license details.
+ */
+#include <stdint.h>
+#include "compat.h"
+#include <string.h>
+#include <Uefi.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Protocol/SimpleFileSystem.h>
+#include <Guid/FileInfo.h>
+#include "kfile.h"
+#include "memmap.h"
+
+extern EFI_STATUS GetRootFileSystem(EFI_FILE_PROTOCOL** RootFs);
+
+static EFI_FILE_PROTOCOL* kfile_root = NULL;
+
+static int kfile_read_raw(void* ctx, uint64_t offset, void* dst, uint64_t len);
+
+// A file that starts with a gzip/zstd/lz4/xz magic is opened as its
+// contents, the way GRUB unpacks kernels and modules unless told not to.
+static int kfile_unpack_head(struct kfile* kf) {
+    uint64_t len;
+    kf->packed = decomp_detect(kf->head, kf->head_len);
+    if (kf->packed == DECOMP_NONE) return 0;
+    kf->src.read = kfile_read_raw;
+    kf->src.ctx = kf;
+    kf->src.size = kf->raw_size;
+    if (decomp_size(&kf->src, kf->packed, &kf->size) != 0) return -1;
+    kf->head_len = kf->size < KFILE_HEAD_SIZE ? (uint32_t)kf->size : KFILE_HEAD_SIZE;
+    int r = decomp_run(&kf->src, kf->packed, kf->head, kf->head_len, &len);
+    return (r < 0 || len != kf->head_len) ? -1 : 0;
+}
+
+static int kfile_unpack(struct kfile* kf, void* dst) {
+    uint64_t len;
+    return (decomp_run(&kf->src, kf->packed, dst, kf->size, &len) == 0 && len == kf->size) ? 0 : -1;
+}
+
+int kfile_open(struct kfile* kf, const char* path) {
+    CHAR16 wpath[256];
+    UINT8 info_buf[sizeof(EFI_FILE_INFO) + 512];
+    UINTN info_size = sizeof(info_buf);
+    EFI_FILE_PROTOCOL* fh;
+    UINTN i;
+
+    kf->handle = NULL;
+    kf->mem = NULL;
+    kf->packed = DECOMP_NONE;
+    kf->unpacked = NULL;
+    if (!path || (!kfile_root && EFI_ERROR(GetRootFileSystem(&kfile_root)))) return -1;
+    for (i = 0; path[i] && i < 255; ++i) wpath[i] = path[i] == '/' ? L'\\' : (CHAR16)(UINT8)path[i];
+    wpath[i] = 0;
+    if (EFI_ERROR(kfile_root->Open(kfile_root, &fh, wpath, EFI_FILE_MODE_READ, 0))) return -1;
+    if (EFI_ERROR(fh->GetInfo(fh, &gEfiFileInfoGuid, &info_size, info_buf))) {
+        fh->Close(fh);
+        return -1;
+    }
+    kf->handle = fh;
+    kf->size = ((EFI_FILE_INFO*)info_buf)->FileSize;
+    kf->raw_size = kf->size;
+    kf->head_len = kf->size < KFILE_HEAD_SIZE ? (uint32_t)kf->size : KFILE_HEAD_SIZE;
+    if (kfile_read_raw(kf, 0, kf->head, kf->head_len) != 0 || kfile_unpack_head(kf) != 0) {
+        kfile_close(kf);
+        return -1;
+    }
+    return 0;
+}
+
+int kfile_open_mem(struct kfile* kf, const void* data, uint64_t size) {
+    if (!data) return -1;
+    kf->handle = NULL;
+    kf->mem = data;
+    kf->size = size;
+    kf->raw_size = size;
+    kf->packed = DECOMP_NONE;
+    kf->unpacked = NULL;
+    kf->head_len = size < KFILE_HEAD_SIZE ? (uint32_t)size : KFILE_HEAD_SIZE;
+    memcpy(kf->head, data, kf->head_len);
+    return kfile_unpack_head(kf);
+}
+
+void kfile_close(struct kfile* kf) {
+    if (kf->handle) {
+        EFI_FILE_PROTOCOL* fh = kf->handle;
+        fh->Close(fh);
+        kf->handle = NULL;
+    }
+    if (kf->unpacked) {
+        memmap_free((uint64_t)(uintptr_t)kf->unpacked, kf->size);
+        kf->unpacked = NULL;
+    }
+}
+
+// Reads go straight into dst; large ones are split because several FAT
+// drivers mishandle single reads of many megabytes.
+static int kfile_read_raw(void* ctx, uint64_t offset, void* dst, uint64_t len) {
+    struct kfile* kf = ctx;
+    EFI_FILE_PROTOCOL* fh = kf->handle;
+    uint8_t* out = dst;
+    if (offset > kf->raw_size || len > kf->raw_size - offset) return -1;
+    if (kf->mem) {
+        if (out != kf->mem + offset) memmove(out, kf->mem + offset, len);
+        return 0;
+    }
+    if (!fh) return -1;
+    if (EFI_ERROR(fh->SetPosition(fh, offset))) return -1;
+    while (len) {
+        UINTN n = len > KFILE_READ_CHUNK ? KFILE_READ_CHUNK : (UINTN)len;
+        UINTN want = n;
+        if (EFI_ERROR(fh->Read(fh, &n, out)) || n != want) return -1;
+        out += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Compressed files decode a whole-image read straight into dst. Anything
+// else past the head (ELF segments, section tables) is served from a copy
+// unpacked on first use.
+int kfile_read(struct kfile* kf, uint64_t offset, void* dst, uint64_t len) {
+    if (offset > kf->size || len > kf->size - offset) return -1;
+    if (kf->packed == DECOMP_NONE) return kfile_read_raw(kf, offset, dst, len);
+    if (offset + len <= kf->head_len) {
+        memcpy(dst, kf->head + offset, len);
+        return 0;
+    }
+    if (!kf->unpacked) {
+        if (offset == 0 && len == kf->size) return kfile_unpack(kf, dst);
+        kf->unpacked = memmap_alloc(kf->size, MEMMAP_PAGE_SIZE, UINTPTR_MAX);
+        if (!kf->unpacked) return -1;
+        if (kfile_unpack(kf, kf->unpacked) != 0) {
+            memmap_free((uint64_t)(uintptr_t)kf->unpacked, kf->size);
+            kf->unpacked = NULL;
+            return -1;
+        }
+    }
+    memcpy(dst, kf->unpacked + offset, len);
+    return 0;
+}
+
+// Header bytes from the cached head, or NULL when the range is not there.
+const void* kfile_at(struct kfile* kf, uint64_t offset, uint64_t len) {
+    if (offset > kf->head_len || len > kf->head_len - offset) return NULL;
+    return kf->head + offset;
+}
+
+int kfile_plan_add(struct kfile_plan* plan, uint64_t offset, uint64_t file_len, uint64_t dest, uint64_t mem_len) {
+    if (plan->count == KFILE_MAX_SEGMENTS || file_len > mem_len) return -1;
+    struct kfile_segment* s = &plan->seg[plan->count++];
+    s->offset = offset;
+    s->file_len = file_len;
+    s->dest = dest;
+    s->mem_len = mem_len;
+    return 0;
+}
+
+// Segments are read in file order so the device sees one forward sweep
+// whatever order the format listed them in.
+int kfile_plan_run(struct kfile* kf, struct kfile_plan* plan) {
+    for (int i = 1; i < plan->count; ++i) {
+        struct kfile_segment s = plan->seg[i];
+        int j = i;
+        while (j > 0 && plan->seg[j - 1].offset > s.offset) {
+            plan->seg[j] = plan->seg[j - 1];
+            j--;
+        }
+        plan->seg[j] = s;
+    }
+    for (int i = 0; i < plan->count; ++i) {
+        struct kfile_segment* s = &plan->seg[i];
+        if (s->file_len && kfile_read(kf, s->offset, (void*)(uintptr_t)s->dest, s->file_len) != 0) return -1;
+        if (s->mem_len > s->file_len) memset((void*)(uintptr_t)(s->dest + s->file_len), 0, s->mem_len - s->file_len);
+    }
+    return 0;
+}
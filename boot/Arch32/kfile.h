@@ -0,0 +1,56 @@
+/*
+ * BloodHorn Bootloader
+ *
+ * This file is part of BloodHorn and is licensed under the MIT License.
+ * See the root of the repository for license details.
+ */
+#ifndef BLOODHORN_KFILE_H
+#define BLOODHORN_KFILE_H
+#include <stdint.h>
+#include "compat.h"
+#include "compress/decomp.h"
+
+// Loaders parse headers out of the cached head, then read each payload
+// straight to its final address instead of staging the whole file.
+#define KFILE_HEAD_SIZE 0x10000
+#define KFILE_MAX_SEGMENTS 32
+#define KFILE_READ_CHUNK 0x1000000
+
+// A kfile reads either through a firmware file handle or, for images the
+// caller already holds, from memory. Compressed files are seen through
+// their contents: size and head describe the decompressed image.
+struct kfile {
+    void* handle;
+    const uint8_t* mem;
+    uint64_t size;
+    uint32_t head_len;
+    int packed;
+    uint64_t raw_size;
+    struct decomp_src src;
+    uint8_t* unpacked;
+    uint8_t head[KFILE_HEAD_SIZE];
+};
+
+// One piece of a load plan: file_len bytes from offset land at dest, and
+// the rest of mem_len is zero-filled.
+struct kfile_segment {
+    uint64_t offset;
+    uint64_t file_len;
+    uint64_t dest;
+    uint64_t mem_len;
+};
+
+struct kfile_plan {
+    struct kfile_segment seg[KFILE_MAX_SEGMENTS];
+    int count;
+};
+
+int kfile_open(struct kfile* kf, const char* path);
+int kfile_open_mem(struct kfile* kf, const void* data, uint64_t size);
+void kfile_close(struct kfile* kf);
+int kfile_read(struct kfile* kf, uint64_t offset, void* dst, uint64_t len);
+const void* kfile_at(struct kfile* kf, uint64_t offset, uint64_t len);
+int kfile_plan_add(struct kfile_plan* plan, uint64_t offset, uint64_t file_len, uint64_t dest, uint64_t mem_len);
+int kfile_plan_run(struct kfile* kf, struct kfile_plan* plan);
+
+#endif // BLOODHORN_KFILE_H
@@ -8,262 +8,452 @@
 #include "compat.h"
 #include <string.h>
 #include "limine.h"
-// go to line 65
-extern void* allocate_memory(uint32_t size);
-extern int load_file(const char* path, uint8_t** data, uint32_t* size);
+#include "memmap.h"
+#include "kfile.h"
+#include "elf.h"
+#include "paging.h"
+#include "fwinfo.h"
+#include "smp.h"
 
-struct limine_memmap_request memmap_request = {
-    .id = LIMINE_MEMMAP_REQUEST,
-    .revision = 0
-};
+#define LIMINE_HHDM_4LEVEL 0xffff800000000000ULL
+#define LIMINE_HHDM_5LEVEL 0xff00000000000000ULL
+#define LIMINE_ARENA_SIZE 0x20000
+#define LIMINE_PATH_MAX 256
+#define LIMINE_LOW_MAP 0x100000000ULL
 
-struct limine_kernel_address_request kernel_address_request = {
-    .id = LIMINE_KERNEL_ADDRESS_REQUEST,
-    .revision = 0
+// Requests this responder answers, in the order they are filled
+enum limine_req {
+    LIMINE_REQ_HHDM,
+    LIMINE_REQ_KERNEL_ADDRESS,
+    LIMINE_REQ_KERNEL_FILE,
+    LIMINE_REQ_MODULE,
+    LIMINE_REQ_FRAMEBUFFER,
+    LIMINE_REQ_RSDP,
+    LIMINE_REQ_SMBIOS,
+    LIMINE_REQ_EFI_SYSTEM_TABLE,
+    LIMINE_REQ_DTB,
+    LIMINE_REQ_BOOT_TIME,
+    LIMINE_REQ_SMP,
+    LIMINE_REQ_PAGING_MODE,
+    LIMINE_REQ_5_LEVEL_PAGING,
+    LIMINE_REQ_STACK_SIZE,
+    LIMINE_REQ_ENTRY_POINT,
+    LIMINE_REQ_MEMMAP,
+    LIMINE_REQ_COUNT
 };
 
-struct limine_hhdm_request hhdm_request = {
-    .id = LIMINE_HHDM_REQUEST,
-    .revision = 0
+static const uint64_t limine_ids[LIMINE_REQ_COUNT][4] = {
+    [LIMINE_REQ_HHDM] = LIMINE_HHDM_REQUEST,
+    [LIMINE_REQ_KERNEL_ADDRESS] = LIMINE_KERNEL_ADDRESS_REQUEST,
+    [LIMINE_REQ_KERNEL_FILE] = LIMINE_KERNEL_FILE_REQUEST,
+    [LIMINE_REQ_MODULE] = LIMINE_MODULE_REQUEST,
+    [LIMINE_REQ_FRAMEBUFFER] = LIMINE_FRAMEBUFFER_REQUEST,
+    [LIMINE_REQ_RSDP] = LIMINE_RSDP_REQUEST,
+    [LIMINE_REQ_SMBIOS] = LIMINE_SMBIOS_REQUEST,
+    [LIMINE_REQ_EFI_SYSTEM_TABLE] = LIMINE_EFI_SYSTEM_TABLE_REQUEST,
+    [LIMINE_REQ_DTB] = LIMINE_DTB_REQUEST,
+    [LIMINE_REQ_BOOT_TIME] = LIMINE_BOOT_TIME_REQUEST,
+    [LIMINE_REQ_SMP] = LIMINE_SMP_REQUEST,
+    [LIMINE_REQ_PAGING_MODE] = LIMINE_PAGING_MODE_REQUEST,
+    [LIMINE_REQ_5_LEVEL_PAGING] = LIMINE_5_LEVEL_PAGING_REQUEST,
+    [LIMINE_REQ_STACK_SIZE] = LIMINE_STACK_SIZE_REQUEST,
+    [LIMINE_REQ_ENTRY_POINT] = LIMINE_ENTRY_POINT_REQUEST,
+    [LIMINE_REQ_MEMMAP] = LIMINE_MEMMAP_REQUEST,
 };
 
-struct limine_framebuffer_request framebuffer_request = {
-    .id = LIMINE_FRAMEBUFFER_REQUEST,
-    .revision = 0
-};
+static const uint64_t limine_magic[2] = { LIMINE_COMMON_MAGIC };
+static const uint64_t limine_base_magic[2] = { LIMINE_BASE_REVISION_MAGIC };
 
-struct limine_module_request module_request = {
-    .id = LIMINE_MODULE_REQUEST,
-    .revision = 0
+struct limine_module_path {
+    char path[LIMINE_PATH_MAX];
+    char cmdline[LIMINE_PATH_MAX];
 };
 
-struct limine_rsdp_request rsdp_request = {
-    .id = LIMINE_RSDP_REQUEST,
-    .revision = 0
-};
+static struct limine_module_path limine_module_paths[LIMINE_MAX_MODULES];
+static int limine_module_count = 0;
 
-struct limine_smbios_request smbios_request = {
-    .id = LIMINE_SMBIOS_REQUEST,
-    .revision = 0
-};
+static struct kfile limine_file;
+static struct kfile limine_module_file;
+static struct paging_ctx limine_pt;
+static struct limine_request_header* limine_reqs[LIMINE_REQ_COUNT];
+static uint8_t* limine_arena;
+static uint64_t limine_arena_used;
+static uint64_t limine_hhdm;
+static struct smp_info limine_smp;
+static struct limine_smp_info** limine_smp_list;
 
-struct limine_efi_system_table_request efi_system_table_request = {
-    .id = LIMINE_EFI_SYSTEM_TABLE_REQUEST,
-    .revision = 0
-};
-
-struct limine_boot_time_request boot_time_request = {
-    .id = LIMINE_BOOT_TIME_REQUEST,
-    .revision = 0
-};
+// Responses and everything they point at come from one loader-reclaimable
+// arena, so the kernel sees them as a single region it may free later.
+static void* limine_alloc(uint64_t size) {
+    uint64_t off = (limine_arena_used + 15) & ~15ULL;
+    if (off > LIMINE_ARENA_SIZE || size > LIMINE_ARENA_SIZE - off) return NULL;
+    limine_arena_used = off + size;
+    return limine_arena + off;
+}
 
-struct limine_kernel_file_request kernel_file_request = {
-    .id = LIMINE_KERNEL_FILE_REQUEST,
-    .revision = 0
-};
+// Every pointer handed to the kernel is an HHDM address
+static uint64_t limine_virt(uint64_t phys) {
+    return phys ? limine_hhdm + phys : 0;
+}
 
-struct limine_smp_request smp_request = {
-    .id = LIMINE_SMP_REQUEST,
-    .revision = 0
-};
+static char* limine_strdup(const char* s) {
+    uint64_t len = s ? strlen(s) : 0;
+    char* d = limine_alloc(len + 1);
+    if (d && len) memcpy(d, s, len);
+    return d;
+}
 
-struct limine_paging_mode_request paging_mode_request = {
-    .id = LIMINE_PAGING_MODE_REQUEST,
-    .revision = 0
-};
+static void limine_respond(int req, void* response) {
+    if (limine_reqs[req] && response) limine_reqs[req]->response = limine_virt((uintptr_t)response);
+}
 
-struct limine_5_level_paging_request level5_paging_request = {
-    .id = LIMINE_5_LEVEL_PAGING_REQUEST,
-    .revision = 0
-};
+// Requests may sit anywhere in the image on an 8-byte boundary; a match
+// needs all four ID words. A base revision tag we can honour is zeroed.
+static void limine_scan(uint8_t* base, uint64_t len) {
+    memset(limine_reqs, 0, sizeof(limine_reqs));
+    for (uint64_t off = 0; off + 3 * sizeof(uint64_t) <= len; off += 8) {
+        uint64_t* w = (uint64_t*)(base + off);
+        if (w[0] == limine_base_magic[0] && w[1] == limine_base_magic[1]) {
+            if (w[2] <= LIMINE_BASE_REVISION_SUPPORTED) w[2] = 0;
+            continue;
+        }
+        if (w[0] != limine_magic[0] || w[1] != limine_magic[1] || off + sizeof(struct limine_request_header) > len) continue;
+        for (int k = 0; k < LIMINE_REQ_COUNT; ++k) {
+            if (w[2] == limine_ids[k][2] && w[3] == limine_ids[k][3]) {
+                limine_reqs[k] = (struct limine_request_header*)w;
+                break;
+            }
+        }
+    }
+}
 
-struct limine_terminal_request terminal_request = {
-    .id = LIMINE_TERMINAL_REQUEST,
-    .revision = 0
-};
+static struct limine_file* limine_file_entry(uint64_t addr, uint64_t size, const char* path, const char* cmdline) {
+    struct limine_file* f = limine_alloc(sizeof(*f));
+    char* p = limine_strdup(path);
+    char* c = limine_strdup(cmdline);
+    if (!f || !p || !c) return NULL;
+    f->address = (void*)(uintptr_t)limine_virt(addr);
+    f->size = size;
+    f->path = (char*)(uintptr_t)limine_virt((uintptr_t)p);
+    f->cmdline = (char*)(uintptr_t)limine_virt((uintptr_t)c);
+    return f;
+}
 
-struct limine_stack_size_request stack_size_request = {
-    .id = LIMINE_STACK_SIZE_REQUEST,
-    .revision = 0
-};
+// Reads a whole file into kernel-and-modules pages
+static int limine_load_file(struct kfile* kf, uint64_t* addr) {
+    struct memmap_request req = { 0 };
+    req.size = kf->size ? kf->size : 1;
+    req.align = PAGING_4K;
+    req.kernel = 1;
+    if (memmap_place(&req, addr) != 0) return -1;
+    return kfile_read(kf, 0, (void*)(uintptr_t)*addr, kf->size);
+}
 
-struct limine_base_virtual_address_request base_virtual_address_request = {
-    .id = LIMINE_BASE_VIRTUAL_ADDRESS_REQUEST,
-    .revision = 0
-};
+static void limine_fill_modules(void) {
+    struct limine_module_response* r = limine_alloc(sizeof(*r));
+    struct limine_file** list = limine_alloc(LIMINE_MAX_MODULES * sizeof(*list));
+    if (!r || !list) return;
+    for (int i = 0; i < limine_module_count; ++i) {
+        uint64_t addr;
+        struct limine_module_path* m = &limine_module_paths[i];
+        if (kfile_open(&limine_module_file, m->path) != 0) continue;
+        int rc = limine_load_file(&limine_module_file, &addr);
+        uint64_t size = limine_module_file.size;
+        kfile_close(&limine_module_file);
+        if (rc != 0) continue;
+        struct limine_file* f = limine_file_entry(addr, size, m->path, m->cmdline);
+        if (f) list[r->module_count++] = (struct limine_file*)(uintptr_t)limine_virt((uintptr_t)f);
+    }
+    r->modules = (struct limine_file**)(uintptr_t)limine_virt((uintptr_t)list);
+    limine_respond(LIMINE_REQ_MODULE, r);
+}
 
-struct limine_kernel_address_virtual_request kernel_address_virtual_request = {
-    .id = LIMINE_KERNEL_ADDRESS_VIRTUAL_REQUEST,
-    .revision = 0
-};
+static int limine_fill_framebuffer(struct fwinfo_fb* fb) {
+    struct limine_framebuffer_response* r = limine_alloc(sizeof(*r));
+    struct limine_framebuffer** list = limine_alloc(sizeof(*list));
+    struct limine_framebuffer* f = limine_alloc(sizeof(*f));
+    if (!r || !list || !f || fwinfo_framebuffer(fb) != 0) return -1;
+    f->address = (void*)(uintptr_t)limine_virt(fb->base);
+    f->width = fb->width;
+    f->height = fb->height;
+    f->pitch = fb->pitch;
+    f->bpp = fb->bpp;
+    f->memory_model = LIMINE_FRAMEBUFFER_RGB;
+    f->red_mask_size = fb->red_size;
+    f->red_mask_shift = fb->red_shift;
+    f->green_mask_size = fb->green_size;
+    f->green_mask_shift = fb->green_shift;
+    f->blue_mask_size = fb->blue_size;
+    f->blue_mask_shift = fb->blue_shift;
+    list[0] = (struct limine_framebuffer*)(uintptr_t)limine_virt((uintptr_t)f);
+    r->framebuffer_count = 1;
+    r->framebuffers = (struct limine_framebuffer**)(uintptr_t)limine_virt((uintptr_t)list);
+    limine_respond(LIMINE_REQ_FRAMEBUFFER, r);
+    return 0;
+}
 
-struct limine_dtb_request dtb_request = {
-    .id = LIMINE_DTB_REQUEST,
-    .revision = 0
-};
+// Records and the pointer list are set aside before ExitBootServices; the
+// list is filled once the APs have been started and parked.
+static struct limine_smp_response* limine_prepare_smp(uint64_t stack_size) {
+    struct limine_smp_response* r = limine_alloc(sizeof(*r));
+    if (!r || smp_prepare(&limine_smp, stack_size) < 1) return NULL;
+    limine_smp_list = limine_alloc(limine_smp.cpu_count * sizeof(*limine_smp_list));
+    if (!limine_smp_list) return NULL;
+    r->flags = limine_smp.x2apic ? LIMINE_SMP_X2APIC : 0;
+    r->bsp_lapic_id = limine_smp.bsp_lapic_id;
+    r->cpus = (struct limine_smp_info**)(uintptr_t)limine_virt((uintptr_t)limine_smp_list);
+    limine_respond(LIMINE_REQ_SMP, r);
+    return r;
+}
 
-struct limine_vmap_request vmap_request = {
-    .id = LIMINE_VMAP_REQUEST,
-    .revision = 0
-};
+// Only CPUs that reached the parking loop are listed; the records are the
+// ones the APs poll, so the kernel's goto_address write releases them.
+static void limine_start_smp(struct limine_smp_response* r) {
+    smp_start(&limine_smp, limine_pt.root, limine_hhdm);
+    for (uint32_t i = 0; i < limine_smp.cpu_count; ++i) {
+        if (!(limine_smp.cpus[i].flags & SMP_CPU_PARKED)) continue;
+        limine_smp_list[r->cpu_count++] = (struct limine_smp_info*)(uintptr_t)limine_virt((uintptr_t)&limine_smp.cpus[i]);
+    }
+}
 
-struct limine_loader_info_request loader_info_request = {
-    .id = LIMINE_LOADER_INFO_REQUEST,
-    .revision = 0
-};
+// Copies the final firmware map; the framebuffer is added as its own
+// entry when the firmware map leaves its range undescribed.
+static void limine_fill_memmap(struct limine_memmap_response* r, struct limine_memmap_entry* e, struct limine_memmap_entry** list, const struct fwinfo_fb* fb) {
+    int count;
+    const struct memmap_entry* map = memmap_get(&count);
+    int fb_pending = fb && fb->base;
+    for (int i = 0; i < count && fb_pending; ++i) {
+        if (fb->base < map[i].base + map[i].length && map[i].base < fb->base + fb->size) fb_pending = 0;
+    }
+    uint64_t n = 0;
+    for (int i = 0; i <= count && n < MEMMAP_MAX_ENTRIES + 1; ++i) {
+        if (fb_pending && (i == count || fb->base < map[i].base)) {
+            e[n].base = fb->base;
+            e[n].length = (fb->size + PAGING_4K - 1) & ~(PAGING_4K - 1);
+            e[n].type = LIMINE_MEMMAP_FRAMEBUFFER;
+            list[n] = (struct limine_memmap_entry*)(uintptr_t)limine_virt((uintptr_t)&e[n]);
+            n++;
+            fb_pending = 0;
+        }
+        if (i == count) break;
+        e[n].base = map[i].base;
+        e[n].length = map[i].length;
+        e[n].type = memmap_limine_type(map[i].type);
+        list[n] = (struct limine_memmap_entry*)(uintptr_t)limine_virt((uintptr_t)&e[n]);
+        n++;
+    }
+    r->entry_count = n;
+    r->entries = (struct limine_memmap_entry**)(uintptr_t)limine_virt((uintptr_t)list);
+}
 
-struct limine_framebuffer_request framebuffer_request = {
-    .id = LIMINE_FRAMEBUFFER_REQUEST,
-    .revision = 0
-};
+// Loads the kernel, answers the requests it carries in place, builds the
+// address space it expects -- identity and HHDM views of physical memory
+// plus the kernel at its link address -- then exits boot services and
+// jumps on a fresh stack.
+static int limine_boot(struct kfile* kf, const char* path, const char* cmdline) {
+    struct elf_image img;
+    struct fwinfo_fb fb = { 0 };
+    uint64_t sect_addr, sect_size, kernel_copy = 0;
+    int levels = paging_levels_active();
+    limine_hhdm = levels == 5 ? LIMINE_HHDM_5LEVEL : LIMINE_HHDM_4LEVEL;
 
-int limine_load_kernel(const char* kernel_path, const char* cmdline) {
-    uint8_t* kernel_data = NULL;
-    uint32_t kernel_size = 0;
-    
-    // Load kernel file
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
+    if (paging_init(&limine_pt, levels) != 0 ||
+        elf_load(kf, ELF_MACHINE_NATIVE, 0, &limine_pt, &img) != 0) {
+        kfile_close(kf);
         return -1;
     }
-    
-    // Parse ELF header
-    struct elf64_header* elf_header = (struct elf64_header*)kernel_data;
-    
-    // Verify ELF magic
-    if (memcmp(elf_header->e_ident, ELF_MAGIC, 4) != 0) {
-        return -1;
+
+    // Kernels built with the Limine templates keep their requests in one
+    // section; otherwise the whole image is scanned.
+    if (elf_find_section(kf, ".limine_requests", &sect_addr, &sect_size) == 0 &&
+        sect_addr + img.slide >= img.virt_base && sect_size <= img.size &&
+        sect_addr + img.slide - img.virt_base <= img.size - sect_size) {
+        limine_scan((uint8_t*)(uintptr_t)elf_virt_to_phys(&img, sect_addr + img.slide), sect_size);
+    } else {
+        limine_scan((uint8_t*)(uintptr_t)img.phys_base, img.size);
     }
-    
-    // Verify it's a 64-bit ELF
-    if (elf_header->e_ident[EI_CLASS] != ELFCLASS64) {
-        return -1;
+
+    // The file itself is only read a second time if the kernel asks for it
+    if (limine_reqs[LIMINE_REQ_KERNEL_FILE]) {
+        if (kf->mem) {
+            kernel_copy = (uintptr_t)kf->mem;
+        } else if (limine_load_file(kf, &kernel_copy) != 0) {
+            kfile_close(kf);
+            return -1;
+        }
+    }
+    kfile_close(kf);
+
+    limine_arena = memmap_alloc(LIMINE_ARENA_SIZE, PAGING_4K, 0);
+    if (!limine_arena) return -1;
+    memset(limine_arena, 0, LIMINE_ARENA_SIZE);
+    limine_arena_used = 0;
+
+    struct limine_hhdm_response* hhdm = limine_alloc(sizeof(*hhdm));
+    if (hhdm) hhdm->offset = limine_hhdm;
+    limine_respond(LIMINE_REQ_HHDM, hhdm);
+
+    struct limine_kernel_address_response* ka = limine_alloc(sizeof(*ka));
+    if (ka) {
+        ka->physical_base = img.phys_base;
+        ka->virtual_base = img.virt_base;
     }
-    
-    // Load kernel to preferred address
-    uint64_t load_addr = 0x200000; // 2MB
-    if (elf_header->e_entry >= 0xffffffff80000000) {
-        load_addr = elf_header->e_entry;
+    limine_respond(LIMINE_REQ_KERNEL_ADDRESS, ka);
+
+    if (limine_reqs[LIMINE_REQ_KERNEL_FILE]) {
+        struct limine_kernel_file_response* r = limine_alloc(sizeof(*r));
+        struct limine_file* f = limine_file_entry(kernel_copy, kf->size, path, cmdline);
+        if (r && f) {
+            r->kernel_file = (struct limine_file*)(uintptr_t)limine_virt((uintptr_t)f);
+            limine_respond(LIMINE_REQ_KERNEL_FILE, r);
+        }
     }
-    
-    // Load ELF segments
-    struct elf64_phdr* phdr = (struct elf64_phdr*)(kernel_data + elf_header->e_phoff);
-    for (int i = 0; i < elf_header->e_phnum; i++) {
-        if (phdr[i].p_type == PT_LOAD) {
-            uint64_t vaddr = phdr[i].p_vaddr;
-            if (vaddr >= 0xffffffff80000000) {
-                vaddr -= 0xffffffff80000000;
-                vaddr += load_addr;
-            }
-            
-            memcpy((void*)vaddr, kernel_data + phdr[i].p_offset, phdr[i].p_filesz);
-            
-            // Zero out BSS
-            if (phdr[i].p_memsz > phdr[i].p_filesz) {
-                memset((void*)(vaddr + phdr[i].p_filesz), 0, phdr[i].p_memsz - phdr[i].p_filesz);
-            }
+
+    if (limine_reqs[LIMINE_REQ_MODULE]) limine_fill_modules();
+    if (limine_reqs[LIMINE_REQ_FRAMEBUFFER] && limine_fill_framebuffer(&fb) != 0) fb.base = 0;
+
+    uint64_t rsdp = fwinfo_acpi_rsdp(1);
+    if (!rsdp) rsdp = fwinfo_acpi_rsdp(0);
+    if (rsdp && limine_reqs[LIMINE_REQ_RSDP]) {
+        struct limine_rsdp_response* r = limine_alloc(sizeof(*r));
+        if (r) r->address = (void*)(uintptr_t)limine_virt(rsdp);
+        limine_respond(LIMINE_REQ_RSDP, r);
+    }
+
+    uint64_t smbios32, smbios64;
+    if (limine_reqs[LIMINE_REQ_SMBIOS] && fwinfo_smbios(&smbios32, &smbios64) == 0) {
+        struct limine_smbios_response* r = limine_alloc(sizeof(*r));
+        if (r) {
+            r->entry_32 = (void*)(uintptr_t)limine_virt(smbios32);
+            r->entry_64 = (void*)(uintptr_t)limine_virt(smbios64);
         }
+        limine_respond(LIMINE_REQ_SMBIOS, r);
     }
-    
-    // Setup Limine requests
-    struct limine_memmap_response* memmap_response = allocate_memory(sizeof(struct limine_memmap_response));
-    memmap_response->entry_count = 1;
-    memmap_response->entries = allocate_memory(sizeof(struct limine_memmap_entry));
-    memmap_response->entries[0].base = 0;
-    memmap_response->entries[0].length = 0x100000000; // 4GB
-    memmap_response->entries[0].type = LIMINE_MEMMAP_USABLE;
-    
-    struct limine_kernel_address_response* kernel_address_response = allocate_memory(sizeof(struct limine_kernel_address_response));
-    kernel_address_response->physical_base = load_addr;
-    kernel_address_response->virtual_base = 0xffffffff80000000;
-    
-    struct limine_hhdm_response* hhdm_response = allocate_memory(sizeof(struct limine_hhdm_response));
-    hhdm_response->offset = 0xffff800000000000;
-    
-    struct limine_framebuffer_response* framebuffer_response = allocate_memory(sizeof(struct limine_framebuffer_response));
-    framebuffer_response->framebuffer_count = 1;
-    framebuffer_response->framebuffers = allocate_memory(sizeof(struct limine_framebuffer));
-    framebuffer_response->framebuffers[0].address = 0xb8000;
-    framebuffer_response->framebuffers[0].width = 80;
-    framebuffer_response->framebuffers[0].height = 25;
-    framebuffer_response->framebuffers[0].pitch = 160;
-    framebuffer_response->framebuffers[0].bpp = 16;
-    framebuffer_response->framebuffers[0].memory_model = 1;
-    framebuffer_response->framebuffers[0].red_mask_size = 5;
-    framebuffer_response->framebuffers[0].red_mask_shift = 11;
-    framebuffer_response->framebuffers[0].green_mask_size = 6;
-    framebuffer_response->framebuffers[0].green_mask_shift = 5;
-    framebuffer_response->framebuffers[0].blue_mask_size = 5;
-    framebuffer_response->framebuffers[0].blue_mask_shift = 0;
-    
-    // Jump to kernel
-    void (*kernel_entry)(void) = (void*)elf_header->e_entry;
-    kernel_entry();
-    
-    return 0;
-}
 
-int limine_verify_kernel(const char* kernel_path) {
-    uint8_t* kernel_data = NULL;
-    uint32_t kernel_size = 0;
-    
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
-        return -1;
+    if (limine_reqs[LIMINE_REQ_EFI_SYSTEM_TABLE]) {
+        struct limine_efi_system_table_response* r = limine_alloc(sizeof(*r));
+        if (r) r->address = (void*)(uintptr_t)limine_virt(fwinfo_system_table());
+        limine_respond(LIMINE_REQ_EFI_SYSTEM_TABLE, r);
     }
-    
-    struct elf64_header* elf_header = (struct elf64_header*)kernel_data;
-    
-    // Check ELF magic
-    if (memcmp(elf_header->e_ident, ELF_MAGIC, 4) != 0) {
-        return -1;
+
+    uint64_t dtb = fwinfo_dtb();
+    if (dtb && limine_reqs[LIMINE_REQ_DTB]) {
+        struct limine_dtb_response* r = limine_alloc(sizeof(*r));
+        if (r) r->dtb_ptr = (void*)(uintptr_t)limine_virt(dtb);
+        limine_respond(LIMINE_REQ_DTB, r);
+    }
+
+    if (limine_reqs[LIMINE_REQ_BOOT_TIME]) {
+        struct limine_boot_time_response* r = limine_alloc(sizeof(*r));
+        if (r) r->boot_time = fwinfo_unix_time();
+        limine_respond(LIMINE_REQ_BOOT_TIME, r);
+    }
+
+    // LA57 is whatever the firmware left it as, so that is what we report
+    if (limine_reqs[LIMINE_REQ_PAGING_MODE]) {
+        struct limine_paging_mode_response* r = limine_alloc(sizeof(*r));
+        if (r) r->mode = levels == 5 ? LIMINE_PAGING_MODE_5LEVEL : LIMINE_PAGING_MODE_4LEVEL;
+        limine_respond(LIMINE_REQ_PAGING_MODE, r);
+    }
+    if (levels == 5) limine_respond(LIMINE_REQ_5_LEVEL_PAGING, limine_alloc(sizeof(struct limine_5_level_paging_response)));
+
+    uint64_t stack_size = LIMINE_STACK_SIZE_DEFAULT;
+    if (limine_reqs[LIMINE_REQ_STACK_SIZE]) {
+        uint64_t want = ((struct limine_stack_size_request*)limine_reqs[LIMINE_REQ_STACK_SIZE])->stack_size;
+        if (want > stack_size) stack_size = (want + PAGING_4K - 1) & ~(PAGING_4K - 1);
+        limine_respond(LIMINE_REQ_STACK_SIZE, limine_alloc(sizeof(struct limine_stack_size_response)));
+    }
+    uint64_t entry = img.entry;
+    if (limine_reqs[LIMINE_REQ_ENTRY_POINT]) {
+        uint64_t want = ((struct limine_entry_point_request*)limine_reqs[LIMINE_REQ_ENTRY_POINT])->entry;
+        if (want) entry = want;
+        limine_respond(LIMINE_REQ_ENTRY_POINT, limine_alloc(sizeof(struct limine_entry_point_response)));
+    }
+
+    uint8_t* stack = memmap_alloc(stack_size, PAGING_4K, 0);
+    if (!stack) return -1;
+
+    struct limine_smp_response* smp = NULL;
+    if (limine_reqs[LIMINE_REQ_SMP]) smp = limine_prepare_smp(stack_size);
+
+    // The memory map is only final after ExitBootServices, so its storage
+    // is set aside now and filled in afterwards.
+    struct limine_memmap_response* mm = NULL;
+    struct limine_memmap_entry* mm_entries = NULL;
+    struct limine_memmap_entry** mm_list = NULL;
+    if (limine_reqs[LIMINE_REQ_MEMMAP]) {
+        mm = limine_alloc(sizeof(*mm));
+        mm_entries = limine_alloc((MEMMAP_MAX_ENTRIES + 1) * sizeof(*mm_entries));
+        mm_list = limine_alloc((MEMMAP_MAX_ENTRIES + 1) * sizeof(*mm_list));
+        if (!mm || !mm_entries || !mm_list) return -1;
+        limine_respond(LIMINE_REQ_MEMMAP, mm);
+    }
+
+    // Both physical views cover everything in the map, the low 4 GiB of
+    // MMIO and the framebuffer; 1G/2M leaves keep this to a few pages.
+    int map_count = 0;
+    const struct memmap_entry* map = memmap_get(&map_count);
+    uint64_t top = LIMINE_LOW_MAP;
+    for (int i = 0; i < map_count; i++) {
+        if (map[i].base + map[i].length > top) top = map[i].base + map[i].length;
     }
-    
-    // Check architecture
-    if (elf_header->e_machine != EM_X86_64) {
+    if (fb.base && fb.base + fb.size > top) top = fb.base + fb.size;
+    top = (top + PAGING_1G - 1) & ~(PAGING_1G - 1);
+    if (paging_map(&limine_pt, 0, 0, top, PAGING_WRITE | PAGING_EXEC) != 0 ||
+        paging_map(&limine_pt, limine_hhdm, 0, top, PAGING_WRITE) != 0) {
         return -1;
     }
-    
+
+    if (memmap_exit_boot_services() != 0) return -1;
+    if (mm) limine_fill_memmap(mm, mm_entries, mm_list, &fb);
+    if (smp) limine_start_smp(smp);
+
+    if (paging_activate(&limine_pt) != 0) return -1;
+
+#if defined(__x86_64__)
+    uint64_t stack_top = limine_virt((uintptr_t)stack) + stack_size;
+    __asm__ __volatile__(
+        "cli\n\t"
+        "mov %0, %%rsp\n\t"
+        "xor %%ebp, %%ebp\n\t"
+        "push $0\n\t"
+        "jmp *%1"
+        : : "r"(stack_top), "r"(entry) : "memory");
+#endif
+    return -1;
+}
+
+int limine_add_module(const char* path, const char* cmdline) {
+    if (!path || limine_module_count == LIMINE_MAX_MODULES) return -1;
+    if (strlen(path) >= LIMINE_PATH_MAX || (cmdline && strlen(cmdline) >= LIMINE_PATH_MAX)) return -1;
+    struct limine_module_path* m = &limine_module_paths[limine_module_count++];
+    strcpy(m->path, path);
+    strcpy(m->cmdline, cmdline ? cmdline : "");
     return 0;
-} 
+}
 
-int boot_limine_kernel(uint8_t* kernel_data, uint32_t kernel_size, const char* cmdline) {
-    struct elf64_header* elf_header = (struct elf64_header*)kernel_data;
-    
-    if (elf_header->e_ident[0] != 0x7F || elf_header->e_ident[1] != 'E' || 
-        elf_header->e_ident[2] != 'L' || elf_header->e_ident[3] != 'F') {
+int limine_load_kernel(const char* kernel_path, const char* cmdline) {
+    if (kfile_open(&limine_file, kernel_path) != 0) {
         return -1;
     }
-    
-    if (elf_header->e_type != 2) {
+    return limine_boot(&limine_file, kernel_path, cmdline);
+}
+
+int limine_verify_kernel(const char* kernel_path) {
+    struct kfile* kf = &limine_file;
+
+    if (kfile_open(kf, kernel_path) != 0) {
         return -1;
     }
-    
-    uint64_t entry_point = elf_header->e_entry;
-    struct elf64_phdr* phdr = (struct elf64_phdr*)(kernel_data + elf_header->e_phoff);
-    
-    for (int i = 0; i < elf_header->e_phnum; i++) {
-        if (phdr[i].p_type == 1) {
-            memcpy((void*)phdr[i].p_vaddr, kernel_data + phdr[i].p_offset, phdr[i].p_filesz);
-            if (phdr[i].p_memsz > phdr[i].p_filesz) {
-                memset((void*)(phdr[i].p_vaddr + phdr[i].p_filesz), 0, phdr[i].p_memsz - phdr[i].p_filesz);
-            }
-        }
-    }
-    
-    struct limine_kernel_file_response* kernel_response = (struct limine_kernel_file_response*)0x1000;
-    kernel_response->revision = 0;
-    kernel_response->kernel_file = (struct limine_file*)0x1100;
-    kernel_response->kernel_file->revision = 0;
-    kernel_response->kernel_file->address = (void*)0x100000;
-    kernel_response->kernel_file->size = kernel_size;
-    kernel_response->kernel_file->path = (char*)0x1200;
-    kernel_response->kernel_file->cmdline = (char*)0x1300;
-    
-    if (cmdline && strlen(cmdline) > 0) {
-        strcpy(kernel_response->kernel_file->cmdline, cmdline);
+    kfile_close(kf);
+
+    // Checks magic, class, type, machine and program header bounds
+    return elf_validate(kfile_at(kf, 0, sizeof(struct elf64_header)), kf->size, ELF_MACHINE_NATIVE);
+}
+
+int boot_limine_kernel(uint8_t* kernel_data, uint32_t kernel_size, const char* cmdline) {
+    if (kfile_open_mem(&limine_file, kernel_data, kernel_size) != 0) {
+        return -1;
     }
-    
-    void (*entry)(void) = (void*)entry_point;
-    entry();
-    
-    return 0;
-} 
\ No newline at end of file
+    return limine_boot(&limine_file, "", cmdline);
+}
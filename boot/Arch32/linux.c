@@ -7,131 +7,322 @@
 #include <stdint.h>
 #include "compat.h"
 #include <string.h>
+#include <Library/UefiLib.h>
 #include "linux.h"
+#include "memmap.h"
+#include "kfile.h"
+#include "fwinfo.h"
+#include "initrd.h"
 
 extern void read_sector(uint32_t lba, uint8_t* buf);
 extern void* allocate_memory(uint32_t size);
 
-struct linux_kernel_header {
-    uint8_t setup_sects;
-    uint16_t root_flags;
-    uint32_t syssize;
-    uint16_t ram_size;
-    uint16_t vid_mode;
-    uint16_t root_dev;
-    uint16_t boot_flag;
-    uint16_t jump;
-    uint32_t header;
-    uint16_t version;
-    uint32_t realmode_swtch;
-    uint16_t start_sys_seg;
-    uint16_t kernel_version;
-    uint8_t type_of_loader;
-    uint8_t loadflags;
-    uint16_t setup_move_size;
-    uint32_t code32_start;
-    uint32_t ramdisk_image;
-    uint32_t ramdisk_size;
-    uint32_t bootsect_kludge;
-    uint16_t heap_end_ptr;
-    uint8_t ext_loader_ver;
-    uint8_t ext_loader_type;
-    uint32_t cmd_line_ptr;
-    uint32_t initrd_addr_max;
-    uint32_t kernel_alignment;
-    uint8_t relocatable_kernel;
-    uint8_t min_alignment;
-    uint16_t xloadflags;
-    uint32_t cmdline_size;
-    uint32_t hardware_subarch;
-    uint64_t hardware_subarch_data;
-    uint32_t payload_offset;
-    uint32_t payload_length;
-    uint64_t setup_data;
-    uint64_t pref_address;
-    uint32_t init_size;
-    uint32_t handover_offset;
-};
+#define LINUX_DEFAULT_LOAD 0x100000
+#define LINUX_LEGACY_INITRD_MAX 0x37FFFFFF
+#define LINUX_LEGACY_CMDLINE_MAX 255
+#define LINUX_SETUP_AREA (2 * sizeof(struct linux_setup_data) + LINUX_RNG_SEED_SIZE + \
+                          (MEMMAP_MAX_ENTRIES - LINUX_E820_MAX_ZEROPAGE) * sizeof(struct linux_e820_entry))
 
-int linux_load_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline) {
-    uint8_t* kernel_data = NULL;
-    uint32_t kernel_size = 0;
-    
-    // Load kernel file
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
+static struct linux_setup_header* linux_header(uint8_t* kernel_data, uint32_t kernel_size) {
+    if (kernel_size < LINUX_HDR_OFFSET + sizeof(struct linux_setup_header)) return NULL;
+    struct linux_setup_header* header = (struct linux_setup_header*)(kernel_data + LINUX_HDR_OFFSET);
+    return header->header == LINUX_MAGIC ? header : NULL;
+}
+
+static uint32_t linux_setup_size(const struct linux_setup_header* header) {
+    return ((header->setup_sects ? header->setup_sects : 4) + 1) * 512;
+}
+
+static int linux_above_4g(const struct linux_setup_header* header) {
+    return header->version >= 0x20C && (header->xloadflags & LINUX_XLF_CAN_BE_LOADED_ABOVE_4G);
+}
+
+// Finds room for the protected-mode payload: pref_address with
+// kernel_alignment, or exactly pref_address if it is not relocatable.
+// code32_start is 32 bits wide, so the payload stays below 4 GiB.
+static int linux_place_kernel(const struct linux_setup_header* header, uint32_t payload_size, uint64_t* kernel_addr) {
+    struct memmap_request kreq = { 0 };
+    kreq.size = payload_size;
+    kreq.align = 0x1000;
+    kreq.min_addr = LINUX_DEFAULT_LOAD;
+    kreq.max_addr = 0xFFFFFFFF;
+    kreq.pref_addr = LINUX_DEFAULT_LOAD;
+    kreq.kernel = 1;
+    if (header->version >= 0x20A) {
+        if (header->init_size > kreq.size) kreq.size = header->init_size;
+        if (header->pref_address) kreq.pref_addr = header->pref_address;
+    }
+    if (header->version >= 0x205 && header->relocatable_kernel) {
+        if (header->kernel_alignment) kreq.align = header->kernel_alignment;
+    } else {
+        kreq.min_addr = kreq.pref_addr;
+        kreq.max_addr = kreq.pref_addr + kreq.size - 1;
+    }
+    return memmap_place(&kreq, kernel_addr);
+}
+
+// The initrd goes as high as initrd_addr_max allows, or anywhere at all
+// when the kernel takes ext_ramdisk_image.
+static int linux_place_initrd(const struct linux_setup_header* header, uint64_t initrd_size, uint64_t* initrd_addr) {
+    struct memmap_request ireq = { 0 };
+    ireq.size = initrd_size;
+    ireq.align = 0x1000;
+    ireq.min_addr = LINUX_DEFAULT_LOAD;
+    if (!linux_above_4g(header)) {
+        ireq.max_addr = header->version >= 0x203 ? header->initrd_addr_max : LINUX_LEGACY_INITRD_MAX;
+    }
+    ireq.top_down = 1;
+    ireq.kernel = 1;
+    return memmap_place(&ireq, initrd_addr);
+}
+
+// An initrd the caller already placed (PXE fetches into page-aligned
+// memory-map regions) can be handed over where it is.
+static int linux_initrd_fits(const struct linux_setup_header* header, const uint8_t* data, uint64_t size) {
+    uint64_t addr = (uintptr_t)data;
+    uint64_t max = linux_above_4g(header) ? ~0ULL :
+                   header->version >= 0x203 ? header->initrd_addr_max : LINUX_LEGACY_INITRD_MAX;
+    return !(addr & 0xFFF) && addr >= LINUX_DEFAULT_LOAD && addr + size - 1 <= max;
+}
+
+static void linux_screen_info(struct linux_screen_info* si) {
+    struct fwinfo_fb fb;
+    if (fwinfo_framebuffer(&fb) != 0) return;
+    si->orig_video_isVGA = LINUX_VIDEO_TYPE_EFI;
+    si->lfb_width = fb.width;
+    si->lfb_height = fb.height;
+    si->lfb_depth = fb.bpp;
+    si->lfb_linelength = fb.pitch;
+    si->lfb_base = (uint32_t)fb.base;
+    si->ext_lfb_base = (uint32_t)(fb.base >> 32);
+    if (si->ext_lfb_base) si->capabilities |= LINUX_VIDEO_CAPABILITY_64BIT_BASE;
+    si->lfb_size = (uint32_t)fb.size;
+    si->red_size = fb.red_size;
+    si->red_pos = fb.red_shift;
+    si->green_size = fb.green_size;
+    si->green_pos = fb.green_shift;
+    si->blue_size = fb.blue_size;
+    si->blue_pos = fb.blue_shift;
+    si->rsvd_size = fb.reserved_size;
+    si->rsvd_pos = fb.reserved_shift;
+    si->pages = 1;
+}
+
+// Links a setup_data node at the head of the chain in hdr.
+static void linux_setup_data_link(struct linux_setup_header* hdr, struct linux_setup_data* sd, uint32_t type, uint32_t len) {
+    sd->type = type;
+    sd->len = len;
+    sd->next = hdr->setup_data;
+    hdr->setup_data = (uintptr_t)sd;
+}
+
+#if defined(__x86_64__)
+static uint64_t linux_gdt[4] = { 0, 0, 0x00af9a000000ffffULL, 0x00cf92000000ffffULL };
+
+// 64-bit boot protocol entry: flat __BOOT_CS/__BOOT_DS at 0x10/0x18,
+// interrupts off, %rsi pointing at the zero page.
+static void linux_jump64(uint64_t entry, struct linux_zero_page* zp) __attribute__((noreturn));
+static void linux_jump64(uint64_t entry, struct linux_zero_page* zp) {
+    struct {
+        uint16_t limit;
+        uint64_t base;
+    } __attribute__((packed)) gdtr = { sizeof(linux_gdt) - 1, (uintptr_t)linux_gdt };
+    asm volatile (
+        "cli\n"
+        "lgdt %0\n"
+        "movl $0x18, %%eax\n"
+        "movl %%eax, %%ds\n"
+        "movl %%eax, %%es\n"
+        "movl %%eax, %%fs\n"
+        "movl %%eax, %%gs\n"
+        "movl %%eax, %%ss\n"
+        "pushq $0x10\n"
+        "pushq %1\n"
+        "lretq\n"
+        :: "m"(gdtr), "r"(entry), "S"(zp) : "rax", "memory");
+    __builtin_unreachable();
+}
+#endif
+
+// Builds the zero page, command line and setup_data chain below 4 GiB in
+// one allocation, then enters the kernel through its EFI handover entry
+// if it has one, or through the 64-bit boot protocol after exiting boot
+// services, with e820 and efi_info taken from the final UEFI map.
+static int linux_enter(const uint8_t* setup, uint32_t setup_size, uint64_t kernel_addr, uint64_t initrd_addr, uint64_t initrd_size, const char* cmdline) {
+    const struct linux_setup_header* src = (const struct linux_setup_header*)(setup + LINUX_HDR_OFFSET);
+    uint32_t cmdline_max = src->version >= 0x206 ? src->cmdline_size : LINUX_LEGACY_CMDLINE_MAX;
+    uint32_t cmdline_len = cmdline ? strlen(cmdline) : 0;
+    if (cmdline_len > cmdline_max) cmdline_len = cmdline_max;
+
+    uint8_t* area = memmap_alloc(sizeof(struct linux_zero_page) + LINUX_SETUP_AREA + cmdline_len + 1, 0x1000, 0xFFFFFFFF);
+    if (!area) {
         return -1;
     }
-    
-    // Parse kernel header
-    struct linux_kernel_header* header = (struct linux_kernel_header*)kernel_data;
-    
-    // Verify it's a Linux kernel
-    if (header->header != 0x53726448) { // "HdrS" magic
+    struct linux_zero_page* zp = (struct linux_zero_page*)area;
+    struct linux_setup_data* rng = (struct linux_setup_data*)(area + sizeof(*zp));
+    struct linux_setup_data* e820_ext = (struct linux_setup_data*)((uint8_t*)(rng + 1) + LINUX_RNG_SEED_SIZE);
+    char* cmd = (char*)area + sizeof(*zp) + LINUX_SETUP_AREA;
+    memset(zp, 0, sizeof(*zp));
+
+    // The header extends to the target of the jump at 0x200.
+    uint32_t hdr_len = 0x202 + setup[0x201] - LINUX_HDR_OFFSET;
+    if (hdr_len > sizeof(zp->hdr)) hdr_len = sizeof(zp->hdr);
+    if (LINUX_HDR_OFFSET + hdr_len > setup_size) hdr_len = setup_size - LINUX_HDR_OFFSET;
+    memcpy(&zp->hdr, src, hdr_len);
+    struct linux_setup_header* hdr = &zp->hdr;
+    hdr->type_of_loader = 0xFF;
+    hdr->code32_start = (uint32_t)kernel_addr;
+    hdr->setup_data = 0;
+
+    if (cmdline_len) memcpy(cmd, cmdline, cmdline_len);
+    cmd[cmdline_len] = 0;
+    hdr->cmd_line_ptr = (uint32_t)(uintptr_t)cmd;
+
+    if (initrd_size) {
+        hdr->ramdisk_image = (uint32_t)initrd_addr;
+        hdr->ramdisk_size = (uint32_t)initrd_size;
+        zp->ext_ramdisk_image = (uint32_t)(initrd_addr >> 32);
+        zp->ext_ramdisk_size = (uint32_t)(initrd_size >> 32);
+    }
+
+    linux_screen_info(&zp->screen_info);
+    if (hdr->version >= 0x20E) {
+        zp->acpi_rsdp_addr = fwinfo_acpi_rsdp(1);
+        if (!zp->acpi_rsdp_addr) zp->acpi_rsdp_addr = fwinfo_acpi_rsdp(0);
+    }
+    if (hdr->version >= 0x209 && fwinfo_random(rng->data, LINUX_RNG_SEED_SIZE) == 0) {
+        linux_setup_data_link(hdr, rng, LINUX_SETUP_RNG_SEED, LINUX_RNG_SEED_SIZE);
+    }
+
+#if defined(__x86_64__)
+    // The EFI stub exits boot services itself and builds its own e820.
+    if (hdr->version >= 0x20B && hdr->handover_offset && (hdr->xloadflags & LINUX_XLF_EFI_HANDOVER_64)) {
+        typedef void (__attribute__((sysv_abi)) *linux_handover_fn)(void*, void*, struct linux_zero_page*);
+        linux_handover_fn handover = (linux_handover_fn)(uintptr_t)(kernel_addr + LINUX_ENTRY64_OFFSET + hdr->handover_offset);
+        handover((void*)(uintptr_t)fwinfo_image_handle(), (void*)(uintptr_t)fwinfo_system_table(), zp);
+        return -1;
+    }
+    if (hdr->version < 0x20C || !(hdr->xloadflags & LINUX_XLF_KERNEL_64)) {
+        return -1;
+    }
+
+    // A map that does not fit is refused while boot services are still
+    // there to return to; a truncated one would hide RAM or reservations.
+    static struct memmap_e820 e820[MEMMAP_MAX_ENTRIES];
+    if (memmap_to_e820(e820, MEMMAP_MAX_ENTRIES) < 0 || memmap_exit_boot_services() != 0) {
+        return -1;
+    }
+    int n = memmap_to_e820(e820, MEMMAP_MAX_ENTRIES);
+    if (n < 0) {
         return -1;
     }
+    int low = n < LINUX_E820_MAX_ZEROPAGE ? n : LINUX_E820_MAX_ZEROPAGE;
+    memcpy(zp->e820_table, e820, low * sizeof(struct linux_e820_entry));
+    zp->e820_entries = (uint8_t)low;
+    if (n > low) {
+        uint32_t len = (n - low) * sizeof(struct linux_e820_entry);
+        memcpy(e820_ext->data, &e820[low], len);
+        linux_setup_data_link(hdr, e820_ext, LINUX_SETUP_E820_EXT, len);
+    }
+
+    uint64_t map_bytes, desc_size;
+    uint32_t desc_version;
+    const void* map = memmap_efi_map(&map_bytes, &desc_size, &desc_version);
+    uint64_t systab = fwinfo_system_table();
+    zp->efi_info.efi_loader_signature = LINUX_EFI64_LOADER_SIGNATURE;
+    zp->efi_info.efi_systab = (uint32_t)systab;
+    zp->efi_info.efi_systab_hi = (uint32_t)(systab >> 32);
+    zp->efi_info.efi_memdesc_size = (uint32_t)desc_size;
+    zp->efi_info.efi_memdesc_version = desc_version;
+    zp->efi_info.efi_memmap = (uint32_t)(uintptr_t)map;
+    zp->efi_info.efi_memmap_hi = (uint32_t)((uint64_t)(uintptr_t)map >> 32);
+    zp->efi_info.efi_memmap_size = (uint32_t)map_bytes;
+
+    linux_jump64(kernel_addr + LINUX_ENTRY64_OFFSET, zp);
+#else
+    (void)e820_ext;
+    return -1;
+#endif
+}
+
+static struct kfile linux_kernel_file;
+static struct initrd_list linux_initrds;
+
+// Only the setup sectors are parsed from the file head; the payload and
+// every initrd are read straight to their final addresses.
+static int linux_boot(struct kfile* kf, const char* initrd_spec, const char* cmdline) {
+    uint64_t kernel_addr;
+    uint64_t initrd_addr = 0;
+    uint64_t initrd_size = 0;
     
-    // Calculate setup size
-    uint32_t setup_size = (header->setup_sects + 1) * 512;
-    if (setup_size == 0) setup_size = 4 * 512; // Default 4 sectors
+    struct linux_setup_header* header = linux_header(kf->head, kf->head_len);
+    if (!header) {
+        kfile_close(kf);
+        return -1;
+    }
+    uint32_t setup_size = linux_setup_size(header);
+    if (setup_size > kf->head_len || setup_size >= kf->size || kf->size > 0xFFFFFFFF) {
+        kfile_close(kf);
+        return -1;
+    }
+    uint32_t payload_size = (uint32_t)kf->size - setup_size;
     
-    // Load kernel to 0x100000 (1MB)
-    uint8_t* kernel_dest = (uint8_t*)0x100000;
-    memcpy(kernel_dest, kernel_data + setup_size, kernel_size - setup_size);
+    if (linux_place_kernel(header, payload_size, &kernel_addr) != 0 ||
+        kfile_read(kf, setup_size, (void*)(uintptr_t)kernel_addr, payload_size) != 0) {
+        kfile_close(kf);
+        return -1;
+    }
+    kfile_close(kf);
     
-    // Load initrd if specified
-    uint32_t initrd_addr = 0;
-    uint32_t initrd_size = 0;
-    if (initrd_path && strlen(initrd_path) > 0) {
-        uint8_t* initrd_data = NULL;
-        if (load_file(initrd_path, &initrd_data, &initrd_size) == 0) {
-            // Place initrd after kernel
-            initrd_addr = 0x100000 + kernel_size - setup_size;
-            memcpy((void*)initrd_addr, initrd_data, initrd_size);
+    // The initrds share one region; kernels that take ext_ramdisk_image
+    // get it above 4 GiB, so its size is not capped at 32 bits. A kernel
+    // is never started without the initrds it was given.
+    if (initrd_prepare(&linux_initrds, initrd_spec, &initrd_size) != 0) {
+        Print(L"  Cannot open initrd %a\r\n", initrd_spec);
+        return -1;
+    }
+    if (!linux_above_4g(header) && initrd_size > 0xFFFFFFFF) {
+        Print(L"  Initrd is over 4 GiB and the kernel cannot load it above 4 GiB\r\n");
+        return -1;
+    }
+    if (initrd_size) {
+        if (linux_place_initrd(header, initrd_size, &initrd_addr) != 0 ||
+            initrd_load(&linux_initrds, initrd_addr) != 0) {
+            Print(L"  Cannot load initrd %a\r\n", initrd_spec);
+            return -1;
         }
     }
     
-    // Setup boot parameters
-    struct linux_boot_params* params = (struct linux_boot_params*)0x90000;
-    memset(params, 0, sizeof(struct linux_boot_params));
-    
-    // Copy setup code
-    memcpy(params, kernel_data, setup_size);
-    
-    // Set command line
-    if (cmdline && strlen(cmdline) > 0) {
-        strcpy((char*)0x90000 + 0x0020, cmdline);
-        params->cmd_line_ptr = 0x90020;
+    return linux_enter(kf->head, setup_size, kernel_addr, initrd_addr, initrd_size, cmdline);
+}
+
+int linux_load_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline) {
+    if (kfile_open(&linux_kernel_file, kernel_path) != 0) {
+        return -1;
     }
-    
-    // Set initrd parameters
-    if (initrd_addr > 0) {
-        params->ramdisk_image = initrd_addr;
-        params->ramdisk_size = initrd_size;
+    return linux_boot(&linux_kernel_file, initrd_path, cmdline);
+}
+
+// For callers that already hold the kernel image but not the initrds.
+int linux_boot_image(uint8_t* kernel_data, uint32_t kernel_size, const char* initrd_path, const char* cmdline) {
+    if (kfile_open_mem(&linux_kernel_file, kernel_data, kernel_size) != 0) {
+        return -1;
     }
-    
-    // Set memory parameters
-    params->mem_upper = 0x7FE00; // 640KB - 1MB
-    params->ext_mem_k = 0x7FE00; // Extended memory in KB
-    
-    // Jump to kernel
-    void (*kernel_entry)(struct linux_boot_params*) = (void*)0x100000;
-    kernel_entry(params);
-    
-    return 0;
+    return linux_boot(&linux_kernel_file, initrd_path, cmdline);
 }
 
 int linux_verify_kernel(const char* kernel_path) {
-    uint8_t* kernel_data = NULL;
-    uint32_t kernel_size = 0;
+    struct kfile* kf = &linux_kernel_file;
     
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
+    if (kfile_open(kf, kernel_path) != 0) {
         return -1;
     }
+    kfile_close(kf);
     
-    struct linux_kernel_header* header = (struct linux_kernel_header*)kernel_data;
+    struct linux_setup_header* header = linux_header(kf->head, kf->head_len);
     
     // Check magic number
-    if (header->header != 0x53726448) {
+    if (!header) {
         return -1;
     }
     
@@ -143,45 +334,35 @@ int linux_verify_kernel(const char* kernel_path) {
     return 0;
 } 
 
+// Buffer entry point for callers that already hold the whole image.
 int boot_linux_kernel(uint8_t* kernel_data, uint32_t kernel_size, uint8_t* initrd_data, uint32_t initrd_size, const char* cmdline) {
-    struct linux_kernel_header* header = (struct linux_kernel_header*)kernel_data;
+    struct linux_setup_header* header = linux_header(kernel_data, kernel_size);
     
-    if (header->header != 0x53726448) {
+    if (!header) {
         return -1;
     }
     
-    uint32_t setup_size = (header->setup_sects + 1) * 512;
-    if (setup_size == 0) setup_size = 4 * 512;
-    
-    uint8_t* kernel_dest = (uint8_t*)0x100000;
-    memcpy(kernel_dest, kernel_data + setup_size, kernel_size - setup_size);
-    
-    uint32_t initrd_addr = 0;
-    if (initrd_data && initrd_size > 0) {
-        initrd_addr = 0x100000 + kernel_size - setup_size;
-        memcpy((void*)initrd_addr, initrd_data, initrd_size);
+    uint32_t setup_size = linux_setup_size(header);
+    if (setup_size >= kernel_size) {
+        return -1;
     }
+    uint32_t payload_size = kernel_size - setup_size;
     
-    struct linux_boot_params* params = (struct linux_boot_params*)0x90000;
-    memset(params, 0, sizeof(struct linux_boot_params));
-    
-    memcpy(params, kernel_data, setup_size);
-    
-    if (cmdline && strlen(cmdline) > 0) {
-        strcpy((char*)0x90000 + 0x0020, cmdline);
-        params->cmd_line_ptr = 0x90020;
+    uint64_t kernel_addr;
+    if (linux_place_kernel(header, payload_size, &kernel_addr) != 0) {
+        return -1;
     }
+    memcpy((void*)(uintptr_t)kernel_addr, kernel_data + setup_size, payload_size);
     
-    if (initrd_addr > 0) {
-        params->ramdisk_image = initrd_addr;
-        params->ramdisk_size = initrd_size;
+    uint64_t initrd_addr = 0;
+    if (initrd_data && initrd_size > 0 && linux_initrd_fits(header, initrd_data, initrd_size)) {
+        initrd_addr = (uintptr_t)initrd_data;
+    } else if (initrd_data && initrd_size > 0) {
+        if (linux_place_initrd(header, initrd_size, &initrd_addr) != 0) {
+            return -1;
+        }
+        memcpy((void*)(uintptr_t)initrd_addr, initrd_data, initrd_size);
     }
     
-    params->mem_upper = 0x7FE00;
-    params->ext_mem_k = 0x7FE00;
-    
-    void (*kernel_entry)(struct linux_boot_params*) = (void*)0x100000;
-    kernel_entry(params);
-    
-    return 0;
-} 
\ No newline at end of file
+    return linux_enter(kernel_data, setup_size, kernel_addr, initrd_addr, initrd_size, cmdline);
+}
@@ -9,7 +9,29 @@
 #include <stdint.h>
 #include "compat.h"
 
-struct linux_boot_params {
+#define LINUX_HDR_OFFSET 0x1F1
+#define LINUX_MAGIC 0x53726448
+#define LINUX_ENTRY64_OFFSET 0x200
+#define LINUX_E820_MAX_ZEROPAGE 128
+
+// xloadflags
+#define LINUX_XLF_KERNEL_64 (1 << 0)
+#define LINUX_XLF_CAN_BE_LOADED_ABOVE_4G (1 << 1)
+#define LINUX_XLF_EFI_HANDOVER_32 (1 << 2)
+#define LINUX_XLF_EFI_HANDOVER_64 (1 << 3)
+
+// setup_data types
+#define LINUX_SETUP_E820_EXT 1
+#define LINUX_SETUP_DTB 2
+#define LINUX_SETUP_RNG_SEED 9
+
+#define LINUX_VIDEO_TYPE_EFI 0x70
+#define LINUX_VIDEO_CAPABILITY_64BIT_BASE (1 << 1)
+#define LINUX_EFI64_LOADER_SIGNATURE 0x34364c45 // "EL64"
+#define LINUX_RNG_SEED_SIZE 32
+
+// Setup header as it sits at offset 0x1F1 of bzImage and of the zero page.
+struct linux_setup_header {
     uint8_t setup_sects;
     uint16_t root_flags;
     uint32_t syssize;
@@ -48,12 +70,115 @@ struct linux_boot_params {
     uint64_t pref_address;
     uint32_t init_size;
     uint32_t handover_offset;
-    uint32_t mem_upper;
-    uint32_t ext_mem_k;
-};
+    uint32_t kernel_info_offset;
+} __attribute__((packed));
+
+struct linux_screen_info {
+    uint8_t orig_x;
+    uint8_t orig_y;
+    uint16_t ext_mem_k;
+    uint16_t orig_video_page;
+    uint8_t orig_video_mode;
+    uint8_t orig_video_cols;
+    uint8_t flags;
+    uint8_t unused2;
+    uint16_t orig_video_ega_bx;
+    uint16_t unused3;
+    uint8_t orig_video_lines;
+    uint8_t orig_video_isVGA;
+    uint16_t orig_video_points;
+    uint16_t lfb_width;
+    uint16_t lfb_height;
+    uint16_t lfb_depth;
+    uint32_t lfb_base;
+    uint32_t lfb_size;
+    uint16_t cl_magic;
+    uint16_t cl_offset;
+    uint16_t lfb_linelength;
+    uint8_t red_size;
+    uint8_t red_pos;
+    uint8_t green_size;
+    uint8_t green_pos;
+    uint8_t blue_size;
+    uint8_t blue_pos;
+    uint8_t rsvd_size;
+    uint8_t rsvd_pos;
+    uint16_t vesapm_seg;
+    uint16_t vesapm_off;
+    uint16_t pages;
+    uint16_t vesa_attributes;
+    uint32_t capabilities;
+    uint32_t ext_lfb_base;
+    uint8_t reserved[2];
+} __attribute__((packed));
+
+struct linux_efi_info {
+    uint32_t efi_loader_signature;
+    uint32_t efi_systab;
+    uint32_t efi_memdesc_size;
+    uint32_t efi_memdesc_version;
+    uint32_t efi_memmap;
+    uint32_t efi_memmap_size;
+    uint32_t efi_systab_hi;
+    uint32_t efi_memmap_hi;
+} __attribute__((packed));
+
+struct linux_e820_entry {
+    uint64_t addr;
+    uint64_t size;
+    uint32_t type;
+} __attribute__((packed));
+
+// The 4 KiB zero page ("struct boot_params"), laid out as in
+// Documentation/arch/x86/zero-page.rst.
+struct linux_zero_page {
+    struct linux_screen_info screen_info;       // 0x000
+    uint8_t apm_bios_info[0x14];                // 0x040
+    uint8_t pad2[4];                            // 0x054
+    uint64_t tboot_addr;                        // 0x058
+    uint8_t ist_info[0x10];                     // 0x060
+    uint64_t acpi_rsdp_addr;                    // 0x070
+    uint8_t pad3[8];                            // 0x078
+    uint8_t hd0_info[16];                       // 0x080
+    uint8_t hd1_info[16];                       // 0x090
+    uint8_t sys_desc_table[0x10];               // 0x0a0
+    uint8_t olpc_ofw_header[0x10];              // 0x0b0
+    uint32_t ext_ramdisk_image;                 // 0x0c0
+    uint32_t ext_ramdisk_size;                  // 0x0c4
+    uint32_t ext_cmd_line_ptr;                  // 0x0c8
+    uint8_t pad4[112];                          // 0x0cc
+    uint32_t cc_blob_address;                   // 0x13c
+    uint8_t edid_info[0x80];                    // 0x140
+    struct linux_efi_info efi_info;             // 0x1c0
+    uint32_t alt_mem_k;                         // 0x1e0
+    uint32_t scratch;                           // 0x1e4
+    uint8_t e820_entries;                       // 0x1e8
+    uint8_t eddbuf_entries;                     // 0x1e9
+    uint8_t edd_mbr_sig_buf_entries;            // 0x1ea
+    uint8_t kbd_status;                         // 0x1eb
+    uint8_t secure_boot;                        // 0x1ec
+    uint8_t pad5[2];                            // 0x1ed
+    uint8_t sentinel;                           // 0x1ef
+    uint8_t pad6[1];                            // 0x1f0
+    struct linux_setup_header hdr;              // 0x1f1
+    uint8_t pad7[0x290 - 0x1f1 - sizeof(struct linux_setup_header)];
+    uint32_t edd_mbr_sig_buffer[16];            // 0x290
+    struct linux_e820_entry e820_table[LINUX_E820_MAX_ZEROPAGE]; // 0x2d0
+    uint8_t pad8[48];                           // 0xcd0
+    uint8_t eddbuf[6 * 82];                     // 0xd00
+    uint8_t pad9[276];                          // 0xeec
+} __attribute__((packed));
+
+struct linux_setup_data {
+    uint64_t next;
+    uint32_t type;
+    uint32_t len;
+    uint8_t data[];
+} __attribute__((packed));
 
 int linux_load_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline);
+int linux_boot_image(uint8_t* kernel_data, uint32_t kernel_size, const char* initrd_path, const char* cmdline);
 int linux_verify_kernel(const char* kernel_path);
 int boot_linux_kernel(uint8_t* kernel_data, uint32_t kernel_size, uint8_t* initrd_data, uint32_t initrd_size, const char* cmdline);
 
-#endif // BLOODHORN_LINUX_H 
\ No newline at end of file
+#endif // BLOODHORN_LINUX_H
@@ -0,0 +1,282 @@
+/*
+ * BloodHorn Bootloader
+ *
+ * This file is part of BloodHorn and is licensed under the MIT License.
+ * See the root of the repository for license details.
+ */
+#include <stdint.h>
+#include "compat.h"
+#include <stddef.h>
+#include <string.h>
+#include "loader.h"
+#include "memmap.h"
+#include "kfile.h"
+#include "initrd.h"
+#include "elf.h"
+#include "linux.h"
+#include "multiboot1.h"
+#include "multiboot2.h"
+#include "aarch64.h"
+#include "riscv64.h"
+#include "loongarch64.h"
+#include "BloodChain/bcbp_loader.h"
+#include "../secure.h"
+
+static struct kfile loader_file;
+static struct initrd_list loader_initrds;
+static const char* loader_dtb_path;
+static const char* loader_overlays;
+
+static int loader_mb2_probe(struct kfile* kf, struct loader_image* img) {
+    struct multiboot2_header_info hdr;
+    (void)img;
+    return multiboot2_parse_header(kf->head, kf->head_len, &hdr);
+}
+
+static int loader_mb2_load(const char* kernel_path, const char* initrd_path, const char* cmdline) {
+    (void)initrd_path;
+    return multiboot2_load_kernel(kernel_path, cmdline);
+}
+
+static int loader_mb1_probe(struct kfile* kf, struct loader_image* img) {
+    uint32_t offset;
+    (void)img;
+    return multiboot1_find_header(kf->head, kf->head_len, &offset) ? 0 : -1;
+}
+
+static int loader_mb1_load(const char* kernel_path, const char* initrd_path, const char* cmdline) {
+    (void)initrd_path;
+    return multiboot1_load_kernel(kernel_path, cmdline);
+}
+
+static int loader_bzimage_probe(struct kfile* kf, struct loader_image* img) {
+    const void* p = kfile_at(kf, LINUX_HDR_OFFSET + offsetof(struct linux_setup_header, header), 4);
+    uint32_t magic = 0;
+    (void)img;
+    if (p) memcpy(&magic, p, 4);
+    return magic == LINUX_MAGIC ? 0 : -1;
+}
+
+static int loader_elf_probe(struct kfile* kf, struct loader_image* img) {
+    (void)img;
+    return elf_validate(kfile_at(kf, 0, sizeof(struct elf64_header)), kf->size, ELF_MACHINE_NATIVE);
+}
+
+// A native ELF that carries the BloodChain section; this one probe reads
+// past the head, for the section headers.
+static int loader_bloodchain_probe(struct kfile* kf, struct loader_image* img) {
+    uint64_t addr, size;
+    if (loader_elf_probe(kf, img) != 0) return -1;
+    return elf_find_section(kf, BCBP_ELF_SECTION, &addr, &size);
+}
+
+// Any other native ELF: segments at their physical addresses, boot
+// services exited, and the entry called with the command line under the
+// firmware's identity mapping. There is no protocol to pass an initrd by.
+static int loader_elf_load(const char* kernel_path, const char* initrd_path, const char* cmdline) {
+    struct kfile* kf = &loader_file;
+    struct elf_image img;
+    (void)initrd_path;
+    if (kfile_open(kf, kernel_path) != 0) {
+        return -1;
+    }
+    if (elf_load_phys(kf, NULL, &img) != 0) {
+        kfile_close(kf);
+        return -1;
+    }
+    kfile_close(kf);
+    if (memmap_exit_boot_services() != 0) {
+        return -1;
+    }
+    void (*entry)(const char*) = (void (*)(const char*))(uintptr_t)img.entry;
+    entry(cmdline ? cmdline : "");
+    return -1;
+}
+
+// Anything else the firmware can run itself: EFI applications, including
+// kernels with an EFI stub for which no native format above matched.
+static int loader_pe_probe(struct kfile* kf, struct loader_image* img) {
+    const uint8_t* mz = kfile_at(kf, 0, 0x40);
+    uint32_t pe_offset;
+    (void)img;
+    if (!mz || mz[0] != 'M' || mz[1] != 'Z') return -1;
+    memcpy(&pe_offset, mz + 0x3C, 4);
+    const uint8_t* pe = kfile_at(kf, pe_offset, 6);
+    if (!pe || memcmp(pe, "PE\0\0", 4) != 0) return -1;
+    return (uint16_t)(pe[4] | pe[5] << 8) == LOADER_PE_MACHINE ? 0 : -1;
+}
+
+// LoadImage wants the whole image in one buffer, so this is the one
+// format that is staged rather than read in place. The firmware applies
+// Secure Boot policy on LoadImage.
+static int loader_pe_load(const char* kernel_path, const char* initrd_path, const char* cmdline) {
+    struct kfile* kf = &loader_file;
+    int r = -1;
+    (void)initrd_path;
+    if (kfile_open(kf, kernel_path) != 0) {
+        return -1;
+    }
+    uint64_t size = kf->size;
+    uint64_t len = cmdline ? strlen(cmdline) : 0;
+    void* image = memmap_alloc(size, 0x1000, 0);
+    CHAR16* options = memmap_alloc((len + 1) * sizeof(CHAR16), 0x1000, 0);
+    if (image && options && kfile_read(kf, 0, image, size) == 0) {
+        kfile_close(kf);
+        for (uint64_t i = 0; i < len; i++) options[i] = (CHAR16)(uint8_t)cmdline[i];
+        options[len] = 0;
+        r = EFI_ERROR(ExecuteKernel(image, size, len ? options : NULL)) ? -1 : 0;
+    } else {
+        kfile_close(kf);
+    }
+    if (options) memmap_free((uintptr_t)options, (len + 1) * sizeof(CHAR16));
+    if (image) memmap_free((uintptr_t)image, size);
+    return r;
+}
+
+static const struct loader_format loader_mb2_format = { "multiboot2", loader_mb2_probe, loader_mb2_load, NULL };
+static const struct loader_format loader_mb1_format = { "multiboot1", loader_mb1_probe, loader_mb1_load, NULL };
+static const struct loader_format loader_bzimage_format = { "bzImage", loader_bzimage_probe, linux_load_kernel, NULL };
+static const struct loader_format loader_bloodchain_format = { "BloodChain ELF", loader_bloodchain_probe, bcbp_load_kernel, NULL };
+static const struct loader_format loader_elf_format = { "ELF", loader_elf_probe, loader_elf_load, NULL };
+static const struct loader_format loader_pe_format = { "EFI application", loader_pe_probe, loader_pe_load, NULL };
+
+// Probed in order, so the order settles overlaps: Multiboot kernels are
+// often ELF files, and bzImage and the arm64/RISC-V/LoongArch Images all
+// carry an EFI stub, so each is claimed before the generic ELF and PE
+// entries. Only this build's architecture's kernel formats are listed.
+static const struct loader_format* const loader_formats[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    &loader_mb2_format,
+    &loader_mb1_format,
+    &loader_bzimage_format,
+#elif defined(__aarch64__)
+    &aarch64_image_format,
+#elif defined(__riscv)
+    &riscv64_image_format,
+#elif defined(__loongarch__)
+    &loongarch64_image_format,
+#endif
+    &loader_bloodchain_format,
+    &loader_elf_format,
+    &loader_pe_format,
+};
+
+const struct loader_format* loader_probe(struct kfile* kf, struct loader_image* img) {
+    for (uint32_t i = 0; i < sizeof(loader_formats) / sizeof(loader_formats[0]); i++) {
+        memset(img, 0, sizeof(*img));
+        if (loader_formats[i]->probe(kf, img) == 0) return loader_formats[i];
+    }
+    return NULL;
+}
+
+// All initrds share one region at the top of the window above the kernel,
+// each streamed from disk straight to its slot.
+static int loader_load_initrds(uint64_t kernel_end, const char* initrd_path, uint64_t* addr, uint64_t* size) {
+    *addr = 0;
+    if (initrd_prepare(&loader_initrds, initrd_path, size) != 0 || !*size) {
+        *size = 0;
+        return 0;
+    }
+    struct memmap_request req = {0};
+    req.size = *size;
+    req.align = 0x1000;
+    req.min_addr = kernel_end;
+    req.max_addr = kernel_end + LOADER_INITRD_WINDOW - 1;
+    req.top_down = 1;
+    req.kernel = 1;
+    if (memmap_place(&req, addr) != 0 || initrd_load(&loader_initrds, *addr) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Planner, executor and handoff for plain images: one placement from the
+// memory map, one read plan that lands the file at its load address and
+// zero-fills the rest of mem_size, then the initrds. Consumes kf.
+int loader_run(struct kfile* kf, const struct loader_format* fmt, const struct loader_image* img,
+               const char* initrd_path, const char* cmdline) {
+    struct loader_handoff h = {0};
+    struct kfile_plan plan = {0};
+    struct memmap_request req = {0};
+    uint64_t base;
+
+    h.mem_size = img->mem_size > kf->size ? img->mem_size : kf->size;
+    req.size = img->offset + h.mem_size;
+    req.align = img->align;
+    req.pref_addr = img->pref_base;
+    req.kernel = 1;
+    if (!fmt->handoff || memmap_place(&req, &base) != 0) {
+        kfile_close(kf);
+        return -1;
+    }
+    h.load_addr = base + img->offset;
+    if (kfile_plan_add(&plan, 0, kf->size, h.load_addr, h.mem_size) != 0 || kfile_plan_run(kf, &plan) != 0) {
+        kfile_close(kf);
+        memmap_free(base, req.size);
+        return -1;
+    }
+    kfile_close(kf);
+
+    h.entry = h.load_addr + img->entry;
+    h.cmdline = cmdline;
+    h.dtb_path = loader_dtb_path;
+    h.overlays = loader_overlays;
+    if (loader_load_initrds(h.load_addr + h.mem_size, initrd_path, &h.initrd_addr, &h.initrd_size) != 0) {
+        return -1;
+    }
+    return fmt->handoff(&h);
+}
+
+static int loader_start(struct kfile* kf, const struct loader_format* fmt, const char* kernel_path,
+                        const char* initrd_path, const char* cmdline) {
+    struct loader_image img = {0};
+    if (fmt ? fmt->probe(kf, &img) != 0 : (fmt = loader_probe(kf, &img)) == NULL) {
+        kfile_close(kf);
+        return -1;
+    }
+    if (fmt->load) {
+        kfile_close(kf);
+        return kernel_path ? fmt->load(kernel_path, initrd_path, cmdline) : -1;
+    }
+    return loader_run(kf, fmt, &img, initrd_path, cmdline);
+}
+
+// fmt NULL probes every registered format.
+int loader_load(const char* kernel_path, const char* initrd_path, const char* cmdline, const struct loader_format* fmt) {
+    if (kfile_open(&loader_file, kernel_path) != 0) {
+        return -1;
+    }
+    return loader_start(&loader_file, fmt, kernel_path, initrd_path, cmdline);
+}
+
+// For callers that already hold the image; only formats the core loads
+// itself can boot from memory.
+int loader_load_mem(const void* data, uint64_t size, const char* initrd_path, const char* cmdline, const struct loader_format* fmt) {
+    if (kfile_open_mem(&loader_file, data, size) != 0) {
+        return -1;
+    }
+    return loader_start(&loader_file, fmt, NULL, initrd_path, cmdline);
+}
+
+int loader_verify(const char* kernel_path, const struct loader_format* fmt) {
+    struct loader_image img;
+    int r;
+    if (kfile_open(&loader_file, kernel_path) != 0) {
+        return -1;
+    }
+    r = fmt ? fmt->probe(&loader_file, &img) : (loader_probe(&loader_file, &img) ? 0 : -1);
+    kfile_close(&loader_file);
+    return r;
+}
+
+int loader_boot(const char* kernel_path, const char* initrd_path, const char* cmdline) {
+    return loader_load(kernel_path, initrd_path, cmdline, NULL);
+}
+
+// Device tree and overlays (a space- or comma-separated path list) for the
+// handoffs that build one; NULL keeps the firmware's tree. The strings are
+// used at handoff time, so they must outlive the boot attempt.
+void loader_set_devicetree(const char* dtb_path, const char* overlays) {
+    loader_dtb_path = dtb_path && *dtb_path ? dtb_path : NULL;
+    loader_overlays = overlays && *overlays ? overlays : NULL;
+}
@@ -0,0 +1,80 @@
+/*
+ * BloodHorn Bootloader
+ *
+ * This file is part of BloodHorn and is licensed under the MIT License.
+ * See the root of the repository for license details.
+ */
+#ifndef BLOODHORN_LOADER_H
+#define BLOODHORN_LOADER_H
+#include <stdint.h>
+#include "compat.h"
+#include "kfile.h"
+
+// Initrds go at the top of this much memory above the kernel, which keeps
+// them inside the linear map of every architecture we load.
+#define LOADER_INITRD_WINDOW 0x40000000ULL
+
+#define LOADER_PE_MACHINE_X64 0x8664
+#define LOADER_PE_MACHINE_AA64 0xAA64
+#define LOADER_PE_MACHINE_RISCV64 0x5064
+#define LOADER_PE_MACHINE_LOONGARCH64 0x6264
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define LOADER_PE_MACHINE LOADER_PE_MACHINE_X64
+#elif defined(__aarch64__)
+#define LOADER_PE_MACHINE LOADER_PE_MACHINE_AA64
+#elif defined(__riscv)
+#define LOADER_PE_MACHINE LOADER_PE_MACHINE_RISCV64
+#elif defined(__loongarch__)
+#define LOADER_PE_MACHINE LOADER_PE_MACHINE_LOONGARCH64
+#else
+#define LOADER_PE_MACHINE LOADER_PE_MACHINE_X64
+#endif
+
+// What a probe learned from the file head for the shared planner: the
+// image wants mem_size bytes (BSS included) at base + offset, with base
+// aligned to align and pref_base tried first when non-zero. entry is
+// relative to the load address.
+struct loader_image {
+    uint64_t offset;
+    uint64_t mem_size;
+    uint64_t align;
+    uint64_t pref_base;
+    uint64_t entry;
+};
+
+// Where everything ended up, for the handoff.
+struct loader_handoff {
+    uint64_t load_addr;
+    uint64_t mem_size;
+    uint64_t entry;
+    uint64_t initrd_addr;
+    uint64_t initrd_size;
+    const char* cmdline;
+    const char* dtb_path;
+    const char* overlays;
+};
+
+// A kernel format. probe looks at the cached head of an open kfile (the
+// BloodChain probe also reads the ELF section headers) and returns 0 when
+// the file is this format. Formats with a pipeline of
+// their own (page tables, boot info built while loading) supply load and
+// get the path; plain images leave it NULL and supply handoff, and the
+// core places them, reads them in place and loads the initrds.
+struct loader_format {
+    const char* name;
+    int (*probe)(struct kfile* kf, struct loader_image* img);
+    int (*load)(const char* kernel_path, const char* initrd_path, const char* cmdline);
+    int (*handoff)(const struct loader_handoff* h);
+};
+
+const struct loader_format* loader_probe(struct kfile* kf, struct loader_image* img);
+int loader_run(struct kfile* kf, const struct loader_format* fmt, const struct loader_image* img,
+               const char* initrd_path, const char* cmdline);
+int loader_load(const char* kernel_path, const char* initrd_path, const char* cmdline, const struct loader_format* fmt);
+int loader_load_mem(const void* data, uint64_t size, const char* initrd_path, const char* cmdline, const struct loader_format* fmt);
+int loader_verify(const char* kernel_path, const struct loader_format* fmt);
+int loader_boot(const char* kernel_path, const char* initrd_path, const char* cmdline);
+void loader_set_devicetree(const char* dtb_path, const char* overlays);
+
+#endif // BLOODHORN_LOADER_H
@@ -8,173 +8,157 @@
 #include "compat.h"
 #include <string.h>
 #include "loongarch64.h"
+#include "memmap.h"
+#include "kfile.h"
+#include "loader.h"
+#include "fwinfo.h"
+#include "fdt.h"
 
-extern void* allocate_memory(uint32_t size);
-extern int load_file(const char* path, uint8_t** data, uint32_t* size);
-
-struct loongarch64_boot_params {
-    uint64_t dtb_addr;
-    uint64_t initrd_addr;
-    uint64_t initrd_size;
-    uint64_t cmdline_addr;
-    uint64_t cmdline_size;
-    uint64_t kernel_addr;
-    uint64_t kernel_size;
-    uint64_t mem_start;
-    uint64_t mem_size;
-    uint64_t acpi_rsdp;
-    uint64_t efi_systab;
+static int loongarch64_valid_header(const struct loongarch64_linux_header* header) {
+    return header && (header->mz_magic & 0xFFFF) == LOONGARCH64_MZ_MAGIC && header->pe_magic == LOONGARCH64_IMAGE_MAGIC;
+}
+
+// The header records the physical address the kernel was linked for;
+// that is tried first so non-relocatable kernels run where they expect,
+// and relocatable ones go anywhere 2 MiB-aligned in RAM otherwise.
+// kernel_asize covers BSS.
+static int loongarch64_probe(struct kfile* kf, struct loader_image* img) {
+    const struct loongarch64_linux_header* header = kfile_at(kf, 0, sizeof(struct loongarch64_linux_header));
+    if (!loongarch64_valid_header(header)) {
+        return -1;
+    }
+    uint64_t size = header->kernel_asize > kf->size ? header->kernel_asize : kf->size;
+    if (header->kernel_entry < header->load_offset || header->kernel_entry - header->load_offset >= size) {
+        return -1;
+    }
+    img->mem_size = header->kernel_asize;
+    img->align = LOONGARCH64_IMAGE_ALIGN;
+    img->pref_base = header->load_offset;
+    img->entry = header->kernel_entry - header->load_offset;
+    return 0;
+}
+
+#if defined(__loongarch64)
+// Describes the memory map the kernel will get. The buffer has to exist
+// and be installed before ExitBootServices; the final descriptors are
+// copied into it afterwards, as nothing may be allocated by then.
+struct loongarch64_boot_memmap {
+    uint64_t map_size;
+    uint64_t desc_size;
+    uint32_t desc_ver;
+    uint64_t map_key;
+    uint64_t buff_size;
+    uint8_t map[];
 };
 
-struct loongarch64_linux_header {
-    uint32_t code0;
-    uint32_t code1;
-    uint64_t text_offset;
-    uint64_t image_size;
-    uint64_t flags;
-    uint32_t version;
-    uint32_t res1;
-    uint64_t res2;
-    uint64_t res3;
-    uint64_t res4;
-    uint32_t magic;
-    uint32_t hdr_offset;
-    uint32_t hdr_size;
-    uint32_t end_offset;
-    uint32_t end_size;
-    uint64_t hdr_version;
-    uint64_t comp_version;
-    uint64_t name_offset;
-    uint64_t name_size;
-    uint64_t id_offset;
-    uint64_t id_size;
-    uint64_t hdr_string_offset;
-    uint64_t hdr_string_size;
+struct loongarch64_efi_initrd {
+    uint64_t base;
+    uint64_t size;
 };
 
-int loongarch64_load_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline) {
-    uint8_t* kernel_data = NULL;
-    uint64_t kernel_size = 0;
-    
-    if (load_file(kernel_path, &kernel_data, (uint32_t*)&kernel_size) != 0) {
+static const struct fwinfo_guid loongarch64_memmap_guid = { 0x800f683f, 0xd08b, 0x423a, { 0xa2, 0x93, 0x96, 0x5c, 0x3c, 0x6f, 0xe2, 0xb4 } };
+static const struct fwinfo_guid loongarch64_initrd_guid = { 0x5568e427, 0x68fc, 0x4f3d, { 0xac, 0x74, 0xca, 0x55, 0x52, 0x31, 0xcc, 0x68 } };
+static const struct fwinfo_guid loongarch64_fdt_guid = { 0xb1b621d5, 0xf19c, 0x41a5, { 0x83, 0x0b, 0xd9, 0x15, 0x2c, 0x69, 0xaa, 0xe0 } };
+#endif
+
+// LoongArch EFI boot ABI, as the kernel's own EFI stub enters it: a0 = 1
+// (booted from EFI), a1 = command line, a2 = EFI system table, boot
+// services exited. Everything else comes from configuration tables: the
+// memory map (LINUX_EFI_BOOT_MEMMAP), the initrd (LINUX_EFI_INITRD_MEDIA),
+// and ACPI, SMBIOS and any device tree the firmware installed already. A
+// configured device tree (with its overlays) replaces the firmware's.
+// SetVirtualAddressMap is not called, so runtime services stay 1:1.
+static int loongarch64_handoff(const struct loader_handoff* h) {
+#if defined(__loongarch64)
+    const char* cmdline = h->cmdline;
+    uint64_t cmdline_size = cmdline ? strlen(cmdline) + 1 : 1;
+    char* cmdline_buf = memmap_alloc(cmdline_size, 0x1000, 0);
+    if (!cmdline_buf) {
         return -1;
     }
-    
-    struct loongarch64_linux_header* header = (struct loongarch64_linux_header*)kernel_data;
-    
-    if (header->magic == 0x4c4f4f4e) {
-        return loongarch64_boot_linux(kernel_data, kernel_size, initrd_path, cmdline);
+    memcpy(cmdline_buf, cmdline ? cmdline : "", cmdline_size);
+
+    if (h->dtb_path || h->overlays) {
+        uint64_t dtb_addr = fdt_prepare(h->dtb_path, h->overlays, cmdline, h->initrd_addr, h->initrd_size, NULL);
+        if (!dtb_addr || fwinfo_install_table(&loongarch64_fdt_guid, (void*)(uintptr_t)dtb_addr) != 0) {
+            return -1;
+        }
     }
-    
-    return -1;
-}
 
-int loongarch64_boot_linux(uint8_t* kernel_data, uint64_t kernel_size, const char* initrd_path, const char* cmdline) {
-    struct loongarch64_linux_header* header = (struct loongarch64_linux_header*)kernel_data;
-    
-    uint64_t kernel_load_addr = 0x9000000000200000;
-    uint64_t dtb_addr = 0x9000000000300000;
-    uint64_t initrd_addr = 0;
-    uint64_t initrd_size = 0;
-    
-    if (initrd_path && strlen(initrd_path) > 0) {
-        uint8_t* initrd_data = NULL;
-        uint32_t initrd_size32 = 0;
-        if (load_file(initrd_path, &initrd_data, &initrd_size32) == 0) {
-            initrd_size = initrd_size32;
-            initrd_addr = dtb_addr + 0x100000;
-            if (initrd_data && initrd_size > 0) {
-                memcpy((void*)initrd_addr, initrd_data, initrd_size);
-            }
+    if (h->initrd_size) {
+        struct loongarch64_efi_initrd* initrd = memmap_alloc(sizeof(*initrd), 0x1000, 0);
+        if (!initrd) {
+            return -1;
+        }
+        initrd->base = h->initrd_addr;
+        initrd->size = h->initrd_size;
+        if (fwinfo_install_table(&loongarch64_initrd_guid, initrd) != 0) {
+            return -1;
         }
     }
 
-    uint64_t cmdline_addr = 0;
-    uint64_t cmdline_size = 0;
-    if (cmdline && strlen(cmdline) > 0) {
-        cmdline_addr = initrd_addr + initrd_size + 0x1000;
-        cmdline_size = strlen(cmdline) + 1;
-        // Use strncpy for buffer safety assumes cmdline_addr points to a buffer of at least cmdline_size
-        strncpy((char*)cmdline_addr, cmdline, cmdline_size - 1);
-        ((char*)cmdline_addr)[cmdline_size - 1] = '\0';
+    uint64_t map_bytes, desc_size;
+    uint32_t desc_version;
+    if (memmap_refresh() != 0 || !memmap_efi_map(&map_bytes, &desc_size, &desc_version)) {
+        return -1;
+    }
+    uint64_t buff_size = map_bytes + desc_size * LOONGARCH64_MEMMAP_SLACK;
+    struct loongarch64_boot_memmap* mm = memmap_alloc(sizeof(*mm) + buff_size, 0x1000, 0);
+    if (!mm) {
+        return -1;
+    }
+    mm->buff_size = buff_size;
+    if (fwinfo_install_table(&loongarch64_memmap_guid, mm) != 0) {
+        return -1;
     }
 
-    if (kernel_data && kernel_size > 0) {
-        memcpy((void*)kernel_load_addr, kernel_data, kernel_size);
+    if (memmap_exit_boot_services() != 0) {
+        return -1;
+    }
+    const void* map = memmap_efi_map(&map_bytes, &desc_size, &desc_version);
+    if (!map || map_bytes > buff_size) {
+        return -1;
     }
+    memcpy(mm->map, map, map_bytes);
+    mm->map_size = map_bytes;
+    mm->desc_size = desc_size;
+    mm->desc_ver = desc_version;
+    mm->map_key = memmap_key();
 
-    struct loongarch64_boot_params* params = (struct loongarch64_boot_params*)0x9000000000100000;
-    memset(params, 0, sizeof(struct loongarch64_boot_params));
-    
-    params->dtb_addr = dtb_addr;
-    params->initrd_addr = initrd_addr;
-    params->initrd_size = initrd_size;
-    params->cmdline_addr = cmdline_addr;
-    params->cmdline_size = cmdline_size;
-    params->kernel_addr = kernel_load_addr;
-    params->kernel_size = kernel_size;
-    params->mem_start = 0x9000000000000000;
-    params->mem_size = 0x800000000;
-    params->acpi_rsdp = 0;
-    params->efi_systab = 0;
-    
-    uint64_t entry_point = kernel_load_addr + header->text_offset;
-    void (*kernel_entry)(uint64_t, uint64_t, uint64_t) = (void*)entry_point;
-    kernel_entry(0, dtb_addr, (uint64_t)params);
-    
-    return 0;
+    register uint64_t a0 __asm__("$a0") = 1;
+    register uint64_t a1 __asm__("$a1") = (uintptr_t)cmdline_buf;
+    register uint64_t a2 __asm__("$a2") = fwinfo_system_table();
+    register uint64_t t0 __asm__("$t0") = h->entry;
+    register uint64_t t1 __asm__("$t1") = LOONGARCH64_DMW0_INIT;
+    register uint64_t t2 __asm__("$t2") = LOONGARCH64_DMW1_INIT;
+    __asm__ __volatile__(
+        "csrwr $t1, 0x180\n\t"
+        "csrwr $t2, 0x181\n\t"
+        "dbar 0\n\t"
+        "ibar 0\n\t"
+        "jirl $zero, $t0, 0"
+        : : "r"(a0), "r"(a1), "r"(a2), "r"(t0), "r"(t1), "r"(t2) : "memory");
+#else
+    (void)h;
+#endif
+    return -1;
 }
 
-int loongarch64_boot_uefi(uint8_t* kernel_data, uint64_t kernel_size, const char* cmdline) {
-    uint64_t kernel_load_addr = 0x9000000000200000;
-    uint64_t dtb_addr = 0x9000000000300000;
-    
-    uint64_t cmdline_addr = 0;
-    uint64_t cmdline_size = 0;
-    if (cmdline && strlen(cmdline) > 0) {
-        cmdline_addr = dtb_addr + 0x100000;
-        cmdline_size = strlen(cmdline) + 1;
-        // Use strncpy for buffer safety; assumes cmdline_addr points to a buffer of at least cmdline_size
-        strncpy((char*)cmdline_addr, cmdline, cmdline_size - 1);
-        ((char*)cmdline_addr)[cmdline_size - 1] = '\0';
-    }
+const struct loader_format loongarch64_image_format = { "LoongArch Image", loongarch64_probe, NULL, loongarch64_handoff };
 
-    if (kernel_data && kernel_size > 0) {
-        memcpy((void*)kernel_load_addr, kernel_data, kernel_size);
-    }
-    
-    struct loongarch64_boot_params* params = (struct loongarch64_boot_params*)0x9000000000100000;
-    memset(params, 0, sizeof(struct loongarch64_boot_params));
-    
-    params->dtb_addr = dtb_addr;
-    params->cmdline_addr = cmdline_addr;
-    params->cmdline_size = cmdline_size;
-    params->kernel_addr = kernel_load_addr;
-    params->kernel_size = kernel_size;
-    params->mem_start = 0x9000000000000000;
-    params->mem_size = 0x800000000;
-    params->acpi_rsdp = 0;
-    params->efi_systab = 0;
-    
-    void (*kernel_entry)(uint64_t, uint64_t, uint64_t) = (void*)kernel_load_addr;
-    kernel_entry(0, dtb_addr, (uint64_t)params);
-    
-    return 0;
+int loongarch64_load_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline) {
+    return loader_load(kernel_path, initrd_path, cmdline, &loongarch64_image_format);
+}
+
+// Buffer entry point for callers that already hold the whole image.
+int loongarch64_boot_linux(uint8_t* kernel_data, uint64_t kernel_size, const char* initrd_path, const char* cmdline) {
+    return loader_load_mem(kernel_data, kernel_size, initrd_path, cmdline, &loongarch64_image_format);
+}
+
+int loongarch64_boot_uefi(uint8_t* kernel_data, uint64_t kernel_size, const char* cmdline) {
+    return loongarch64_boot_linux(kernel_data, kernel_size, NULL, cmdline);
 }
 
 int loongarch64_verify_kernel(const char* kernel_path) {
-    uint8_t* kernel_data = NULL;
-    uint32_t kernel_size = 0;
-    
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
-        return -1;
-    }
-    
-    struct loongarch64_linux_header* header = (struct loongarch64_linux_header*)kernel_data;
-    
-    if (header->magic == 0x4c4f4f4e) {
-        return 0;
-    }
-    
-    return -1;
-} 
\ No newline at end of file
+    return loader_verify(kernel_path, &loongarch64_image_format);
+}
@@ -8,6 +8,17 @@
 #define BLOODHORN_LOONGARCH64_H
 #include <stdint.h>
 #include "compat.h"
+#include "loader.h"
+
+#define LOONGARCH64_MZ_MAGIC 0x5a4d
+#define LOONGARCH64_IMAGE_MAGIC 0x818223cd
+#define LOONGARCH64_IMAGE_ALIGN 0x200000
+// Descriptors of headroom for the final memory map over the one measured
+// before the tables were installed
+#define LOONGARCH64_MEMMAP_SLACK 32
+// Direct-map windows the kernel expects: 0x8000... uncached, 0x9000... cached
+#define LOONGARCH64_DMW0_INIT 0x8000000000000001ULL
+#define LOONGARCH64_DMW1_INIT 0x9000000000000011ULL
 
 struct loongarch64_boot_params {
     uint64_t dtb_addr;
@@ -23,32 +34,24 @@ struct loongarch64_boot_params {
     uint64_t efi_systab;
 };
 
+// Leading part of the PE image head.S emits; the kernel's physical link
+// address and entry point are recorded there for loaders that are not
+// the EFI stub.
 struct loongarch64_linux_header {
-    uint32_t code0;
-    uint32_t code1;
-    uint64_t text_offset;
-    uint64_t image_size;
-    uint64_t flags;
-    uint32_t version;
-    uint32_t res1;
+    uint32_t mz_magic;
+    uint32_t res0;
+    uint64_t kernel_entry;
+    uint64_t kernel_asize;
+    uint64_t load_offset;
+    uint64_t res1;
     uint64_t res2;
     uint64_t res3;
-    uint64_t res4;
-    uint32_t magic;
-    uint32_t hdr_offset;
-    uint32_t hdr_size;
-    uint32_t end_offset;
-    uint32_t end_size;
-    uint64_t hdr_version;
-    uint64_t comp_version;
-    uint64_t name_offset;
-    uint64_t name_size;
-    uint64_t id_offset;
-    uint64_t id_size;
-    uint64_t hdr_string_offset;
-    uint64_t hdr_string_size;
+    uint32_t pe_magic;
+    uint32_t pe_header;
 };
 
+extern const struct loader_format loongarch64_image_format;
+
 int loongarch64_load_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline);
 int loongarch64_boot_linux(uint8_t* kernel_data, uint64_t kernel_size, const char* initrd_path, const char* cmdline);
 int loongarch64_boot_uefi(uint8_t* kernel_data, uint64_t kernel_size, const char* cmdline);
@@ -0,0 +1,446 @@
+/*
+ * BloodHorn Bootloader
+ *
+ * This file is part of BloodHorn and is licensed under the MIT License.
+ * See the root of the repository for license details.
+ */
+#include <stdint.h>
+#include "compat.h"
+#include <string.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include "memmap.h"
+
+// Descriptors of headroom over what GetMemoryMap asked for: allocating the
+// buffer itself can split a free descriptor in two.
+#define MEMMAP_DESC_SLACK 16
+#define MEMMAP_EXIT_SPARE 32
+
+struct memmap_range {
+    uint64_t lo;
+    uint64_t hi;
+};
+
+static uint8_t* desc_buf;
+static UINTN desc_cap;
+static UINTN desc_size;
+static UINTN desc_bytes;
+static UINT32 desc_version;
+static UINTN map_key;
+static struct memmap_entry entries[MEMMAP_MAX_ENTRIES];
+static int entry_count;
+static int map_valid = 0;
+static int desc_fixed = 0;
+
+// Free memory as of the last snapshot, carved as we allocate so placement
+// does not re-read the firmware map each time. Firmware allocations make it
+// stale; a placement that fails on it retries once against a fresh map.
+static struct memmap_range* free_ranges;
+static UINTN free_cap;
+static UINTN free_count;
+static int free_valid = 0;
+
+static uint32_t memmap_classify(uint32_t efi_type) {
+    switch (efi_type) {
+    case EfiConventionalMemory:
+    case EfiBootServicesCode:
+    case EfiBootServicesData:
+        return MEMMAP_USABLE;
+    case EfiLoaderCode:
+    case EfiLoaderData:
+        return MEMMAP_LOADER_RECLAIMABLE;
+    case EfiACPIReclaimMemory:
+        return MEMMAP_ACPI_RECLAIMABLE;
+    case EfiACPIMemoryNVS:
+        return MEMMAP_ACPI_NVS;
+    case EfiUnusableMemory:
+        return MEMMAP_BAD;
+    case EfiPersistentMemory:
+        return MEMMAP_PERSISTENT;
+    case MEMMAP_EFI_KERNEL_TYPE:
+        return MEMMAP_KERNEL_AND_MODULES;
+    default:
+        return MEMMAP_RESERVED;
+    }
+}
+
+static EFI_MEMORY_DESCRIPTOR* memmap_desc(UINTN i) {
+    return (EFI_MEMORY_DESCRIPTOR*)(desc_buf + i * desc_size);
+}
+
+// Sizes both buffers for bytes worth of descriptors plus slack. Once
+// ExitBootServices has been tried the pool is off limits and this fails.
+static int memmap_grow(UINTN bytes) {
+    uint8_t* buf;
+    struct memmap_range* ranges;
+    if (desc_fixed) return -1;
+    if (!desc_size) desc_size = sizeof(EFI_MEMORY_DESCRIPTOR);
+    UINTN count = bytes / desc_size + MEMMAP_DESC_SLACK;
+    if (EFI_ERROR(gBS->AllocatePool(EfiLoaderData, count * desc_size, (VOID**)&buf))) return -1;
+    if (EFI_ERROR(gBS->AllocatePool(EfiLoaderData, count * sizeof(*ranges), (VOID**)&ranges))) {
+        gBS->FreePool(buf);
+        return -1;
+    }
+    if (desc_buf) {
+        gBS->FreePool(desc_buf);
+        gBS->FreePool(free_ranges);
+    }
+    desc_buf = buf;
+    desc_cap = count * desc_size;
+    free_ranges = ranges;
+    free_cap = count;
+    return 0;
+}
+
+// Reads the firmware map, growing the buffer whenever GetMemoryMap reports
+// it too small, and rebuilds the free-range cache from it. free_cap is at
+// least the descriptor count, so every free descriptor gets a slot.
+static int memmap_snapshot(void) {
+    for (int tries = 0; tries < MEMMAP_EXIT_RETRIES; ++tries) {
+        UINTN size = desc_cap;
+        EFI_STATUS status = gBS->GetMemoryMap(&size, (EFI_MEMORY_DESCRIPTOR*)desc_buf, &map_key, &desc_size, &desc_version);
+        if (!EFI_ERROR(status)) {
+            desc_bytes = size;
+            free_count = 0;
+            for (UINTN i = 0; i < desc_bytes / desc_size; ++i) {
+                EFI_MEMORY_DESCRIPTOR* d = memmap_desc(i);
+                if (d->Type != EfiConventionalMemory) continue;
+                free_ranges[free_count].lo = d->PhysicalStart;
+                free_ranges[free_count].hi = d->PhysicalStart + d->NumberOfPages * MEMMAP_PAGE_SIZE;
+                free_count++;
+            }
+            free_valid = 1;
+            return 0;
+        }
+        if (status != EFI_BUFFER_TOO_SMALL || memmap_grow(size) != 0) break;
+    }
+    map_valid = 0;
+    free_valid = 0;
+    return -1;
+}
+
+// Takes [lo, hi) out of the free-range cache. A split that finds no spare
+// slot drops the cache rather than lose track of a range.
+static void memmap_carve(uint64_t lo, uint64_t hi) {
+    for (UINTN i = 0; free_valid && i < free_count; ++i) {
+        struct memmap_range* r = &free_ranges[i];
+        if (hi <= r->lo || lo >= r->hi) continue;
+        if (lo > r->lo && hi < r->hi) {
+            if (free_count == free_cap) {
+                free_valid = 0;
+                return;
+            }
+            free_ranges[free_count].lo = hi;
+            free_ranges[free_count].hi = r->hi;
+            free_count++;
+            r->hi = lo;
+        } else if (lo > r->lo) {
+            r->hi = lo;
+        } else if (hi < r->hi) {
+            r->lo = hi;
+        } else {
+            free_ranges[i--] = free_ranges[--free_count];
+        }
+    }
+}
+
+// Snapshots the firmware map and builds the sorted, coalesced view every
+// protocol is fed from. Any allocation invalidates it, so callers that
+// build a map for the kernel do so after their last allocation. A map that
+// coalesces to more than MEMMAP_MAX_ENTRIES entries is an error: every
+// consumer would otherwise be handed one with RAM or reservations missing.
+int memmap_refresh(void) {
+    if (memmap_snapshot() != 0) return -1;
+    entry_count = 0;
+    map_valid = 0;
+    for (UINTN i = 0; i < desc_bytes / desc_size; ++i) {
+        EFI_MEMORY_DESCRIPTOR* d = memmap_desc(i);
+        struct memmap_entry e = { d->PhysicalStart, d->NumberOfPages * MEMMAP_PAGE_SIZE, memmap_classify(d->Type) };
+        int j = entry_count;
+        while (j > 0 && entries[j - 1].base > e.base) j--;
+        if (j > 0 && entries[j - 1].type == e.type && entries[j - 1].base + entries[j - 1].length == e.base) {
+            entries[j - 1].length += e.length;
+            if (j < entry_count && entries[j].type == e.type && entries[j - 1].base + entries[j - 1].length == entries[j].base) {
+                entries[j - 1].length += entries[j].length;
+                memmove(&entries[j], &entries[j + 1], (entry_count - j - 1) * sizeof(entries[0]));
+                entry_count--;
+            }
+            continue;
+        }
+        if (j < entry_count && entries[j].type == e.type && e.base + e.length == entries[j].base) {
+            entries[j].base = e.base;
+            entries[j].length += e.length;
+            continue;
+        }
+        if (entry_count == MEMMAP_MAX_ENTRIES) return -1;
+        memmove(&entries[j + 1], &entries[j], (entry_count - j) * sizeof(entries[0]));
+        entries[j] = e;
+        entry_count++;
+    }
+    map_valid = 1;
+    return 0;
+}
+
+const struct memmap_entry* memmap_get(int* count) {
+    if (!map_valid && memmap_refresh() != 0) {
+        *count = 0;
+        return 0;
+    }
+    *count = entry_count;
+    return entries;
+}
+
+uintptr_t memmap_key(void) {
+    return map_key;
+}
+
+static uint64_t align_up(uint64_t v, uint64_t a) {
+    return (v + a - 1) & ~(a - 1);
+}
+
+// Picks the lowest -- or, top_down, the highest -- aligned fit for size
+// inside [min_addr, limit] among the cached free ranges.
+static int memmap_pick(const struct memmap_request* req, uint64_t size, uint64_t align, uint64_t limit, uint64_t* out) {
+    int found = 0;
+    uint64_t best = 0;
+    for (UINTN i = 0; i < free_count; ++i) {
+        uint64_t lo = free_ranges[i].lo;
+        uint64_t hi = free_ranges[i].hi;
+        if (lo < req->min_addr) lo = req->min_addr;
+        if (hi - 1 > limit) hi = limit + 1;
+        if (lo == 0) lo = MEMMAP_PAGE_SIZE;
+        if (hi <= lo || hi - lo < size) continue;
+        uint64_t cand;
+        if (req->top_down) {
+            cand = (hi - size) & ~(align - 1);
+            if (cand < lo) continue;
+            if (!found || cand > best) best = cand;
+        } else {
+            cand = align_up(lo, align);
+            if (cand + size > hi) continue;
+            if (!found || cand < best) best = cand;
+        }
+        found = 1;
+    }
+    *out = best;
+    return found;
+}
+
+// The fit is chosen from the free-range cache, then AllocateAddress claims
+// exactly that. AllocateMaxAddress cannot express alignment, which is why
+// the choice is made here. The cache is carved on success; a miss or a
+// failed claim on a cache that predates this call is retried once on a
+// fresh snapshot.
+int memmap_place(const struct memmap_request* req, uint64_t* out_addr) {
+    uint64_t align = req->align > MEMMAP_PAGE_SIZE ? req->align : MEMMAP_PAGE_SIZE;
+    uint64_t size = align_up(req->size, MEMMAP_PAGE_SIZE);
+    uint64_t limit = req->max_addr ? req->max_addr : ~0ULL;
+    EFI_MEMORY_TYPE type = req->kernel ? (EFI_MEMORY_TYPE)MEMMAP_EFI_KERNEL_TYPE : EfiLoaderData;
+    EFI_PHYSICAL_ADDRESS addr;
+    int fresh = 0;
+    if (!size) return -1;
+    if (req->pref_addr && (req->pref_addr & (MEMMAP_PAGE_SIZE - 1)) == 0 && req->pref_addr + size - 1 <= limit) {
+        addr = req->pref_addr;
+        if (!EFI_ERROR(gBS->AllocatePages(AllocateAddress, type, EFI_SIZE_TO_PAGES(size), &addr))) {
+            memmap_carve(addr, addr + size);
+            map_valid = 0;
+            *out_addr = addr;
+            return 0;
+        }
+    }
+    if (!free_valid) {
+        if (memmap_snapshot() != 0) return -1;
+        fresh = 1;
+    }
+    for (;;) {
+        uint64_t best;
+        if (memmap_pick(req, size, align, limit, &best)) {
+            addr = best;
+            if (!EFI_ERROR(gBS->AllocatePages(AllocateAddress, type, EFI_SIZE_TO_PAGES(size), &addr))) {
+                memmap_carve(addr, addr + size);
+                map_valid = 0;
+                *out_addr = addr;
+                return 0;
+            }
+        }
+        if (fresh || memmap_snapshot() != 0) return -1;
+        fresh = 1;
+    }
+}
+
+// Claims [addr, addr + size) exactly, for images linked to run at a fixed
+// physical address.
+int memmap_claim(uint64_t addr, uint64_t size) {
+    EFI_PHYSICAL_ADDRESS base = addr & ~(MEMMAP_PAGE_SIZE - 1);
+    uint64_t len = align_up(addr + size, MEMMAP_PAGE_SIZE) - base;
+    if (!size) return -1;
+    if (EFI_ERROR(gBS->AllocatePages(AllocateAddress, (EFI_MEMORY_TYPE)MEMMAP_EFI_KERNEL_TYPE, EFI_SIZE_TO_PAGES(len), &base))) return -1;
+    memmap_carve(base, base + len);
+    map_valid = 0;
+    return 0;
+}
+
+void* memmap_alloc(uint64_t size, uint64_t align, uint64_t max_addr) {
+    struct memmap_request req = { size, align, 0, max_addr, 0, 0, 0 };
+    uint64_t addr;
+    if (memmap_place(&req, &addr) != 0) return 0;
+    return (void*)(uintptr_t)addr;
+}
+
+void memmap_free(uint64_t addr, uint64_t size) {
+    size = align_up(size, MEMMAP_PAGE_SIZE);
+    map_valid = 0;
+    if (EFI_ERROR(gBS->FreePages(addr, EFI_SIZE_TO_PAGES(size))) || !free_valid) return;
+    if (free_count == free_cap) {
+        free_valid = 0;
+        return;
+    }
+    free_ranges[free_count].lo = addr;
+    free_ranges[free_count].hi = addr + size;
+    free_count++;
+}
+
+// The key goes stale whenever the firmware allocates between GetMemoryMap
+// and ExitBootServices (timer callbacks can), in which case the call fails
+// with EFI_INVALID_PARAMETER and must be repeated with a fresh map. Nothing
+// may be allocated between those attempts, so the buffer gets
+// MEMMAP_EXIT_SPARE descriptors of headroom up front and is never grown
+// again. On success the cached map is the final one handed to the kernel.
+int memmap_exit_boot_services(void) {
+    if (memmap_snapshot() != 0) return -1;
+    if (desc_cap < desc_bytes + MEMMAP_EXIT_SPARE * desc_size &&
+        memmap_grow(desc_bytes + MEMMAP_EXIT_SPARE * desc_size) != 0) {
+        return -1;
+    }
+    desc_fixed = 1;
+    for (int tries = 0; tries < MEMMAP_EXIT_RETRIES; ++tries) {
+        if (memmap_refresh() != 0) return -1;
+        EFI_STATUS status = gBS->ExitBootServices(gImageHandle, map_key);
+        if (!EFI_ERROR(status)) return 0;
+        if (status != EFI_INVALID_PARAMETER) return -1;
+    }
+    return -1;
+}
+
+// The firmware descriptors behind the cached map, for protocols that hand
+// the kernel the EFI memory map itself rather than a converted one.
+const void* memmap_efi_map(uint64_t* bytes, uint64_t* entry_size, uint32_t* version) {
+    if (!map_valid) return NULL;
+    *bytes = desc_bytes;
+    *entry_size = desc_size;
+    *version = desc_version;
+    return desc_buf;
+}
+
+static int memmap_is_ram(uint32_t type) {
+    return type == MEMMAP_USABLE || type == MEMMAP_LOADER_RECLAIMABLE || type == MEMMAP_KERNEL_AND_MODULES;
+}
+
+// Size of the RAM run starting at start, walking across adjacent RAM
+// entries whatever their sub-type.
+static uint64_t memmap_run_from(uint64_t start) {
+    int count;
+    const struct memmap_entry* e = memmap_get(&count);
+    uint64_t end = start;
+    for (int i = 0; i < count; ++i) {
+        if (!memmap_is_ram(e[i].type)) continue;
+        if (e[i].base <= end && e[i].base + e[i].length > end) end = e[i].base + e[i].length;
+    }
+    return end - start;
+}
+
+uint32_t memmap_mem_lower_kb(void) {
+    uint64_t kb = memmap_run_from(0) / 1024;
+    return kb > 640 ? 640 : (uint32_t)kb;
+}
+
+// Multiboot/E801 semantics: contiguous RAM from 1 MiB, capped at 4 GiB.
+uint32_t memmap_mem_upper_kb(void) {
+    uint64_t bytes = memmap_run_from(0x100000);
+    if (bytes > 0xFFF00000ULL) bytes = 0xFFF00000ULL;
+    return (uint32_t)(bytes / 1024);
+}
+
+uint64_t memmap_usable_bytes(void) {
+    int count;
+    const struct memmap_entry* e = memmap_get(&count);
+    uint64_t total = 0;
+    for (int i = 0; i < count; ++i) {
+        if (memmap_is_ram(e[i].type)) total += e[i].length;
+    }
+    return total;
+}
+
+// Lowest RAM address, for platforms whose DRAM does not start at zero.
+uint64_t memmap_ram_base(void) {
+    int count;
+    const struct memmap_entry* e = memmap_get(&count);
+    for (int i = 0; i < count; ++i) {
+        if (memmap_is_ram(e[i].type)) return e[i].base;
+    }
+    return 0;
+}
+
+// E820 (and Multiboot) have no notion of loader-owned RAM: it is usable,
+// and the kernel knows where its own image and modules are.
+int memmap_to_e820(struct memmap_e820* out, int max) {
+    int count, n = 0;
+    const struct memmap_entry* e = memmap_get(&count);
+    for (int i = 0; i < count; ++i) {
+        uint32_t type = memmap_is_ram(e[i].type) ? MEMMAP_USABLE : e[i].type;
+        if (n > 0 && out[n - 1].type == type && out[n - 1].addr + out[n - 1].size == e[i].base) {
+            out[n - 1].size += e[i].length;
+            continue;
+        }
+        if (n == max) return -1;
+        out[n].addr = e[i].base;
+        out[n].size = e[i].length;
+        out[n].type = type;
+        n++;
+    }
+    return n;
+}
+
+static struct memmap_e820 mb_scratch[MEMMAP_MAX_ENTRIES];
+
+// Multiboot 1 mmap buffer: each 20-byte entry is preceded by its size.
+// Returns the buffer length in bytes.
+int memmap_to_multiboot1(uint8_t* out, int max_entries) {
+    int n = memmap_to_e820(mb_scratch, max_entries < MEMMAP_MAX_ENTRIES ? max_entries : MEMMAP_MAX_ENTRIES);
+    if (n < 0) return -1;
+    for (int i = 0; i < n; ++i) {
+        uint8_t* e = out + i * 24;
+        uint32_t size = 20;
+        memcpy(e, &size, 4);
+        memcpy(e + 4, &mb_scratch[i].addr, 8);
+        memcpy(e + 12, &mb_scratch[i].size, 8);
+        memcpy(e + 20, &mb_scratch[i].type, 4);
+    }
+    return n * 24;
+}
+
+// Multiboot 2 mmap tag entries (entry_size 24, version 0). Returns the count.
+int memmap_to_multiboot2(uint8_t* out, int max_entries) {
+    int n = memmap_to_e820(mb_scratch, max_entries < MEMMAP_MAX_ENTRIES ? max_entries : MEMMAP_MAX_ENTRIES);
+    if (n < 0) return -1;
+    for (int i = 0; i < n; ++i) {
+        uint8_t* e = out + i * 24;
+        uint32_t zero = 0;
+        memcpy(e, &mb_scratch[i].addr, 8);
+        memcpy(e + 8, &mb_scratch[i].size, 8);
+        memcpy(e + 16, &mb_scratch[i].type, 4);
+        memcpy(e + 20, &zero, 4);
+    }
+    return n;
+}
+
+uint32_t memmap_limine_type(uint32_t type) {
+    switch (type) {
+    case MEMMAP_USABLE: return 0;
+    case MEMMAP_ACPI_RECLAIMABLE: return 2;
+    case MEMMAP_ACPI_NVS: return 3;
+    case MEMMAP_BAD: return 4;
+    case MEMMAP_LOADER_RECLAIMABLE: return 5;
+    case MEMMAP_KERNEL_AND_MODULES: return 6;
+    default: return 1;
+    }
+}
@@ -0,0 +1,74 @@
+/*
+ * BloodHorn Bootloader
+ *
+ * This file is part of BloodHorn and is licensed under the MIT License.
+ * See the root of the repository for license details.
+ */
+#ifndef BLOODHORN_MEMMAP_H
+#define BLOODHORN_MEMMAP_H
+#include <stdint.h>
+#include "compat.h"
+
+#define MEMMAP_MAX_ENTRIES 256
+#define MEMMAP_PAGE_SIZE 0x1000ULL
+#define MEMMAP_MB_ENTRY_SIZE 24
+#define MEMMAP_EXIT_RETRIES 8
+
+// Entry types use the E820/Multiboot numbering so those protocols can take
+// them as-is; the last two are BloodHorn-specific and fold to usable there.
+#define MEMMAP_USABLE 1
+#define MEMMAP_RESERVED 2
+#define MEMMAP_ACPI_RECLAIMABLE 3
+#define MEMMAP_ACPI_NVS 4
+#define MEMMAP_BAD 5
+#define MEMMAP_PERSISTENT 7
+#define MEMMAP_LOADER_RECLAIMABLE 0x100
+#define MEMMAP_KERNEL_AND_MODULES 0x101
+
+// OS-loader memory type (UEFI reserves 0x80000000+ for us) used for kernel
+// and module pages, so they stay distinguishable in the firmware map.
+#define MEMMAP_EFI_KERNEL_TYPE 0x80000001U
+
+struct memmap_entry {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+};
+
+struct memmap_e820 {
+    uint64_t addr;
+    uint64_t size;
+    uint32_t type;
+} __attribute__((packed));
+
+// A placement request. max_addr is the highest address the last byte may
+// occupy (0 means no limit); pref_addr is tried first when non-zero.
+struct memmap_request {
+    uint64_t size;
+    uint64_t align;
+    uint64_t min_addr;
+    uint64_t max_addr;
+    uint64_t pref_addr;
+    int top_down;
+    int kernel;
+};
+
+int memmap_refresh(void);
+const struct memmap_entry* memmap_get(int* count);
+uintptr_t memmap_key(void);
+int memmap_place(const struct memmap_request* req, uint64_t* out_addr);
+int memmap_claim(uint64_t addr, uint64_t size);
+void* memmap_alloc(uint64_t size, uint64_t align, uint64_t max_addr);
+void memmap_free(uint64_t addr, uint64_t size);
+int memmap_exit_boot_services(void);
+const void* memmap_efi_map(uint64_t* bytes, uint64_t* entry_size, uint32_t* version);
+uint32_t memmap_mem_lower_kb(void);
+uint32_t memmap_mem_upper_kb(void);
+uint64_t memmap_usable_bytes(void);
+uint64_t memmap_ram_base(void);
+int memmap_to_e820(struct memmap_e820* out, int max);
+int memmap_to_multiboot1(uint8_t* out, int max_entries);
+int memmap_to_multiboot2(uint8_t* out, int max_entries);
+uint32_t memmap_limine_type(uint32_t type);
+
+#endif // BLOODHORN_MEMMAP_H
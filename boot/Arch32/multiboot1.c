@@ -8,162 +8,275 @@
 #include "compat.h"
 #include <string.h>
 #include "multiboot1.h"
+#include "memmap.h"
+#include "kfile.h"
+#include "elf.h"
+#include "fwinfo.h"
 
-extern void* allocate_memory(uint32_t size);
-extern int load_file(const char* path, uint8_t** data, uint32_t* size);
-
-struct multiboot_info {
-    uint32_t flags;
-    uint32_t mem_lower;
-    uint32_t mem_upper;
-    uint32_t boot_device;
-    uint32_t cmdline;
-    uint32_t mods_count;
-    uint32_t mods_addr;
-    uint32_t syms[4];
-    uint32_t mmap_length;
-    uint32_t mmap_addr;
-    uint32_t drives_length;
-    uint32_t drives_addr;
-    uint32_t config_table;
-    uint32_t boot_loader_name;
-    uint32_t apm_table;
-    uint32_t vbe_control_info;
-    uint32_t vbe_mode_info;
-    uint16_t vbe_mode;
-    uint16_t vbe_interface_seg;
-    uint16_t vbe_interface_off;
-    uint16_t vbe_interface_len;
-};
-
-struct multiboot_mmap_entry {
-    uint32_t size;
-    uint64_t addr;
-    uint64_t len;
-    uint32_t type;
-};
-
-struct multiboot_module {
-    uint32_t mod_start;
-    uint32_t mod_end;
-    uint32_t string;
-    uint32_t reserved;
-};
+#define MB1_MAX_MODULES 16
+#define MB1_MODULE_CMDLINE 64
+#define MULTIBOOT1_LOADER_NAME "BloodHorn"
 
-int multiboot1_load_kernel(const char* kernel_path, const char* cmdline) {
-    uint8_t* kernel_data = NULL;
-    uint32_t kernel_size = 0;
-    
-    // Load kernel file
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
-        return -1;
-    }
-    
-    // Parse Multiboot 1 header
-    uint32_t* header = (uint32_t*)kernel_data;
-    
-    // Verify Multiboot 1 magic
-    if (header[0] != MULTIBOOT_HEADER_MAGIC) {
+// Handoff page: stub code from offset 0, flat GDT and its descriptor
+// from 0x800.
+#define MB1_ENTER_GDT 0x800
+#define MB1_ENTER_GDTR 0x818
+#define MB1_CR0_PG 0x80000000
+#define MB1_CR4_PAE 0x20
+#define MB1_CR4_PCIDE 0x20000
+#define MB1_MSR_EFER 0xC0000080
+#define MB1_EFER_LME 0x100
+
+#define MB1_STR_(x) #x
+#define MB1_STR(x) MB1_STR_(x)
+
+// Modules are placed as they are loaded; the table and their strings live in
+// one page below 4 GiB that the info structure later points at.
+static struct multiboot_module* module_table = NULL;
+static int module_count = 0;
+
+static struct kfile mb1_file;
+static uint64_t mb1_enter_page;
+
+#if defined(__x86_64__)
+// Runs from a page below 4 GiB, identity-mapped by the firmware. It far
+// returns into the flat 32-bit code segment, which leaves long mode for
+// compatibility mode; clearing CR0.PG then drops to legacy protected mode,
+// after which EFER.LME and CR4.PAE go too. Entered with the page in rdi,
+// the magic in eax, the info pointer in ebx and the kernel entry in esi.
+__asm__(
+    ".pushsection .text\n"
+    ".globl mb1_enter_start\n.hidden mb1_enter_start\n"
+    ".globl mb1_enter_end\n.hidden mb1_enter_end\n"
+    ".code64\n"
+    "mb1_enter_start:\n"
+    "    cli\n"
+    "    lgdt " MB1_STR(MB1_ENTER_GDTR) "(%rdi)\n"
+    "    movq %cr4, %rcx\n"
+    "    andq $~" MB1_STR(MB1_CR4_PCIDE) ", %rcx\n"
+    "    movq %rcx, %cr4\n"
+    "    leaq mb1_enter_pm(%rip), %rcx\n"
+    "    pushq $0x08\n"
+    "    pushq %rcx\n"
+    "    lretq\n"
+    ".code32\n"
+    "mb1_enter_pm:\n"
+    "    movl %eax, %ebp\n"
+    "    movl %cr0, %eax\n"
+    "    andl $~" MB1_STR(MB1_CR0_PG) ", %eax\n"
+    "    movl %eax, %cr0\n"
+    "    movl $" MB1_STR(MB1_MSR_EFER) ", %ecx\n"
+    "    rdmsr\n"
+    "    andl $~" MB1_STR(MB1_EFER_LME) ", %eax\n"
+    "    wrmsr\n"
+    "    movl %cr4, %eax\n"
+    "    andl $~" MB1_STR(MB1_CR4_PAE) ", %eax\n"
+    "    movl %eax, %cr4\n"
+    "    movw $0x10, %ax\n"
+    "    movw %ax, %ds\n"
+    "    movw %ax, %es\n"
+    "    movw %ax, %fs\n"
+    "    movw %ax, %gs\n"
+    "    movw %ax, %ss\n"
+    "    movl %ebp, %eax\n"
+    "    jmp *%esi\n"
+    "mb1_enter_end:\n"
+    ".code64\n"
+    ".popsection\n");
+
+extern const uint8_t mb1_enter_start[];
+extern const uint8_t mb1_enter_end[];
+#endif
+
+// Sets up the handoff page while boot services can still allocate it.
+// Shared with Multiboot 2, whose i386 entry wants the same machine state.
+int multiboot1_enter_prepare(void) {
+#if defined(__x86_64__)
+    uint64_t gdt[3] = { 0, 0x00cf9a000000ffffULL, 0x00cf92000000ffffULL };
+    uint16_t limit = sizeof(gdt) - 1;
+    uint8_t* page = memmap_alloc(0x1000, 0x1000, 0xFFFFFFFF);
+    if (!page) {
         return -1;
     }
-    
-    // Find header address
-    uint32_t header_addr = 0;
-    uint32_t load_addr = 0;
-    uint32_t load_end_addr = 0;
-    uint32_t bss_end_addr = 0;
-    uint32_t entry_addr = 0;
-    
-    // Parse header fields
-    for (uint32_t i = 1; i < 8; i++) {
-        if (header[i] == MULTIBOOT_HEADER_TAG_LOAD) {
-            load_addr = header[i + 1];
-            load_end_addr = header[i + 2];
-            bss_end_addr = header[i + 3];
-        } else if (header[i] == MULTIBOOT_HEADER_TAG_ENTRY) {
-            entry_addr = header[i + 1];
+    uint64_t base = (uintptr_t)page + MB1_ENTER_GDT;
+    memcpy(page, mb1_enter_start, mb1_enter_end - mb1_enter_start);
+    memcpy(page + MB1_ENTER_GDT, gdt, sizeof(gdt));
+    memcpy(page + MB1_ENTER_GDTR, &limit, 2);
+    memcpy(page + MB1_ENTER_GDTR + 2, &base, 8);
+    mb1_enter_page = (uintptr_t)page;
+    return 0;
+#elif defined(__i386__)
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+// Enters a 32-bit kernel the way the Multiboot specifications require:
+// protected mode, paging off, flat segments, magic in EAX and the info
+// structure in EBX. Only returns if there is nothing to enter with.
+void multiboot1_enter(uint32_t entry, uint32_t magic, uint32_t info) {
+#if defined(__x86_64__)
+    if (!mb1_enter_page) return;
+    __asm__ __volatile__("jmp *%%rdi" : : "D"(mb1_enter_page), "a"(magic), "b"(info), "S"(entry) : "memory");
+#elif defined(__i386__)
+    __asm__ __volatile__(
+        "cli\n"
+        "movl %%cr0, %%ecx\n"
+        "andl $~" MB1_STR(MB1_CR0_PG) ", %%ecx\n"
+        "movl %%ecx, %%cr0\n"
+        "jmp *%%esi\n" : : "a"(magic), "b"(info), "S"(entry) : "ecx", "memory");
+#else
+    (void)entry; (void)magic; (void)info;
+#endif
+}
+
+// The header may sit anywhere in the first 8 KiB, 32-bit aligned, and is
+// identified by magic plus a zero checksum over magic, flags, checksum.
+const struct multiboot_header* multiboot1_find_header(const uint8_t* image, uint32_t len, uint32_t* offset) {
+    uint32_t limit = len < MULTIBOOT_SEARCH ? len : MULTIBOOT_SEARCH;
+    for (uint32_t off = 0; off + 12 <= limit; off += 4) {
+        const struct multiboot_header* h = (const struct multiboot_header*)(image + off);
+        if (h->magic == MULTIBOOT_HEADER_MAGIC && h->magic + h->flags + h->checksum == 0) {
+            *offset = off;
+            return h;
         }
     }
-    
-    // Default values if not specified
-    if (load_addr == 0) load_addr = 0x100000; // 1MB
-    if (entry_addr == 0) entry_addr = load_addr;
-    
-    // Load kernel to specified address
-    uint32_t load_size = load_end_addr - load_addr;
-    if (load_size > kernel_size) load_size = kernel_size;
-    
-    memcpy((void*)load_addr, kernel_data, load_size);
-    
-    // Zero out BSS
-    if (bss_end_addr > load_end_addr) {
-        memset((void*)load_end_addr, 0, bss_end_addr - load_end_addr);
+    return NULL;
+}
+
+// The a.out kludge names one flat range of the file and where it goes;
+// without it the image must be ELF and is placed by its program headers.
+// Either way only the declared bytes are read, straight into place.
+static int multiboot1_load_image(struct kfile* kf, const struct multiboot_header* h, uint32_t header_offset, uint32_t* entry) {
+    if (!(h->flags & MULTIBOOT_AOUT_KLUDGE)) {
+        struct elf_image img;
+        if (elf_load_phys(kf, NULL, &img) != 0 || img.phys_base + img.size > 0x100000000ULL) return -1;
+        *entry = (uint32_t)img.entry;
+        return 0;
     }
-    
-    // Setup Multiboot 1 info structure
-    struct multiboot_info* mb_info = (struct multiboot_info*)0x90000;
-    memset(mb_info, 0, sizeof(struct multiboot_info));
-    
-    // Set flags
-    mb_info->flags = MULTIBOOT_INFO_MEMORY | MULTIBOOT_INFO_CMDLINE | MULTIBOOT_INFO_BOOTDEV;
-    
-    // Set memory info
-    mb_info->mem_lower = 640; // 640KB
-    mb_info->mem_upper = 0x7FE00; // Extended memory in KB
-    
-    // Set command line
-    if (cmdline && strlen(cmdline) > 0) {
-        char* cmdline_addr = (char*)0x90020;
-        strcpy(cmdline_addr, cmdline);
-        mb_info->cmdline = (uint32_t)cmdline_addr;
+    if (header_offset + 32 > kf->head_len || h->header_addr < h->load_addr || h->header_addr - h->load_addr > header_offset) {
+        return -1;
     }
-    
-    // Set boot device
-    mb_info->boot_device = 0x8000; // First hard disk, first partition
-    
-    // Setup memory map
-    struct multiboot_mmap_entry* mmap = (struct multiboot_mmap_entry*)0x90100;
-    mmap[0].size = sizeof(struct multiboot_mmap_entry) - 4;
-    mmap[0].addr = 0;
-    mmap[0].len = 0x100000; // 1MB
-    mmap[0].type = 1; // Available memory
-    
-    mmap[1].size = sizeof(struct multiboot_mmap_entry) - 4;
-    mmap[1].addr = 0x100000;
-    mmap[1].len = 0x7FF00000; // ~2GB
-    mmap[1].type = 1; // Available memory
-    
-    mb_info->mmap_length = 2 * sizeof(struct multiboot_mmap_entry);
-    mb_info->mmap_addr = (uint32_t)mmap;
-    
-    // Jump to kernel
-    void (*kernel_entry)(uint32_t, struct multiboot_info*) = (void*)entry_addr;
-    kernel_entry(MULTIBOOT_BOOTLOADER_MAGIC, mb_info);
-    
+    uint32_t file_offset = header_offset - (h->header_addr - h->load_addr);
+    uint64_t load_size = kf->size - file_offset;
+    if (h->load_end_addr) {
+        if (h->load_end_addr < h->load_addr) return -1;
+        if (h->load_end_addr - h->load_addr < load_size) load_size = h->load_end_addr - h->load_addr;
+    }
+    uint64_t mem_size = h->bss_end_addr > h->load_addr + load_size ? h->bss_end_addr - h->load_addr : load_size;
+    struct kfile_plan plan = { 0 };
+    if (memmap_claim(h->load_addr, mem_size) != 0 ||
+        kfile_plan_add(&plan, file_offset, load_size, h->load_addr, mem_size) != 0 ||
+        kfile_plan_run(kf, &plan) != 0) {
+        return -1;
+    }
+    *entry = h->entry_addr;
     return 0;
 }
 
-int multiboot1_verify_kernel(const char* kernel_path) {
-    uint8_t* kernel_data = NULL;
-    uint32_t kernel_size = 0;
-    
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
+// The video fields only state a preference; the mode GOP is already in is
+// reported, and nothing when it has no linear framebuffer.
+static void multiboot1_put_framebuffer(struct multiboot_info* info) {
+    struct fwinfo_fb fb;
+    if (fwinfo_framebuffer(&fb) != 0) return;
+    info->flags |= MULTIBOOT_INFO_FRAMEBUFFER_INFO;
+    info->framebuffer_addr = fb.base;
+    info->framebuffer_pitch = fb.pitch;
+    info->framebuffer_width = fb.width;
+    info->framebuffer_height = fb.height;
+    info->framebuffer_bpp = fb.bpp;
+    info->framebuffer_type = MULTIBOOT_FRAMEBUFFER_TYPE_RGB;
+    info->framebuffer_red_field_position = fb.red_shift;
+    info->framebuffer_red_mask_size = fb.red_size;
+    info->framebuffer_green_field_position = fb.green_shift;
+    info->framebuffer_green_mask_size = fb.green_size;
+    info->framebuffer_blue_field_position = fb.blue_shift;
+    info->framebuffer_blue_mask_size = fb.blue_size;
+}
+
+// Info, memory map, command line and loader name share one allocation
+// below 4 GiB. Memory figures and the map are taken after
+// ExitBootServices so they describe what the kernel inherits.
+static struct multiboot_info* multiboot1_build_info(const char* cmdline) {
+    uint32_t cmdline_len = cmdline ? strlen(cmdline) : 0;
+    uint32_t mmap_max = MEMMAP_MAX_ENTRIES * MEMMAP_MB_ENTRY_SIZE;
+    uint32_t size = sizeof(struct multiboot_info) + mmap_max + cmdline_len + 1 + sizeof(MULTIBOOT1_LOADER_NAME);
+    uint8_t* page = memmap_alloc(size, 0x1000, 0xFFFFFFFF);
+    if (!page) {
+        return NULL;
+    }
+    memset(page, 0, size);
+    struct multiboot_info* info = (struct multiboot_info*)page;
+    uint8_t* mmap = page + sizeof(struct multiboot_info);
+    char* strings = (char*)(mmap + mmap_max);
+
+    info->flags = MULTIBOOT_INFO_CMDLINE | MULTIBOOT_INFO_BOOT_LOADER_NAME;
+    if (cmdline_len) memcpy(strings, cmdline, cmdline_len);
+    info->cmdline = (uint32_t)(uintptr_t)strings;
+    memcpy(strings + cmdline_len + 1, MULTIBOOT1_LOADER_NAME, sizeof(MULTIBOOT1_LOADER_NAME));
+    info->boot_loader_name = (uint32_t)(uintptr_t)(strings + cmdline_len + 1);
+    if (module_count > 0) {
+        info->flags |= MULTIBOOT_INFO_MODS;
+        info->mods_count = module_count;
+        info->mods_addr = (uint32_t)(uintptr_t)module_table;
+    }
+    multiboot1_put_framebuffer(info);
+
+    if (memmap_exit_boot_services() != 0) {
+        return NULL;
+    }
+    info->flags |= MULTIBOOT_INFO_MEMORY;
+    info->mem_lower = memmap_mem_lower_kb();
+    info->mem_upper = memmap_mem_upper_kb();
+    int mmap_len = memmap_to_multiboot1(mmap, MEMMAP_MAX_ENTRIES);
+    if (mmap_len > 0) {
+        info->flags |= MULTIBOOT_INFO_MEM_MAP;
+        info->mmap_length = mmap_len;
+        info->mmap_addr = (uint32_t)(uintptr_t)mmap;
+    }
+    return info;
+}
+
+static int multiboot1_boot(struct kfile* kf, const char* cmdline) {
+    uint32_t header_offset, entry;
+    const struct multiboot_header* h = multiboot1_find_header(kf->head, kf->head_len, &header_offset);
+    if (!h || (h->flags & MULTIBOOT_REQUIRED_MASK & ~(MULTIBOOT_PAGE_ALIGN | MULTIBOOT_MEMORY_INFO | MULTIBOOT_VIDEO_MODE)) ||
+        kf->size > 0xFFFFFFFF || multiboot1_load_image(kf, h, header_offset, &entry) != 0) {
+        kfile_close(kf);
         return -1;
     }
-    
-    uint32_t* header = (uint32_t*)kernel_data;
-    
-    // Check Multiboot 1 magic
-    if (header[0] != MULTIBOOT_HEADER_MAGIC) {
+    kfile_close(kf);
+
+    if (multiboot1_enter_prepare() != 0) {
+        return -1;
+    }
+    struct multiboot_info* info = multiboot1_build_info(cmdline);
+    if (!info) {
         return -1;
     }
+    multiboot1_enter(entry, MULTIBOOT_BOOTLOADER_MAGIC, (uint32_t)(uintptr_t)info);
+    return -1;
+}
+
+int multiboot1_load_kernel(const char* kernel_path, const char* cmdline) {
+    if (kfile_open(&mb1_file, kernel_path) != 0) {
+        return -1;
+    }
+    return multiboot1_boot(&mb1_file, cmdline);
+}
+
+int multiboot1_verify_kernel(const char* kernel_path) {
+    struct kfile* kf = &mb1_file;
+    uint32_t header_offset;
     
-    // Check header checksum
-    uint32_t checksum = 0;
-    for (int i = 0; i < 8; i++) {
-        checksum += header[i];
+    if (kfile_open(kf, kernel_path) != 0) {
+        return -1;
     }
-    if (checksum != 0) {
+    kfile_close(kf);
+    
+    // Magic and checksum are both checked by the header search
+    if (!multiboot1_find_header(kf->head, kf->head_len, &header_offset)) {
         return -1;
     }
     
@@ -171,29 +284,58 @@ int multiboot1_verify_kernel(const char* kernel_path) {
 }
 
 int multiboot1_load_module(const char* module_path, const char* cmdline) {
-    uint8_t* module_data = NULL;
-    uint32_t module_size = 0;
+    struct kfile* kf = &mb1_file;
     
-    if (load_file(module_path, &module_data, &module_size) != 0) {
+    if (module_count >= MB1_MAX_MODULES) {
         return -1;
     }
+    if (!module_table) {
+        module_table = memmap_alloc(MB1_MAX_MODULES * (sizeof(struct multiboot_module) + MB1_MODULE_CMDLINE), 0x1000, 0xFFFFFFFF);
+        if (!module_table) {
+            return -1;
+        }
+    }
     
-    // Load module to high memory
-    uint32_t module_addr = 0x200000; // 2MB
-    memcpy((void*)module_addr, module_data, module_size);
+    if (kfile_open(kf, module_path) != 0) {
+        return -1;
+    }
+    if (kf->size == 0 || kf->size > 0xFFFFFFFF) {
+        kfile_close(kf);
+        return -1;
+    }
+    uint32_t module_size = (uint32_t)kf->size;
+    
+    // Modules go as high as possible below 4 GiB, away from the kernel image,
+    // and are read from disk directly into place
+    struct memmap_request req = {0};
+    req.size = module_size;
+    req.align = 0x1000;
+    req.min_addr = 0x100000;
+    req.max_addr = 0xFFFFFFFF;
+    req.top_down = 1;
+    req.kernel = 1;
+    uint64_t module_addr;
+    if (memmap_place(&req, &module_addr) != 0 ||
+        kfile_read(kf, 0, (void*)(uintptr_t)module_addr, module_size) != 0) {
+        kfile_close(kf);
+        return -1;
+    }
+    kfile_close(kf);
     
     // Add to module list
-    struct multiboot_module* modules = (struct multiboot_module*)0x90200;
-    static int module_count = 0;
-    
-    modules[module_count].mod_start = module_addr;
-    modules[module_count].mod_end = module_addr + module_size;
-    modules[module_count].string = 0x90300 + module_count * 64;
+    struct multiboot_module* mod = &module_table[module_count];
+    char* strings = (char*)&module_table[MB1_MAX_MODULES];
+    mod->mod_start = (uint32_t)module_addr;
+    mod->mod_end = (uint32_t)(module_addr + module_size);
+    mod->string = (uint32_t)(uintptr_t)(strings + module_count * MB1_MODULE_CMDLINE);
+    mod->reserved = 0;
     
     // Copy module command line
+    char* cmdline_addr = (char*)(uintptr_t)mod->string;
+    cmdline_addr[0] = 0;
     if (cmdline && strlen(cmdline) > 0) {
-        char* cmdline_addr = (char*)modules[module_count].string;
-        strcpy(cmdline_addr, cmdline);
+        strncpy(cmdline_addr, cmdline, MB1_MODULE_CMDLINE - 1);
+        cmdline_addr[MB1_MODULE_CMDLINE - 1] = 0;
     }
     
     module_count++;
@@ -201,24 +343,11 @@ int multiboot1_load_module(const char* module_path, const char* cmdline) {
     return 0;
 } 
 
+// Images already in memory go through the same header-driven loader, so
+// only the declared range is copied out of the staging buffer.
 int boot_multiboot1_kernel(uint8_t* kernel_data, uint32_t kernel_size, const char* cmdline) {
-    struct multiboot_info* info = (struct multiboot_info*)0x1000;
-    memset(info, 0, sizeof(struct multiboot_info));
-    
-    info->flags = MULTIBOOT_INFO_MEMORY | MULTIBOOT_INFO_CMDLINE;
-    info->mem_lower = 640;
-    info->mem_upper = 0x7FE00;
-    
-    if (cmdline && strlen(cmdline) > 0) {
-        strcpy((char*)0x2000, cmdline);
-        info->cmdline = 0x2000;
+    if (kfile_open_mem(&mb1_file, kernel_data, kernel_size) != 0) {
+        return -1;
     }
-    
-    uint32_t kernel_entry = 0x100000;
-    memcpy((void*)kernel_entry, kernel_data, kernel_size);
-    
-    void (*entry_point)(uint32_t, uint32_t) = (void*)kernel_entry;
-    entry_point(MULTIBOOT_BOOTLOADER_MAGIC, (uint32_t)info);
-    
-    return 0;
-} 
\ No newline at end of file
+    return multiboot1_boot(&mb1_file, cmdline);
+}
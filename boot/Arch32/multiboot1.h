@@ -11,17 +11,19 @@
 
 #define MULTIBOOT_HEADER_MAGIC 0x1BADB002
 #define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002
+#define MULTIBOOT_SEARCH 8192
+#define MULTIBOOT_AOUT_KLUDGE 0x00010000
 
-#define MULTIBOOT_HEADER_TAG_END 0
-#define MULTIBOOT_HEADER_TAG_LOAD 1
-#define MULTIBOOT_HEADER_TAG_ENTRY 3
-#define MULTIBOOT_HEADER_TAG_CONSOLE_FLAGS 4
-#define MULTIBOOT_HEADER_TAG_FRAMEBUFFER 5
-#define MULTIBOOT_HEADER_TAG_MODULE_ALIGN 6
-#define MULTIBOOT_HEADER_TAG_EFI_BS 7
-#define MULTIBOOT_HEADER_TAG_ENTRY_ADDRESS_EFI_32 8
-#define MULTIBOOT_HEADER_TAG_ENTRY_ADDRESS_EFI_64 9
-#define MULTIBOOT_HEADER_TAG_RELOCATABLE 10
+// Header flags. A loader must refuse images with a bit in 0-15 it does
+// not understand; bits 16-31 are optional features.
+#define MULTIBOOT_PAGE_ALIGN 0x00000001
+#define MULTIBOOT_MEMORY_INFO 0x00000002
+#define MULTIBOOT_VIDEO_MODE 0x00000004
+#define MULTIBOOT_REQUIRED_MASK 0x0000FFFF
+
+#define MULTIBOOT_FRAMEBUFFER_TYPE_INDEXED 0
+#define MULTIBOOT_FRAMEBUFFER_TYPE_RGB 1
+#define MULTIBOOT_FRAMEBUFFER_TYPE_EGA_TEXT 2
 
 #define MULTIBOOT_INFO_MEMORY 0x00000001
 #define MULTIBOOT_INFO_BOOTDEV 0x00000002
@@ -37,6 +39,24 @@
 #define MULTIBOOT_INFO_VBE_INFO 0x00000800
 #define MULTIBOOT_INFO_FRAMEBUFFER_INFO 0x00001000
 
+// Fields past checksum are only meaningful when the matching flag is set:
+// the address fields with MULTIBOOT_AOUT_KLUDGE, the video fields with
+// MULTIBOOT_VIDEO_MODE.
+struct multiboot_header {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t checksum;
+    uint32_t header_addr;
+    uint32_t load_addr;
+    uint32_t load_end_addr;
+    uint32_t bss_end_addr;
+    uint32_t entry_addr;
+    uint32_t mode_type;
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth;
+};
+
 struct multiboot_info {
     uint32_t flags;
     uint32_t mem_lower;
@@ -59,6 +79,26 @@ struct multiboot_info {
     uint16_t vbe_interface_seg;
     uint16_t vbe_interface_off;
     uint16_t vbe_interface_len;
+    uint64_t framebuffer_addr;
+    uint32_t framebuffer_pitch;
+    uint32_t framebuffer_width;
+    uint32_t framebuffer_height;
+    uint8_t framebuffer_bpp;
+    uint8_t framebuffer_type;
+    union {
+        struct {
+            uint32_t framebuffer_palette_addr;
+            uint16_t framebuffer_palette_num_colors;
+        };
+        struct {
+            uint8_t framebuffer_red_field_position;
+            uint8_t framebuffer_red_mask_size;
+            uint8_t framebuffer_green_field_position;
+            uint8_t framebuffer_green_mask_size;
+            uint8_t framebuffer_blue_field_position;
+            uint8_t framebuffer_blue_mask_size;
+        };
+    };
 };
 
 struct multiboot_mmap_entry {
@@ -89,9 +129,12 @@ struct multiboot_elf_section_header_table {
     uint32_t shndx;
 };
 
+const struct multiboot_header* multiboot1_find_header(const uint8_t* image, uint32_t len, uint32_t* offset);
 int multiboot1_load_kernel(const char* kernel_path, const char* cmdline);
 int multiboot1_verify_kernel(const char* kernel_path);
 int multiboot1_load_module(const char* module_path, const char* cmdline);
 int boot_multiboot1_kernel(uint8_t* kernel_data, uint32_t kernel_size, const char* cmdline);
+int multiboot1_enter_prepare(void);
+void multiboot1_enter(uint32_t entry, uint32_t magic, uint32_t info);
 
 #endif // BLOODHORN_MULTIBOOT1_H 
\ No newline at end of file
@@ -8,461 +8,478 @@
 #include "compat.h"
 #include <string.h>
 #include "multiboot2.h"
+#include "multiboot1.h"
+#include "memmap.h"
+#include "kfile.h"
+#include "fwinfo.h"
+#include "elf.h"
 
-extern void* allocate_memory(uint32_t size);
-extern int load_file(const char* path, uint8_t** data, uint32_t* size);
+#define MULTIBOOT2_LOADER_NAME "BloodHorn"
+// Descriptors the firmware map may gain between sizing and the final
+// GetMemoryMap (our own allocation splits at least one entry)
+#define MULTIBOOT2_EFI_MAP_SLACK 8
+// Common framebuffer fields plus the six RGB position/size bytes
+#define MULTIBOOT2_FB_TAG_SIZE 38
 
-struct multiboot2_info {
-    uint32_t total_size;
-    uint32_t reserved;
-    uint8_t tags[];
+struct multiboot2_module_slot {
+    uint32_t start;
+    uint32_t end;
+    char cmdline[MULTIBOOT2_MODULE_CMDLINE];
 };
 
-struct multiboot2_tag {
-    uint32_t type;
-    uint32_t size;
-};
-
-struct multiboot2_tag_string {
-    uint32_t type;
-    uint32_t size;
-    char string[];
-};
+static struct multiboot2_module_slot multiboot2_modules[MULTIBOOT2_MAX_MODULES];
+static int multiboot2_module_count = 0;
+static struct kfile multiboot2_file;
+static struct kfile multiboot2_module_file;
 
-struct multiboot2_tag_basic_meminfo {
-    uint32_t type;
-    uint32_t size;
-    uint32_t mem_lower;
-    uint32_t mem_upper;
+// Firmware state is looked up once and both sizes and fills the info
+// block, so it is allocated exactly once.
+struct multiboot2_firmware {
+    struct fwinfo_fb fb;
+    int have_fb;
+    const uint8_t* rsdp_old;
+    const uint8_t* rsdp_new;
+    uint32_t rsdp_new_len;
+    const uint8_t* smbios[2];
+    uint32_t smbios_len[2];
+    uint64_t efi_map_max;
 };
 
-struct multiboot2_tag_bootdev {
-    uint32_t type;
-    uint32_t size;
-    uint32_t biosdev;
-    uint32_t partition;
-    uint32_t subpartition;
-};
+static uint32_t multiboot2_pad(uint32_t size) {
+    return (size + 7) & ~7U;
+}
 
-struct multiboot2_tag_mmap {
-    uint32_t type;
-    uint32_t size;
-    uint32_t entry_size;
-    uint32_t entry_version;
-    struct multiboot2_mmap_entry entries[];
-};
+static void* multiboot2_put(uint8_t* info, uint32_t* used, uint32_t type, uint32_t size) {
+    struct multiboot2_tag* tag = (struct multiboot2_tag*)(info + *used);
+    tag->type = type;
+    tag->size = size;
+    *used += multiboot2_pad(size);
+    return tag;
+}
 
-struct multiboot2_mmap_entry {
-    uint64_t addr;
-    uint64_t len;
-    uint32_t type;
-    uint32_t zero;
-};
+// The old ACPI tag takes the first 20 bytes of the 2.0 RSDP when the
+// firmware publishes no separate 1.0 one; that prefix is a valid v1 RSDP.
+static void multiboot2_probe(struct multiboot2_firmware* fw) {
+    uint64_t entry32, entry64, bytes, desc_size;
+    uint32_t version;
+    memset(fw, 0, sizeof(*fw));
+    fw->have_fb = fwinfo_framebuffer(&fw->fb) == 0;
+    fw->rsdp_new = (const uint8_t*)(uintptr_t)fwinfo_acpi_rsdp(1);
+    fw->rsdp_old = (const uint8_t*)(uintptr_t)fwinfo_acpi_rsdp(0);
+    if (fw->rsdp_new) {
+        memcpy(&fw->rsdp_new_len, fw->rsdp_new + 20, 4);
+        if (fw->rsdp_new_len < 36) fw->rsdp_new_len = 36;
+        if (!fw->rsdp_old) fw->rsdp_old = fw->rsdp_new;
+    }
+    if (fwinfo_smbios(&entry32, &entry64) == 0) {
+        fw->smbios[0] = (const uint8_t*)(uintptr_t)entry32;
+        fw->smbios[1] = (const uint8_t*)(uintptr_t)entry64;
+        if (fw->smbios[0]) fw->smbios_len[0] = fw->smbios[0][5];
+        if (fw->smbios[1]) fw->smbios_len[1] = fw->smbios[1][6];
+    }
+    if (memmap_refresh() == 0 && memmap_efi_map(&bytes, &desc_size, &version)) {
+        fw->efi_map_max = bytes + MULTIBOOT2_EFI_MAP_SLACK * desc_size;
+    }
+}
 
-struct multiboot2_tag_vbe {
-    uint32_t type;
-    uint32_t size;
-    uint16_t vbe_mode;
-    uint16_t vbe_interface_seg;
-    uint16_t vbe_interface_off;
-    uint16_t vbe_interface_len;
-    struct multiboot2_vbe_info_block vbe_control_info;
-    struct multiboot2_vbe_mode_info_block vbe_mode_info;
-};
+static uint32_t multiboot2_info_size(const struct multiboot2_firmware* fw, uint32_t cmdline_len) {
+    uint32_t size = sizeof(struct multiboot2_info) + 2 * sizeof(struct multiboot2_tag);
+    size += multiboot2_pad(sizeof(struct multiboot2_tag_string) + cmdline_len + 1);
+    size += multiboot2_pad(sizeof(struct multiboot2_tag_string) + sizeof(MULTIBOOT2_LOADER_NAME));
+    size += multiboot2_pad(sizeof(struct multiboot2_tag_basic_meminfo));
+    size += multiboot2_pad(sizeof(struct multiboot2_tag_load_base_addr));
+    size += multiboot2_pad(sizeof(struct multiboot2_tag_efi64));
+    size += multiboot2_pad(sizeof(struct multiboot2_tag_efi64_ih));
+    for (int i = 0; i < multiboot2_module_count; ++i) {
+        size += multiboot2_pad(sizeof(struct multiboot2_tag_module) + strlen(multiboot2_modules[i].cmdline) + 1);
+    }
+    if (fw->have_fb) size += multiboot2_pad(MULTIBOOT2_FB_TAG_SIZE);
+    if (fw->rsdp_old) size += multiboot2_pad(sizeof(struct multiboot2_tag_old_acpi) + 20);
+    if (fw->rsdp_new) size += multiboot2_pad(sizeof(struct multiboot2_tag_new_acpi) + fw->rsdp_new_len);
+    for (int i = 0; i < 2; ++i) {
+        if (fw->smbios[i]) size += multiboot2_pad(sizeof(struct multiboot2_tag_smbios) + fw->smbios_len[i]);
+    }
+    size += multiboot2_pad(sizeof(struct multiboot2_tag_mmap) + MEMMAP_MAX_ENTRIES * MEMMAP_MB_ENTRY_SIZE);
+    size += multiboot2_pad(sizeof(struct multiboot2_tag_efi_mmap) + (uint32_t)fw->efi_map_max);
+    return size;
+}
 
-struct multiboot2_vbe_info_block {
-    uint8_t vbe_signature[4];
-    uint16_t vbe_version;
-    uint32_t oem_string_ptr;
-    uint32_t capabilities;
-    uint32_t video_mode_ptr;
-    uint16_t total_memory;
-    uint16_t oem_software_rev;
-    uint32_t oem_vendor_name_ptr;
-    uint32_t oem_product_name_ptr;
-    uint32_t oem_product_rev_ptr;
-    uint8_t reserved[222];
-    uint8_t oem_data[256];
-};
+static void multiboot2_put_framebuffer(uint8_t* info, uint32_t* used, const struct fwinfo_fb* fb) {
+    struct multiboot2_tag_framebuffer* tag = multiboot2_put(info, used, MULTIBOOT2_TAG_TYPE_FRAMEBUFFER, MULTIBOOT2_FB_TAG_SIZE);
+    tag->framebuffer_addr = fb->base;
+    tag->framebuffer_pitch = fb->pitch;
+    tag->framebuffer_width = fb->width;
+    tag->framebuffer_height = fb->height;
+    tag->framebuffer_bpp = fb->bpp;
+    tag->framebuffer_type = MULTIBOOT2_FRAMEBUFFER_TYPE_RGB;
+    tag->framebuffer_red_field_position = fb->red_shift;
+    tag->framebuffer_red_mask_size = fb->red_size;
+    tag->framebuffer_green_field_position = fb->green_shift;
+    tag->framebuffer_green_mask_size = fb->green_size;
+    tag->framebuffer_blue_field_position = fb->blue_shift;
+    tag->framebuffer_blue_mask_size = fb->blue_size;
+}
 
-struct multiboot2_vbe_mode_info_block {
-    uint16_t mode_attributes;
-    uint8_t win_a_attributes;
-    uint8_t win_b_attributes;
-    uint16_t win_granularity;
-    uint16_t win_size;
-    uint16_t win_a_segment;
-    uint16_t win_b_segment;
-    uint32_t win_func_ptr;
-    uint16_t bytes_per_scan_line;
-    uint16_t x_resolution;
-    uint16_t y_resolution;
-    uint8_t x_char_size;
-    uint8_t y_char_size;
-    uint8_t number_of_planes;
-    uint8_t bits_per_pixel;
-    uint8_t number_of_banks;
-    uint8_t memory_model;
-    uint8_t bank_size;
-    uint8_t number_of_image_pages;
-    uint8_t reserved1;
-    uint8_t red_mask_size;
-    uint8_t red_field_position;
-    uint8_t green_mask_size;
-    uint8_t green_field_position;
-    uint8_t blue_mask_size;
-    uint8_t blue_field_position;
-    uint8_t reserved_mask_size;
-    uint8_t reserved_field_position;
-    uint8_t direct_color_mode_info;
-    uint32_t framebuffer;
-    uint32_t off_screen_mem_offset;
-    uint16_t off_screen_mem_size;
-    uint8_t reserved2[206];
-};
+static void multiboot2_put_firmware_tables(uint8_t* info, uint32_t* used, const struct multiboot2_firmware* fw) {
+    if (fw->rsdp_old) {
+        struct multiboot2_tag_old_acpi* tag = multiboot2_put(info, used, MULTIBOOT2_TAG_TYPE_ACPI_OLD, sizeof(*tag) + 20);
+        memcpy(tag->rsdp, fw->rsdp_old, 20);
+    }
+    if (fw->rsdp_new) {
+        struct multiboot2_tag_new_acpi* tag = multiboot2_put(info, used, MULTIBOOT2_TAG_TYPE_ACPI_NEW, sizeof(*tag) + fw->rsdp_new_len);
+        memcpy(tag->rsdp, fw->rsdp_new, fw->rsdp_new_len);
+    }
+    // SMBIOS 2.x keeps its version at bytes 6-7 of the entry point, 3.x at 7-8
+    for (int i = 0; i < 2; ++i) {
+        if (!fw->smbios[i]) continue;
+        struct multiboot2_tag_smbios* tag = multiboot2_put(info, used, MULTIBOOT2_TAG_TYPE_SMBIOS, sizeof(*tag) + fw->smbios_len[i]);
+        tag->major = fw->smbios[i][6 + i];
+        tag->minor = fw->smbios[i][7 + i];
+        memcpy(tag->tables, fw->smbios[i], fw->smbios_len[i]);
+    }
+    struct multiboot2_tag_efi64* systab = multiboot2_put(info, used, MULTIBOOT2_TAG_TYPE_EFI64, sizeof(*systab));
+    systab->pointer = fwinfo_system_table();
+    struct multiboot2_tag_efi64_ih* handle = multiboot2_put(info, used, MULTIBOOT2_TAG_TYPE_EFI64_IH, sizeof(*handle));
+    handle->pointer = fwinfo_image_handle();
+}
 
-struct multiboot2_tag_framebuffer {
-    uint32_t type;
-    uint32_t size;
-    uint64_t framebuffer_addr;
-    uint32_t framebuffer_pitch;
-    uint32_t framebuffer_width;
-    uint32_t framebuffer_height;
-    uint8_t framebuffer_bpp;
-    uint8_t framebuffer_type;
-    uint8_t reserved;
-    union {
-        struct {
-            uint32_t framebuffer_palette_num_colors;
-            struct multiboot2_color_info framebuffer_palette[];
-        };
-        struct {
-            uint8_t framebuffer_red_field_position;
-            uint8_t framebuffer_red_mask_size;
-            uint8_t framebuffer_green_field_position;
-            uint8_t framebuffer_green_mask_size;
-            uint8_t framebuffer_blue_field_position;
-            uint8_t framebuffer_blue_mask_size;
-        };
-    };
-};
+// Tags taken from the final memory map go last, after ExitBootServices;
+// everything before them is filled while firmware services still work.
+// The EFI map is dropped rather than truncated if it outgrew its slot,
+// and left out when boot services stay up since it would go stale.
+static int multiboot2_put_maps(uint8_t* info, uint32_t* used, const struct multiboot2_firmware* fw, int efi_map) {
+    uint64_t bytes, desc_size;
+    uint32_t version;
+    struct multiboot2_tag_basic_meminfo* meminfo = multiboot2_put(info, used, MULTIBOOT2_TAG_TYPE_BASIC_MEMINFO, sizeof(*meminfo));
+    meminfo->mem_lower = memmap_mem_lower_kb();
+    meminfo->mem_upper = memmap_mem_upper_kb();
 
-struct multiboot2_color_info {
-    uint8_t red_value;
-    uint8_t green_value;
-    uint8_t blue_value;
-};
+    struct multiboot2_tag_mmap* mmap = (struct multiboot2_tag_mmap*)(info + *used);
+    int count = memmap_to_multiboot2((uint8_t*)mmap->entries, MEMMAP_MAX_ENTRIES);
+    if (count < 0) return -1;
+    multiboot2_put(info, used, MULTIBOOT2_TAG_TYPE_MMAP, sizeof(*mmap) + count * MEMMAP_MB_ENTRY_SIZE);
+    mmap->entry_size = MEMMAP_MB_ENTRY_SIZE;
+    mmap->entry_version = 0;
 
-struct multiboot2_tag_elf_sections {
-    uint32_t type;
-    uint32_t size;
-    uint32_t num;
-    uint32_t entsize;
-    uint32_t shndx;
-    char sections[];
-};
+    const void* map = memmap_efi_map(&bytes, &desc_size, &version);
+    if (efi_map && map && bytes <= fw->efi_map_max) {
+        struct multiboot2_tag_efi_mmap* efi = multiboot2_put(info, used, MULTIBOOT2_TAG_TYPE_EFI_MMAP, sizeof(*efi) + (uint32_t)bytes);
+        efi->descr_size = (uint32_t)desc_size;
+        efi->descr_vers = version;
+        memcpy(efi->efi_mmap, map, bytes);
+    }
+    return 0;
+}
 
-struct multiboot2_tag_apm {
-    uint32_t type;
-    uint32_t size;
-    uint16_t version;
-    uint16_t cseg;
-    uint32_t offset;
-    uint16_t cseg_16;
-    uint16_t dseg;
-    uint16_t flags;
-    uint16_t cseg_len;
-    uint16_t cseg_16_len;
-    uint16_t dseg_len;
-};
+// Sizes the info block from the firmware state, fills it below 4 GiB and
+// leaves boot services unless the kernel asked to keep them. On success
+// the caller's only job is the jump.
+struct multiboot2_info* multiboot2_build_info(const char* cmdline, uint32_t load_base, int keep_boot_services) {
+    struct multiboot2_firmware fw;
+    uint32_t cmdline_len = cmdline ? strlen(cmdline) : 0;
+    multiboot2_probe(&fw);
+    uint32_t size = multiboot2_info_size(&fw, cmdline_len);
+    uint8_t* info = memmap_alloc(size, 0x1000, 0xFFFFFFFF);
+    if (!info) {
+        return NULL;
+    }
+    memset(info, 0, size);
+    uint32_t used = sizeof(struct multiboot2_info);
 
-struct multiboot2_tag_efi32 {
-    uint32_t type;
-    uint32_t size;
-    uint32_t pointer;
-};
+    struct multiboot2_tag_string* str = multiboot2_put(info, &used, MULTIBOOT2_TAG_TYPE_CMDLINE, sizeof(*str) + cmdline_len + 1);
+    if (cmdline_len) memcpy(str->string, cmdline, cmdline_len);
+    str = multiboot2_put(info, &used, MULTIBOOT2_TAG_TYPE_BOOT_LOADER_NAME, sizeof(*str) + sizeof(MULTIBOOT2_LOADER_NAME));
+    memcpy(str->string, MULTIBOOT2_LOADER_NAME, sizeof(MULTIBOOT2_LOADER_NAME));
 
-struct multiboot2_tag_efi64 {
-    uint32_t type;
-    uint32_t size;
-    uint64_t pointer;
-};
+    for (int i = 0; i < multiboot2_module_count; ++i) {
+        uint32_t len = strlen(multiboot2_modules[i].cmdline);
+        struct multiboot2_tag_module* mod = multiboot2_put(info, &used, MULTIBOOT2_TAG_TYPE_MODULE, sizeof(*mod) + len + 1);
+        mod->mod_start = multiboot2_modules[i].start;
+        mod->mod_end = multiboot2_modules[i].end;
+        memcpy(mod->cmdline, multiboot2_modules[i].cmdline, len);
+    }
 
-struct multiboot2_tag_smbios {
-    uint32_t type;
-    uint32_t size;
-    uint8_t major;
-    uint8_t minor;
-    uint8_t reserved[6];
-    uint8_t tables[];
-};
+    struct multiboot2_tag_load_base_addr* base = multiboot2_put(info, &used, MULTIBOOT2_TAG_TYPE_LOAD_BASE_ADDR, sizeof(*base));
+    base->load_base_addr = load_base;
+    if (fw.have_fb) multiboot2_put_framebuffer(info, &used, &fw.fb);
+    multiboot2_put_firmware_tables(info, &used, &fw);
 
-struct multiboot2_tag_old_acpi {
-    uint32_t type;
-    uint32_t size;
-    uint8_t rsdp[];
-};
+    if (keep_boot_services) {
+        multiboot2_put(info, &used, MULTIBOOT2_TAG_TYPE_EFI_BS, sizeof(struct multiboot2_tag));
+        if (memmap_refresh() != 0) return NULL;
+    } else if (memmap_exit_boot_services() != 0) {
+        return NULL;
+    }
+    if (multiboot2_put_maps(info, &used, &fw, !keep_boot_services) != 0) {
+        return NULL;
+    }
+    multiboot2_put(info, &used, MULTIBOOT2_TAG_TYPE_END, sizeof(struct multiboot2_tag));
+    ((struct multiboot2_info*)info)->total_size = used;
+    return (struct multiboot2_info*)info;
+}
 
-struct multiboot2_tag_new_acpi {
-    uint32_t type;
-    uint32_t size;
-    uint8_t rsdp[];
-};
+// Modules are placed as they are loaded, page aligned and as high as
+// possible below 4 GiB; the info builder turns the table into tags.
+int multiboot2_load_module(const char* module_path, const char* cmdline) {
+    struct kfile* kf = &multiboot2_module_file;
 
-struct multiboot2_tag_network {
-    uint32_t type;
-    uint32_t size;
-    uint8_t dhcpack[];
-};
+    if (multiboot2_module_count >= MULTIBOOT2_MAX_MODULES || kfile_open(kf, module_path) != 0) {
+        return -1;
+    }
+    if (kf->size == 0 || kf->size > 0xFFFFFFFF) {
+        kfile_close(kf);
+        return -1;
+    }
+    uint32_t module_size = (uint32_t)kf->size;
 
-struct multiboot2_tag_efi_mmap {
-    uint32_t type;
-    uint32_t size;
-    uint32_t descr_size;
-    uint32_t descr_vers;
-    uint8_t efi_mmap[];
-};
+    struct memmap_request req = {0};
+    req.size = module_size;
+    req.align = 0x1000;
+    req.min_addr = 0x100000;
+    req.max_addr = 0xFFFFFFFF;
+    req.top_down = 1;
+    req.kernel = 1;
+    uint64_t module_addr;
+    if (memmap_place(&req, &module_addr) != 0 ||
+        kfile_read(kf, 0, (void*)(uintptr_t)module_addr, module_size) != 0) {
+        kfile_close(kf);
+        return -1;
+    }
+    kfile_close(kf);
 
-struct multiboot2_tag_efi32_ih {
-    uint32_t type;
-    uint32_t size;
-    uint32_t pointer;
-};
+    struct multiboot2_module_slot* mod = &multiboot2_modules[multiboot2_module_count++];
+    mod->start = (uint32_t)module_addr;
+    mod->end = (uint32_t)(module_addr + module_size);
+    mod->cmdline[0] = 0;
+    if (cmdline) {
+        strncpy(mod->cmdline, cmdline, MULTIBOOT2_MODULE_CMDLINE - 1);
+        mod->cmdline[MULTIBOOT2_MODULE_CMDLINE - 1] = 0;
+    }
+    return 0;
+}
 
-struct multiboot2_tag_efi64_ih {
-    uint32_t type;
-    uint32_t size;
-    uint64_t pointer;
-};
+// Info tags the builder always emits; an information request for any
+// other type can only be ignored when the kernel marked it optional.
+static int multiboot2_provides(uint32_t type) {
+    switch (type) {
+    case MULTIBOOT2_TAG_TYPE_END:
+    case MULTIBOOT2_TAG_TYPE_CMDLINE:
+    case MULTIBOOT2_TAG_TYPE_BOOT_LOADER_NAME:
+    case MULTIBOOT2_TAG_TYPE_MODULE:
+    case MULTIBOOT2_TAG_TYPE_BASIC_MEMINFO:
+    case MULTIBOOT2_TAG_TYPE_MMAP:
+    case MULTIBOOT2_TAG_TYPE_FRAMEBUFFER:
+    case MULTIBOOT2_TAG_TYPE_EFI64:
+    case MULTIBOOT2_TAG_TYPE_SMBIOS:
+    case MULTIBOOT2_TAG_TYPE_ACPI_OLD:
+    case MULTIBOOT2_TAG_TYPE_ACPI_NEW:
+    case MULTIBOOT2_TAG_TYPE_EFI_MMAP:
+    case MULTIBOOT2_TAG_TYPE_EFI_BS:
+    case MULTIBOOT2_TAG_TYPE_EFI64_IH:
+    case MULTIBOOT2_TAG_TYPE_LOAD_BASE_ADDR:
+        return 1;
+    default:
+        return 0;
+    }
+}
 
-struct multiboot2_tag_load_base_addr {
-    uint32_t type;
-    uint32_t size;
-    uint32_t load_base_addr;
-};
+static int multiboot2_header_tag(const struct multiboot2_header_tag* tag, struct multiboot2_header_info* out) {
+    int optional = tag->flags & MULTIBOOT2_HEADER_TAG_OPTIONAL;
+    switch (tag->type) {
+    case MULTIBOOT2_HEADER_TAG_INFORMATION_REQUEST: {
+        const struct multiboot2_header_tag_information_request* req = (const void*)tag;
+        for (uint32_t i = 0; i < (tag->size - sizeof(*req)) / 4; ++i) {
+            if (!optional && !multiboot2_provides(req->requests[i])) return -1;
+        }
+        return 0;
+    }
+    case MULTIBOOT2_HEADER_TAG_ADDRESS: {
+        const struct multiboot2_header_tag_address* addr = (const void*)tag;
+        if (tag->size < sizeof(*addr)) return -1;
+        out->has_address = 1;
+        out->header_addr = addr->header_addr;
+        out->load_addr = addr->load_addr;
+        out->load_end_addr = addr->load_end_addr;
+        out->bss_end_addr = addr->bss_end_addr;
+        return 0;
+    }
+    case MULTIBOOT2_HEADER_TAG_ENTRY_ADDRESS:
+    case MULTIBOOT2_HEADER_TAG_ENTRY_ADDRESS_EFI_64: {
+        const struct multiboot2_header_tag_entry_address* entry = (const void*)tag;
+        if (tag->size < sizeof(*entry)) return -1;
+        if (tag->type == MULTIBOOT2_HEADER_TAG_ENTRY_ADDRESS) {
+            out->has_entry = 1;
+            out->entry_addr = entry->entry_addr;
+        } else {
+            out->has_efi64_entry = 1;
+            out->efi64_entry_addr = entry->entry_addr;
+        }
+        return 0;
+    }
+    case MULTIBOOT2_HEADER_TAG_RELOCATABLE: {
+        const struct multiboot2_header_tag_relocatable* reloc = (const void*)tag;
+        if (tag->size < sizeof(*reloc) || reloc->min_addr > reloc->max_addr || (reloc->align & (reloc->align - 1))) return -1;
+        out->relocatable = 1;
+        out->min_addr = reloc->min_addr;
+        out->max_addr = reloc->max_addr;
+        out->align = reloc->align;
+        out->preference = reloc->preference;
+        return 0;
+    }
+    case MULTIBOOT2_HEADER_TAG_EFI_BS:
+        out->keep_boot_services = 1;
+        return 0;
+    // Modules are always page aligned; the i386 EFI entry is for 32-bit
+    // firmware; the firmware console and current GOP mode are passed on
+    // as they are.
+    case MULTIBOOT2_HEADER_TAG_MODULE_ALIGN:
+    case MULTIBOOT2_HEADER_TAG_ENTRY_ADDRESS_EFI_32:
+    case MULTIBOOT2_HEADER_TAG_CONSOLE_FLAGS:
+    case MULTIBOOT2_HEADER_TAG_FRAMEBUFFER:
+        return 0;
+    default:
+        return optional ? 0 : -1;
+    }
+}
 
-int multiboot2_load_kernel(const char* kernel_path, const char* cmdline) {
-    uint8_t* kernel_data = NULL;
-    uint32_t kernel_size = 0;
-    
-    // Load kernel file
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
-        return -1;
+// The header lies wholly within the first 32 KiB on an 8-byte boundary,
+// and magic, architecture, length and checksum sum to zero. Its tags run
+// up to an end tag, each padded to 8 bytes.
+int multiboot2_parse_header(const uint8_t* image, uint32_t len, struct multiboot2_header_info* out) {
+    uint32_t limit = len < MULTIBOOT2_SEARCH ? len : MULTIBOOT2_SEARCH;
+    const struct multiboot2_header* h = NULL;
+    uint32_t off;
+    for (off = 0; off + sizeof(*h) <= limit; off += 8) {
+        const struct multiboot2_header* c = (const struct multiboot2_header*)(image + off);
+        if (c->magic == MULTIBOOT2_HEADER_MAGIC && c->magic + c->architecture + c->header_length + c->checksum == 0) {
+            h = c;
+            break;
+        }
     }
-    
-    // Parse Multiboot 2 header
-    uint32_t* header = (uint32_t*)kernel_data;
-    
-    // Verify Multiboot 2 magic
-    if (header[0] != MULTIBOOT2_HEADER_MAGIC) {
+    if (!h || h->architecture != MULTIBOOT2_ARCHITECTURE_I386 || h->header_length > limit - off) {
         return -1;
     }
-    
-    // Find header address and entry point
-    uint32_t header_addr = 0;
-    uint32_t load_addr = 0;
-    uint32_t load_end_addr = 0;
-    uint32_t bss_end_addr = 0;
-    uint32_t entry_addr = 0;
-    
-    // Parse header tags
-    uint32_t offset = 8;
-    while (offset < kernel_size) {
-        struct multiboot2_tag* tag = (struct multiboot2_tag*)(kernel_data + offset);
-        
-        if (tag->type == MULTIBOOT2_HEADER_TAG_END) {
-            break;
+    memset(out, 0, sizeof(*out));
+    out->offset = off;
+    uint32_t pos = sizeof(*h);
+    while (pos + sizeof(struct multiboot2_header_tag) <= h->header_length) {
+        const struct multiboot2_header_tag* tag = (const struct multiboot2_header_tag*)((const uint8_t*)h + pos);
+        if (tag->type == MULTIBOOT2_HEADER_TAG_END) return 0;
+        if (tag->size < sizeof(*tag) || tag->size > h->header_length - pos || multiboot2_header_tag(tag, out) != 0) return -1;
+        pos += multiboot2_pad(tag->size);
+    }
+    return -1;
+}
+
+// An image with an address tag is one flat range of the file; anything
+// else is ELF and placed by its program headers. A relocatable image
+// moves as a whole, and the entry tags move with it.
+static int multiboot2_load_image(struct kfile* kf, const struct multiboot2_header_info* hdr, uint32_t* load_base, uint32_t* entry) {
+    struct memmap_request req = {0};
+    uint64_t base, link, start;
+    req.min_addr = hdr->min_addr;
+    req.max_addr = hdr->max_addr ? hdr->max_addr : 0xFFFFFFFF;
+    req.align = hdr->align > 0x1000 ? hdr->align : 0x1000;
+    req.top_down = hdr->preference == MULTIBOOT2_LOAD_PREFERENCE_HIGH;
+    req.kernel = 1;
+
+    if (hdr->has_address) {
+        uint32_t file_offset = 0;
+        link = hdr->load_addr;
+        if (hdr->load_addr == 0xFFFFFFFF) {
+            if (hdr->header_addr < hdr->offset) return -1;
+            link = hdr->header_addr - hdr->offset;
+        } else if (hdr->header_addr < hdr->load_addr || hdr->header_addr - hdr->load_addr > hdr->offset) {
+            return -1;
+        } else {
+            file_offset = hdr->offset - (hdr->header_addr - hdr->load_addr);
         }
-        
-        if (tag->type == MULTIBOOT2_HEADER_TAG_INFORMATION_REQUEST) {
-            // Handle information request
-        } else if (tag->type == MULTIBOOT2_HEADER_TAG_ADDRESS) {
-            struct multiboot2_header_tag_address* addr_tag = (struct multiboot2_header_tag_address*)tag;
-            header_addr = addr_tag->header_addr;
-            load_addr = addr_tag->load_addr;
-            load_end_addr = addr_tag->load_end_addr;
-            bss_end_addr = addr_tag->bss_end_addr;
-        } else if (tag->type == MULTIBOOT2_HEADER_TAG_ENTRY_ADDRESS) {
-            struct multiboot2_header_tag_entry_address* entry_tag = (struct multiboot2_header_tag_entry_address*)tag;
-            entry_addr = entry_tag->entry_addr;
+        uint64_t load_size = kf->size - file_offset;
+        if (hdr->load_end_addr) {
+            if (hdr->load_end_addr < link) return -1;
+            if (hdr->load_end_addr - link < load_size) load_size = hdr->load_end_addr - link;
         }
-        
-        offset += tag->size;
-        if (tag->size % 8 != 0) {
-            offset += 8 - (tag->size % 8);
+        uint64_t mem_size = hdr->bss_end_addr > link + load_size ? hdr->bss_end_addr - link : load_size;
+        struct kfile_plan plan = {0};
+        req.size = mem_size;
+        if (hdr->relocatable) {
+            if (memmap_place(&req, &base) != 0) return -1;
+        } else {
+            if (memmap_claim(link, mem_size) != 0) return -1;
+            base = link;
         }
+        if (kfile_plan_add(&plan, file_offset, load_size, base, mem_size) != 0 || kfile_plan_run(kf, &plan) != 0) return -1;
+        start = base;
+    } else {
+        struct elf_image img;
+        if (elf_load_phys(kf, hdr->relocatable ? &req : NULL, &img) != 0 || img.phys_base + img.size > 0x100000000ULL) return -1;
+        base = img.phys_base;
+        link = img.phys_base - img.slide;
+        start = img.entry;
     }
-    
-    // Default values if not specified
-    if (load_addr == 0) load_addr = 0x100000; // 1MB
-    if (entry_addr == 0) entry_addr = load_addr;
-    
-    // Load kernel to specified address
-    uint32_t load_size = load_end_addr - load_addr;
-    if (load_size > kernel_size) load_size = kernel_size;
-    
-    memcpy((void*)load_addr, kernel_data, load_size);
-    
-    // Zero out BSS
-    if (bss_end_addr > load_end_addr) {
-        memset((void*)load_end_addr, 0, bss_end_addr - load_end_addr);
-    }
-    
-    // Setup Multiboot 2 info structure
-    struct multiboot2_info* mb_info = (struct multiboot2_info*)0x90000;
-    memset(mb_info, 0, sizeof(struct multiboot2_info));
-    
-    uint32_t info_offset = sizeof(struct multiboot2_info);
-    
-    // Add command line tag
-    if (cmdline && strlen(cmdline) > 0) {
-        struct multiboot2_tag_string* cmdline_tag = (struct multiboot2_tag_string*)((uint8_t*)mb_info + info_offset);
-        cmdline_tag->type = MULTIBOOT2_TAG_TYPE_CMDLINE;
-        cmdline_tag->size = sizeof(struct multiboot2_tag_string) + strlen(cmdline) + 1;
-        strcpy(cmdline_tag->string, cmdline);
-        
-        info_offset += cmdline_tag->size;
-        if (cmdline_tag->size % 8 != 0) {
-            info_offset += 8 - (cmdline_tag->size % 8);
-        }
+
+    if (hdr->keep_boot_services && hdr->has_efi64_entry) {
+        start = hdr->efi64_entry_addr + (base - link);
+    } else if (hdr->has_entry) {
+        start = hdr->entry_addr + (base - link);
     }
-    
-    // Add basic memory info tag
-    struct multiboot2_tag_basic_meminfo* meminfo_tag = (struct multiboot2_tag_basic_meminfo*)((uint8_t*)mb_info + info_offset);
-    meminfo_tag->type = MULTIBOOT2_TAG_TYPE_BASIC_MEMINFO;
-    meminfo_tag->size = sizeof(struct multiboot2_tag_basic_meminfo);
-    meminfo_tag->mem_lower = 640; // 640KB
-    meminfo_tag->mem_upper = 0x7FE00; // Extended memory in KB
-    
-    info_offset += meminfo_tag->size;
-    if (meminfo_tag->size % 8 != 0) {
-        info_offset += 8 - (meminfo_tag->size % 8);
-    }
-    
-    // Add boot device tag
-    struct multiboot2_tag_bootdev* bootdev_tag = (struct multiboot2_tag_bootdev*)((uint8_t*)mb_info + info_offset);
-    bootdev_tag->type = MULTIBOOT2_TAG_TYPE_BOOTDEV;
-    bootdev_tag->size = sizeof(struct multiboot2_tag_bootdev);
-    bootdev_tag->biosdev = 0x80; // First hard disk
-    bootdev_tag->partition = 0;
-    bootdev_tag->subpartition = 0;
-    
-    info_offset += bootdev_tag->size;
-    if (bootdev_tag->size % 8 != 0) {
-        info_offset += 8 - (bootdev_tag->size % 8);
-    }
-    
-    // Add memory map tag
-    struct multiboot2_tag_mmap* mmap_tag = (struct multiboot2_tag_mmap*)((uint8_t*)mb_info + info_offset);
-    mmap_tag->type = MULTIBOOT2_TAG_TYPE_MMAP;
-    mmap_tag->size = sizeof(struct multiboot2_tag_mmap) + 2 * sizeof(struct multiboot2_mmap_entry);
-    mmap_tag->entry_size = sizeof(struct multiboot2_mmap_entry);
-    mmap_tag->entry_version = 0;
-    
-    mmap_tag->entries[0].addr = 0;
-    mmap_tag->entries[0].len = 0x100000; // 1MB
-    mmap_tag->entries[0].type = MULTIBOOT2_MMAP_TYPE_AVAILABLE;
-    mmap_tag->entries[0].zero = 0;
-    
-    mmap_tag->entries[1].addr = 0x100000;
-    mmap_tag->entries[1].len = 0x7FF00000; // ~2GB
-    mmap_tag->entries[1].type = MULTIBOOT2_MMAP_TYPE_AVAILABLE;
-    mmap_tag->entries[1].zero = 0;
-    
-    info_offset += mmap_tag->size;
-    if (mmap_tag->size % 8 != 0) {
-        info_offset += 8 - (mmap_tag->size % 8);
-    }
-    
-    // Add end tag
-    struct multiboot2_tag* end_tag = (struct multiboot2_tag*)((uint8_t*)mb_info + info_offset);
-    end_tag->type = MULTIBOOT2_TAG_TYPE_END;
-    end_tag->size = sizeof(struct multiboot2_tag);
-    
-    info_offset += end_tag->size;
-    
-    // Set total size
-    mb_info->total_size = info_offset;
-    mb_info->reserved = 0;
-    
-    // Jump to kernel
-    void (*kernel_entry)(uint32_t, struct multiboot2_info*) = (void*)entry_addr;
-    kernel_entry(MULTIBOOT2_BOOTLOADER_MAGIC, mb_info);
-    
+    *load_base = (uint32_t)base;
+    *entry = (uint32_t)start;
     return 0;
 }
 
-int multiboot2_verify_kernel(const char* kernel_path) {
-    uint8_t* kernel_data = NULL;
-    uint32_t kernel_size = 0;
-    
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
+static int multiboot2_boot(struct kfile* kf, const char* cmdline) {
+    struct multiboot2_header_info hdr;
+    uint32_t load_base, entry;
+    if (kf->size > 0xFFFFFFFF || multiboot2_parse_header(kf->head, kf->head_len, &hdr) != 0 ||
+        multiboot2_load_image(kf, &hdr, &load_base, &entry) != 0) {
+        kfile_close(kf);
         return -1;
     }
-    
-    uint32_t* header = (uint32_t*)kernel_data;
-    
-    // Check Multiboot 2 magic
-    if (header[0] != MULTIBOOT2_HEADER_MAGIC) {
+    kfile_close(kf);
+
+    // Boot services are only kept for the EFI amd64 entry, which runs in
+    // long mode on the firmware's state with RAX/RBX set. The i386 entry
+    // gets the same 32-bit protected-mode handoff as Multiboot 1.
+    int efi64 = hdr.keep_boot_services && hdr.has_efi64_entry;
+    if (!efi64 && multiboot1_enter_prepare() != 0) {
         return -1;
     }
-    
-    // Check architecture
-    if (header[1] != MULTIBOOT2_ARCHITECTURE_I386) {
+    struct multiboot2_info* info = multiboot2_build_info(cmdline, load_base, efi64);
+    if (!info) {
         return -1;
     }
-    
-    // Check header length
-    if (header[2] < 8 || header[2] > kernel_size) {
-        return -1;
+#if defined(__x86_64__)
+    if (efi64) {
+        __asm__ __volatile__("jmp *%0" : : "r"((uint64_t)entry), "a"((uint64_t)MULTIBOOT2_BOOTLOADER_MAGIC),
+                             "b"((uint64_t)(uintptr_t)info) : "memory");
     }
-    
-    // Check header checksum
-    uint32_t checksum = 0;
-    for (uint32_t i = 0; i < header[2] / 4; i++) {
-        checksum += header[i];
+#endif
+    multiboot1_enter(entry, MULTIBOOT2_BOOTLOADER_MAGIC, (uint32_t)(uintptr_t)info);
+    return -1;
+}
+
+int multiboot2_load_kernel(const char* kernel_path, const char* cmdline) {
+    if (kfile_open(&multiboot2_file, kernel_path) != 0) {
+        return -1;
     }
-    if (checksum != 0) {
+    return multiboot2_boot(&multiboot2_file, cmdline);
+}
+
+int multiboot2_verify_kernel(const char* kernel_path) {
+    struct multiboot2_header_info hdr;
+    if (kfile_open(&multiboot2_file, kernel_path) != 0) {
         return -1;
     }
-    
-    return 0;
-} 
+    kfile_close(&multiboot2_file);
+    return multiboot2_parse_header(multiboot2_file.head, multiboot2_file.head_len, &hdr);
+}
 
+// Images already in memory go through the same header-driven loader, so
+// only the declared range is copied out of the staging buffer.
 int boot_multiboot2_kernel(uint8_t* kernel_data, uint32_t kernel_size, const char* cmdline) {
-    struct multiboot2_info* info = (struct multiboot2_info*)0x1000;
-    uint8_t* tag_ptr = (uint8_t*)info + 8;
-    
-    info->total_size = 8;
-    info->reserved = 0;
-    
-    struct multiboot2_tag_basic_meminfo* meminfo = (struct multiboot2_tag_basic_meminfo*)tag_ptr;
-    meminfo->type = 4;
-    meminfo->size = 16;
-    meminfo->mem_lower = 640;
-    meminfo->mem_upper = 0x7FE00;
-    tag_ptr += meminfo->size;
-    info->total_size += meminfo->size;
-    
-    if (cmdline && strlen(cmdline) > 0) {
-        struct multiboot2_tag_string* cmdline_tag = (struct multiboot2_tag_string*)tag_ptr;
-        cmdline_tag->type = 1;
-        strcpy(cmdline_tag->string, cmdline);
-        cmdline_tag->size = 8 + strlen(cmdline) + 1;
-        tag_ptr += cmdline_tag->size;
-        info->total_size += cmdline_tag->size;
-    }
-    
-    struct multiboot2_tag* end_tag = (struct multiboot2_tag*)tag_ptr;
-    end_tag->type = 0;
-    end_tag->size = 8;
-    info->total_size += 8;
-    
-    uint32_t kernel_entry = 0x100000;
-    memcpy((void*)kernel_entry, kernel_data, kernel_size);
-    
-    void (*entry_point)(uint32_t, uint32_t) = (void*)kernel_entry;
-    entry_point(0x36d76289, (uint32_t)info);
-    
-    return 0;
-} 
\ No newline at end of file
+    if (kfile_open_mem(&multiboot2_file, kernel_data, kernel_size) != 0) {
+        return -1;
+    }
+    return multiboot2_boot(&multiboot2_file, cmdline);
+}
@@ -59,6 +59,20 @@
 #define MULTIBOOT2_MMAP_TYPE_KERNEL_AND_MODULES 0x1001
 #define MULTIBOOT2_MMAP_TYPE_FRAMEBUFFER 0x1002
 
+#define MULTIBOOT2_FRAMEBUFFER_TYPE_INDEXED 0
+#define MULTIBOOT2_FRAMEBUFFER_TYPE_RGB 1
+#define MULTIBOOT2_FRAMEBUFFER_TYPE_EGA_TEXT 2
+
+#define MULTIBOOT2_SEARCH 32768
+#define MULTIBOOT2_HEADER_TAG_OPTIONAL 1
+
+#define MULTIBOOT2_LOAD_PREFERENCE_NONE 0
+#define MULTIBOOT2_LOAD_PREFERENCE_LOW 1
+#define MULTIBOOT2_LOAD_PREFERENCE_HIGH 2
+
+#define MULTIBOOT2_MAX_MODULES 16
+#define MULTIBOOT2_MODULE_CMDLINE 128
+
 struct multiboot2_info {
     uint32_t total_size;
     uint32_t reserved;
@@ -83,20 +97,20 @@ struct multiboot2_tag_basic_meminfo {
     uint32_t mem_upper;
 };
 
-struct multiboot2_tag_bootdev {
+struct multiboot2_tag_module {
     uint32_t type;
     uint32_t size;
-    uint32_t biosdev;
-    uint32_t partition;
-    uint32_t subpartition;
+    uint32_t mod_start;
+    uint32_t mod_end;
+    char cmdline[];
 };
 
-struct multiboot2_tag_mmap {
+struct multiboot2_tag_bootdev {
     uint32_t type;
     uint32_t size;
-    uint32_t entry_size;
-    uint32_t entry_version;
-    struct multiboot2_mmap_entry entries[];
+    uint32_t biosdev;
+    uint32_t partition;
+    uint32_t subpartition;
 };
 
 struct multiboot2_mmap_entry {
@@ -106,15 +120,12 @@ struct multiboot2_mmap_entry {
     uint32_t zero;
 };
 
-struct multiboot2_tag_vbe {
+struct multiboot2_tag_mmap {
     uint32_t type;
     uint32_t size;
-    uint16_t vbe_mode;
-    uint16_t vbe_interface_seg;
-    uint16_t vbe_interface_off;
-    uint16_t vbe_interface_len;
-    struct multiboot2_vbe_info_block vbe_control_info;
-    struct multiboot2_vbe_mode_info_block vbe_mode_info;
+    uint32_t entry_size;
+    uint32_t entry_version;
+    struct multiboot2_mmap_entry entries[];
 };
 
 struct multiboot2_vbe_info_block {
@@ -168,6 +179,23 @@ struct multiboot2_vbe_mode_info_block {
     uint8_t reserved2[206];
 };
 
+struct multiboot2_tag_vbe {
+    uint32_t type;
+    uint32_t size;
+    uint16_t vbe_mode;
+    uint16_t vbe_interface_seg;
+    uint16_t vbe_interface_off;
+    uint16_t vbe_interface_len;
+    struct multiboot2_vbe_info_block vbe_control_info;
+    struct multiboot2_vbe_mode_info_block vbe_mode_info;
+};
+
+struct multiboot2_color_info {
+    uint8_t red_value;
+    uint8_t green_value;
+    uint8_t blue_value;
+};
+
 struct multiboot2_tag_framebuffer {
     uint32_t type;
     uint32_t size;
@@ -177,7 +205,7 @@ struct multiboot2_tag_framebuffer {
     uint32_t framebuffer_height;
     uint8_t framebuffer_bpp;
     uint8_t framebuffer_type;
-    uint8_t reserved;
+    uint16_t reserved;
     union {
         struct {
             uint32_t framebuffer_palette_num_colors;
@@ -194,12 +222,6 @@ struct multiboot2_tag_framebuffer {
     };
 };
 
-struct multiboot2_color_info {
-    uint8_t red_value;
-    uint8_t green_value;
-    uint8_t blue_value;
-};
-
 struct multiboot2_tag_elf_sections {
     uint32_t type;
     uint32_t size;
@@ -288,15 +310,32 @@ struct multiboot2_tag_load_base_addr {
     uint32_t load_base_addr;
 };
 
+struct multiboot2_header {
+    uint32_t magic;
+    uint32_t architecture;
+    uint32_t header_length;
+    uint32_t checksum;
+};
+
+// Header tags start with a 16-bit type and flags; bit 0 of the flags marks
+// the tag optional, so a loader that lacks support may ignore it.
+struct multiboot2_header_tag {
+    uint16_t type;
+    uint16_t flags;
+    uint32_t size;
+};
+
 struct multiboot2_header_tag_information_request {
-    uint32_t type;
-    uint32_t flags;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t size;
     uint32_t requests[];
 };
 
 struct multiboot2_header_tag_address {
-    uint32_t type;
-    uint32_t flags;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t size;
     uint32_t header_addr;
     uint32_t load_addr;
     uint32_t load_end_addr;
@@ -304,33 +343,59 @@ struct multiboot2_header_tag_address {
 };
 
 struct multiboot2_header_tag_entry_address {
-    uint32_t type;
-    uint32_t flags;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t size;
     uint32_t entry_addr;
 };
 
 struct multiboot2_header_tag_console_flags {
-    uint32_t type;
-    uint32_t flags;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t size;
     uint32_t console_flags;
 };
 
 struct multiboot2_header_tag_framebuffer {
-    uint32_t type;
-    uint32_t flags;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t size;
     uint32_t width;
     uint32_t height;
     uint32_t depth;
 };
 
 struct multiboot2_header_tag_module_align {
-    uint32_t type;
-    uint32_t flags;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t size;
 };
 
 struct multiboot2_header_tag_relocatable {
-    uint32_t type;
-    uint32_t flags;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t size;
+    uint32_t min_addr;
+    uint32_t max_addr;
+    uint32_t align;
+    uint32_t preference;
+};
+
+// What the header tags asked for, gathered before anything is loaded.
+struct multiboot2_header_info {
+    uint32_t offset;
+    int has_address;
+    uint32_t header_addr;
+    uint32_t load_addr;
+    uint32_t load_end_addr;
+    uint32_t bss_end_addr;
+    int has_entry;
+    uint32_t entry_addr;
+    int has_efi64_entry;
+    uint32_t efi64_entry_addr;
+    int keep_boot_services;
+    int module_align;
+    int relocatable;
     uint32_t min_addr;
     uint32_t max_addr;
     uint32_t align;
@@ -340,5 +405,8 @@ struct multiboot2_header_tag_relocatable {
 int multiboot2_load_kernel(const char* kernel_path, const char* cmdline);
 int multiboot2_verify_kernel(const char* kernel_path);
 int boot_multiboot2_kernel(uint8_t* kernel_data, uint32_t kernel_size, const char* cmdline);
+int multiboot2_load_module(const char* module_path, const char* cmdline);
+int multiboot2_parse_header(const uint8_t* image, uint32_t len, struct multiboot2_header_info* out);
+struct multiboot2_info* multiboot2_build_info(const char* cmdline, uint32_t load_base, int keep_boot_services);
 
 #endif // BLOODHORN_MULTIBOOT2_H 
\ No newline at end of file
@@ -0,0 +1,134 @@
+/*
+ * BloodHorn Bootloader
+ *
+ * This file is part of BloodHorn and is licensed under the MIT License.
+ * See the root of the repository for license details.
+ */
+#include <stdint.h>
+#include "compat.h"
+#include <string.h>
+#include "paging.h"
+#include "memmap.h"
+
+#if defined(__x86_64__)
+static void paging_cpuid(uint32_t leaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    __asm__ __volatile__("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+static uint64_t paging_rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+#endif
+
+static uint64_t paging_new_table(struct paging_ctx* ctx, uint64_t max_addr) {
+    void* t = memmap_alloc(PAGING_4K, PAGING_4K, max_addr);
+    if (!t) return 0;
+    memset(t, 0, PAGING_4K);
+    ctx->tables++;
+    return (uintptr_t)t;
+}
+
+int paging_init(struct paging_ctx* ctx, int levels) {
+    memset(ctx, 0, sizeof(*ctx));
+    if (levels != 4 && levels != 5) return -1;
+    ctx->levels = levels;
+#if defined(__x86_64__)
+    uint32_t a, b, c, d;
+    paging_cpuid(0x80000000, &a, &b, &c, &d);
+    if (a >= 0x80000001) {
+        paging_cpuid(0x80000001, &a, &b, &c, &d);
+        ctx->have_1g = (d >> 26) & 1;
+    }
+    // NX is only honoured once EFER.NXE is on; firmware decides that
+    ctx->have_nx = (paging_rdmsr(0xC0000080) >> 11) & 1;
+#endif
+    // APs load CR3 from 32-bit code on their way up, so the root stays low
+    ctx->root = paging_new_table(ctx, PAGING_ROOT_LIMIT);
+    return ctx->root ? 0 : -1;
+}
+
+// Level 1 holds 4K leaves, 2 holds 2M, 3 holds 1G; the root is ctx->levels.
+static uint64_t* paging_walk(struct paging_ctx* ctx, uint64_t virt, int leaf_level) {
+    uint64_t* table = (uint64_t*)(uintptr_t)ctx->root;
+    for (int level = ctx->levels; level > leaf_level; --level) {
+        uint64_t* e = &table[(virt >> (12 + 9 * (level - 1))) & 0x1FF];
+        if (!(*e & PTE_PRESENT)) {
+            uint64_t t = paging_new_table(ctx, 0);
+            if (!t) return NULL;
+            *e = t | PTE_PRESENT | PTE_WRITE;
+        } else if (*e & PTE_LARGE) {
+            return NULL;
+        }
+        table = (uint64_t*)(uintptr_t)(*e & PTE_ADDR_MASK);
+    }
+    return &table[(virt >> (12 + 9 * (leaf_level - 1))) & 0x1FF];
+}
+
+int paging_map(struct paging_ctx* ctx, uint64_t virt, uint64_t phys, uint64_t size, uint32_t flags) {
+    if ((virt | phys) & (PAGING_4K - 1)) return -1;
+    size = (size + PAGING_4K - 1) & ~(PAGING_4K - 1);
+    while (size) {
+        int level = 1;
+        if (ctx->have_1g && size >= PAGING_1G && !((virt | phys) & (PAGING_1G - 1))) level = 3;
+        else if (size >= PAGING_2M && !((virt | phys) & (PAGING_2M - 1))) level = 2;
+        uint64_t* e;
+        for (;;) {
+            e = paging_walk(ctx, virt, level);
+            if (!e) return -1;
+            // A slot that already holds a table cannot take a large leaf
+            if (level == 1 || !(*e & PTE_PRESENT) || (*e & PTE_LARGE)) break;
+            level--;
+        }
+        uint64_t page = 1ULL << (12 + 9 * (level - 1));
+        uint64_t pte = phys | PTE_PRESENT;
+        if (level > 1) pte |= PTE_LARGE;
+        if (flags & PAGING_WRITE) pte |= PTE_WRITE;
+        if (!(flags & PAGING_EXEC) && ctx->have_nx) pte |= PTE_NX;
+        if (*e & PTE_PRESENT) {
+            // Segments sharing a page get the union of their rights
+            if ((*e & PTE_ADDR_MASK) != phys || ((*e ^ pte) & PTE_LARGE)) return -1;
+            pte |= *e & PTE_WRITE;
+            if (!(*e & PTE_NX)) pte &= ~PTE_NX;
+        }
+        *e = pte;
+        virt += page;
+        phys += page;
+        size -= page;
+    }
+    return 0;
+}
+
+int paging_levels_active(void) {
+#if defined(__x86_64__)
+    uint64_t cr4;
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+    return (cr4 >> 12) & 1 ? 5 : 4;
+#else
+    return 4;
+#endif
+}
+
+uint64_t paging_active_root(void) {
+#if defined(__x86_64__)
+    uint64_t cr3;
+    __asm__ __volatile__("mov %%cr3, %0" : "=r"(cr3));
+    return cr3 & PTE_ADDR_MASK;
+#else
+    return 0;
+#endif
+}
+
+// CR4.LA57 cannot change while long mode is active, so the tables must
+// match the depth the firmware is already running with.
+int paging_activate(const struct paging_ctx* ctx) {
+#if defined(__x86_64__)
+    if (ctx->levels != paging_levels_active()) return -1;
+    __asm__ __volatile__("mov %0, %%cr3" : : "r"(ctx->root) : "memory");
+    return 0;
+#else
+    (void)ctx;
+    return -1;
+#endif
+}
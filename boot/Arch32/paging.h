@@ -0,0 +1,42 @@
+/*
+ * BloodHorn Bootloader
+ *
+ * This file is part of BloodHorn and is licensed under the MIT License.
+ * See the root of the repository for license details.
+ */
+#ifndef BLOODHORN_PAGING_H
+#define BLOODHORN_PAGING_H
+#include <stdint.h>
+#include "compat.h"
+
+// x86-64 long-mode page tables (4- or 5-level), built for a kernel before
+// it is entered. Leaves are the largest of 1G/2M/4K that alignment allows.
+#define PAGING_4K 0x1000ULL
+#define PAGING_2M 0x200000ULL
+#define PAGING_1G 0x40000000ULL
+#define PAGING_ROOT_LIMIT 0xFFFFFFFFULL
+
+#define PAGING_WRITE 0x1
+#define PAGING_EXEC 0x2
+
+#define PTE_PRESENT 0x1ULL
+#define PTE_WRITE 0x2ULL
+#define PTE_LARGE 0x80ULL
+#define PTE_NX 0x8000000000000000ULL
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+struct paging_ctx {
+    uint64_t root;
+    int levels;
+    int have_1g;
+    int have_nx;
+    uint32_t tables;
+};
+
+int paging_init(struct paging_ctx* ctx, int levels);
+int paging_map(struct paging_ctx* ctx, uint64_t virt, uint64_t phys, uint64_t size, uint32_t flags);
+int paging_levels_active(void);
+uint64_t paging_active_root(void);
+int paging_activate(const struct paging_ctx* ctx);
+
+#endif // BLOODHORN_PAGING_H
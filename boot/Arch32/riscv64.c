@@ -8,163 +8,186 @@
 #include "compat.h"
 #include <string.h>
 #include "riscv64.h"
+#include "memmap.h"
+#include "kfile.h"
+#include "loader.h"
+#include "fdt.h"
+#include "fwinfo.h"
 
-extern void* allocate_memory(uint32_t size);
-extern int load_file(const char* path, uint8_t** data, uint32_t* size);
-
-struct riscv64_boot_params {
-    uint64_t dtb_addr;
-    uint64_t initrd_addr;
-    uint64_t initrd_size;
-    uint64_t cmdline_addr;
-    uint64_t cmdline_size;
-    uint64_t kernel_addr;
-    uint64_t kernel_size;
-    uint64_t mem_start;
-    uint64_t mem_size;
-    uint64_t hartid;
-    uint64_t fdt_addr;
-};
+// The image runs at a 2 MiB-aligned base plus text_offset and needs
+// image_size bytes there (BSS included), wherever RAM actually is.
+static int riscv64_probe(struct kfile* kf, struct loader_image* img) {
+    const struct riscv64_linux_header* header = kfile_at(kf, 0, sizeof(struct riscv64_linux_header));
+    if (!header || header->magic2 != RISCV64_IMAGE_MAGIC) {
+        return -1;
+    }
+    img->offset = header->text_offset;
+    img->mem_size = header->image_size;
+    img->align = RISCV64_IMAGE_ALIGN;
+    return 0;
+}
+
+static uint64_t riscv64_hartid;
+static int riscv64_have_hartid;
+static uint32_t riscv64_cbom_block;
 
-struct riscv64_linux_header {
-    uint32_t code0;
-    uint32_t code1;
-    uint64_t text_offset;
-    uint64_t image_size;
-    uint64_t flags;
-    uint32_t version;
-    uint32_t res1;
-    uint64_t res2;
-    uint64_t res3;
-    uint64_t res4;
-    uint32_t magic;
-    uint32_t hdr_offset;
-    uint32_t hdr_size;
-    uint32_t end_offset;
-    uint32_t end_size;
-    uint64_t hdr_version;
-    uint64_t comp_version;
-    uint64_t name_offset;
-    uint64_t name_size;
-    uint64_t id_offset;
-    uint64_t id_size;
-    uint64_t hdr_string_offset;
-    uint64_t hdr_string_size;
+#if defined(__riscv) && __riscv_xlen == 64
+struct riscv64_sbiret {
+    long error;
+    long value;
 };
 
-int riscv64_load_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline) {
-    uint8_t* kernel_data = NULL;
-    uint64_t kernel_size = 0;
-    
-    if (load_file(kernel_path, &kernel_data, (uint32_t*)&kernel_size) != 0) {
-        return -1;
-    }
-    
-    struct riscv64_linux_header* header = (struct riscv64_linux_header*)kernel_data;
-    
-    if (header->magic == 0x56435352) {
-        return riscv64_boot_linux(kernel_data, kernel_size, initrd_path, cmdline);
+static struct riscv64_sbiret riscv64_sbi_call(long ext, long fid, long arg0) {
+    register long a0 __asm__("a0") = arg0;
+    register long a1 __asm__("a1") = 0;
+    register long a6 __asm__("a6") = fid;
+    register long a7 __asm__("a7") = ext;
+    __asm__ __volatile__("ecall" : "+r"(a0), "+r"(a1) : "r"(a6), "r"(a7) : "memory");
+    struct riscv64_sbiret ret = { a0, a1 };
+    return ret;
+}
+
+static int riscv64_sbi_has(long ext) {
+    struct riscv64_sbiret ret = riscv64_sbi_call(RISCV64_SBI_EXT_BASE, RISCV64_SBI_BASE_PROBE, ext);
+    return ret.error == 0 && ret.value != 0;
+}
+
+static long riscv64_hart_status(uint64_t hart) {
+    struct riscv64_sbiret ret = riscv64_sbi_call(RISCV64_SBI_EXT_HSM, RISCV64_SBI_HSM_STATUS, (long)hart);
+    return ret.error ? -1 : ret.value;
+}
+
+// cbo.flush by hand so older assemblers without Zicbom still build this.
+static void riscv64_sync_range(uint64_t base, uint64_t size) {
+    uint64_t block = riscv64_cbom_block;
+    if (!size || !block) return;
+    for (uint64_t p = base & ~(block - 1); p < base + size; p += block) {
+        __asm__ __volatile__(".insn i 0x0f, 2, x0, %0, 2" : : "r"(p) : "memory");
     }
-    
+}
+#else
+static long riscv64_hart_status(uint64_t hart) {
+    (void)hart;
     return -1;
 }
+#endif
 
-int riscv64_boot_linux(uint8_t* kernel_data, uint64_t kernel_size, const char* initrd_path, const char* cmdline) {
-    struct riscv64_linux_header* header = (struct riscv64_linux_header*)kernel_data;
-    
-    uint64_t kernel_load_addr = 0x80200000;
-    uint64_t dtb_addr = 0x82000000;
-    uint64_t initrd_addr = 0;
-    uint64_t initrd_size = 0;
-    
-    if (initrd_path && strlen(initrd_path) > 0) {
-        uint8_t* initrd_data = NULL;
-        uint32_t initrd_size32 = 0;
-        if (load_file(initrd_path, &initrd_data, &initrd_size32) == 0) {
-            initrd_size = initrd_size32;
-            initrd_addr = dtb_addr + 0x100000;
-            memcpy((void*)initrd_addr, initrd_data, initrd_size);
+static int riscv64_has_isa_ext(const void* fdt, int cpu, const char* ext) {
+    int len;
+    const char* list = fdt_getprop(fdt, cpu, "riscv,isa-extensions", &len);
+    if (list) {
+        for (int off = 0; off < len; off += strlen(list + off) + 1) {
+            if (strcmp(list + off, ext) == 0) return 1;
         }
+        return 0;
     }
-    
-    uint64_t cmdline_addr = 0;
-    uint64_t cmdline_size = 0;
-    if (cmdline && strlen(cmdline) > 0) {
-        cmdline_addr = initrd_addr + initrd_size + 0x1000;
-        cmdline_size = strlen(cmdline) + 1;
-        strcpy((char*)cmdline_addr, cmdline);
+    const char* isa = fdt_getprop(fdt, cpu, "riscv,isa", &len);
+    size_t n = strlen(ext);
+    for (const char* p = isa; p && (p = strchr(p, '_')) != NULL; p++) {
+        if (strncmp(p + 1, ext, n) == 0 && (p[n + 1] == '_' || p[n + 1] == 0)) return 1;
     }
-    
-    memcpy((void*)kernel_load_addr, kernel_data, kernel_size);
-    
-    struct riscv64_boot_params* params = (struct riscv64_boot_params*)0x80000000;
-    memset(params, 0, sizeof(struct riscv64_boot_params));
-    
-    params->dtb_addr = dtb_addr;
-    params->initrd_addr = initrd_addr;
-    params->initrd_size = initrd_size;
-    params->cmdline_addr = cmdline_addr;
-    params->cmdline_size = cmdline_size;
-    params->kernel_addr = kernel_load_addr;
-    params->kernel_size = kernel_size;
-    params->mem_start = 0x80000000;
-    params->mem_size = 0x80000000;
-    params->hartid = 0;
-    params->fdt_addr = dtb_addr;
-    
-    uint64_t entry_point = kernel_load_addr + header->text_offset;
-    void (*kernel_entry)(uint64_t, uint64_t, uint64_t) = (void*)entry_point;
-    kernel_entry(0, dtb_addr, (uint64_t)params);
-    
     return 0;
 }
 
-int riscv64_boot_opensbi(uint8_t* kernel_data, uint64_t kernel_size, const char* cmdline) {
-    uint64_t kernel_load_addr = 0x80200000;
-    uint64_t dtb_addr = 0x82000000;
-    
-    uint64_t cmdline_addr = 0;
-    uint64_t cmdline_size = 0;
-    if (cmdline && strlen(cmdline) > 0) {
-        cmdline_addr = dtb_addr + 0x100000;
-        cmdline_size = strlen(cmdline) + 1;
-        strcpy((char*)cmdline_addr, cmdline);
+// Tells the kernel which hart it runs on and hides harts it could not
+// start: with SBI HSM every hart other than ours has to be STOPPED for
+// hart_start to bring it up, and one the firmware kept running would hang
+// SMP bring-up. Without HSM the tree is left alone. Zicbom and its block
+// size are picked up from the boot hart's node on the way.
+static int riscv64_fixup_fdt(void* fdt) {
+    int chosen = fdt_path_offset(fdt, "/chosen");
+    if (chosen < 0) return -1;
+    if (!riscv64_have_hartid) {
+        int len;
+        const void* id = fdt_getprop(fdt, chosen, "boot-hartid", &len);
+        if (!id || (len != 4 && len != 8)) return -1;
+        riscv64_hartid = len == 4 ? fdt_rd32(id) : fdt_rd64(id);
+        riscv64_have_hartid = 1;
+    }
+    if (fdt_setprop_u32(fdt, chosen, "boot-hartid", (uint32_t)riscv64_hartid) != 0) return -1;
+
+    int cpus = fdt_path_offset(fdt, "/cpus");
+    if (cpus < 0) return 0;
+#if defined(__riscv) && __riscv_xlen == 64
+    int hsm = riscv64_sbi_has(RISCV64_SBI_EXT_HSM);
+#else
+    int hsm = 0;
+#endif
+    for (int cpu = fdt_first_subnode(fdt, cpus); cpu >= 0; cpu = fdt_next_subnode(fdt, cpu)) {
+        int len;
+        const char* type = fdt_getprop(fdt, cpu, "device_type", NULL);
+        const void* reg = fdt_getprop(fdt, cpu, "reg", &len);
+        if (!type || strcmp(type, "cpu") != 0 || !reg || (len != 4 && len != 8)) continue;
+        uint64_t hart = len == 4 ? fdt_rd32(reg) : fdt_rd64(reg);
+        if (hart == riscv64_hartid) {
+            const void* block = fdt_getprop(fdt, cpu, "riscv,cbom-block-size", &len);
+            uint32_t size = block && len == 4 ? fdt_rd32(block) : 0;
+            if (riscv64_has_isa_ext(fdt, cpu, "zicbom") && size && !(size & (size - 1))) {
+                riscv64_cbom_block = size;
+            }
+            continue;
+        }
+        const char* status = fdt_getprop(fdt, cpu, "status", NULL);
+        if (!hsm || (status && strcmp(status, "okay") != 0 && strcmp(status, "ok") != 0)) continue;
+        if (riscv64_hart_status(hart) != RISCV64_HSM_STOPPED &&
+            fdt_setprop_string(fdt, cpu, "status", "disabled") != 0) {
+            return -1;
+        }
     }
-    
-    memcpy((void*)kernel_load_addr, kernel_data, kernel_size);
-    
-    struct riscv64_boot_params* params = (struct riscv64_boot_params*)0x80000000;
-    memset(params, 0, sizeof(struct riscv64_boot_params));
-    
-    params->dtb_addr = dtb_addr;
-    params->cmdline_addr = cmdline_addr;
-    params->cmdline_size = cmdline_size;
-    params->kernel_addr = kernel_load_addr;
-    params->kernel_size = kernel_size;
-    params->mem_start = 0x80000000;
-    params->mem_size = 0x80000000;
-    params->hartid = 0;
-    params->fdt_addr = dtb_addr;
-    
-    void (*kernel_entry)(uint64_t, uint64_t, uint64_t) = (void*)kernel_load_addr;
-    kernel_entry(0, dtb_addr, (uint64_t)params);
-    
     return 0;
 }
 
-int riscv64_verify_kernel(const char* kernel_path) {
-    uint8_t* kernel_data = NULL;
-    uint32_t kernel_size = 0;
-    
-    if (load_file(kernel_path, &kernel_data, &kernel_size) != 0) {
+// RISC-V boot protocol: a0 = boot hart ID, a1 = DTB, S-mode with the MMU
+// off and interrupts disabled. Harts are cache-coherent with each other,
+// so writes only need fence.i to reach instruction fetch; the Zicbom flush
+// covers platforms where the kernel may first touch memory non-coherently.
+static int riscv64_handoff(const struct loader_handoff* h) {
+    riscv64_have_hartid = fwinfo_boot_hartid(&riscv64_hartid) == 0;
+    riscv64_cbom_block = 0;
+    uint64_t dtb_addr = fdt_prepare(h->dtb_path, h->overlays, h->cmdline, h->initrd_addr, h->initrd_size, riscv64_fixup_fdt);
+    if (!dtb_addr) {
         return -1;
     }
-    
-    struct riscv64_linux_header* header = (struct riscv64_linux_header*)kernel_data;
-    
-    if (header->magic == 0x56435352) {
-        return 0;
+#if defined(__riscv) && __riscv_xlen == 64
+    if (memmap_exit_boot_services() != 0) {
+        return -1;
     }
-    
+    riscv64_sync_range(h->load_addr, h->mem_size);
+    riscv64_sync_range(dtb_addr, fdt_totalsize((const void*)(uintptr_t)dtb_addr));
+    riscv64_sync_range(h->initrd_addr, h->initrd_size);
+
+    register uint64_t a0 __asm__("a0") = riscv64_hartid;
+    register uint64_t a1 __asm__("a1") = dtb_addr;
+    register uint64_t t0 __asm__("t0") = h->entry;
+    __asm__ __volatile__(
+        "csrci sstatus, 2\n\t"
+        "csrw sie, zero\n\t"
+        "csrw satp, zero\n\t"
+        "sfence.vma\n\t"
+        "fence rw, rw\n\t"
+        "fence.i\n\t"
+        "jr t0"
+        : : "r"(a0), "r"(a1), "r"(t0) : "memory");
+#endif
     return -1;
-} 
\ No newline at end of file
+}
+
+const struct loader_format riscv64_image_format = { "RISC-V Image", riscv64_probe, NULL, riscv64_handoff };
+
+int riscv64_load_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline) {
+    return loader_load(kernel_path, initrd_path, cmdline, &riscv64_image_format);
+}
+
+// Buffer entry point for callers that already hold the whole image.
+int riscv64_boot_linux(uint8_t* kernel_data, uint64_t kernel_size, const char* initrd_path, const char* cmdline) {
+    return loader_load_mem(kernel_data, kernel_size, initrd_path, cmdline, &riscv64_image_format);
+}
+
+// OpenSBI stays resident underneath; the kernel talks to it over SBI.
+int riscv64_boot_opensbi(uint8_t* kernel_data, uint64_t kernel_size, const char* cmdline) {
+    return riscv64_boot_linux(kernel_data, kernel_size, NULL, cmdline);
+}
+
+int riscv64_verify_kernel(const char* kernel_path) {
+    return loader_verify(kernel_path, &riscv64_image_format);
+}
@@ -8,6 +8,17 @@
 #define BLOODHORN_RISCV64_H
 #include <stdint.h>
 #include "compat.h"
+#include "loader.h"
+
+// magic2, "RSC\x05" at offset 0x38 of the Image header
+#define RISCV64_IMAGE_MAGIC 0x05435352
+#define RISCV64_IMAGE_ALIGN 0x200000
+
+#define RISCV64_SBI_EXT_BASE 0x10
+#define RISCV64_SBI_BASE_PROBE 3
+#define RISCV64_SBI_EXT_HSM 0x48534D
+#define RISCV64_SBI_HSM_STATUS 2
+#define RISCV64_HSM_STOPPED 1
 
 struct riscv64_boot_params {
     uint64_t dtb_addr;
@@ -32,23 +43,13 @@ struct riscv64_linux_header {
     uint32_t version;
     uint32_t res1;
     uint64_t res2;
-    uint64_t res3;
-    uint64_t res4;
-    uint32_t magic;
-    uint32_t hdr_offset;
-    uint32_t hdr_size;
-    uint32_t end_offset;
-    uint32_t end_size;
-    uint64_t hdr_version;
-    uint64_t comp_version;
-    uint64_t name_offset;
-    uint64_t name_size;
-    uint64_t id_offset;
-    uint64_t id_size;
-    uint64_t hdr_string_offset;
-    uint64_t hdr_string_size;
+    uint64_t magic;
+    uint32_t magic2;
+    uint32_t res3;
 };
 
+extern const struct loader_format riscv64_image_format;
+
 int riscv64_load_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline);
 int riscv64_boot_linux(uint8_t* kernel_data, uint64_t kernel_size, const char* initrd_path, const char* cmdline);
 int riscv64_boot_opensbi(uint8_t* kernel_data, uint64_t kernel_size, const char* cmdline);
@@ -0,0 +1,409 @@
+/*
+ * BloodHorn Bootloader
+ *
+ * This file is part of BloodHorn and is licensed under the MIT License.
+ * See the root of the repository for license details.
+ */
+#include <stdint.h>
+#include "compat.h"
+#include <string.h>
+#include <Uefi.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Protocol/MpService.h>
+#include "smp.h"
+#include "memmap.h"
+#include "paging.h"
+#include "fwinfo.h"
+
+#define SMP_LOW_LIMIT 0xFFFFFULL
+#define SMP_MSR_APIC_BASE 0x1B
+#define SMP_MSR_EFER 0xC0000080
+#define SMP_MSR_X2APIC_ICR 0x830
+#define SMP_APIC_BASE_X2APIC 0x400
+#define SMP_APIC_ICR_LOW 0x300
+#define SMP_APIC_ICR_HIGH 0x310
+#define SMP_ICR_INIT 0x4500
+#define SMP_ICR_STARTUP 0x4600
+#define SMP_ICR_BUSY 0x1000
+#define SMP_INIT_DELAY_US 10000
+#define SMP_SIPI_DELAY_US 200
+
+#define SMP_CR4_PAE 0x20
+#define SMP_CR4_OSFXSR 0x200
+#define SMP_CR4_OSXMMEXCPT 0x400
+#define SMP_CR4_LA57 0x1000
+#define SMP_EFER_LME 0x100
+#define SMP_EFER_NXE 0x800
+
+// Trampoline page: real-mode code from offset 0, its data from 0x800
+#define SMP_TR_GDT 0x800
+#define SMP_TR_GDTR 0x820
+#define SMP_TR_PM_JUMP 0x828
+#define SMP_TR_LM_JUMP 0x830
+#define SMP_TR_CR4 0x838
+#define SMP_TR_CR3 0x83c
+#define SMP_TR_EFER 0x840
+#define SMP_TR_SLOT 0x844
+#define SMP_TR_STACKS 0x848
+#define SMP_TR_STACK_SIZE 0x850
+#define SMP_TR_ENTRY 0x858
+
+#define SMP_STR_(x) #x
+#define SMP_STR(x) SMP_STR_(x)
+
+struct smp_rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt;
+    uint32_t length;
+    uint64_t xsdt;
+    uint8_t ext_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+struct smp_sdt {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+static uint32_t smp_ids[SMP_MAX_CPUS];
+static uint32_t smp_id_count;
+static struct smp_cpu* smp_cpus;
+static uint32_t smp_count;
+static uint64_t smp_stacks;
+static uint64_t smp_stack_size;
+static uint64_t smp_trampoline;
+static uint64_t smp_virt_offset;
+static uint32_t smp_parked;
+static uint64_t smp_tsc_per_us;
+
+#if defined(__x86_64__)
+// Each AP wakes here in real mode at the trampoline page, climbs through
+// protected mode into long mode on the kernel's page tables, takes the
+// next stack slot and jumps into smp_ap_main.
+__asm__(
+    ".pushsection .text\n"
+    ".globl smp_trampoline_start\n.hidden smp_trampoline_start\n"
+    ".globl smp_trampoline_pm\n.hidden smp_trampoline_pm\n"
+    ".globl smp_trampoline_lm\n.hidden smp_trampoline_lm\n"
+    ".globl smp_trampoline_end\n.hidden smp_trampoline_end\n"
+    ".code16\n"
+    "smp_trampoline_start:\n"
+    "    cli\n"
+    "    cld\n"
+    "    xorl %ebx, %ebx\n"
+    "    movw %cs, %bx\n"
+    "    shll $4, %ebx\n"
+    "    movw %cs, %ax\n"
+    "    movw %ax, %ds\n"
+    "    lgdtl " SMP_STR(SMP_TR_GDTR) "\n"
+    "    movl %cr0, %eax\n"
+    "    orl $1, %eax\n"
+    "    movl %eax, %cr0\n"
+    "    ljmpl *" SMP_STR(SMP_TR_PM_JUMP) "\n"
+    ".code32\n"
+    "smp_trampoline_pm:\n"
+    "    movw $0x10, %ax\n"
+    "    movw %ax, %ds\n"
+    "    movw %ax, %es\n"
+    "    movw %ax, %ss\n"
+    "    movw %ax, %fs\n"
+    "    movw %ax, %gs\n"
+    "    movl " SMP_STR(SMP_TR_CR4) "(%ebx), %eax\n"
+    "    movl %eax, %cr4\n"
+    "    movl " SMP_STR(SMP_TR_CR3) "(%ebx), %eax\n"
+    "    movl %eax, %cr3\n"
+    "    movl $" SMP_STR(SMP_MSR_EFER) ", %ecx\n"
+    "    rdmsr\n"
+    "    orl " SMP_STR(SMP_TR_EFER) "(%ebx), %eax\n"
+    "    wrmsr\n"
+    "    movl $0x80010033, %eax\n"
+    "    movl %eax, %cr0\n"
+    "    ljmpl *" SMP_STR(SMP_TR_LM_JUMP) "(%ebx)\n"
+    ".code64\n"
+    "smp_trampoline_lm:\n"
+    "    movl %ebx, %ebx\n"
+    "    movl $1, %eax\n"
+    "    lock xaddl %eax, " SMP_STR(SMP_TR_SLOT) "(%rbx)\n"
+    "    leal 1(%rax), %edx\n"
+    "    imulq " SMP_STR(SMP_TR_STACK_SIZE) "(%rbx), %rdx\n"
+    "    movq " SMP_STR(SMP_TR_STACKS) "(%rbx), %rsp\n"
+    "    addq %rdx, %rsp\n"
+    "    movl %eax, %edi\n"
+    "    movl %eax, %ecx\n"
+    "    xorl %ebp, %ebp\n"
+    "    pushq $0\n"
+    "    jmpq *" SMP_STR(SMP_TR_ENTRY) "(%rbx)\n"
+    "smp_trampoline_end:\n"
+    ".popsection\n");
+
+extern const uint8_t smp_trampoline_start[];
+extern const uint8_t smp_trampoline_pm[];
+extern const uint8_t smp_trampoline_lm[];
+extern const uint8_t smp_trampoline_end[];
+
+static void smp_cpuid(uint32_t leaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    __asm__ __volatile__("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+static uint64_t smp_rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static void smp_wrmsr(uint32_t msr, uint64_t v) {
+    __asm__ __volatile__("wrmsr" : : "c"(msr), "a"((uint32_t)v), "d"((uint32_t)(v >> 32)));
+}
+
+static uint64_t smp_rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// After ExitBootServices there is no Stall(), so delays run off the TSC
+// calibrated against it beforehand.
+static void smp_delay_us(uint64_t us) {
+    uint64_t end = smp_rdtsc() + us * smp_tsc_per_us;
+    while (smp_rdtsc() < end) __asm__ __volatile__("pause");
+}
+
+// The x2APIC ID (leaf 0xB) works whatever mode the local APIC is in, which
+// matters for APs: INIT drops them back to xAPIC mode.
+static uint32_t smp_apic_id(void) {
+    uint32_t a, b, c, d;
+    smp_cpuid(0, &a, &b, &c, &d);
+    if (a >= 0xB) {
+        smp_cpuid(0xB, &a, &b, &c, &d);
+        if (b) return d;
+    }
+    smp_cpuid(1, &a, &b, &c, &d);
+    return b >> 24;
+}
+
+static void smp_ipi(const struct smp_info* info, uint32_t apic_id, uint32_t icr) {
+    if (info->x2apic) {
+        smp_wrmsr(SMP_MSR_X2APIC_ICR, ((uint64_t)apic_id << 32) | icr);
+        return;
+    }
+    volatile uint32_t* apic = (volatile uint32_t*)(uintptr_t)(smp_rdmsr(SMP_MSR_APIC_BASE) & PTE_ADDR_MASK);
+    apic[SMP_APIC_ICR_HIGH / 4] = apic_id << 24;
+    apic[SMP_APIC_ICR_LOW / 4] = icr;
+    while (apic[SMP_APIC_ICR_LOW / 4] & SMP_ICR_BUSY) __asm__ __volatile__("pause");
+}
+
+// Runs on each AP with the kernel's page tables and its own stack slot.
+// The record's goto_address is the only thing it waits on; the kernel
+// writes it (through whatever mapping it likes) to release the CPU.
+__attribute__((noreturn, used)) static void smp_ap_main(uint32_t slot) {
+    uint32_t id = smp_apic_id();
+    struct smp_cpu* cpu = NULL;
+    for (uint32_t i = 0; i < smp_count; ++i) {
+        if (smp_cpus[i].lapic_id == id && !(smp_cpus[i].flags & SMP_CPU_BSP)) cpu = &smp_cpus[i];
+    }
+    if (!cpu || slot + 1 >= smp_count) {
+        for (;;) __asm__ __volatile__("cli; hlt");
+    }
+    uint64_t stack_top = smp_stacks + (uint64_t)(slot + 1) * smp_stack_size;
+    __atomic_or_fetch(&cpu->flags, SMP_CPU_PARKED, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&smp_parked, 1, __ATOMIC_RELEASE);
+    uint64_t target;
+    while (!(target = __atomic_load_n(&cpu->goto_address, __ATOMIC_ACQUIRE))) __asm__ __volatile__("pause");
+    __asm__ __volatile__(
+        "mov %0, %%rsp\n\t"
+        "xor %%ebp, %%ebp\n\t"
+        "push $0\n\t"
+        "jmp *%2"
+        : : "r"(stack_top + smp_virt_offset), "D"((uintptr_t)cpu + smp_virt_offset), "r"(target) : "memory");
+    __builtin_unreachable();
+}
+#endif
+
+static void smp_add_id(uint32_t id) {
+    for (uint32_t i = 0; i < smp_id_count; ++i) {
+        if (smp_ids[i] == id) return;
+    }
+    if (smp_id_count < SMP_MAX_CPUS) smp_ids[smp_id_count++] = id;
+}
+
+static int smp_enum_mp_services(void) {
+    EFI_MP_SERVICES_PROTOCOL* mp = NULL;
+    UINTN total, enabled;
+    if (EFI_ERROR(gBS->LocateProtocol(&gEfiMpServiceProtocolGuid, NULL, (VOID**)&mp)) || !mp) return -1;
+    if (EFI_ERROR(mp->GetNumberOfProcessors(mp, &total, &enabled))) return -1;
+    for (UINTN i = 0; i < total; ++i) {
+        EFI_PROCESSOR_INFORMATION pi;
+        if (EFI_ERROR(mp->GetProcessorInfo(mp, i, &pi))) continue;
+        if ((pi.StatusFlag & (PROCESSOR_ENABLED_BIT | PROCESSOR_HEALTH_STATUS_BIT)) != (PROCESSOR_ENABLED_BIT | PROCESSOR_HEALTH_STATUS_BIT)) continue;
+        smp_add_id((uint32_t)pi.ProcessorId);
+    }
+    return smp_id_count ? 0 : -1;
+}
+
+// Without MP services the MADT is the CPU list: enabled local APIC and
+// x2APIC entries. Online-capable but disabled CPUs are left alone.
+static int smp_enum_madt(void) {
+    const struct smp_rsdp* rsdp = (const struct smp_rsdp*)(uintptr_t)fwinfo_acpi_rsdp(1);
+    if (!rsdp) rsdp = (const struct smp_rsdp*)(uintptr_t)fwinfo_acpi_rsdp(0);
+    if (!rsdp) return -1;
+    int wide = rsdp->revision >= 2 && rsdp->xsdt;
+    const struct smp_sdt* root = (const struct smp_sdt*)(uintptr_t)(wide ? rsdp->xsdt : rsdp->rsdt);
+    if (!root || root->length < sizeof(*root)) return -1;
+    uint32_t esize = wide ? 8 : 4;
+    const uint8_t* ptrs = (const uint8_t*)(root + 1);
+    for (uint32_t i = 0; i < (root->length - sizeof(*root)) / esize; ++i) {
+        uint64_t addr = 0;
+        memcpy(&addr, ptrs + i * esize, esize);
+        const struct smp_sdt* t = (const struct smp_sdt*)(uintptr_t)addr;
+        if (!t || memcmp(t->signature, "APIC", 4) != 0) continue;
+        const uint8_t* p = (const uint8_t*)(t + 1) + 8;
+        const uint8_t* end = (const uint8_t*)t + t->length;
+        while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+            uint32_t flags, id;
+            if (p[0] == 0 && p[1] >= 8) {
+                memcpy(&flags, p + 4, 4);
+                if (flags & 1) smp_add_id(p[3]);
+            } else if (p[0] == 9 && p[1] >= 16) {
+                memcpy(&id, p + 4, 4);
+                memcpy(&flags, p + 8, 4);
+                if (flags & 1) smp_add_id(id);
+            }
+            p += p[1];
+        }
+        return smp_id_count ? 0 : -1;
+    }
+    return -1;
+}
+
+// Enumerates CPUs and sets aside everything the APs will need -- records,
+// stacks and a trampoline page below 1 MiB -- while boot services still
+// exist. Returns the number of CPUs, BSP included.
+int smp_prepare(struct smp_info* info, uint64_t stack_size) {
+    memset(info, 0, sizeof(*info));
+#if defined(__x86_64__)
+    uint32_t bsp = smp_apic_id();
+    smp_id_count = 0;
+    smp_trampoline = 0;
+    smp_cpus = NULL;
+    smp_count = 0;
+    info->x2apic = (smp_rdmsr(SMP_MSR_APIC_BASE) & SMP_APIC_BASE_X2APIC) != 0;
+    info->bsp_lapic_id = bsp;
+    if (smp_enum_mp_services() != 0) smp_enum_madt();
+    smp_add_id(bsp);
+
+    info->cpus = memmap_alloc(smp_id_count * sizeof(struct smp_cpu), PAGING_4K, 0);
+    if (!info->cpus) return -1;
+    memset(info->cpus, 0, smp_id_count * sizeof(struct smp_cpu));
+    for (uint32_t i = 0; i < smp_id_count; ++i) {
+        info->cpus[i].processor_id = i;
+        info->cpus[i].lapic_id = smp_ids[i];
+        if (smp_ids[i] == bsp) info->cpus[i].flags = SMP_CPU_BSP | SMP_CPU_PARKED;
+    }
+    info->cpu_count = smp_id_count;
+    smp_cpus = info->cpus;
+    smp_count = info->cpu_count;
+    if (info->cpu_count < 2) return (int)info->cpu_count;
+
+    struct memmap_request req = { 0 };
+    req.size = PAGING_4K;
+    req.align = PAGING_4K;
+    req.min_addr = PAGING_4K;
+    req.max_addr = SMP_LOW_LIMIT;
+    smp_stack_size = stack_size > SMP_AP_STACK_SIZE ? (stack_size + 15) & ~15ULL : SMP_AP_STACK_SIZE;
+    smp_stacks = (uintptr_t)memmap_alloc((info->cpu_count - 1) * smp_stack_size, PAGING_4K, 0);
+    if (!smp_stacks || memmap_place(&req, &smp_trampoline) != 0) {
+        smp_trampoline = 0;
+        info->cpu_count = 1;
+        return 1;
+    }
+
+    uint64_t start = smp_rdtsc();
+    gBS->Stall(1000);
+    smp_tsc_per_us = (smp_rdtsc() - start) / 1000;
+    if (!smp_tsc_per_us) smp_tsc_per_us = 1;
+    return (int)info->cpu_count;
+#else
+    (void)stack_size;
+    return -1;
+#endif
+}
+
+// Starts every AP after ExitBootServices (the firmware's own MP driver
+// reclaims them at that point). INIT and both SIPIs go out as batches, so
+// the mandated delays are paid once rather than once per CPU. APs run on
+// cr3, which must sit below 4 GiB for the 32-bit hop; virt_offset is added
+// to the stack and record pointers they are released with. Returns the
+// number of parked APs.
+int smp_start(struct smp_info* info, uint64_t cr3, uint64_t virt_offset) {
+#if defined(__x86_64__)
+    if (info->cpu_count < 2 || !smp_trampoline) return 0;
+    if (cr3 >> 32) return -1;
+    uint8_t* tr = (uint8_t*)(uintptr_t)smp_trampoline;
+    uint64_t gdt[4] = { 0, 0x00cf9a000000ffffULL, 0x00cf92000000ffffULL, 0x00af9a000000ffffULL };
+    uint32_t u32;
+    uint16_t u16;
+    uint64_t u64;
+
+    memset(tr, 0, PAGING_4K);
+    memcpy(tr, smp_trampoline_start, smp_trampoline_end - smp_trampoline_start);
+    memcpy(tr + SMP_TR_GDT, gdt, sizeof(gdt));
+    u16 = sizeof(gdt) - 1;
+    u32 = (uint32_t)smp_trampoline + SMP_TR_GDT;
+    memcpy(tr + SMP_TR_GDTR, &u16, 2);
+    memcpy(tr + SMP_TR_GDTR + 2, &u32, 4);
+    u32 = (uint32_t)smp_trampoline + (uint32_t)(smp_trampoline_pm - smp_trampoline_start);
+    u16 = 0x08;
+    memcpy(tr + SMP_TR_PM_JUMP, &u32, 4);
+    memcpy(tr + SMP_TR_PM_JUMP + 4, &u16, 2);
+    u32 = (uint32_t)smp_trampoline + (uint32_t)(smp_trampoline_lm - smp_trampoline_start);
+    u16 = 0x18;
+    memcpy(tr + SMP_TR_LM_JUMP, &u32, 4);
+    memcpy(tr + SMP_TR_LM_JUMP + 4, &u16, 2);
+    u32 = SMP_CR4_PAE | SMP_CR4_OSFXSR | SMP_CR4_OSXMMEXCPT | (paging_levels_active() == 5 ? SMP_CR4_LA57 : 0);
+    memcpy(tr + SMP_TR_CR4, &u32, 4);
+    u32 = (uint32_t)cr3;
+    memcpy(tr + SMP_TR_CR3, &u32, 4);
+    u32 = SMP_EFER_LME | (uint32_t)(smp_rdmsr(SMP_MSR_EFER) & SMP_EFER_NXE);
+    memcpy(tr + SMP_TR_EFER, &u32, 4);
+    memcpy(tr + SMP_TR_STACKS, &smp_stacks, 8);
+    memcpy(tr + SMP_TR_STACK_SIZE, &smp_stack_size, 8);
+    u64 = (uintptr_t)smp_ap_main;
+    memcpy(tr + SMP_TR_ENTRY, &u64, 8);
+    smp_virt_offset = virt_offset;
+    __atomic_store_n(&smp_parked, 0, __ATOMIC_RELEASE);
+
+    uint32_t vector = (uint32_t)(smp_trampoline >> 12);
+    for (uint32_t i = 0; i < info->cpu_count; ++i) {
+        if (!(info->cpus[i].flags & SMP_CPU_BSP)) smp_ipi(info, info->cpus[i].lapic_id, SMP_ICR_INIT);
+    }
+    smp_delay_us(SMP_INIT_DELAY_US);
+    for (int round = 0; round < 2; ++round) {
+        for (uint32_t i = 0; i < info->cpu_count; ++i) {
+            if (!(__atomic_load_n(&info->cpus[i].flags, __ATOMIC_ACQUIRE) & SMP_CPU_PARKED)) smp_ipi(info, info->cpus[i].lapic_id, SMP_ICR_STARTUP | vector);
+        }
+        smp_delay_us(SMP_SIPI_DELAY_US);
+    }
+
+    uint64_t deadline = smp_rdtsc() + SMP_AP_TIMEOUT_US * smp_tsc_per_us;
+    while (__atomic_load_n(&smp_parked, __ATOMIC_ACQUIRE) < info->cpu_count - 1 && smp_rdtsc() < deadline) {
+        __asm__ __volatile__("pause");
+    }
+    info->parked = __atomic_load_n(&smp_parked, __ATOMIC_ACQUIRE);
+    return (int)info->parked;
+#else
+    (void)info;
+    (void)cr3;
+    (void)virt_offset;
+    return -1;
+#endif
+}
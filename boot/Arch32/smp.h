@@ -0,0 +1,43 @@
+/*
+ * BloodHorn Bootloader
+ *
+ * This file is part of BloodHorn and is licensed under the MIT License.
+ * See the root of the repository for license details.
+ */
+#ifndef BLOODHORN_SMP_H
+#define BLOODHORN_SMP_H
+#include <stdint.h>
+#include "compat.h"
+
+// Application processors are started by the loader, all at once, and left
+// spinning on their goto_address so the kernel only has to release them.
+#define SMP_MAX_CPUS 1024
+#define SMP_AP_STACK_SIZE 0x10000
+#define SMP_AP_TIMEOUT_US 100000
+
+#define SMP_CPU_BSP 0x1
+#define SMP_CPU_PARKED 0x2
+
+// Per-CPU record. The layout is Limine's smp_info (flags sits in its
+// reserved word) and BloodChain's SMP module entry, so both protocols hand
+// the kernel the very records the APs are polling.
+struct smp_cpu {
+    uint32_t processor_id;
+    uint32_t lapic_id;
+    uint64_t flags;
+    uint64_t goto_address;
+    uint64_t extra_argument;
+};
+
+struct smp_info {
+    uint32_t cpu_count;
+    uint32_t bsp_lapic_id;
+    uint32_t parked;
+    int x2apic;
+    struct smp_cpu* cpus;
+};
+
+int smp_prepare(struct smp_info* info, uint64_t stack_size);
+int smp_start(struct smp_info* info, uint64_t cr3, uint64_t virt_offset);
+
+#endif // BLOODHORN_SMP_H
@@ -0,0 +1,123 @@
+#include "decomp.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+
+static struct decomp_in decomp_input;
+
+int decomp_detect(const uint8_t* head, uint64_t len) {
+    if (len >= 3 && head[0] == 0x1F && head[1] == 0x8B && head[2] == 0x08) return DECOMP_GZIP;
+    if (len >= 4 && head[0] == 0x28 && head[1] == 0xB5 && head[2] == 0x2F && head[3] == 0xFD) return DECOMP_ZSTD;
+    if (len >= 4 && head[0] == 0x04 && head[1] == 0x22 && head[2] == 0x4D && head[3] == 0x18) return DECOMP_LZ4;
+    if (len >= 4 && head[0] == 0x02 && head[1] == 0x21 && head[2] == 0x4C && head[3] == 0x18) return DECOMP_LZ4;
+    if (len >= 6 && !memcmp(head, "\xFD" "7zXZ\0", 6)) return DECOMP_XZ;
+    return DECOMP_NONE;
+}
+
+int decomp_in_init(struct decomp_in* in, const struct decomp_src* src, uint64_t offset) {
+    if (offset > src->size) return -1;
+    in->src = src;
+    in->base = offset;
+    in->len = 0;
+    in->pos = 0;
+    return 0;
+}
+
+int decomp_in_fill(struct decomp_in* in) {
+    in->base += in->len;
+    in->pos = 0;
+    in->len = 0;
+    uint64_t left = in->src->size - in->base;
+    if (!left) return -1;
+    uint32_t n = left < DECOMP_IN_BUF ? (uint32_t)left : DECOMP_IN_BUF;
+    if (in->src->read(in->src->ctx, in->base, in->buf, n) != 0) return -1;
+    in->len = n;
+    return 0;
+}
+
+// Reads len bytes, or skips them when dst is NULL. Whatever the buffer
+// doesn't hold is read from the source straight into dst.
+int decomp_in_read(struct decomp_in* in, void* dst, uint64_t len) {
+    uint8_t* out = dst;
+    uint32_t have = in->len - in->pos;
+    uint32_t n = len < have ? (uint32_t)len : have;
+    if (out) {
+        memcpy(out, in->buf + in->pos, n);
+        out += n;
+    }
+    in->pos += n;
+    len -= n;
+    if (!len) return 0;
+    uint64_t at = decomp_in_offset(in);
+    if (len > in->src->size - at) return -1;
+    if (len >= DECOMP_IN_BUF || !out) {
+        if (out && in->src->read(in->src->ctx, at, out, len) != 0) return -1;
+        in->base = at + len;
+        in->len = 0;
+        in->pos = 0;
+        return 0;
+    }
+    if (decomp_in_fill(in) != 0) return -1;
+    memcpy(out, in->buf, len);
+    in->pos = (uint32_t)len;
+    return 0;
+}
+
+// Stored/raw blocks: input bytes go straight to the output.
+int decomp_in_copy(struct decomp_in* in, struct decomp_out* out, uint64_t len) {
+    int r = 0;
+    if (len > out->cap - out->pos) {
+        if (decomp_in_read(in, out->base ? out->base + out->pos : NULL, out->cap - out->pos) != 0) return -1;
+        out->pos = out->cap;
+        return DECOMP_FULL;
+    }
+    r = decomp_in_read(in, out->base ? out->base + out->pos : NULL, len);
+    out->pos += len;
+    return r;
+}
+
+static int decomp_decode(struct decomp_in* in, int type, struct decomp_out* out) {
+    switch (type) {
+    case DECOMP_GZIP:
+        return gzip_decode(in, out);
+    case DECOMP_ZSTD:
+        return zstd_decode(in, out);
+    case DECOMP_LZ4:
+        return lz4_decode(in, out);
+    case DECOMP_XZ:
+        return xz_decode(in, out);
+    default:
+        return -1;
+    }
+}
+
+// Decompressed size from the container where it records one, otherwise
+// by a counting pass that decodes without writing anything.
+int decomp_size(const struct decomp_src* src, int type, uint64_t* size) {
+    int r;
+    switch (type) {
+    case DECOMP_GZIP:
+        r = gzip_size(src, size);
+        break;
+    case DECOMP_ZSTD:
+        r = zstd_size(src, size);
+        break;
+    case DECOMP_LZ4:
+        r = lz4_size(src, size);
+        break;
+    case DECOMP_XZ:
+        return xz_size(src, size);
+    default:
+        return -1;
+    }
+    if (r == 0) return 0;
+    return decomp_run(src, type, NULL, ~0ULL, size) == 0 ? 0 : -1;
+}
+
+int decomp_run(const struct decomp_src* src, int type, void* dst, uint64_t cap, uint64_t* out_len) {
+    struct decomp_out out = { dst, 0, cap };
+    if (decomp_in_init(&decomp_input, src, 0) != 0) return -1;
+    int r = decomp_decode(&decomp_input, type, &out);
+    *out_len = out.pos;
+    return r;
+}
@@ -0,0 +1,134 @@
+#ifndef BLOODHORN_DECOMP_H
+#define BLOODHORN_DECOMP_H
+#include <stdint.h>
+#include "compat.h"
+#include <string.h>
+
+#define DECOMP_IN_BUF 0x10000
+
+#define DECOMP_NONE 0
+#define DECOMP_GZIP 1
+#define DECOMP_ZSTD 2
+#define DECOMP_LZ4 3
+#define DECOMP_XZ 4
+
+// Returned instead of 0 when the output cap was reached before the end of
+// the stream; used to decode just the head of an image.
+#define DECOMP_FULL 1
+
+// Match copies move this many bytes per step and may overrun by as much;
+// they are only used with that much room left before the output cap.
+#define DECOMP_WILD 32
+
+#define DECOMP_CPU_AVX2 (1 << 0)
+#define DECOMP_CPU_BMI2 (1 << 1)
+#define DECOMP_CPU_NEON (1 << 2)
+
+// Random-access byte source: a file being read from disk, or an image that
+// arrived over the network. Only the size lookups seek; decoding is one
+// forward pass.
+struct decomp_src {
+    int (*read)(void* ctx, uint64_t offset, void* dst, uint64_t len);
+    void* ctx;
+    uint64_t size;
+};
+
+struct decomp_in {
+    const struct decomp_src* src;
+    uint64_t base;
+    uint32_t len;
+    uint32_t pos;
+    uint8_t buf[DECOMP_IN_BUF];
+};
+
+// Output goes to its final address, which doubles as the history window.
+// A NULL base only counts bytes, for sizing streams whose headers don't
+// record it.
+struct decomp_out {
+    uint8_t* base;
+    uint64_t pos;
+    uint64_t cap;
+};
+
+static inline int decomp_src_read(const struct decomp_src* src, uint64_t offset, void* dst, uint64_t len) {
+    if (offset > src->size || len > src->size - offset) return -1;
+    return src->read(src->ctx, offset, dst, len);
+}
+
+int decomp_detect(const uint8_t* head, uint64_t len);
+int decomp_size(const struct decomp_src* src, int type, uint64_t* size);
+int decomp_run(const struct decomp_src* src, int type, void* dst, uint64_t cap, uint64_t* out_len);
+
+uint32_t decomp_cpu(void);
+void decomp_wild_match(uint8_t* dst, uint64_t dist, uint64_t len);
+
+int decomp_in_init(struct decomp_in* in, const struct decomp_src* src, uint64_t offset);
+int decomp_in_fill(struct decomp_in* in);
+int decomp_in_read(struct decomp_in* in, void* dst, uint64_t len);
+int decomp_in_copy(struct decomp_in* in, struct decomp_out* out, uint64_t len);
+
+static inline int decomp_in_byte(struct decomp_in* in) {
+    if (in->pos == in->len && decomp_in_fill(in) != 0) return -1;
+    return in->buf[in->pos++];
+}
+
+static inline uint64_t decomp_in_offset(const struct decomp_in* in) {
+    return in->base + in->pos;
+}
+
+static inline int decomp_in_eof(struct decomp_in* in) {
+    return decomp_in_offset(in) >= in->src->size;
+}
+
+static inline int decomp_put(struct decomp_out* out, uint8_t b) {
+    if (out->pos == out->cap) return DECOMP_FULL;
+    if (out->base) out->base[out->pos] = b;
+    out->pos++;
+    return 0;
+}
+
+// LZ77 back-reference; overlapping copies repeat the pattern.
+static inline int decomp_match(struct decomp_out* out, uint64_t dist, uint64_t len) {
+    int r = 0;
+    if (dist == 0 || dist > out->pos) return -1;
+    if (len > out->cap - out->pos) {
+        len = out->cap - out->pos;
+        r = DECOMP_FULL;
+    }
+    if (out->base) {
+        uint8_t* d = out->base + out->pos;
+        if (len <= 16 && dist >= 16 && out->cap - out->pos >= 16) {
+            memcpy(d, d - dist, 16);
+        } else if (out->cap - out->pos - len >= DECOMP_WILD) {
+            decomp_wild_match(d, dist, len);
+        } else {
+            const uint8_t* s = d - dist;
+            for (uint64_t i = 0; i < len; ++i) d[i] = s[i];
+        }
+    }
+    out->pos += len;
+    return r;
+}
+
+static inline int decomp_write(struct decomp_out* out, const uint8_t* src, uint64_t len) {
+    int r = 0;
+    if (len > out->cap - out->pos) {
+        len = out->cap - out->pos;
+        r = DECOMP_FULL;
+    }
+    if (out->base) memcpy(out->base + out->pos, src, len);
+    out->pos += len;
+    return r;
+}
+
+// Decoders; each consumes every frame/member in the source.
+int gzip_decode(struct decomp_in* in, struct decomp_out* out);
+int gzip_size(const struct decomp_src* src, uint64_t* size);
+int zstd_decode(struct decomp_in* in, struct decomp_out* out);
+int zstd_size(const struct decomp_src* src, uint64_t* size);
+int lz4_decode(struct decomp_in* in, struct decomp_out* out);
+int lz4_size(const struct decomp_src* src, uint64_t* size);
+int xz_decode(struct decomp_in* in, struct decomp_out* out);
+int xz_size(const struct decomp_src* src, uint64_t* size);
+
+#endif
@@ -0,0 +1,324 @@
+#include "decomp.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+
+// DEFLATE (RFC 1951) inside gzip members (RFC 1952).
+
+#define INF_MAX_BITS 15
+#define INF_FAST_BITS 10
+#define INF_MAX_LIT 288
+#define INF_MAX_DIST 30
+
+#define GZIP_FHCRC 0x02
+#define GZIP_FEXTRA 0x04
+#define GZIP_FNAME 0x08
+#define GZIP_FCOMMENT 0x10
+
+// Codes up to INF_FAST_BITS resolve with one lookup (symbol | length << 9);
+// longer ones fall back to the canonical count/symbol walk.
+struct inf_huff {
+    uint16_t fast[1 << INF_FAST_BITS];
+    uint16_t count[INF_MAX_BITS + 1];
+    uint16_t symbol[INF_MAX_LIT];
+};
+
+struct inf_state {
+    struct decomp_in* in;
+    uint64_t bits;
+    uint32_t nbits;
+};
+
+static struct inf_huff inf_lit;
+static struct inf_huff inf_dist;
+static struct inf_huff inf_lens;
+static struct inf_huff inf_fixed_lit;
+static struct inf_huff inf_fixed_dist;
+static int inf_fixed_built;
+
+static const uint16_t inf_len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t inf_len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t inf_dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t inf_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t inf_clen_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+static int inf_need(struct inf_state* s, uint32_t n) {
+    while (s->nbits <= 56) {
+        int c = decomp_in_byte(s->in);
+        if (c < 0) break;
+        s->bits |= (uint64_t)c << s->nbits;
+        s->nbits += 8;
+    }
+    return s->nbits >= n ? 0 : -1;
+}
+
+static int inf_bits(struct inf_state* s, uint32_t n, uint32_t* v) {
+    if (s->nbits < n && inf_need(s, n) != 0) return -1;
+    *v = (uint32_t)(s->bits & ((1ULL << n) - 1));
+    s->bits >>= n;
+    s->nbits -= n;
+    return 0;
+}
+
+// Byte-level reads after a block or member; bytes already pulled into the
+// bit buffer come first.
+static int inf_byte(struct inf_state* s) {
+    uint32_t v;
+    if (s->nbits >= 8) {
+        v = (uint32_t)(s->bits & 0xFF);
+        s->bits >>= 8;
+        s->nbits -= 8;
+        return (int)v;
+    }
+    return decomp_in_byte(s->in);
+}
+
+static void inf_align(struct inf_state* s) {
+    s->bits >>= s->nbits & 7;
+    s->nbits &= ~7u;
+}
+
+static int inf_build(struct inf_huff* h, const uint8_t* lengths, int n) {
+    uint16_t offs[INF_MAX_BITS + 1];
+    memset(h->count, 0, sizeof(h->count));
+    memset(h->fast, 0, sizeof(h->fast));
+    for (int i = 0; i < n; ++i) h->count[lengths[i]]++;
+    if (h->count[0] == n) return 0;
+    int left = 1;
+    for (int len = 1; len <= INF_MAX_BITS; ++len) {
+        left = (left << 1) - h->count[len];
+        if (left < 0) return -1;
+    }
+    offs[1] = 0;
+    for (int len = 1; len < INF_MAX_BITS; ++len) offs[len + 1] = offs[len] + h->count[len];
+    for (int i = 0; i < n; ++i) {
+        if (lengths[i]) h->symbol[offs[lengths[i]]++] = (uint16_t)i;
+    }
+    // Canonical codes are assigned in symbol order within each length;
+    // the table is indexed by the bit-reversed code as it arrives.
+    uint32_t code = 0;
+    int k = 0;
+    for (int len = 1; len <= INF_FAST_BITS; ++len) {
+        for (int j = 0; j < h->count[len]; ++j, ++k) {
+            uint32_t rev = 0;
+            for (int b = 0; b < len; ++b) rev |= ((code >> b) & 1) << (len - 1 - b);
+            for (uint32_t f = rev; f < (1u << INF_FAST_BITS); f += 1u << len) {
+                h->fast[f] = (uint16_t)(h->symbol[k] | (len << 9));
+            }
+            code++;
+        }
+        code <<= 1;
+    }
+    return 0;
+}
+
+static int inf_decode(struct inf_state* s, const struct inf_huff* h) {
+    if (s->nbits < INF_MAX_BITS) inf_need(s, INF_MAX_BITS);
+    uint32_t e = h->fast[s->bits & ((1u << INF_FAST_BITS) - 1)];
+    if (e) {
+        uint32_t len = e >> 9;
+        if (len > s->nbits) return -1;
+        s->bits >>= len;
+        s->nbits -= len;
+        return (int)(e & 0x1FF);
+    }
+    int code = 0, first = 0, index = 0;
+    for (uint32_t len = 1; len <= INF_MAX_BITS && len <= s->nbits; ++len) {
+        code |= (int)((s->bits >> (len - 1)) & 1);
+        int count = h->count[len];
+        if (code - count < first) {
+            s->bits >>= len;
+            s->nbits -= len;
+            return h->symbol[index + (code - first)];
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+static int inf_fixed(void) {
+    uint8_t lengths[INF_MAX_LIT];
+    if (inf_fixed_built) return 0;
+    int i = 0;
+    for (; i < 144; ++i) lengths[i] = 8;
+    for (; i < 256; ++i) lengths[i] = 9;
+    for (; i < 280; ++i) lengths[i] = 7;
+    for (; i < INF_MAX_LIT; ++i) lengths[i] = 8;
+    if (inf_build(&inf_fixed_lit, lengths, INF_MAX_LIT) != 0) return -1;
+    for (i = 0; i < INF_MAX_DIST; ++i) lengths[i] = 5;
+    if (inf_build(&inf_fixed_dist, lengths, INF_MAX_DIST) != 0) return -1;
+    inf_fixed_built = 1;
+    return 0;
+}
+
+static int inf_dynamic(struct inf_state* s) {
+    uint8_t lengths[INF_MAX_LIT + INF_MAX_DIST];
+    uint32_t hlit, hdist, hclen, v;
+    if (inf_bits(s, 5, &hlit) || inf_bits(s, 5, &hdist) || inf_bits(s, 4, &hclen)) return -1;
+    hlit += 257;
+    hdist += 1;
+    hclen += 4;
+    if (hlit > 286 || hdist > INF_MAX_DIST) return -1;
+    memset(lengths, 0, 19);
+    for (uint32_t i = 0; i < hclen; ++i) {
+        if (inf_bits(s, 3, &v)) return -1;
+        lengths[inf_clen_order[i]] = (uint8_t)v;
+    }
+    if (inf_build(&inf_lens, lengths, 19) != 0) return -1;
+    uint32_t n = 0;
+    while (n < hlit + hdist) {
+        int sym = inf_decode(s, &inf_lens);
+        uint32_t rep;
+        uint8_t len = 0;
+        if (sym < 0) return -1;
+        if (sym < 16) {
+            lengths[n++] = (uint8_t)sym;
+            continue;
+        }
+        if (sym == 16) {
+            if (!n || inf_bits(s, 2, &rep)) return -1;
+            len = lengths[n - 1];
+            rep += 3;
+        } else if (sym == 17) {
+            if (inf_bits(s, 3, &rep)) return -1;
+            rep += 3;
+        } else {
+            if (inf_bits(s, 7, &rep)) return -1;
+            rep += 11;
+        }
+        if (n + rep > hlit + hdist) return -1;
+        while (rep--) lengths[n++] = len;
+    }
+    if (!lengths[256]) return -1;
+    if (inf_build(&inf_lit, lengths, hlit) != 0 || inf_build(&inf_dist, lengths + hlit, hdist) != 0) return -1;
+    return 0;
+}
+
+static int inf_codes(struct inf_state* s, struct decomp_out* out, const struct inf_huff* lit, const struct inf_huff* dist) {
+    for (;;) {
+        int sym = inf_decode(s, lit);
+        uint32_t extra;
+        int r;
+        if (sym < 0) return -1;
+        if (sym < 256) {
+            if ((r = decomp_put(out, (uint8_t)sym)) != 0) return r;
+            continue;
+        }
+        if (sym == 256) return 0;
+        sym -= 257;
+        if (sym >= 29 || inf_bits(s, inf_len_extra[sym], &extra)) return -1;
+        uint32_t len = inf_len_base[sym] + extra;
+        int dsym = inf_decode(s, dist);
+        if (dsym < 0 || dsym >= INF_MAX_DIST || inf_bits(s, inf_dist_extra[dsym], &extra)) return -1;
+        if ((r = decomp_match(out, inf_dist_base[dsym] + extra, len)) != 0) return r;
+    }
+}
+
+static int inf_stored(struct inf_state* s, struct decomp_out* out) {
+    inf_align(s);
+    int b0 = inf_byte(s), b1 = inf_byte(s), b2 = inf_byte(s), b3 = inf_byte(s);
+    if (b3 < 0) return -1;
+    uint32_t len = (uint32_t)(b0 | (b1 << 8));
+    if ((len ^ 0xFFFF) != (uint32_t)(b2 | (b3 << 8))) return -1;
+    while (len && s->nbits) {
+        int r = decomp_put(out, (uint8_t)inf_byte(s));
+        if (r) return r;
+        len--;
+    }
+    return decomp_in_copy(s->in, out, len);
+}
+
+static int inf_blocks(struct inf_state* s, struct decomp_out* out) {
+    uint32_t last, type;
+    do {
+        int r;
+        if (inf_bits(s, 1, &last) || inf_bits(s, 2, &type)) return -1;
+        if (type == 0) {
+            r = inf_stored(s, out);
+        } else if (type == 1) {
+            r = inf_fixed() != 0 ? -1 : inf_codes(s, out, &inf_fixed_lit, &inf_fixed_dist);
+        } else if (type == 2) {
+            r = inf_dynamic(s) != 0 ? -1 : inf_codes(s, out, &inf_lit, &inf_dist);
+        } else {
+            return -1;
+        }
+        if (r) return r;
+    } while (!last);
+    return 0;
+}
+
+static int gzip_header(struct inf_state* s) {
+    uint8_t h[10];
+    for (int i = 0; i < 10; ++i) {
+        int c = inf_byte(s);
+        if (c < 0) return -1;
+        h[i] = (uint8_t)c;
+    }
+    if (h[0] != 0x1F || h[1] != 0x8B || h[2] != 0x08) return -1;
+    if (h[3] & GZIP_FEXTRA) {
+        int lo = inf_byte(s), hi = inf_byte(s);
+        if (hi < 0) return -1;
+        for (int n = lo | (hi << 8); n > 0; --n) {
+            if (inf_byte(s) < 0) return -1;
+        }
+    }
+    for (int flag = GZIP_FNAME; flag <= GZIP_FCOMMENT; flag <<= 1) {
+        if (!(h[3] & flag)) continue;
+        int c;
+        while ((c = inf_byte(s)) > 0) {
+        }
+        if (c < 0) return -1;
+    }
+    if (h[3] & GZIP_FHCRC) {
+        if (inf_byte(s) < 0 || inf_byte(s) < 0) return -1;
+    }
+    return 0;
+}
+
+// Members are decoded back to back until the input runs out or something
+// other than a gzip header (such as zero padding) follows. The CRC32 is not
+// recomputed; ISIZE is checked against what the member produced.
+int gzip_decode(struct decomp_in* in, struct decomp_out* out) {
+    struct inf_state s = { in, 0, 0 };
+    for (;;) {
+        if (gzip_header(&s) != 0) return -1;
+        uint64_t start = out->pos;
+        int r = inf_blocks(&s, out);
+        if (r) return r;
+        inf_align(&s);
+        uint32_t isize = 0;
+        for (int i = 0; i < 8; ++i) {
+            int c = inf_byte(&s);
+            if (c < 0) return -1;
+            if (i >= 4) isize |= (uint32_t)c << ((i - 4) * 8);
+        }
+        if ((uint32_t)(out->pos - start) != isize) return -1;
+        // The bit buffer is byte aligned here, so a peeked byte can be
+        // put back at its bottom.
+        if (!s.nbits) {
+            int c = decomp_in_byte(in);
+            if (c < 0) return 0;
+            s.bits = (uint64_t)c;
+            s.nbits = 8;
+        }
+        if ((s.bits & 0xFF) != 0x1F) return 0;
+    }
+}
+
+// gzip records no usable size: ISIZE covers only the last member, modulo
+// 4 GiB, and trailing padding hides it. decomp_size counts instead.
+int gzip_size(const struct decomp_src* src, uint64_t* size) {
+    (void)src; (void)size;
+    return -1;
+}
@@ -0,0 +1,183 @@
+#include "decomp.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+
+// LZ4 frames, and the legacy format the Linux build uses for lz4 kernels
+// and initramfs images.
+
+#define LZ4_FRAME_MAGIC 0x184D2204U
+#define LZ4_LEGACY_MAGIC 0x184C2102U
+#define LZ4_SKIP_MAGIC 0x184D2A50U
+#define LZ4_SKIP_MASK 0xFFFFFFF0U
+#define LZ4_LEGACY_BOUND (0x800000U + 0x800000U / 255 + 16)
+
+#define LZ4_FLG_BLOCK_CHECKSUM 0x10
+#define LZ4_FLG_CONTENT_SIZE 0x08
+#define LZ4_FLG_CONTENT_CHECKSUM 0x04
+#define LZ4_FLG_DICT_ID 0x01
+
+static uint32_t lz4_get32(const uint8_t* b) {
+    return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static int lz4_le32(struct decomp_in* in, uint32_t* v) {
+    uint8_t b[4];
+    if (decomp_in_read(in, b, 4) != 0) return -1;
+    *v = lz4_get32(b);
+    return 0;
+}
+
+// Length nibble 15 continues in 255-valued bytes.
+static int lz4_length(struct decomp_in* in, uint64_t* left, uint32_t* len) {
+    int c;
+    do {
+        if (!*left) return -1;
+        c = decomp_in_byte(in);
+        if (c < 0) return -1;
+        (*left)--;
+        *len += (uint32_t)c;
+    } while (c == 255);
+    return 0;
+}
+
+// One block of sequences, size bytes long. Literals are read from the
+// source straight into the output.
+static int lz4_block(struct decomp_in* in, struct decomp_out* out, uint64_t size) {
+    uint64_t left = size;
+    while (left) {
+        // Short sequences, the common case, are taken straight from the
+        // input buffer with one 16-byte literal copy.
+        if (left >= 19 && in->len - in->pos >= 19 && out->base && out->cap - out->pos >= 32) {
+            const uint8_t* ip = in->buf + in->pos;
+            uint32_t lit = ip[0] >> 4, ml = ip[0] & 15;
+            if (lit < 15 && ml < 15) {
+                int r;
+                memcpy(out->base + out->pos, ip + 1, 16);
+                out->pos += lit;
+                in->pos += 3 + lit;
+                left -= 3 + lit;
+                if ((r = decomp_match(out, (uint32_t)(ip[1 + lit] | (ip[2 + lit] << 8)), ml + 4)) != 0) return r;
+                continue;
+            }
+        }
+        int token = decomp_in_byte(in);
+        int r;
+        if (token < 0) return -1;
+        left--;
+        uint32_t lit = (uint32_t)token >> 4;
+        if (lit == 15 && lz4_length(in, &left, &lit) != 0) return -1;
+        if (lit > left) return -1;
+        if ((r = decomp_in_copy(in, out, lit)) != 0) return r;
+        left -= lit;
+        if (!left) break;
+        if (left < 2) return -1;
+        int lo = decomp_in_byte(in), hi = decomp_in_byte(in);
+        if (hi < 0) return -1;
+        left -= 2;
+        uint32_t len = ((uint32_t)token & 15);
+        if (len == 15 && lz4_length(in, &left, &len) != 0) return -1;
+        if ((r = decomp_match(out, (uint32_t)(lo | (hi << 8)), len + 4)) != 0) return r;
+    }
+    return 0;
+}
+
+static int lz4_frame(struct decomp_in* in, struct decomp_out* out) {
+    uint8_t flg[2];
+    if (decomp_in_read(in, flg, 2) != 0 || (flg[0] & 0xC0) != 0x40) return -1;
+    uint32_t skip = 1;
+    if (flg[0] & LZ4_FLG_CONTENT_SIZE) skip += 8;
+    if (flg[0] & LZ4_FLG_DICT_ID) return -1;
+    if (decomp_in_read(in, NULL, skip) != 0) return -1;
+    for (;;) {
+        uint32_t bsize;
+        int r;
+        if (lz4_le32(in, &bsize) != 0) return -1;
+        if (!bsize) break;
+        if (bsize & 0x80000000U) {
+            r = decomp_in_copy(in, out, bsize & 0x7FFFFFFFU);
+        } else {
+            r = lz4_block(in, out, bsize);
+        }
+        if (r) return r;
+        if ((flg[0] & LZ4_FLG_BLOCK_CHECKSUM) && decomp_in_read(in, NULL, 4) != 0) return -1;
+    }
+    if ((flg[0] & LZ4_FLG_CONTENT_CHECKSUM) && decomp_in_read(in, NULL, 4) != 0) return -1;
+    return 0;
+}
+
+// Legacy streams have no end mark: blocks run until the input ends or a
+// word that can't be a block size shows up. That is either the next
+// stream's magic or the size trailer the kernel build appends.
+static int lz4_legacy(struct decomp_in* in, struct decomp_out* out, uint32_t* next) {
+    *next = 0;
+    while (!decomp_in_eof(in)) {
+        uint32_t bsize;
+        if (lz4_le32(in, &bsize) != 0) return -1;
+        if (bsize > LZ4_LEGACY_BOUND || bsize > in->src->size - decomp_in_offset(in)) {
+            *next = bsize;
+            return 0;
+        }
+        int r = lz4_block(in, out, bsize);
+        if (r) return r;
+    }
+    return 0;
+}
+
+// Frames (and skippable frames) run back to back; checksums are skipped.
+int lz4_decode(struct decomp_in* in, struct decomp_out* out) {
+    uint32_t magic;
+    if (lz4_le32(in, &magic) != 0) return -1;
+    for (;;) {
+        int r;
+        if (magic == LZ4_FRAME_MAGIC) {
+            if ((r = lz4_frame(in, out)) != 0) return r;
+            magic = 0;
+        } else if (magic == LZ4_LEGACY_MAGIC) {
+            if ((r = lz4_legacy(in, out, &magic)) != 0) return r;
+        } else if ((magic & LZ4_SKIP_MASK) == LZ4_SKIP_MAGIC) {
+            uint32_t len;
+            if (lz4_le32(in, &len) != 0 || decomp_in_read(in, NULL, len) != 0) return -1;
+            magic = 0;
+        } else {
+            return 0;
+        }
+        if (!magic) {
+            if (decomp_in_eof(in)) return 0;
+            if (lz4_le32(in, &magic) != 0) return 0;
+        }
+    }
+}
+
+// Only frames that record their content size can be sized without a
+// counting pass; the block headers are walked to find where each ends.
+int lz4_size(const struct decomp_src* src, uint64_t* size) {
+    uint64_t off = 0, total = 0;
+    while (src->size - off >= 4) {
+        uint8_t h[14];
+        uint32_t bsize;
+        if (decomp_src_read(src, off, h, 4) != 0) return -1;
+        uint32_t magic = lz4_get32(h);
+        if ((magic & LZ4_SKIP_MASK) == LZ4_SKIP_MAGIC) {
+            if (decomp_src_read(src, off + 4, h, 4) != 0) return -1;
+            off += 8 + (uint64_t)lz4_get32(h);
+            continue;
+        }
+        if (magic != LZ4_FRAME_MAGIC) break;
+        if (decomp_src_read(src, off, h, sizeof(h)) != 0 || !(h[4] & LZ4_FLG_CONTENT_SIZE)) return -1;
+        if (h[4] & LZ4_FLG_DICT_ID) return -1;
+        total += (uint64_t)lz4_get32(h + 6) | ((uint64_t)lz4_get32(h + 10) << 32);
+        off += sizeof(h) + 1;
+        do {
+            if (decomp_src_read(src, off, h, 4) != 0) return -1;
+            bsize = lz4_get32(h);
+            off += 4;
+            if (bsize) off += (bsize & 0x7FFFFFFFU) + ((h[4] & LZ4_FLG_BLOCK_CHECKSUM) ? 4 : 0);
+        } while (bsize);
+        if (h[4] & LZ4_FLG_CONTENT_CHECKSUM) off += 4;
+        if (off > src->size) return -1;
+    }
+    if (!off) return -1;
+    *size = total;
+    return 0;
+}
@@ -0,0 +1,139 @@
+#include "decomp.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Match copies for the LZ decoders. Every kernel moves DECOMP_WILD bytes
+// per step, so it may write up to DECOMP_WILD - 1 bytes past the end and
+// needs the source at least DECOMP_WILD bytes behind. The kernel is
+// picked by CPU probing on first use; all of them produce the same bytes.
+
+static uint32_t decomp_features;
+static int decomp_probed;
+
+#if defined(__x86_64__)
+static void decomp_cpuid(uint32_t leaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    __asm__ __volatile__("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+// AVX2 also needs the YMM state enabled in XCR0, which firmware does not
+// always do.
+static uint32_t decomp_probe(void) {
+    uint32_t a, b, c, d, lo, hi, f = 0;
+    decomp_cpuid(0, &a, &b, &c, &d);
+    if (a < 7) return 0;
+    decomp_cpuid(7, &a, &b, &c, &d);
+    if (b & (1u << 8)) f |= DECOMP_CPU_BMI2;
+    uint32_t leaf7_b = b;
+    decomp_cpuid(1, &a, &b, &c, &d);
+    if ((c & (1u << 27)) && (c & (1u << 28))) {
+        __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        if ((lo & 6) == 6 && (leaf7_b & (1u << 5))) f |= DECOMP_CPU_AVX2;
+    }
+    return f;
+}
+#elif defined(__aarch64__)
+static uint32_t decomp_probe(void) {
+    uint64_t pfr0;
+    __asm__ __volatile__("mrs %0, id_aa64pfr0_el1" : "=r"(pfr0));
+    return ((pfr0 >> 20) & 0xF) != 0xF ? DECOMP_CPU_NEON : 0;
+}
+#else
+static uint32_t decomp_probe(void) {
+    return 0;
+}
+#endif
+
+uint32_t decomp_cpu(void) {
+    if (!decomp_probed) {
+        decomp_features = decomp_probe();
+        decomp_probed = 1;
+    }
+    return decomp_features;
+}
+
+static void decomp_copy_scalar(uint8_t* d, const uint8_t* s, uint64_t len) {
+    uint8_t* end = d + len;
+    do {
+        uint64_t w[4];
+        memcpy(w, s, sizeof(w));
+        memcpy(d, w, sizeof(w));
+        d += DECOMP_WILD;
+        s += DECOMP_WILD;
+    } while (d < end);
+}
+
+#if defined(__x86_64__)
+static void decomp_copy_sse2(uint8_t* d, const uint8_t* s, uint64_t len) {
+    uint8_t* end = d + len;
+    do {
+        __m128i v0 = _mm_loadu_si128((const __m128i*)s);
+        __m128i v1 = _mm_loadu_si128((const __m128i*)(s + 16));
+        _mm_storeu_si128((__m128i*)d, v0);
+        _mm_storeu_si128((__m128i*)(d + 16), v1);
+        d += DECOMP_WILD;
+        s += DECOMP_WILD;
+    } while (d < end);
+}
+
+__attribute__((target("avx2")))
+static void decomp_copy_avx2(uint8_t* d, const uint8_t* s, uint64_t len) {
+    uint8_t* end = d + len;
+    do {
+        _mm256_storeu_si256((__m256i*)d, _mm256_loadu_si256((const __m256i*)s));
+        d += DECOMP_WILD;
+        s += DECOMP_WILD;
+    } while (d < end);
+}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+static void decomp_copy_neon(uint8_t* d, const uint8_t* s, uint64_t len) {
+    uint8_t* end = d + len;
+    do {
+        uint8x16_t v0 = vld1q_u8(s);
+        uint8x16_t v1 = vld1q_u8(s + 16);
+        vst1q_u8(d, v0);
+        vst1q_u8(d + 16, v1);
+        d += DECOMP_WILD;
+        s += DECOMP_WILD;
+    } while (d < end);
+}
+#endif
+
+static void decomp_copy_pick(uint8_t* d, const uint8_t* s, uint64_t len);
+static void (*decomp_copy)(uint8_t* d, const uint8_t* s, uint64_t len) = decomp_copy_pick;
+
+static void decomp_copy_pick(uint8_t* d, const uint8_t* s, uint64_t len) {
+    uint32_t f = decomp_cpu();
+    decomp_copy = decomp_copy_scalar;
+#if defined(__x86_64__)
+    decomp_copy = (f & DECOMP_CPU_AVX2) ? decomp_copy_avx2 : decomp_copy_sse2;
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    if (f & DECOMP_CPU_NEON) decomp_copy = decomp_copy_neon;
+#endif
+    (void)f;
+    decomp_copy(d, s, len);
+}
+
+// Close matches repeat a short pattern. Distances under 8 are widened to
+// the first multiple of the pattern that is at least 8, after writing the
+// few bytes that wider distance would reach back past; from there 8-byte
+// steps read only finished output.
+void decomp_wild_match(uint8_t* d, uint64_t dist, uint64_t len) {
+    if (dist >= DECOMP_WILD) {
+        decomp_copy(d, d - dist, len);
+        return;
+    }
+    uint64_t step = dist, i = 0;
+    while (step < 8) step += dist;
+    for (; i < step - dist && i < len; ++i) d[i] = d[i - dist];
+    for (; i < len; i += 8) {
+        uint64_t w;
+        memcpy(&w, d + i - step, 8);
+        memcpy(d + i, &w, 8);
+    }
+}
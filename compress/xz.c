@@ -0,0 +1,515 @@
+#include "decomp.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+
+// .xz containers with LZMA2, optionally behind the x86 or ARM64 BCJ
+// filter that the kernel build applies. Block and index CRCs are not
+// checked.
+
+#define XZ_HEADER_SIZE 12
+#define XZ_FILTER_X86 0x04
+#define XZ_FILTER_ARM64 0x0A
+#define XZ_FILTER_LZMA2 0x21
+#define XZ_INDEX_MAX 4096
+
+#define LZMA_STATES 12
+#define LZMA_POS_STATES_MAX 16
+#define LZMA_LIT_STATES 7
+#define LZMA_MATCH_LEN_MIN 2
+#define LZMA_DIST_STATES 4
+#define LZMA_DIST_SLOTS 64
+#define LZMA_DIST_MODEL_END 14
+#define LZMA_FULL_DISTANCES 128
+#define LZMA_ALIGN_BITS 4
+#define LZMA_PROB_INIT 1024
+
+static const uint8_t xz_magic[6] = { 0xFD, '7', 'z', 'X', 'Z', 0x00 };
+
+struct lzma_len_probs {
+    uint16_t choice;
+    uint16_t choice2;
+    uint16_t low[LZMA_POS_STATES_MAX][8];
+    uint16_t mid[LZMA_POS_STATES_MAX][8];
+    uint16_t high[256];
+};
+
+// Every field is a probability, so a state reset fills the whole struct.
+struct lzma_probs {
+    uint16_t is_match[LZMA_STATES][LZMA_POS_STATES_MAX];
+    uint16_t is_rep[LZMA_STATES];
+    uint16_t is_rep0[LZMA_STATES];
+    uint16_t is_rep1[LZMA_STATES];
+    uint16_t is_rep2[LZMA_STATES];
+    uint16_t is_rep0_long[LZMA_STATES][LZMA_POS_STATES_MAX];
+    uint16_t dist_slot[LZMA_DIST_STATES][LZMA_DIST_SLOTS];
+    uint16_t dist_special[LZMA_FULL_DISTANCES - LZMA_DIST_MODEL_END];
+    uint16_t dist_align[1 << LZMA_ALIGN_BITS];
+    struct lzma_len_probs match_len;
+    struct lzma_len_probs rep_len;
+    uint16_t literal[16][0x300];
+};
+
+struct lzma_rc {
+    struct decomp_in* in;
+    uint32_t range;
+    uint32_t code;
+    int error;
+};
+
+// LZMA positions (pos_state, literal context, and how far back a match
+// may reach) count from the last dictionary reset.
+struct lzma_state {
+    struct lzma_rc rc;
+    uint32_t state;
+    uint32_t rep[4];
+    uint32_t lc, lp, pb;
+    uint32_t pending;
+    uint64_t dict_start;
+    int have_props;
+};
+
+static struct lzma_probs lzma_probs;
+static struct lzma_state lzma;
+static uint8_t xz_index[XZ_INDEX_MAX];
+
+static int lzma_byte(struct lzma_rc* rc) {
+    int c = decomp_in_byte(rc->in);
+    if (c < 0) {
+        rc->error = 1;
+        return 0;
+    }
+    return c;
+}
+
+static inline void lzma_normalize(struct lzma_rc* rc) {
+    if (rc->range < (1u << 24)) {
+        rc->range <<= 8;
+        rc->code = (rc->code << 8) | (uint32_t)lzma_byte(rc);
+    }
+}
+
+static inline uint32_t lzma_bit(struct lzma_rc* rc, uint16_t* prob) {
+    lzma_normalize(rc);
+    uint32_t bound = (rc->range >> 11) * *prob;
+    if (rc->code < bound) {
+        rc->range = bound;
+        *prob += (2048 - *prob) >> 5;
+        return 0;
+    }
+    rc->range -= bound;
+    rc->code -= bound;
+    *prob -= *prob >> 5;
+    return 1;
+}
+
+static uint32_t lzma_tree(struct lzma_rc* rc, uint16_t* probs, uint32_t bits) {
+    uint32_t sym = 1;
+    for (uint32_t i = 0; i < bits; ++i) sym = (sym << 1) | lzma_bit(rc, &probs[sym]);
+    return sym - (1u << bits);
+}
+
+static uint32_t lzma_tree_reverse(struct lzma_rc* rc, uint16_t* probs, uint32_t bits) {
+    uint32_t sym = 1, v = 0;
+    for (uint32_t i = 0; i < bits; ++i) {
+        uint32_t bit = lzma_bit(rc, &probs[sym]);
+        sym = (sym << 1) | bit;
+        v |= bit << i;
+    }
+    return v;
+}
+
+static uint32_t lzma_direct(struct lzma_rc* rc, uint32_t bits) {
+    uint32_t v = 0;
+    while (bits--) {
+        lzma_normalize(rc);
+        rc->range >>= 1;
+        rc->code -= rc->range;
+        uint32_t mask = 0u - (rc->code >> 31);
+        rc->code += rc->range & mask;
+        v = (v << 1) + (mask + 1);
+    }
+    return v;
+}
+
+static uint32_t lzma_len(struct lzma_rc* rc, struct lzma_len_probs* p, uint32_t pos_state) {
+    if (!lzma_bit(rc, &p->choice)) return LZMA_MATCH_LEN_MIN + lzma_tree(rc, p->low[pos_state], 3);
+    if (!lzma_bit(rc, &p->choice2)) return LZMA_MATCH_LEN_MIN + 8 + lzma_tree(rc, p->mid[pos_state], 3);
+    return LZMA_MATCH_LEN_MIN + 16 + lzma_tree(rc, p->high, 8);
+}
+
+static void lzma_reset_state(void) {
+    uint16_t* p = (uint16_t*)&lzma_probs;
+    for (uint32_t i = 0; i < sizeof(lzma_probs) / sizeof(uint16_t); ++i) p[i] = LZMA_PROB_INIT;
+    lzma.state = 0;
+    memset(lzma.rep, 0, sizeof(lzma.rep));
+    lzma.pending = 0;
+}
+
+// Copies up to the chunk end; whatever doesn't fit is finished at the
+// start of the next chunk.
+static int lzma_copy(struct decomp_out* out, uint64_t end, uint32_t len) {
+    uint64_t room = end - out->pos;
+    uint32_t n = len > room ? (uint32_t)room : len;
+    if ((uint64_t)lzma.rep[0] + 1 > out->pos - lzma.dict_start) return -1;
+    lzma.pending = len - n;
+    return decomp_match(out, (uint64_t)lzma.rep[0] + 1, n);
+}
+
+static int lzma_chunk(struct decomp_out* out, uint64_t unpacked) {
+    struct lzma_rc* rc = &lzma.rc;
+    uint64_t end = out->pos + unpacked;
+    uint32_t pos_mask = (1u << lzma.pb) - 1, lit_mask = (1u << lzma.lp) - 1;
+    int r;
+    if (lzma.pending && (r = lzma_copy(out, end, lzma.pending)) != 0) return r;
+    while (out->pos < end) {
+        uint64_t pos = out->pos - lzma.dict_start;
+        uint32_t pos_state = (uint32_t)pos & pos_mask;
+        uint32_t state = lzma.state;
+        if (rc->error) return -1;
+        if (!lzma_bit(rc, &lzma_probs.is_match[state][pos_state])) {
+            uint32_t prev = pos ? out->base[out->pos - 1] : 0;
+            uint16_t* probs = lzma_probs.literal[(((uint32_t)pos & lit_mask) << lzma.lc) + (prev >> (8 - lzma.lc))];
+            uint32_t sym = 1;
+            if (state < LZMA_LIT_STATES) {
+                while (sym < 0x100) sym = (sym << 1) | lzma_bit(rc, &probs[sym]);
+            } else {
+                if ((uint64_t)lzma.rep[0] + 1 > pos) return -1;
+                uint32_t match = out->base[out->pos - lzma.rep[0] - 1];
+                uint32_t offset = 0x100;
+                while (sym < 0x100) {
+                    match <<= 1;
+                    uint32_t match_bit = match & offset;
+                    if (lzma_bit(rc, &probs[offset + match_bit + sym])) {
+                        sym = (sym << 1) | 1;
+                        offset &= match_bit;
+                    } else {
+                        sym <<= 1;
+                        offset &= ~match_bit;
+                    }
+                }
+            }
+            if ((r = decomp_put(out, (uint8_t)sym)) != 0) return r;
+            lzma.state = state < 4 ? 0 : (state < 10 ? state - 3 : state - 6);
+            continue;
+        }
+        uint32_t len;
+        if (!lzma_bit(rc, &lzma_probs.is_rep[state])) {
+            lzma.rep[3] = lzma.rep[2];
+            lzma.rep[2] = lzma.rep[1];
+            lzma.rep[1] = lzma.rep[0];
+            len = lzma_len(rc, &lzma_probs.match_len, pos_state);
+            uint32_t dist_state = len - LZMA_MATCH_LEN_MIN < LZMA_DIST_STATES - 1 ? len - LZMA_MATCH_LEN_MIN : LZMA_DIST_STATES - 1;
+            uint32_t slot = lzma_tree(rc, lzma_probs.dist_slot[dist_state], 6);
+            if (slot < 4) {
+                lzma.rep[0] = slot;
+            } else {
+                uint32_t limit = (slot >> 1) - 1;
+                uint32_t dist = (2 | (slot & 1)) << limit;
+                if (slot < LZMA_DIST_MODEL_END) {
+                    dist += lzma_tree_reverse(rc, lzma_probs.dist_special + dist - slot - 1, limit);
+                } else {
+                    dist += lzma_direct(rc, limit - LZMA_ALIGN_BITS) << LZMA_ALIGN_BITS;
+                    dist += lzma_tree_reverse(rc, lzma_probs.dist_align, LZMA_ALIGN_BITS);
+                }
+                // LZMA2 has no end-of-payload marker.
+                if (dist == 0xFFFFFFFFU) return -1;
+                lzma.rep[0] = dist;
+            }
+            lzma.state = state < LZMA_LIT_STATES ? 7 : 10;
+        } else {
+            if (!lzma_bit(rc, &lzma_probs.is_rep0[state])) {
+                if (!lzma_bit(rc, &lzma_probs.is_rep0_long[state][pos_state])) {
+                    lzma.state = state < LZMA_LIT_STATES ? 9 : 11;
+                    if ((r = lzma_copy(out, end, 1)) != 0) return r;
+                    continue;
+                }
+            } else {
+                uint32_t dist;
+                if (!lzma_bit(rc, &lzma_probs.is_rep1[state])) {
+                    dist = lzma.rep[1];
+                } else {
+                    if (!lzma_bit(rc, &lzma_probs.is_rep2[state])) {
+                        dist = lzma.rep[2];
+                    } else {
+                        dist = lzma.rep[3];
+                        lzma.rep[3] = lzma.rep[2];
+                    }
+                    lzma.rep[2] = lzma.rep[1];
+                }
+                lzma.rep[1] = lzma.rep[0];
+                lzma.rep[0] = dist;
+            }
+            lzma.state = state < LZMA_LIT_STATES ? 8 : 11;
+            len = lzma_len(rc, &lzma_probs.rep_len, pos_state);
+        }
+        if ((r = lzma_copy(out, end, len)) != 0) return r;
+    }
+    // The encoder's flush covers one more normalization than the last
+    // decoded bit needed.
+    lzma_normalize(rc);
+    return rc->error ? -1 : 0;
+}
+
+static int lzma_props(uint8_t props) {
+    if (props >= 9 * 5 * 5) return -1;
+    lzma.lc = props % 9;
+    props /= 9;
+    lzma.lp = props % 5;
+    lzma.pb = props / 5;
+    if (lzma.lc + lzma.lp > 4) return -1;
+    lzma.have_props = 1;
+    return 0;
+}
+
+// LZMA2 chunk stream: control byte, sizes, and either stored bytes or an
+// LZMA chunk with its own range coder.
+static int lzma2_decode(struct decomp_in* in, struct decomp_out* out) {
+    int first = 1;
+    lzma.have_props = 0;
+    lzma.pending = 0;
+    for (;;) {
+        int control = decomp_in_byte(in);
+        uint8_t h[5];
+        int r;
+        if (control < 0) return -1;
+        if (control == 0) return 0;
+        if (first && control != 0x01 && control < 0xE0) return -1;
+        first = 0;
+        if (control == 0x01 || control >= 0xE0) lzma.dict_start = out->pos;
+        if (control < 0x80) {
+            if (control > 0x02 || decomp_in_read(in, h, 2) != 0) return -1;
+            if ((r = decomp_in_copy(in, out, ((uint32_t)h[0] << 8 | h[1]) + 1)) != 0) return r;
+            continue;
+        }
+        if (decomp_in_read(in, h, 4) != 0) return -1;
+        uint64_t unpacked = ((uint64_t)(control & 0x1F) << 16) + ((uint32_t)h[0] << 8 | h[1]) + 1;
+        uint32_t packed = ((uint32_t)h[2] << 8 | h[3]) + 1;
+        uint32_t reset = (control >> 5) & 3;
+        if (reset >= 2) {
+            if (decomp_in_read(in, h, 1) != 0 || lzma_props(h[0]) != 0) return -1;
+        } else if (!lzma.have_props) {
+            return -1;
+        }
+        if (reset >= 1) lzma_reset_state();
+
+        uint64_t start = decomp_in_offset(in);
+        lzma.rc.in = in;
+        lzma.rc.error = 0;
+        lzma.rc.range = 0xFFFFFFFFU;
+        if (decomp_in_read(in, h, 5) != 0 || h[0] != 0) return -1;
+        lzma.rc.code = (uint32_t)h[1] << 24 | (uint32_t)h[2] << 16 | (uint32_t)h[3] << 8 | h[4];
+        if ((r = lzma_chunk(out, unpacked)) != 0) return r;
+        if (decomp_in_offset(in) - start != packed) return -1;
+    }
+}
+
+static void bcj_x86(uint8_t* buf, uint64_t size, uint32_t start) {
+    static const uint8_t allowed[8] = { 1, 1, 1, 0, 1, 0, 0, 0 };
+    static const uint8_t bit_num[8] = { 0, 1, 2, 2, 3, 3, 3, 3 };
+    uint64_t i, prev_pos = (uint64_t)-1;
+    uint32_t prev_mask = 0;
+    if (size <= 4) return;
+    size -= 4;
+    for (i = 0; i < size; ++i) {
+        if ((buf[i] & 0xFE) != 0xE8) continue;
+        prev_pos = i - prev_pos;
+        if (prev_pos > 3) {
+            prev_mask = 0;
+        } else {
+            prev_mask = (prev_mask << (prev_pos - 1)) & 7;
+            if (prev_mask) {
+                uint8_t b = buf[i + 4 - bit_num[prev_mask]];
+                if (!allowed[prev_mask] || b == 0x00 || b == 0xFF) {
+                    prev_pos = i;
+                    prev_mask = (prev_mask << 1) | 1;
+                    continue;
+                }
+            }
+        }
+        prev_pos = i;
+        if (buf[i + 4] != 0x00 && buf[i + 4] != 0xFF) {
+            prev_mask = (prev_mask << 1) | 1;
+            continue;
+        }
+        uint32_t src = (uint32_t)buf[i + 1] | (uint32_t)buf[i + 2] << 8 | (uint32_t)buf[i + 3] << 16 | (uint32_t)buf[i + 4] << 24;
+        uint32_t dest;
+        for (;;) {
+            dest = src - (start + (uint32_t)i + 5);
+            if (!prev_mask) break;
+            uint32_t j = bit_num[prev_mask] * 8;
+            uint8_t b = (uint8_t)(dest >> (24 - j));
+            if (b != 0x00 && b != 0xFF) break;
+            src = dest ^ ((1u << (32 - j)) - 1);
+        }
+        dest &= 0x01FFFFFF;
+        dest |= 0u - (dest & 0x01000000);
+        buf[i + 1] = (uint8_t)dest;
+        buf[i + 2] = (uint8_t)(dest >> 8);
+        buf[i + 3] = (uint8_t)(dest >> 16);
+        buf[i + 4] = (uint8_t)(dest >> 24);
+        i += 4;
+    }
+}
+
+// BL and ADRP immediates were made absolute by the encoder.
+static void bcj_arm64(uint8_t* buf, uint64_t size, uint32_t start) {
+    for (uint64_t i = 0; i + 4 <= size; i += 4) {
+        uint32_t instr = (uint32_t)buf[i] | (uint32_t)buf[i + 1] << 8 | (uint32_t)buf[i + 2] << 16 | (uint32_t)buf[i + 3] << 24;
+        uint32_t pc = start + (uint32_t)i;
+        if ((instr >> 26) == 0x25) {
+            instr = 0x94000000U | ((instr - (pc >> 2)) & 0x03FFFFFFU);
+        } else if ((instr & 0x9F000000U) == 0x90000000U) {
+            uint32_t src = ((instr >> 29) & 3) | ((instr >> 3) & 0x001FFFFCU);
+            if ((src + 0x00020000U) & 0x001C0000U) continue;
+            uint32_t dest = src - (pc >> 12);
+            instr &= 0x9000001FU;
+            instr |= (dest & 3) << 29;
+            instr |= (dest & 0x0003FFFCU) << 3;
+            instr |= (0u - (dest & 0x00020000U)) & 0x00E00000U;
+        } else {
+            continue;
+        }
+        buf[i] = (uint8_t)instr;
+        buf[i + 1] = (uint8_t)(instr >> 8);
+        buf[i + 2] = (uint8_t)(instr >> 16);
+        buf[i + 3] = (uint8_t)(instr >> 24);
+    }
+}
+
+static int xz_varint(const uint8_t* p, uint32_t len, uint32_t* pos, uint64_t* v) {
+    *v = 0;
+    for (uint32_t i = 0; i < 9; ++i) {
+        if (*pos >= len) return -1;
+        uint8_t b = p[(*pos)++];
+        *v |= (uint64_t)(b & 0x7F) << (i * 7);
+        if (!(b & 0x80)) return (i && !b) ? -1 : 0;
+    }
+    return -1;
+}
+
+static uint32_t xz_check_size(uint8_t type) {
+    static const uint8_t sizes[16] = { 0, 4, 4, 4, 8, 8, 8, 16, 16, 16, 32, 32, 32, 64, 64, 64 };
+    return sizes[type & 15];
+}
+
+static int xz_block(struct decomp_in* in, struct decomp_out* out, uint8_t size_byte, uint32_t check) {
+    uint8_t h[1024];
+    uint32_t len = ((uint32_t)size_byte + 1) * 4, pos = 2;
+    uint64_t v, start = decomp_in_offset(in) - 1, out_start = out->pos;
+    int bcj = 0;
+    uint32_t bcj_start = 0;
+    h[0] = size_byte;
+    if (decomp_in_read(in, h + 1, len - 1) != 0) return -1;
+    uint8_t flags = h[1];
+    if (flags & 0x3C) return -1;
+    if ((flags & 0x40) && xz_varint(h, len - 4, &pos, &v) != 0) return -1;
+    if ((flags & 0x80) && xz_varint(h, len - 4, &pos, &v) != 0) return -1;
+    uint32_t filters = (flags & 3) + 1;
+    for (uint32_t f = 0; f < filters; ++f) {
+        uint64_t id, psize;
+        if (xz_varint(h, len - 4, &pos, &id) != 0 || xz_varint(h, len - 4, &pos, &psize) != 0) return -1;
+        if (psize > len - 4 - pos) return -1;
+        if (id == XZ_FILTER_LZMA2) {
+            if (f != filters - 1 || psize != 1 || h[pos] > 40) return -1;
+        } else if ((id == XZ_FILTER_X86 || id == XZ_FILTER_ARM64) && !bcj && f == 0) {
+            if (psize == 4) {
+                bcj_start = (uint32_t)h[pos] | (uint32_t)h[pos + 1] << 8 | (uint32_t)h[pos + 2] << 16 | (uint32_t)h[pos + 3] << 24;
+            } else if (psize) {
+                return -1;
+            }
+            bcj = (int)id;
+        } else {
+            return -1;
+        }
+        pos += (uint32_t)psize;
+    }
+    int r = lzma2_decode(in, out);
+    if (r < 0) return r;
+    if (bcj == XZ_FILTER_X86) bcj_x86(out->base + out_start, out->pos - out_start, bcj_start);
+    if (bcj == XZ_FILTER_ARM64) bcj_arm64(out->base + out_start, out->pos - out_start, bcj_start);
+    if (r) return r;
+    uint64_t pad = (4 - ((decomp_in_offset(in) - start) & 3)) & 3;
+    return decomp_in_read(in, NULL, pad + check);
+}
+
+// Index records and the stream footer are skipped; the sizes they record
+// only matter to xz_size. The record count comes first, then two varints
+// per record.
+static int xz_index_skip(struct decomp_in* in) {
+    uint64_t start = decomp_in_offset(in) - 1, fields = 1, v;
+    uint8_t b[9];
+    for (uint64_t i = 0; i < fields; ++i) {
+        uint32_t pos = 0;
+        do {
+            int c = decomp_in_byte(in);
+            if (c < 0 || pos == sizeof(b)) return -1;
+            b[pos++] = (uint8_t)c;
+        } while (b[pos - 1] & 0x80);
+        uint32_t len = pos;
+        pos = 0;
+        if (xz_varint(b, len, &pos, &v) != 0) return -1;
+        if (i == 0) fields += v * 2;
+    }
+    uint64_t pad = (4 - ((decomp_in_offset(in) - start) & 3)) & 3;
+    uint8_t f[XZ_HEADER_SIZE];
+    if (decomp_in_read(in, NULL, pad + 4) != 0 || decomp_in_read(in, f, sizeof(f)) != 0) return -1;
+    return (f[10] == 'Y' && f[11] == 'Z') ? 0 : -1;
+}
+
+// Streams and their padding back to back; other trailing data ends the
+// input.
+int xz_decode(struct decomp_in* in, struct decomp_out* out) {
+    uint8_t h[XZ_HEADER_SIZE];
+    if (!out->base) return -1;
+    if (decomp_in_read(in, h, 4) != 0) return -1;
+    for (;;) {
+        if (memcmp(h, xz_magic, 4) != 0 || decomp_in_read(in, h + 4, 8) != 0 || memcmp(h, xz_magic, 6) != 0) return -1;
+        if (h[6] != 0 || (h[7] & 0xF0)) return -1;
+        uint32_t check = xz_check_size(h[7]);
+        for (;;) {
+            int b = decomp_in_byte(in);
+            if (b < 0) return -1;
+            if (b == 0) break;
+            int r = xz_block(in, out, (uint8_t)b, check);
+            if (r) return r;
+        }
+        if (xz_index_skip(in) != 0) return -1;
+        do {
+            if (in->src->size - decomp_in_offset(in) < 4) return 0;
+            if (decomp_in_read(in, h, 4) != 0) return -1;
+        } while (!h[0] && !h[1] && !h[2] && !h[3]);
+        if (memcmp(h, xz_magic, 4) != 0) return 0;
+    }
+}
+
+// Uncompressed size from the indexes, walking streams back from the end.
+int xz_size(const struct decomp_src* src, uint64_t* size) {
+    uint64_t end = src->size, total = 0;
+    uint8_t f[XZ_HEADER_SIZE];
+    while (end) {
+        while (end >= 4 && decomp_src_read(src, end - 4, f, 4) == 0 && !f[0] && !f[1] && !f[2] && !f[3]) end -= 4;
+        if (end < 2 * XZ_HEADER_SIZE || decomp_src_read(src, end - XZ_HEADER_SIZE, f, XZ_HEADER_SIZE) != 0) return -1;
+        if (f[10] != 'Y' || f[11] != 'Z') return -1;
+        uint64_t index_size = ((uint64_t)f[4] | (uint64_t)f[5] << 8 | (uint64_t)f[6] << 16 | (uint64_t)f[7] << 24) * 4 + 4;
+        if (index_size > XZ_INDEX_MAX || index_size > end - 2 * XZ_HEADER_SIZE) return -1;
+        uint64_t index_start = end - XZ_HEADER_SIZE - index_size;
+        if (decomp_src_read(src, index_start, xz_index, (uint32_t)index_size) != 0 || xz_index[0]) return -1;
+        uint32_t pos = 1;
+        uint64_t n, unpadded, uncompressed, blocks = 0;
+        if (xz_varint(xz_index, (uint32_t)index_size, &pos, &n) != 0) return -1;
+        for (uint64_t i = 0; i < n; ++i) {
+            if (xz_varint(xz_index, (uint32_t)index_size, &pos, &unpadded) != 0 ||
+                xz_varint(xz_index, (uint32_t)index_size, &pos, &uncompressed) != 0) {
+                return -1;
+            }
+            blocks += (unpadded + 3) & ~3ULL;
+            total += uncompressed;
+        }
+        if (blocks + XZ_HEADER_SIZE > index_start) return -1;
+        end = index_start - blocks - XZ_HEADER_SIZE;
+        if (decomp_src_read(src, end, f, 6) != 0 || memcmp(f, xz_magic, 6) != 0) return -1;
+    }
+    *size = total;
+    return 0;
+}
@@ -0,0 +1,668 @@
+#include "decomp.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+
+// Zstandard frames (RFC 8878). Dictionaries are not supported and the
+// content checksum is skipped.
+
+#define ZSTD_MAGIC 0xFD2FB528U
+#define ZSTD_SKIP_MAGIC 0x184D2A50U
+#define ZSTD_SKIP_MASK 0xFFFFFFF0U
+#define ZSTD_BLOCK_MAX (128 * 1024)
+#define ZSTD_FSE_MAX_LOG 9
+#define ZSTD_HUF_MAX_BITS 11
+#define ZSTD_HUF_MAX_WEIGHTS 255
+
+#define ZSTD_LL_MAX 35
+#define ZSTD_ML_MAX 52
+#define ZSTD_OF_MAX 31
+
+struct zstd_fse {
+    uint8_t symbol[1 << ZSTD_FSE_MAX_LOG];
+    uint8_t nbits[1 << ZSTD_FSE_MAX_LOG];
+    uint16_t base[1 << ZSTD_FSE_MAX_LOG];
+    uint32_t log;
+};
+
+// Entries pack symbol | length << 8 so a decode step is one load.
+struct zstd_huf {
+    uint16_t entry[1 << ZSTD_HUF_MAX_BITS];
+    uint32_t max_bits;
+};
+
+// Backward bit stream: the last byte's top set bit marks the start, and
+// bits are consumed from the top of a 64-bit window that slides towards
+// the front of the buffer.
+struct zstd_bits {
+    const uint8_t* start;
+    const uint8_t* ptr;
+    uint64_t bits;
+    uint32_t used;
+};
+
+struct zstd_frame {
+    uint64_t content;
+    int has_content;
+    int checksum;
+};
+
+// Slack past the end lets short literal runs be copied 16 bytes at a time.
+static uint8_t zstd_block_buf[ZSTD_BLOCK_MAX + 16];
+static uint8_t zstd_lit_buf[ZSTD_BLOCK_MAX + 16];
+
+// Decoder state that carries from block to block within a frame.
+static struct zstd_fse zstd_ll, zstd_of, zstd_ml, zstd_weights;
+static struct zstd_huf zstd_huf;
+static int zstd_ll_valid, zstd_of_valid, zstd_ml_valid, zstd_huf_valid;
+static uint64_t zstd_rep[3];
+
+static const int16_t zstd_ll_default[ZSTD_LL_MAX + 1] = {
+    4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 3, 2, 1, 1, 1, 1, 1, -1, -1, -1, -1 };
+static const int16_t zstd_ml_default[ZSTD_ML_MAX + 1] = {
+    1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1, -1, -1 };
+static const int16_t zstd_of_default[29] = {
+    1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1 };
+
+static const uint32_t zstd_ll_base[ZSTD_LL_MAX + 1] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    16, 18, 20, 22, 24, 28, 32, 40, 48, 64, 128, 256, 512, 1024, 2048, 4096,
+    8192, 16384, 32768, 65536 };
+static const uint8_t zstd_ll_bits[ZSTD_LL_MAX + 1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 2, 2, 3, 3, 4, 6, 7, 8, 9, 10, 11, 12,
+    13, 14, 15, 16 };
+static const uint32_t zstd_ml_base[ZSTD_ML_MAX + 1] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18,
+    19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34,
+    35, 37, 39, 41, 43, 47, 51, 59, 67, 83, 99, 131, 259, 515, 1027, 2051,
+    4099, 8195, 16387, 32771, 65539 };
+static const uint8_t zstd_ml_bits[ZSTD_ML_MAX + 1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11,
+    12, 13, 14, 15, 16 };
+
+static uint32_t zstd_highbit(uint32_t v) {
+    return 31 - (uint32_t)__builtin_clz(v);
+}
+
+static uint64_t zstd_get(const uint8_t* p, uint32_t n) {
+    uint64_t v = 0;
+    for (uint32_t i = 0; i < n; ++i) v |= (uint64_t)p[i] << (i * 8);
+    return v;
+}
+
+static int zstd_bits_init(struct zstd_bits* b, const uint8_t* src, uint64_t len) {
+    if (!len || !src[len - 1]) return -1;
+    uint32_t top = zstd_highbit(src[len - 1]);
+    b->start = src;
+    if (len >= 8) {
+        b->ptr = src + len - 8;
+        b->bits = zstd_get(b->ptr, 8);
+        b->used = 8 - top;
+    } else {
+        b->ptr = src;
+        b->bits = zstd_get(src, (uint32_t)len);
+        b->used = 8 - top + (8 - (uint32_t)len) * 8;
+    }
+    return 0;
+}
+
+static inline void zstd_reload(struct zstd_bits* b) {
+    if (b->used > 64) return;
+    if (b->ptr >= b->start + 8) {
+        b->ptr -= b->used >> 3;
+        b->used &= 7;
+    } else if (b->ptr == b->start) {
+        return;
+    } else {
+        uint32_t n = b->used >> 3;
+        if (n > (uint32_t)(b->ptr - b->start)) n = (uint32_t)(b->ptr - b->start);
+        b->ptr -= n;
+        b->used -= n * 8;
+    }
+    b->bits = zstd_get(b->ptr, 8);
+}
+
+// Bits past the front of the stream read as zero.
+static inline uint32_t zstd_peek(const struct zstd_bits* b, uint32_t n) {
+    if (b->used >= 64) return 0;
+    return (uint32_t)(((b->bits << b->used) >> 1) >> (63 - n));
+}
+
+static inline uint32_t zstd_read(struct zstd_bits* b, uint32_t n) {
+    uint32_t v = zstd_peek(b, n);
+    b->used += n;
+    return v;
+}
+
+static inline int zstd_overflow(const struct zstd_bits* b) {
+    return b->ptr == b->start && b->used > 64;
+}
+
+// Forward little-endian bit reads, only used for FSE table headers.
+static uint32_t zstd_fwd(const uint8_t* p, uint32_t len, uint32_t* pos, uint32_t n) {
+    uint32_t v = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        uint32_t at = *pos + i;
+        if ((at >> 3) < len) v |= (uint32_t)((p[at >> 3] >> (at & 7)) & 1) << i;
+    }
+    *pos += n;
+    return v;
+}
+
+static int zstd_fse_build(struct zstd_fse* t, const int16_t* norm, uint32_t nsym, uint32_t log) {
+    uint16_t next[256];
+    uint32_t size = 1u << log, high = size, pos = 0;
+    uint32_t step = (size >> 1) + (size >> 3) + 3;
+    for (uint32_t s = 0; s < nsym; ++s) {
+        if (norm[s] == -1) {
+            t->symbol[--high] = (uint8_t)s;
+            next[s] = 1;
+        }
+    }
+    for (uint32_t s = 0; s < nsym; ++s) {
+        if (norm[s] <= 0) continue;
+        next[s] = (uint16_t)norm[s];
+        for (int i = 0; i < norm[s]; ++i) {
+            t->symbol[pos] = (uint8_t)s;
+            do {
+                pos = (pos + step) & (size - 1);
+            } while (pos >= high);
+        }
+    }
+    if (pos) return -1;
+    for (uint32_t i = 0; i < size; ++i) {
+        uint32_t n = next[t->symbol[i]]++;
+        t->nbits[i] = (uint8_t)(log - zstd_highbit(n));
+        t->base[i] = (uint16_t)((n << t->nbits[i]) - size);
+    }
+    t->log = log;
+    return 0;
+}
+
+static void zstd_fse_rle(struct zstd_fse* t, uint8_t symbol) {
+    t->symbol[0] = symbol;
+    t->nbits[0] = 0;
+    t->base[0] = 0;
+    t->log = 0;
+}
+
+// Normalized counts as described in RFC 8878 4.1.1; returns the header
+// length in bytes.
+static int zstd_fse_header(struct zstd_fse* t, const uint8_t* p, uint32_t len, uint32_t max_sym, uint32_t max_log, uint32_t* used) {
+    int16_t norm[256];
+    uint32_t pos = 0, s = 0;
+    uint32_t log = zstd_fwd(p, len, &pos, 4) + 5;
+    if (log > max_log) return -1;
+    int32_t remaining = 1 << log;
+    while (remaining > 0 && s <= max_sym) {
+        uint32_t bits = zstd_highbit((uint32_t)remaining + 1) + 1;
+        uint32_t val = zstd_fwd(p, len, &pos, bits);
+        uint32_t lower = (1u << (bits - 1)) - 1;
+        uint32_t threshold = (1u << bits) - 1 - ((uint32_t)remaining + 1);
+        if ((val & lower) < threshold) {
+            pos--;
+            val &= lower;
+        } else if (val > lower) {
+            val -= threshold;
+        }
+        int32_t proba = (int32_t)val - 1;
+        remaining -= proba < 0 ? -proba : proba;
+        norm[s++] = (int16_t)proba;
+        if (proba == 0) {
+            uint32_t rep;
+            do {
+                rep = zstd_fwd(p, len, &pos, 2);
+                for (uint32_t i = 0; i < rep; ++i) {
+                    if (s > max_sym) return -1;
+                    norm[s++] = 0;
+                }
+            } while (rep == 3);
+        }
+    }
+    if (remaining != 0 || pos > len * 8) return -1;
+    *used = (pos + 7) >> 3;
+    return zstd_fse_build(t, norm, s, log);
+}
+
+static int zstd_huf_build(uint8_t* weights, uint32_t n) {
+    uint32_t rank[ZSTD_HUF_MAX_BITS + 2];
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        if (weights[i] > ZSTD_HUF_MAX_BITS) return -1;
+        if (weights[i]) sum += 1u << (weights[i] - 1);
+    }
+    if (!sum) return -1;
+    uint32_t max_bits = zstd_highbit(sum) + 1;
+    uint32_t left = (1u << max_bits) - sum;
+    if (max_bits > ZSTD_HUF_MAX_BITS || (left & (left - 1))) return -1;
+    weights[n++] = (uint8_t)(zstd_highbit(left) + 1);
+
+    memset(rank, 0, sizeof(rank));
+    for (uint32_t i = 0; i < n; ++i) {
+        if (weights[i]) rank[max_bits + 1 - weights[i]]++;
+    }
+    // Codes are handed out from the longest length up, so each length's
+    // block of table slots starts where the longer ones left off.
+    uint32_t idx[ZSTD_HUF_MAX_BITS + 2];
+    idx[max_bits] = 0;
+    for (uint32_t b = max_bits; b >= 1; --b) idx[b - 1] = idx[b] + rank[b] * (1u << (max_bits - b));
+    for (uint32_t i = 0; i < n; ++i) {
+        if (!weights[i]) continue;
+        uint32_t bits = max_bits + 1 - weights[i];
+        uint32_t len = 1u << (max_bits - bits);
+        for (uint32_t j = 0; j < len; ++j) {
+            zstd_huf.entry[idx[bits] + j] = (uint16_t)(i | (bits << 8));
+        }
+        idx[bits] += len;
+    }
+    zstd_huf.max_bits = max_bits;
+    return 0;
+}
+
+// Huffman tree description; weights are either 4-bit values or an FSE
+// stream decoded with two interleaved states.
+static int zstd_huf_tree(const uint8_t* p, uint32_t len, uint32_t* used) {
+    uint8_t weights[ZSTD_HUF_MAX_WEIGHTS + 1];
+    uint32_t n = 0;
+    if (!len) return -1;
+    uint32_t hdr = p[0];
+    if (hdr >= 128) {
+        n = hdr - 127;
+        if (1 + (n + 1) / 2 > len) return -1;
+        for (uint32_t i = 0; i < n; ++i) weights[i] = (i & 1) ? (p[1 + i / 2] & 15) : (p[1 + i / 2] >> 4);
+        *used = 1 + (n + 1) / 2;
+        return zstd_huf_build(weights, n);
+    }
+    uint32_t h;
+    if (1 + hdr > len || zstd_fse_header(&zstd_weights, p + 1, hdr, 255, 6, &h) != 0 || h >= hdr) return -1;
+    struct zstd_bits b;
+    if (zstd_bits_init(&b, p + 1 + h, hdr - h) != 0) return -1;
+    uint32_t s1 = zstd_read(&b, zstd_weights.log), s2 = zstd_read(&b, zstd_weights.log);
+    const struct zstd_fse* t = &zstd_weights;
+    for (;;) {
+        if (n + 2 > ZSTD_HUF_MAX_WEIGHTS) return -1;
+        weights[n++] = t->symbol[s1];
+        s1 = t->base[s1] + zstd_read(&b, t->nbits[s1]);
+        zstd_reload(&b);
+        if (zstd_overflow(&b)) {
+            weights[n++] = t->symbol[s2];
+            break;
+        }
+        weights[n++] = t->symbol[s2];
+        s2 = t->base[s2] + zstd_read(&b, t->nbits[s2]);
+        zstd_reload(&b);
+        if (zstd_overflow(&b)) {
+            weights[n++] = t->symbol[s1];
+            break;
+        }
+    }
+    *used = 1 + hdr;
+    return zstd_huf_build(weights, n);
+}
+
+static inline uint8_t zstd_huf_sym(struct zstd_bits* b, uint32_t max_bits) {
+    uint32_t e = zstd_huf.entry[zstd_peek(b, max_bits)];
+    b->used += e >> 8;
+    return (uint8_t)e;
+}
+
+static int zstd_huf_stream(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t n) {
+    struct zstd_bits b;
+    uint32_t max_bits = zstd_huf.max_bits;
+    if (zstd_bits_init(&b, src, len) != 0) return -1;
+    for (uint32_t i = 0; i < n; ++i) {
+        if (b.used > 64 - ZSTD_HUF_MAX_BITS) zstd_reload(&b);
+        dst[i] = zstd_huf_sym(&b, max_bits);
+    }
+    return zstd_overflow(&b) ? -1 : 0;
+}
+
+// The four streams advance in lockstep so their independent bit windows
+// overlap in the pipeline. One reload leaves at least 57 bits (or reaches
+// the front of the stream), enough for four symbols of up to 11 bits.
+static inline __attribute__((always_inline)) int zstd_huf_lockstep(const uint8_t* src, const uint32_t* sizes, uint8_t* dst, uint32_t regen) {
+    struct zstd_bits b[4];
+    uint8_t* o[4];
+    uint8_t* e[4];
+    uint32_t per = (regen + 3) / 4, max_bits = zstd_huf.max_bits;
+    for (int i = 0; i < 4; ++i) {
+        if (zstd_bits_init(&b[i], src, sizes[i]) != 0) return -1;
+        src += sizes[i];
+        o[i] = dst + per * i;
+        e[i] = i < 3 ? o[i] + per : dst + regen;
+    }
+    // The last stream is the shortest.
+    while (e[3] - o[3] >= 4) {
+        for (int i = 0; i < 4; ++i) {
+            zstd_reload(&b[i]);
+            o[i][0] = zstd_huf_sym(&b[i], max_bits);
+            o[i][1] = zstd_huf_sym(&b[i], max_bits);
+            o[i][2] = zstd_huf_sym(&b[i], max_bits);
+            o[i][3] = zstd_huf_sym(&b[i], max_bits);
+            o[i] += 4;
+        }
+    }
+    for (int i = 0; i < 4; ++i) {
+        while (o[i] < e[i]) {
+            if (b[i].used > 64 - ZSTD_HUF_MAX_BITS) zstd_reload(&b[i]);
+            *o[i]++ = zstd_huf_sym(&b[i], max_bits);
+        }
+        if (zstd_overflow(&b[i])) return -1;
+    }
+    return 0;
+}
+
+static int zstd_huf_4x(const uint8_t* src, const uint32_t* sizes, uint8_t* dst, uint32_t regen) {
+    return zstd_huf_lockstep(src, sizes, dst, regen);
+}
+
+#if defined(__x86_64__)
+// Same loop with BMI2 shifts (shlx/shrx), which take the variable counts
+// without tying up CL.
+__attribute__((target("bmi2")))
+static int zstd_huf_4x_bmi2(const uint8_t* src, const uint32_t* sizes, uint8_t* dst, uint32_t regen) {
+    return zstd_huf_lockstep(src, sizes, dst, regen);
+}
+#endif
+
+// Literals section. Raw literals are left in the block buffer; the rest
+// are decoded into zstd_lit_buf. When only counting, Huffman decoding is
+// skipped since just the size matters.
+static int zstd_literals(const uint8_t* p, uint32_t len, int count, const uint8_t** lit, uint32_t* lit_len, uint32_t* used) {
+    if (!len) return -1;
+    uint32_t type = p[0] & 3, fmt = (p[0] >> 2) & 3;
+    uint32_t regen, comp, hlen, streams = 4;
+    if (type < 2) {
+        if (fmt == 1) {
+            hlen = 2;
+            regen = (p[0] >> 4) + ((uint32_t)p[1] << 4);
+        } else if (fmt == 3) {
+            hlen = 3;
+            regen = (p[0] >> 4) + ((uint32_t)p[1] << 4) + ((uint32_t)p[2] << 12);
+        } else {
+            hlen = 1;
+            regen = p[0] >> 3;
+        }
+        if (hlen > len) return -1;
+        if (regen > ZSTD_BLOCK_MAX) return -1;
+        *lit_len = regen;
+        if (type == 0) {
+            if (hlen + regen > len) return -1;
+            *lit = p + hlen;
+            *used = hlen + regen;
+        } else {
+            if (hlen + 1 > len) return -1;
+            memset(zstd_lit_buf, p[hlen], regen);
+            *lit = zstd_lit_buf;
+            *used = hlen + 1;
+        }
+        return 0;
+    }
+    uint32_t size_bits = 10;
+    hlen = 3;
+    if (fmt == 0) {
+        streams = 1;
+    } else if (fmt == 2) {
+        hlen = 4;
+        size_bits = 14;
+    } else if (fmt == 3) {
+        hlen = 5;
+        size_bits = 18;
+    }
+    if (hlen > len) return -1;
+    uint64_t h = zstd_get(p, hlen) >> 4;
+    regen = (uint32_t)(h & ((1u << size_bits) - 1));
+    comp = (uint32_t)(h >> size_bits) & ((1u << size_bits) - 1);
+    if (regen > ZSTD_BLOCK_MAX || hlen + comp > len) return -1;
+    *lit = zstd_lit_buf;
+    *lit_len = regen;
+    *used = hlen + comp;
+    if (count) return 0;
+
+    const uint8_t* s = p + hlen;
+    if (type == 2) {
+        uint32_t tree;
+        if (zstd_huf_tree(s, comp, &tree) != 0) return -1;
+        zstd_huf_valid = 1;
+        s += tree;
+        comp -= tree;
+    } else if (!zstd_huf_valid) {
+        return -1;
+    }
+    if (streams == 1) return zstd_huf_stream(s, comp, zstd_lit_buf, regen);
+    if (comp < 6) return -1;
+    uint32_t sizes[4], per = (regen + 3) / 4, total = 6;
+    for (int i = 0; i < 3; ++i) {
+        sizes[i] = (uint32_t)zstd_get(s + i * 2, 2);
+        total += sizes[i];
+    }
+    if (total > comp || per * 3 > regen) return -1;
+    sizes[3] = comp - total;
+#if defined(__x86_64__)
+    if (decomp_cpu() & DECOMP_CPU_BMI2) return zstd_huf_4x_bmi2(s + 6, sizes, zstd_lit_buf, regen);
+#endif
+    return zstd_huf_4x(s + 6, sizes, zstd_lit_buf, regen);
+}
+
+static int zstd_table(struct zstd_fse* t, int* valid, uint32_t mode, const uint8_t** p, const uint8_t* end,
+                      const int16_t* norm, uint32_t nsym, uint32_t log, uint32_t max_sym) {
+    uint32_t used;
+    switch (mode) {
+    case 0:
+        if (zstd_fse_build(t, norm, nsym, log) != 0) return -1;
+        break;
+    case 1:
+        if (*p >= end || **p > max_sym) return -1;
+        zstd_fse_rle(t, **p);
+        (*p)++;
+        break;
+    case 2:
+        if (zstd_fse_header(t, *p, (uint32_t)(end - *p), max_sym, ZSTD_FSE_MAX_LOG, &used) != 0) return -1;
+        *p += used;
+        break;
+    default:
+        if (!*valid) return -1;
+        break;
+    }
+    *valid = 1;
+    return 0;
+}
+
+static uint64_t zstd_offset(uint64_t value, uint32_t ll) {
+    uint64_t offset;
+    if (value > 3) {
+        offset = value - 3;
+    } else {
+        uint32_t idx = (uint32_t)value - 1 + (ll == 0);
+        if (!idx) return zstd_rep[0];
+        offset = idx < 3 ? zstd_rep[idx] : zstd_rep[0] - 1;
+        if (idx == 1) {
+            zstd_rep[1] = zstd_rep[0];
+            zstd_rep[0] = offset;
+            return offset;
+        }
+    }
+    zstd_rep[2] = zstd_rep[1];
+    zstd_rep[1] = zstd_rep[0];
+    zstd_rep[0] = offset;
+    return offset;
+}
+
+static int zstd_block(struct decomp_out* out, const uint8_t* p, uint32_t len) {
+    const uint8_t* end = p + len;
+    const uint8_t* lit;
+    uint32_t lit_len, used, nseq;
+    int r;
+    if (zstd_literals(p, len, !out->base, &lit, &lit_len, &used) != 0) return -1;
+    p += used;
+    if (p >= end) return -1;
+    nseq = *p++;
+    if (nseq >= 128) {
+        if (p >= end) return -1;
+        if (nseq == 255) {
+            if (end - p < 2) return -1;
+            nseq = p[0] + ((uint32_t)p[1] << 8) + 0x7F00;
+            p += 2;
+        } else {
+            nseq = ((nseq - 128) << 8) + *p++;
+        }
+    }
+    if (!nseq) return decomp_write(out, lit, lit_len);
+    if (p >= end) return -1;
+    uint32_t modes = *p++;
+    if (modes & 3) return -1;
+    if (zstd_table(&zstd_ll, &zstd_ll_valid, modes >> 6, &p, end, zstd_ll_default, ZSTD_LL_MAX + 1, 6, ZSTD_LL_MAX) != 0 ||
+        zstd_table(&zstd_of, &zstd_of_valid, (modes >> 4) & 3, &p, end, zstd_of_default, 29, 5, ZSTD_OF_MAX) != 0 ||
+        zstd_table(&zstd_ml, &zstd_ml_valid, (modes >> 2) & 3, &p, end, zstd_ml_default, ZSTD_ML_MAX + 1, 6, ZSTD_ML_MAX) != 0) {
+        return -1;
+    }
+
+    struct zstd_bits b;
+    if (zstd_bits_init(&b, p, (uint64_t)(end - p)) != 0) return -1;
+    uint32_t ls = zstd_read(&b, zstd_ll.log);
+    uint32_t os = zstd_read(&b, zstd_of.log);
+    uint32_t ms = zstd_read(&b, zstd_ml.log);
+    uint32_t lit_pos = 0;
+    for (uint32_t i = 0; i < nseq; ++i) {
+        uint32_t lc = zstd_ll.symbol[ls], oc = zstd_of.symbol[os], mc = zstd_ml.symbol[ms];
+        zstd_reload(&b);
+        uint64_t value = (1ULL << oc) + zstd_read(&b, oc);
+        zstd_reload(&b);
+        uint32_t ml = zstd_ml_base[mc] + zstd_read(&b, zstd_ml_bits[mc]);
+        uint32_t ll = zstd_ll_base[lc] + zstd_read(&b, zstd_ll_bits[lc]);
+        zstd_reload(&b);
+        if (i + 1 < nseq) {
+            ls = zstd_ll.base[ls] + zstd_read(&b, zstd_ll.nbits[ls]);
+            ms = zstd_ml.base[ms] + zstd_read(&b, zstd_ml.nbits[ms]);
+            os = zstd_of.base[os] + zstd_read(&b, zstd_of.nbits[os]);
+        }
+        if (zstd_overflow(&b) || ll > lit_len - lit_pos) return -1;
+        if (ll <= 16 && out->base && out->cap - out->pos >= 16) {
+            memcpy(out->base + out->pos, lit + lit_pos, 16);
+            out->pos += ll;
+        } else if ((r = decomp_write(out, lit + lit_pos, ll)) != 0) {
+            return r;
+        }
+        lit_pos += ll;
+        if ((r = decomp_match(out, zstd_offset(value, ll), ml)) != 0) return r;
+    }
+    return decomp_write(out, lit + lit_pos, lit_len - lit_pos);
+}
+
+static uint32_t zstd_header_len(uint8_t fhd) {
+    static const uint8_t dict[4] = { 0, 1, 2, 4 };
+    static const uint8_t fcs[4] = { 0, 2, 4, 8 };
+    uint32_t single = (fhd >> 5) & 1;
+    return 1 + !single + dict[fhd & 3] + ((fhd >> 6) ? fcs[fhd >> 6] : single);
+}
+
+static int zstd_header_parse(const uint8_t* h, struct zstd_frame* f) {
+    static const uint8_t dict[4] = { 0, 1, 2, 4 };
+    uint8_t fhd = h[0];
+    uint32_t single = (fhd >> 5) & 1, pos = 1 + !single;
+    if (fhd & 0x08) return -1;
+    if (zstd_get(h + pos, dict[fhd & 3])) return -1;
+    pos += dict[fhd & 3];
+    uint32_t n = zstd_header_len(fhd) - pos;
+    f->content = zstd_get(h + pos, n);
+    if (n == 2) f->content += 256;
+    f->has_content = n != 0;
+    f->checksum = (fhd >> 2) & 1;
+    return 0;
+}
+
+static int zstd_frame(struct decomp_in* in, struct decomp_out* out) {
+    uint8_t h[14];
+    struct zstd_frame f;
+    if (decomp_in_read(in, h, 1) != 0 || decomp_in_read(in, h + 1, zstd_header_len(h[0]) - 1) != 0) return -1;
+    if (zstd_header_parse(h, &f) != 0) return -1;
+    zstd_rep[0] = 1;
+    zstd_rep[1] = 4;
+    zstd_rep[2] = 8;
+    zstd_ll_valid = zstd_of_valid = zstd_ml_valid = zstd_huf_valid = 0;
+    uint32_t last;
+    do {
+        uint8_t bh[3];
+        int r = 0;
+        if (decomp_in_read(in, bh, 3) != 0) return -1;
+        uint32_t v = (uint32_t)zstd_get(bh, 3), size = v >> 3;
+        last = v & 1;
+        switch ((v >> 1) & 3) {
+        case 0:
+            r = decomp_in_copy(in, out, size);
+            break;
+        case 1: {
+            int c = decomp_in_byte(in);
+            if (c < 0) return -1;
+            for (uint32_t i = 0; i < size && !r; ++i) r = decomp_put(out, (uint8_t)c);
+            break;
+        }
+        case 2:
+            if (size > ZSTD_BLOCK_MAX || decomp_in_read(in, zstd_block_buf, size) != 0) return -1;
+            r = zstd_block(out, zstd_block_buf, size);
+            break;
+        default:
+            return -1;
+        }
+        if (r) return r;
+    } while (!last);
+    if (f.checksum && decomp_in_read(in, NULL, 4) != 0) return -1;
+    return 0;
+}
+
+// Frames and skippable frames back to back; anything else ends the stream.
+int zstd_decode(struct decomp_in* in, struct decomp_out* out) {
+    uint8_t m[4];
+    while (in->src->size - decomp_in_offset(in) >= 4) {
+        if (decomp_in_read(in, m, 4) != 0) return -1;
+        uint32_t magic = (uint32_t)zstd_get(m, 4);
+        if ((magic & ZSTD_SKIP_MASK) == ZSTD_SKIP_MAGIC) {
+            if (decomp_in_read(in, m, 4) != 0 || decomp_in_read(in, NULL, zstd_get(m, 4)) != 0) return -1;
+            continue;
+        }
+        if (magic != ZSTD_MAGIC) break;
+        int r = zstd_frame(in, out);
+        if (r) return r;
+    }
+    return 0;
+}
+
+// Sum of the frame content sizes, walking block headers to find each
+// frame's end. Fails if any frame leaves its size out.
+int zstd_size(const struct decomp_src* src, uint64_t* size) {
+    uint64_t off = 0, total = 0;
+    while (src->size - off >= 4) {
+        uint8_t h[14];
+        struct zstd_frame f;
+        uint32_t last;
+        if (decomp_src_read(src, off, h, 4) != 0) return -1;
+        uint32_t magic = (uint32_t)zstd_get(h, 4);
+        if ((magic & ZSTD_SKIP_MASK) == ZSTD_SKIP_MAGIC) {
+            if (decomp_src_read(src, off + 4, h, 4) != 0) return -1;
+            off += 8 + zstd_get(h, 4);
+            continue;
+        }
+        if (magic != ZSTD_MAGIC) break;
+        off += 4;
+        if (decomp_src_read(src, off, h, 1) != 0 || decomp_src_read(src, off, h, zstd_header_len(h[0])) != 0) return -1;
+        if (zstd_header_parse(h, &f) != 0 || !f.has_content) return -1;
+        total += f.content;
+        off += zstd_header_len(h[0]);
+        do {
+            if (decomp_src_read(src, off, h, 3) != 0) return -1;
+            uint32_t v = (uint32_t)zstd_get(h, 3);
+            last = v & 1;
+            off += 3 + (((v >> 1) & 3) == 1 ? 1 : v >> 3);
+        } while (!last);
+        if (f.checksum) off += 4;
+        if (off > src->size) return -1;
+    }
+    if (!off) return -1;
+    *size = total;
+    return 0;
+}
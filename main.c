@@ -20,17 +20,12 @@
 #include "recovery/shell.h"
 #include "plugins/plugin.h"
 #include "net/pxe.h"
-#include "boot/Arch32/linux.h"
 #include "boot/Arch32/limine.h"
 #include "boot/Arch32/multiboot1.h"
-#include "boot/Arch32/multiboot2.h"
 #include "boot/Arch32/chainload.h"
-#include "boot/Arch32/ia32.h"
-#include "boot/Arch32/x86_64.h"
-#include "boot/Arch32/aarch64.h"
-#include "boot/Arch32/riscv64.h"
-#include "boot/Arch32/loongarch64.h"
-#include "boot/Arch32/BloodChain/bloodchain.h"
+#include "boot/Arch32/BloodChain/bcbp_loader.h"
+#include "boot/Arch32/loader.h"
+#include "boot/Arch32/memmap.h"
 #include "config/config_ini.h"
 #include "config/config_json.h"
 #include "config/config_env.h"
@@ -45,6 +40,8 @@ struct boot_config {
     char kernel[128];
     char initrd[128];
     char cmdline[256];
+    char dtb[128];
+    char dtbo[256];
 };
 
 static int load_boot_config(struct boot_config* cfg) {
@@ -73,6 +70,14 @@ static int load_boot_config(struct boot_config* cfg) {
                     strncpy(cfg->cmdline, entries[i].path, sizeof(cfg->cmdline) - 1);
                     cfg->cmdline[sizeof(cfg->cmdline) - 1] = '\0';
                 }
+                if (strcmp(entries[i].name, "dtb") == 0) {
+                    strncpy(cfg->dtb, entries[i].path, sizeof(cfg->dtb) - 1);
+                    cfg->dtb[sizeof(cfg->dtb) - 1] = '\0';
+                }
+                if (strcmp(entries[i].name, "dtbo") == 0) {
+                    strncpy(cfg->dtbo, entries[i].path, sizeof(cfg->dtbo) - 1);
+                    cfg->dtbo[sizeof(cfg->dtbo) - 1] = '\0';
+                }
             }
         }
         return 0;
@@ -106,6 +111,14 @@ static int load_boot_config(struct boot_config* cfg) {
                 strncpy(cfg->cmdline, json_entries[i].value, sizeof(cfg->cmdline) - 1);
                 cfg->cmdline[sizeof(cfg->cmdline) - 1] = '\0';
             }
+            if (strcmp(json_entries[i].key, "linux.dtb") == 0) {
+                strncpy(cfg->dtb, json_entries[i].value, sizeof(cfg->dtb) - 1);
+                cfg->dtb[sizeof(cfg->dtb) - 1] = '\0';
+            }
+            if (strcmp(json_entries[i].key, "linux.dtbo") == 0) {
+                strncpy(cfg->dtbo, json_entries[i].value, sizeof(cfg->dtbo) - 1);
+                cfg->dtbo[sizeof(cfg->dtbo) - 1] = '\0';
+            }
         }
         return 0;
     }
@@ -131,6 +144,14 @@ static int load_boot_config(struct boot_config* cfg) {
         strncpy(cfg->cmdline, val, sizeof(cfg->cmdline) - 1);
         cfg->cmdline[sizeof(cfg->cmdline) - 1] = '\0';
     }
+    if (config_env_get("BLOODHORN_LINUX_DTB", val, sizeof(val)) == 0) {
+        strncpy(cfg->dtb, val, sizeof(cfg->dtb) - 1);
+        cfg->dtb[sizeof(cfg->dtb) - 1] = '\0';
+    }
+    if (config_env_get("BLOODHORN_LINUX_DTBO", val, sizeof(val)) == 0) {
+        strncpy(cfg->dtbo, val, sizeof(cfg->dtbo) - 1);
+        cfg->dtbo[sizeof(cfg->dtbo) - 1] = '\0';
+    }
 
     return 0;
 }
@@ -260,11 +281,11 @@ EFI_STATUS EFIAPI UefiMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *Syste
 
 // Boot wrapper implementations
 EFI_STATUS boot_linux_kernel_wrapper(void) {
-    return linux_load_kernel("/boot/vmlinuz", "/boot/initrd.img", "root=/dev/sda1 ro");
+    return loader_boot("/boot/vmlinuz", "/boot/initrd.img", "root=/dev/sda1 ro");
 }
 
 EFI_STATUS boot_multiboot2_kernel_wrapper(void) {
-    return multiboot2_load_kernel("/boot/vmlinuz-mb2", "root=/dev/sda1 ro");
+    return loader_boot("/boot/vmlinuz-mb2", NULL, "root=/dev/sda1 ro");
 }
 
 EFI_STATUS boot_limine_kernel_wrapper(void) {
@@ -293,139 +314,34 @@ EFI_STATUS exit_to_firmware_wrapper(void) {
 }
 
 EFI_STATUS boot_ia32_wrapper(void) {
-    return ia32_load_kernel("/boot/vmlinuz-ia32", "/boot/initrd-ia32.img", "root=/dev/sda1 ro");
+    return loader_boot("/boot/vmlinuz-ia32", "/boot/initrd-ia32.img", "root=/dev/sda1 ro");
 }
 
 EFI_STATUS boot_x86_64_wrapper(void) {
-    return x86_64_load_kernel("/boot/vmlinuz-x86_64", "/boot/initrd-x86_64.img", "root=/dev/sda1 ro");
+    return loader_boot("/boot/vmlinuz-x86_64", "/boot/initrd-x86_64.img", "root=/dev/sda1 ro");
+}
+
+// Device-tree platforms take dtb= and dtbo= from the [linux] configuration.
+static EFI_STATUS boot_devicetree_image(const char* kernel_path, const char* initrd_path) {
+    static struct boot_config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    load_boot_config(&cfg);
+    loader_set_devicetree(cfg.dtb, cfg.dtbo);
+    return loader_boot(kernel_path, initrd_path, "root=/dev/sda1 ro");
 }
 
 EFI_STATUS boot_aarch64_wrapper(void) {
-    return aarch64_load_kernel("/boot/Image-aarch64", "/boot/initrd-aarch64.img", "root=/dev/sda1 ro");
+    return boot_devicetree_image("/boot/Image-aarch64", "/boot/initrd-aarch64.img");
 }
 
 EFI_STATUS boot_riscv64_wrapper(void) {
-    return riscv64_load_kernel("/boot/Image-riscv64", "/boot/initrd-riscv64.img", "root=/dev/sda1 ro");
+    return boot_devicetree_image("/boot/Image-riscv64", "/boot/initrd-riscv64.img");
 }
 
 EFI_STATUS boot_loongarch64_wrapper(void) {
-    return loongarch64_load_kernel("/boot/Image-loongarch64", "/boot/initrd-loongarch64.img", "root=/dev/sda1 ro");
+    return boot_devicetree_image("/boot/Image-loongarch64", "/boot/initrd-loongarch64.img");
 }
 
-// BloodChain Boot Protocol implementation
 EFI_STATUS boot_bloodchain_wrapper(void) {
-    EFI_STATUS Status;
-    EFI_PHYSICAL_ADDRESS KernelBase = 0x100000; // 1MB mark
-    EFI_PHYSICAL_ADDRESS BcbpBase;
-    struct bcbp_header *hdr;
-    
-    // Allocate memory for BCBP header (4KB aligned)
-    Status = gBS->AllocatePages(AllocateAnyPages, EfiLoaderData, 
-                              EFI_SIZE_TO_PAGES(64 * 1024), &BcbpBase);
-    if (EFI_ERROR(Status)) {
-        Print(L"Failed to allocate memory for BCBP header\n");
-        return Status;
-    }
-    
-    // Initialize BCBP header
-    hdr = (struct bcbp_header *)(UINTN)BcbpBase;
-    bcbp_init(hdr, KernelBase, 0);  // 0 for boot device (set by bootloader)
-    
-    // Load kernel
-    const char *kernel_path = "kernel.elf";  // Default kernel path
-    const char *initrd_path = "initrd.img";  // Default initrd path
-    const char *cmdline = "root=/dev/sda1 ro"; // Default command line
-    
-    // Load kernel into memory
-    EFI_PHYSICAL_ADDRESS KernelLoadAddr = KernelBase;
-    UINTN KernelSize = 0;
-    
-    // Load kernel file
-    Status = LoadFileToMemory(kernel_path, &KernelLoadAddr, &KernelSize);
-    if (EFI_ERROR(Status)) {
-        Print(L"Failed to load kernel: %r\n", Status);
-        return Status;
-    }
-    
-    // Add kernel module
-    bcbp_add_module(hdr, KernelLoadAddr, KernelSize, "kernel", 
-                   BCBP_MODTYPE_KERNEL, cmdline);
-    
-    // Load initrd if it exists
-    EFI_PHYSICAL_ADDRESS InitrdLoadAddr = KernelLoadAddr + ALIGN_UP(KernelSize, 0x1000);
-    UINTN InitrdSize = 0;
-    
-    if (FileExists(initrd_path)) {
-        Status = LoadFileToMemory(initrd_path, &InitrdLoadAddr, &InitrdSize);
-        if (!EFI_ERROR(Status) && InitrdSize > 0) {
-            bcbp_add_module(hdr, InitrdLoadAddr, InitrdSize, "initrd", 
-                          BCBP_MODTYPE_INITRD, NULL);
-        }
-    }
-    
-    // Set up ACPI and SMBIOS if available
-    EFI_ACPI_2_0_ROOT_SYSTEM_DESCRIPTION_POINTER *Rsdp = NULL;
-    EFI_CONFIGURATION_TABLE *ConfigTable = gST->ConfigurationTable;
-    
-    for (UINTN i = 0; i < gST->NumberOfTableEntries; i++) {
-        if (CompareGuid(&ConfigTable[i].VendorGuid, &gEfiAcpi20TableGuid)) {
-            Rsdp = (EFI_ACPI_2_0_ROOT_SYSTEM_DESCRIPTION_POINTER *)ConfigTable[i].VendorTable;
-            break;
-        }
-    }
-    
-    if (Rsdp) {
-        bcbp_set_acpi_rsdp(hdr, (UINT64)(UINTN)Rsdp);
-    }
-    
-    // Find SMBIOS table
-    for (UINTN i = 0; i < gST->NumberOfTableEntries; i++) {
-        if (CompareGuid(&ConfigTable[i].VendorGuid, &gEfiSmbiosTableGuid)) {
-            bcbp_set_smbios(hdr, (UINT64)(UINTN)ConfigTable[i].VendorTable);
-            break;
-        }
-    }
-    
-    // Set framebuffer information if available
-    EFI_GRAPHICS_OUTPUT_PROTOCOL *Gop = NULL;
-    Status = gBS->LocateProtocol(&gEfiGraphicsOutputProtocolGuid, NULL, (void **)&Gop);
-    if (!EFI_ERROR(Status) && Gop) {
-        bcbp_set_framebuffer(hdr, Gop->Mode->FrameBufferBase);
-    }
-    
-    // Set secure boot status
-    UINT8 SecureBoot = 0;
-    UINTN DataSize = sizeof(SecureBoot);
-    if (EFI_ERROR(gRT->GetVariable(L"SecureBoot", &gEfiGlobalVariableGuid, 
-                                 NULL, &DataSize, &SecureBoot)) == EFI_SUCCESS) {
-        hdr->secure_boot = SecureBoot;
-    }
-    
-    // Set UEFI 64-bit flag
-    hdr->uefi_64bit = (sizeof(UINTN) == 8) ? 1 : 0;
-    
-    // Validate BCBP structure
-    if (bcbp_validate(hdr) != 0) {
-        Print(L"Invalid BCBP structure\n");
-        return EFI_LOAD_ERROR;
-    }
-    
-    // Print boot information
-    Print(L"Booting with BloodChain Boot Protocol\n");
-    Print(L"  Kernel: 0x%llx (%u bytes)\n", KernelLoadAddr, KernelSize);
-    if (InitrdSize > 0) {
-        Print(L"  Initrd: 0x%llx (%u bytes)\n", InitrdLoadAddr, InitrdSize);
-    }
-    Print(L"  Command line: %a\n", cmdline);
-    
-    // Jump to kernel
-    typedef void (*KernelEntry)(struct bcbp_header *);
-    KernelEntry EntryPoint = (KernelEntry)(UINTN)KernelLoadAddr;
-    
-    // Disable interrupts and jump to kernel
-    gBS->ExitBootServices(gImageHandle, 0);
-    EntryPoint(hdr);
-    
-    // We should never get here
-    return EFI_LOAD_ERROR;
+    return bcbp_load_kernel("kernel.elf", "initrd.img", "root=/dev/sda1 ro");
 }
@@ -1,37 +1,155 @@
 #include "arp.h"
+#include "netpoll.h"
+#include "net_utils.h"
 #include "compat.h"
 #include <stdint.h>
 #include <string.h>
-static uint8_t arp_cache_ip[4];
-static uint8_t arp_cache_mac[6];
-static int arp_cache_valid = 0;
+
+// Neighbor table: open-addressed on the IPv4 address, each lookup scans a
+// bounded probe window so there are no tombstones to manage. Expired or
+// least-recently-refreshed slots in the window are recycled on insert.
+struct arp_entry {
+    uint8_t ip[4];
+    uint8_t mac[6];
+    uint8_t valid;
+    uint32_t expires;
+};
+static struct arp_entry arp_table[ARP_TABLE_SIZE];
+static uint8_t arp_local_mac[6];
+static uint8_t arp_local_ip[4];
+static int arp_local_valid = 0;
+static const uint8_t arp_broadcast[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+static uint32_t arp_hash(const uint8_t* ip) {
+    uint32_t h = ((uint32_t)ip[0] << 24) | ((uint32_t)ip[1] << 16) | ((uint32_t)ip[2] << 8) | ip[3];
+    h *= 0x9E3779B1u;
+    return h >> (32 - ARP_TABLE_BITS);
+}
+
+static int arp_expired(const struct arp_entry* e, uint32_t now) {
+    return !e->valid || (int32_t)(e->expires - now) <= 0;
+}
+
+int arp_lookup(const uint8_t* ip, uint8_t* out_mac) {
+    uint32_t now = net_time_ms();
+    uint32_t idx = arp_hash(ip);
+    for (int i = 0; i < ARP_PROBE_LIMIT; ++i) {
+        struct arp_entry* e = &arp_table[(idx + i) & (ARP_TABLE_SIZE - 1)];
+        if (e->valid && memcmp(e->ip, ip, 4) == 0) {
+            if (arp_expired(e, now)) {
+                e->valid = 0;
+                return -1;
+            }
+            if (out_mac) memcpy(out_mac, e->mac, 6);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void arp_update(const uint8_t* ip, const uint8_t* mac) {
+    uint32_t now = net_time_ms();
+    uint32_t idx = arp_hash(ip);
+    struct arp_entry* slot = 0;
+    struct arp_entry* oldest = 0;
+    for (int i = 0; i < ARP_PROBE_LIMIT; ++i) {
+        struct arp_entry* e = &arp_table[(idx + i) & (ARP_TABLE_SIZE - 1)];
+        if (e->valid && memcmp(e->ip, ip, 4) == 0) {
+            slot = e;
+            break;
+        }
+        if (!slot && arp_expired(e, now)) slot = e;
+        if (!oldest || (int32_t)(e->expires - oldest->expires) < 0) oldest = e;
+    }
+    if (!slot) slot = oldest;
+    memcpy(slot->ip, ip, 4);
+    memcpy(slot->mac, mac, 6);
+    slot->valid = 1;
+    slot->expires = now + ARP_ENTRY_TTL_MS;
+}
+
+void arp_flush(void) {
+    memset(arp_table, 0, sizeof(arp_table));
+}
+
 int arp_build_request(uint8_t* buf, const uint8_t* sender_mac, const uint8_t* sender_ip, const uint8_t* target_ip) {
-    memset(buf, 0, 42);
+    memset(buf, 0, 28);
     buf[0] = 0; buf[1] = 1; buf[2] = 8; buf[3] = 0; buf[4] = 6; buf[5] = 4; buf[6] = 0; buf[7] = 1;
     memcpy(buf+8, sender_mac, 6); memcpy(buf+14, sender_ip, 4);
     memset(buf+18, 0, 6); memcpy(buf+24, target_ip, 4);
     return 28;
 }
-int arp_resolve(const uint8_t* sender_mac, const uint8_t* sender_ip, const uint8_t* target_ip, uint8_t* out_mac) {
-    if (arp_cache_valid && memcmp(target_ip, arp_cache_ip, 4) == 0) {
-        memcpy(out_mac, arp_cache_mac, 6);
-        return 0;
+
+static int arp_build_frame(uint8_t* frame, const uint8_t* dst_mac, const uint8_t* sender_mac, const uint8_t* sender_ip,
+                           const uint8_t* target_mac, const uint8_t* target_ip, uint16_t op) {
+    memset(frame, 0, 60);
+    memcpy(frame, dst_mac, 6);
+    memcpy(frame+6, sender_mac, 6);
+    frame[12] = ETHERTYPE_ARP >> 8; frame[13] = ETHERTYPE_ARP & 0xFF;
+    arp_build_request(frame + ETH_HDR_LEN, sender_mac, sender_ip, target_ip);
+    frame[ETH_HDR_LEN+7] = (uint8_t)op;
+    if (target_mac) memcpy(frame+ETH_HDR_LEN+18, target_mac, 6);
+    return 60;
+}
+
+void arp_set_local(const uint8_t* mac, const uint8_t* ip) {
+    memcpy(arp_local_mac, mac, 6);
+    memcpy(arp_local_ip, ip, 4);
+    arp_local_valid = 1;
+    netpoll_register_ethertype(ETHERTYPE_ARP, arp_input, 0);
+}
+
+// Link down: stop answering for the old address and forget every neighbor,
+// so the next bring-up starts clean and announces itself again.
+void arp_clear_local(void) {
+    netpoll_unregister(NETPOLL_ROUTE_ETHERTYPE, ETHERTYPE_ARP);
+    arp_local_valid = 0;
+    arp_flush();
+}
+
+// Gratuitous ARP: sender and target IP are both ours, so every neighbor
+// refreshes its entry for us and nobody needs to ask before the first reply.
+int arp_announce(void) {
+    if (!arp_local_valid) return -1;
+    uint8_t frame[60];
+    int n = arp_build_frame(frame, arp_broadcast, arp_local_mac, arp_local_ip, 0, arp_local_ip, 1);
+    return send_ethernet(frame, n) < 0 ? -1 : 0;
+}
+
+void arp_input(const struct netpoll_rx* rx, void* ctx) {
+    (void)ctx;
+    if (rx->l3_len < 28) return;
+    const uint8_t* arp = rx->l3;
+    if (arp[0] != 0 || arp[1] != 1 || arp[2] != 8 || arp[3] != 0 || arp[4] != 6 || arp[5] != 4) return;
+    uint16_t op = (arp[6] << 8) | arp[7];
+    const uint8_t* sender_mac = arp + 8;
+    const uint8_t* sender_ip = arp + 14;
+    const uint8_t* target_ip = arp + 24;
+    uint8_t zero_ip[4] = { 0, 0, 0, 0 };
+    if (memcmp(sender_ip, zero_ip, 4) != 0) arp_update(sender_ip, sender_mac);
+    if (op == 1 && arp_local_valid && memcmp(target_ip, arp_local_ip, 4) == 0 && memcmp(sender_ip, arp_local_ip, 4) != 0) {
+        uint8_t reply[60];
+        int n = arp_build_frame(reply, sender_mac, arp_local_mac, arp_local_ip, sender_mac, sender_ip, 2);
+        send_ethernet(reply, n);
     }
-    uint8_t req[42];
-    arp_build_request(req, sender_mac, sender_ip, target_ip);
-    for (int retry = 0; retry < 3; ++retry) {
-        send_ethernet(req, 42);
-        for (int t = 0; t < 10000; ++t) {
-            uint8_t resp[60];
-            int n = recv_ethernet(resp, 60);
-            if (n >= 42 && resp[12] == 0x08 && resp[13] == 0x06 && memcmp(resp+28, target_ip, 4) == 0) {
-                memcpy(arp_cache_ip, target_ip, 4);
-                memcpy(arp_cache_mac, resp+22, 6);
-                arp_cache_valid = 1;
-                memcpy(out_mac, resp+22, 6);
-                return 0;
-            }
-        }
+}
+
+struct arp_wait { const uint8_t* ip; uint8_t* mac; };
+
+static int arp_resolved(void* ctx) {
+    struct arp_wait* w = (struct arp_wait*)ctx;
+    return arp_lookup(w->ip, w->mac) == 0;
+}
+
+int arp_resolve(const uint8_t* sender_mac, const uint8_t* sender_ip, const uint8_t* target_ip, uint8_t* out_mac) {
+    if (arp_lookup(target_ip, out_mac) == 0) return 0;
+    if (!arp_local_valid) arp_set_local(sender_mac, sender_ip);
+    uint8_t req[60];
+    int n = arp_build_frame(req, arp_broadcast, sender_mac, sender_ip, 0, target_ip, 1);
+    struct arp_wait w = { target_ip, out_mac };
+    for (int retry = 0; retry < ARP_RESOLVE_RETRIES; ++retry) {
+        send_ethernet(req, n);
+        if (netpoll_wait(arp_resolved, &w, ARP_RESOLVE_TIMEOUT_MS) == 0) return 0;
     }
     return -1;
-} 
\ No newline at end of file
+}
@@ -2,5 +2,22 @@
 #define BLOODHORN_ARP_H
 #include <stdint.h>
 #include "compat.h"
+#include "netpoll.h"
+
+#define ARP_TABLE_BITS 6
+#define ARP_TABLE_SIZE (1 << ARP_TABLE_BITS)
+#define ARP_PROBE_LIMIT 8
+#define ARP_ENTRY_TTL_MS 60000
+#define ARP_RESOLVE_TIMEOUT_MS 500
+#define ARP_RESOLVE_RETRIES 3
+
 int arp_build_request(uint8_t* buf, const uint8_t* sender_mac, const uint8_t* sender_ip, const uint8_t* target_ip);
-#endif 
\ No newline at end of file
+int arp_resolve(const uint8_t* sender_mac, const uint8_t* sender_ip, const uint8_t* target_ip, uint8_t* out_mac);
+int arp_lookup(const uint8_t* ip, uint8_t* out_mac);
+void arp_update(const uint8_t* ip, const uint8_t* mac);
+void arp_flush(void);
+void arp_set_local(const uint8_t* mac, const uint8_t* ip);
+void arp_clear_local(void);
+int arp_announce(void);
+void arp_input(const struct netpoll_rx* rx, void* ctx);
+#endif
@@ -2,7 +2,6 @@
 #include "compat.h"
 #include <stdint.h>
 #include <string.h>
-static uint8_t dhcp_options[312];
 static uint32_t dhcp_lease_time;
 static uint32_t dhcp_renew_time;
 static uint32_t dhcp_rebind_time;
@@ -17,20 +16,66 @@ int dhcp_build_discover(uint8_t* buf, int xid) {
     buf[opt++] = 255;
     return opt;
 }
-int dhcp_parse_offer(const uint8_t* buf, uint32_t* offered_ip) {
-    *offered_ip = *(uint32_t*)&buf[16];
-    memcpy(dhcp_options, buf+240, 312);
-    for (int i = 0; i < 312;) {
-        uint8_t code = dhcp_options[i++];
+static uint32_t dhcp_read32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+static void dhcp_copy_string(char* dst, int size, const uint8_t* src, int len) {
+    int n = len < size - 1 ? len : size - 1;
+    memcpy(dst, src, n);
+    dst[n] = 0;
+}
+// Walks the options where they sit in the received packet instead of
+// copying them out first. lease may be NULL when only the timers matter.
+static int dhcp_parse_options(const uint8_t* buf, int len, struct dhcp_lease* lease) {
+    if (len < 240) return -1;
+    const uint8_t* opts = buf + 240;
+    int optlen = len - 240;
+    for (int i = 0; i < optlen;) {
+        uint8_t code = opts[i++];
         if (code == 0xFF) break;
-        uint8_t len = dhcp_options[i++];
-        if (code == 51) dhcp_lease_time = *(uint32_t*)&dhcp_options[i];
-        if (code == 58) dhcp_renew_time = *(uint32_t*)&dhcp_options[i];
-        if (code == 59) dhcp_rebind_time = *(uint32_t*)&dhcp_options[i];
-        i += len;
+        if (code == 0) continue;
+        if (i >= optlen) break;
+        uint8_t olen = opts[i++];
+        if (i + olen > optlen) break;
+        const uint8_t* v = &opts[i];
+        i += olen;
+        if (code == 51 && olen == 4) dhcp_lease_time = dhcp_read32(v);
+        if (code == 58 && olen == 4) dhcp_renew_time = dhcp_read32(v);
+        if (code == 59 && olen == 4) dhcp_rebind_time = dhcp_read32(v);
+        if (!lease) continue;
+        if (code == 1 && olen == 4) memcpy(lease->mask, v, 4);
+        if (code == 2 && olen == 4) lease->time_offset = dhcp_read32(v);
+        if (code == 3 && olen >= 4) memcpy(lease->gw, v, 4);
+        if (code == 6 && olen >= 4) memcpy(lease->dns, v, 4);
+        if (code == 15) dhcp_copy_string(lease->domain, sizeof(lease->domain), v, olen);
+        if (code == 28 && olen == 4) memcpy(lease->broadcast, v, 4);
+        if (code == 42 && olen >= 4) memcpy(lease->ntp, v, 4);
+        if (code == 51 && olen == 4) lease->lease_time = dhcp_read32(v);
+        if (code == 54 && olen == 4) memcpy(lease->server_id, v, 4);
+        if (code == 66) dhcp_copy_string(lease->server_name, sizeof(lease->server_name), v, olen);
+        if (code == 67) dhcp_copy_string(lease->boot_file, sizeof(lease->boot_file), v, olen);
     }
     return 0;
 }
+int dhcp_parse_offer(const uint8_t* buf, int len, uint32_t* offered_ip) {
+    if (len < 240) return -1;
+    memcpy(offered_ip, &buf[16], 4);
+    return dhcp_parse_options(buf, len, 0);
+}
+// The fixed BOOTP fields go in first, so options 66/67 override sname and
+// file when the server sends both. Option 54 names the DHCP server, which
+// need not be the boot server, so it is kept apart from siaddr.
+int dhcp_parse_ack(const uint8_t* buf, int len, struct dhcp_lease* lease) {
+    if (len < 240 || buf[0] != 2 || buf[2] != 6) return -1;
+    if (buf[236] != 99 || buf[237] != 130 || buf[238] != 83 || buf[239] != 99) return -1;
+    memset(lease, 0, sizeof(*lease));
+    memcpy(lease->mac, &buf[28], 6);
+    memcpy(lease->ip, &buf[16], 4);
+    memcpy(lease->server, &buf[20], 4);
+    dhcp_copy_string(lease->server_name, sizeof(lease->server_name), &buf[44], 64);
+    dhcp_copy_string(lease->boot_file, sizeof(lease->boot_file), &buf[108], 128);
+    return dhcp_parse_options(buf, len, lease);
+}
 int dhcp_renew(uint8_t* buf, int xid) {
     memset(buf, 0, 300);
     buf[0] = 1; buf[1] = 1; buf[2] = 6; buf[3] = 0;
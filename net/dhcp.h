@@ -2,6 +2,29 @@
 #define BLOODHORN_DHCP_H
 #include <stdint.h>
 #include "compat.h"
+
+#define DHCP_PACKET_MAX 1472
+
+// What the server's ACK handed us; addresses are in wire order. server is
+// siaddr (the next server to boot from), server_id is option 54.
+struct dhcp_lease {
+    uint8_t mac[6];
+    uint8_t ip[4];
+    uint8_t server[4];
+    uint8_t server_id[4];
+    uint8_t mask[4];
+    uint8_t gw[4];
+    uint8_t dns[4];
+    uint8_t broadcast[4];
+    uint8_t ntp[4];
+    uint32_t time_offset;
+    uint32_t lease_time;
+    char server_name[64];
+    char boot_file[128];
+    char domain[64];
+};
+
 int dhcp_build_discover(uint8_t* buf, int xid);
-int dhcp_parse_offer(const uint8_t* buf, uint32_t* offered_ip);
-#endif 
\ No newline at end of file
+int dhcp_parse_offer(const uint8_t* buf, int len, uint32_t* offered_ip);
+int dhcp_parse_ack(const uint8_t* buf, int len, struct dhcp_lease* lease);
+#endif
@@ -0,0 +1,174 @@
+#include "dhcp6.h"
+#include "udp.h"
+#include "net_utils.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+
+// RFC 5970 client architecture, so a PXE server can hand out the right image.
+#if defined(__x86_64__)
+#define DHCP6_CLIENT_ARCH 0x0007
+#elif defined(__aarch64__)
+#define DHCP6_CLIENT_ARCH 0x000B
+#elif defined(__riscv)
+#define DHCP6_CLIENT_ARCH 0x001B
+#elif defined(__loongarch64)
+#define DHCP6_CLIENT_ARCH 0x0027
+#else
+#define DHCP6_CLIENT_ARCH 0x0006
+#endif
+
+static const uint8_t dhcp6_all_servers[16] = { 0xFF, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 2 };
+
+static uint8_t* dhcp6_opt(uint8_t* p, uint16_t code, uint16_t len) {
+    p[0] = code >> 8; p[1] = code & 0xFF;
+    p[2] = len >> 8; p[3] = len & 0xFF;
+    return p + 4;
+}
+
+// Header plus the options every message carries: DUID-LL client id, elapsed
+// time, client architecture and the option request list.
+static int dhcp6_build_common(uint8_t* buf, uint8_t type, uint32_t xid, const uint8_t* mac) {
+    uint8_t* p = buf;
+    *p++ = type;
+    *p++ = (xid >> 16) & 0xFF; *p++ = (xid >> 8) & 0xFF; *p++ = xid & 0xFF;
+    p = dhcp6_opt(p, 1, 10);
+    *p++ = 0; *p++ = 3; *p++ = 0; *p++ = 1;
+    memcpy(p, mac, 6); p += 6;
+    p = dhcp6_opt(p, 8, 2);
+    *p++ = 0; *p++ = 0;
+    p = dhcp6_opt(p, 61, 2);
+    *p++ = DHCP6_CLIENT_ARCH >> 8; *p++ = DHCP6_CLIENT_ARCH & 0xFF;
+    p = dhcp6_opt(p, 6, 6);
+    *p++ = 0; *p++ = 23;
+    *p++ = 0; *p++ = 59;
+    *p++ = 0; *p++ = 60;
+    return (int)(p - buf);
+}
+
+static int dhcp6_put_ia_na(uint8_t* p, const uint8_t* addr) {
+    uint8_t* q = dhcp6_opt(p, 3, addr ? 12 + 28 : 12);
+    memset(q, 0, 12);
+    q[3] = DHCP6_IAID;
+    q += 12;
+    if (addr) {
+        q = dhcp6_opt(q, 5, 24);
+        memcpy(q, addr, 16);
+        memset(q + 16, 0, 8);
+        q += 24;
+    }
+    return (int)(q - p);
+}
+
+int dhcp6_build_solicit(uint8_t* buf, uint32_t xid, const uint8_t* mac) {
+    int n = dhcp6_build_common(buf, DHCP6_SOLICIT, xid, mac);
+    return n + dhcp6_put_ia_na(buf + n, 0);
+}
+
+int dhcp6_build_request(uint8_t* buf, uint32_t xid, const uint8_t* mac, const struct dhcp6_lease* lease) {
+    int n = dhcp6_build_common(buf, DHCP6_REQUEST, xid, mac);
+    uint8_t* p = dhcp6_opt(buf + n, 2, (uint16_t)lease->server_id_len);
+    memcpy(p, lease->server_id, lease->server_id_len);
+    n += 4 + lease->server_id_len;
+    return n + dhcp6_put_ia_na(buf + n, lease->have_addr ? lease->addr : 0);
+}
+
+int dhcp6_build_info_request(uint8_t* buf, uint32_t xid, const uint8_t* mac) {
+    return dhcp6_build_common(buf, DHCP6_INFO_REQUEST, xid, mac);
+}
+
+static void dhcp6_copy_str(char* dst, int cap, const uint8_t* src, int len) {
+    if (len >= cap) len = cap - 1;
+    memcpy(dst, src, len);
+    dst[len] = 0;
+}
+
+// Walks the options in place. Returns the message type, or -1 when the
+// packet is malformed, belongs to another transaction or carries a
+// non-success status.
+int dhcp6_parse(const uint8_t* buf, int len, uint32_t xid, struct dhcp6_lease* lease) {
+    if (len < 4) return -1;
+    uint32_t rx_xid = ((uint32_t)buf[1] << 16) | (buf[2] << 8) | buf[3];
+    if (rx_xid != (xid & 0xFFFFFF)) return -1;
+    for (int i = 4; i + 4 <= len;) {
+        uint16_t code = (buf[i] << 8) | buf[i+1];
+        int olen = (buf[i+2] << 8) | buf[i+3];
+        const uint8_t* val = buf + i + 4;
+        if (i + 4 + olen > len) return -1;
+        if (code == 2 && olen <= (int)sizeof(lease->server_id)) {
+            memcpy(lease->server_id, val, olen);
+            lease->server_id_len = olen;
+        } else if (code == 3 && olen >= 12) {
+            for (int j = 12; j + 4 <= olen;) {
+                uint16_t sub = (val[j] << 8) | val[j+1];
+                int slen = (val[j+2] << 8) | val[j+3];
+                if (j + 4 + slen > olen) break;
+                if (sub == 5 && slen >= 24) {
+                    memcpy(lease->addr, val + j + 4, 16);
+                    lease->have_addr = 1;
+                } else if (sub == 13 && slen >= 2 && (val[j+4] | val[j+5]) != 0) {
+                    lease->have_addr = 0;
+                }
+                j += 4 + slen;
+            }
+        } else if (code == 13 && olen >= 2 && (val[0] | val[1]) != 0) {
+            return -1;
+        } else if (code == 23 && olen >= 16) {
+            memcpy(lease->dns, val, 16);
+            lease->have_dns = 1;
+        } else if (code == 59) {
+            dhcp6_copy_str(lease->boot_url, sizeof(lease->boot_url), val, olen);
+        } else if (code == 60 && olen >= 2) {
+            int plen = (val[0] << 8) | val[1];
+            if (plen <= olen - 2) dhcp6_copy_str(lease->boot_param, sizeof(lease->boot_param), val + 2, plen);
+        }
+        i += 4 + olen;
+    }
+    return buf[0];
+}
+
+// Sends msg until a reply of the wanted type for xid turns up.
+static int dhcp6_exchange(struct udp_sock* sock, const uint8_t* msg, int len, uint32_t xid, uint8_t want, struct dhcp6_lease* lease) {
+    for (int retry = 0; retry < DHCP6_RETRIES; ++retry) {
+        udp_sendto6(sock, dhcp6_all_servers, DHCP6_SERVER_PORT, msg, len);
+        uint32_t deadline = net_time_ms() + DHCP6_TIMEOUT_MS;
+        for (;;) {
+            int32_t left = (int32_t)(deadline - net_time_ms());
+            struct udp_dgram d;
+            if (left <= 0 || udp_recv_view(sock, &d, (uint32_t)left) < 0) break;
+            struct dhcp6_lease tmp = *lease;
+            int type = d.ip_version == 6 ? dhcp6_parse(d.payload, d.len, xid, &tmp) : -1;
+            pbuf_free(d.pb);
+            if (type == want) {
+                *lease = tmp;
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+// Stateful (Solicit/Advertise/Request/Reply) when want_addr is set, as the
+// RA's M bit asks for; otherwise stateless Information-Request, which is
+// all that is needed to learn the boot file URL when SLAAC gave us an address.
+int dhcp6_configure(const uint8_t* mac, int want_addr, struct dhcp6_lease* lease) {
+    struct udp_sock sock;
+    uint8_t msg[256];
+    uint32_t xid = (uint32_t)net_ticks() & 0xFFFFFF;
+    int result = -1;
+    memset(lease, 0, sizeof(*lease));
+    if (udp_open(&sock, DHCP6_CLIENT_PORT) != 0) return -1;
+    if (want_addr) {
+        int n = dhcp6_build_solicit(msg, xid, mac);
+        if (dhcp6_exchange(&sock, msg, n, xid, DHCP6_ADVERTISE, lease) == 0 && lease->server_id_len) {
+            xid = (xid + 1) & 0xFFFFFF;
+            n = dhcp6_build_request(msg, xid, mac, lease);
+            if (dhcp6_exchange(&sock, msg, n, xid, DHCP6_REPLY, lease) == 0 && lease->have_addr) result = 0;
+        }
+    } else {
+        int n = dhcp6_build_info_request(msg, xid, mac);
+        result = dhcp6_exchange(&sock, msg, n, xid, DHCP6_REPLY, lease);
+    }
+    udp_close(&sock);
+    return result;
+}
@@ -0,0 +1,34 @@
+#ifndef BLOODHORN_DHCP6_H
+#define BLOODHORN_DHCP6_H
+#include <stdint.h>
+#include "compat.h"
+
+#define DHCP6_CLIENT_PORT 546
+#define DHCP6_SERVER_PORT 547
+#define DHCP6_TIMEOUT_MS 1000
+#define DHCP6_RETRIES 4
+#define DHCP6_IAID 1
+
+#define DHCP6_SOLICIT 1
+#define DHCP6_ADVERTISE 2
+#define DHCP6_REQUEST 3
+#define DHCP6_REPLY 7
+#define DHCP6_INFO_REQUEST 11
+
+struct dhcp6_lease {
+    uint8_t server_id[128];
+    int server_id_len;
+    uint8_t addr[16];
+    int have_addr;
+    uint8_t dns[16];
+    int have_dns;
+    char boot_url[256];
+    char boot_param[128];
+};
+
+int dhcp6_build_solicit(uint8_t* buf, uint32_t xid, const uint8_t* mac);
+int dhcp6_build_request(uint8_t* buf, uint32_t xid, const uint8_t* mac, const struct dhcp6_lease* lease);
+int dhcp6_build_info_request(uint8_t* buf, uint32_t xid, const uint8_t* mac);
+int dhcp6_parse(const uint8_t* buf, int len, uint32_t xid, struct dhcp6_lease* lease);
+int dhcp6_configure(const uint8_t* mac, int want_addr, struct dhcp6_lease* lease);
+#endif
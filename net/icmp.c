@@ -0,0 +1,148 @@
+#include "icmp.h"
+#include "ipv4.h"
+#include "ipv6.h"
+#include "ndisc.h"
+#include "netpoll.h"
+#include "net_utils.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+
+// One echo is outstanding at a time; the reply's RX stamp comes from the
+// pbuf, so time spent queued in the ring is not counted against the RTT. A
+// reply the tick drained has no stamp and is timed when it is dispatched,
+// which the wait loop does on its next pass.
+struct icmp_pending {
+    uint16_t id;
+    uint16_t seq;
+    uint8_t ip[16];
+    int version;
+    int active;
+    int done;
+    uint64_t stamp;
+};
+static struct icmp_pending pending;
+
+static void icmp_reply_echo(const struct netpoll_rx* rx) {
+    struct pbuf* pb = pbuf_alloc();
+    if (!pb) return;
+    uint8_t* msg = pbuf_put(pb, rx->l4_len);
+    memcpy(msg, rx->l4, rx->l4_len);
+    msg[0] = ICMP_ECHO_REPLY;
+    msg[2] = 0; msg[3] = 0;
+    uint16_t csum = net_checksum(msg, rx->l4_len);
+    msg[2] = csum >> 8; msg[3] = csum & 0xFF;
+    ipv4_output_pbuf(rx->l3 + 12, IP_PROTO_ICMP, pb);
+}
+
+static void icmp_match_reply(const struct netpoll_rx* rx, int version, const uint8_t* src) {
+    const uint8_t* msg = rx->l4;
+    if (!pending.active || pending.done || pending.version != version) return;
+    uint16_t id = (msg[4] << 8) | msg[5];
+    uint16_t seq = (msg[6] << 8) | msg[7];
+    if (id != pending.id || seq != pending.seq || memcmp(src, pending.ip, version == 4 ? 4 : 16) != 0) return;
+    pending.stamp = rx->pb->stamp ? rx->pb->stamp : net_ticks();
+    pending.done = 1;
+}
+
+static void icmp_input(const struct netpoll_rx* rx, void* ctx) {
+    (void)ctx;
+    const uint8_t* msg = rx->l4;
+    if (rx->ip_version != 4 || rx->l4_len < ICMP_HDR_LEN || net_checksum(msg, rx->l4_len) != 0) return;
+    struct net_iface* ifc = ipv4_iface();
+    if (msg[0] == ICMP_ECHO_REQUEST) {
+        if (ifc && memcmp(rx->l3 + 16, ifc->ip, 4) == 0) icmp_reply_echo(rx);
+        return;
+    }
+    if (msg[0] == ICMP_ECHO_REPLY) icmp_match_reply(rx, 4, rx->l3 + 12);
+}
+
+// ICMPv6 shares its protocol number with neighbour discovery, so ndisc_input
+// owns the route and hands echo replies here once the checksum is verified.
+void icmp6_echo_reply_input(const struct netpoll_rx* rx) {
+    if (rx->ip_version != 6 || rx->l4_len < ICMP_HDR_LEN) return;
+    icmp_match_reply(rx, 6, rx->l3 + 8);
+}
+
+void icmp_init(void) {
+    net_ticks_calibrate();
+    netpoll_register_ip_proto(IP_PROTO_ICMP, icmp_input, 0);
+}
+
+static int icmp_replied(void* ctx) {
+    (void)ctx;
+    return pending.done;
+}
+
+static uint8_t* icmp_put_echo(struct pbuf* pb, uint8_t type, uint16_t id, uint16_t seq, int payload_len) {
+    uint8_t* msg = pbuf_put(pb, ICMP_HDR_LEN + payload_len);
+    msg[0] = type;
+    msg[1] = 0;
+    msg[2] = 0; msg[3] = 0;
+    msg[4] = id >> 8; msg[5] = id & 0xFF;
+    msg[6] = seq >> 8; msg[7] = seq & 0xFF;
+    for (int i = 0; i < payload_len; ++i) msg[ICMP_HDR_LEN + i] = (uint8_t)i;
+    return msg;
+}
+
+static void icmp_expect(int version, const uint8_t* dst, uint16_t id, uint16_t seq) {
+    pending.id = id;
+    pending.seq = seq;
+    pending.version = version;
+    memcpy(pending.ip, dst, version == 4 ? 4 : 16);
+    pending.done = 0;
+    pending.active = 1;
+}
+
+static int icmp_finish(uint64_t start, uint32_t timeout_ms, uint64_t* rtt_ticks) {
+    int r = netpoll_wait(icmp_replied, 0, timeout_ms);
+    pending.active = 0;
+    if (r != 0 || !pending.done) return -1;
+    if (rtt_ticks) *rtt_ticks = pending.stamp > start ? pending.stamp - start : 0;
+    return 0;
+}
+
+// Sends one echo request and waits for the matching reply. The next hop is
+// resolved before the TX stamp so a cold ARP cache does not inflate the
+// first sample. rtt_ticks is in net_ticks() units.
+int icmp_echo(const uint8_t* dst_ip, uint16_t id, uint16_t seq, int payload_len, uint32_t timeout_ms, uint64_t* rtt_ticks) {
+    uint8_t mac[6];
+    if (payload_len < 0 || payload_len > ICMP_ECHO_MAX_PAYLOAD - ICMP_HDR_LEN) return -1;
+    if (!ipv4_iface() || ipv4_next_hop_mac(dst_ip, mac) != 0) return -1;
+    struct pbuf* pb = pbuf_alloc();
+    if (!pb) return -1;
+    uint8_t* msg = icmp_put_echo(pb, ICMP_ECHO_REQUEST, id, seq, payload_len);
+    uint16_t csum = net_checksum(msg, ICMP_HDR_LEN + payload_len);
+    msg[2] = csum >> 8; msg[3] = csum & 0xFF;
+
+    icmp_expect(4, dst_ip, id, seq);
+    uint64_t start = net_ticks();
+    if (ipv4_output_pbuf(dst_ip, IP_PROTO_ICMP, pb) != 0) {
+        pending.active = 0;
+        return -1;
+    }
+    return icmp_finish(start, timeout_ms, rtt_ticks);
+}
+
+// The same over IPv6; the neighbour entry is resolved up front for the
+// same reason.
+int icmp_echo6(const uint8_t* dst_ip6, uint16_t id, uint16_t seq, int payload_len, uint32_t timeout_ms, uint64_t* rtt_ticks) {
+    uint8_t mac[6];
+    if (payload_len < 0 || payload_len > ICMPV6_ECHO_MAX_PAYLOAD - ICMP_HDR_LEN) return -1;
+    const uint8_t* src = ipv6_source_for(dst_ip6);
+    if (!src || ipv6_next_hop_mac(dst_ip6, mac) != 0) return -1;
+    struct pbuf* pb = pbuf_alloc();
+    if (!pb) return -1;
+    int len = ICMP_HDR_LEN + payload_len;
+    uint8_t* msg = icmp_put_echo(pb, ICMPV6_ECHO_REQUEST, id, seq, payload_len);
+    uint16_t csum = ~net_checksum_partial(ipv6_pseudo_sum(src, dst_ip6, IP_PROTO_ICMPV6, len), msg, len);
+    msg[2] = csum >> 8; msg[3] = csum & 0xFF;
+
+    icmp_expect(6, dst_ip6, id, seq);
+    uint64_t start = net_ticks();
+    if (ipv6_send_pbuf(src, dst_ip6, IP_PROTO_ICMPV6, IPV6_DEFAULT_HOPS, pb) != 0) {
+        pending.active = 0;
+        return -1;
+    }
+    return icmp_finish(start, timeout_ms, rtt_ticks);
+}
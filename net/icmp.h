@@ -0,0 +1,18 @@
+#ifndef BLOODHORN_ICMP_H
+#define BLOODHORN_ICMP_H
+#include <stdint.h>
+#include "compat.h"
+
+#define ICMP_HDR_LEN 8
+#define ICMP_ECHO_REPLY 0
+#define ICMP_ECHO_REQUEST 8
+#define ICMP_ECHO_MAX_PAYLOAD 1472
+#define ICMPV6_ECHO_MAX_PAYLOAD 1452
+
+struct netpoll_rx;
+
+void icmp_init(void);
+int icmp_echo(const uint8_t* dst_ip, uint16_t id, uint16_t seq, int payload_len, uint32_t timeout_ms, uint64_t* rtt_ticks);
+int icmp_echo6(const uint8_t* dst_ip6, uint16_t id, uint16_t seq, int payload_len, uint32_t timeout_ms, uint64_t* rtt_ticks);
+void icmp6_echo_reply_input(const struct netpoll_rx* rx);
+#endif
@@ -0,0 +1,94 @@
+#include "ipv4.h"
+#include "arp.h"
+#include "icmp.h"
+#include "netpoll.h"
+#include "net_utils.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+
+static struct net_iface iface;
+static uint16_t ipv4_ident = 1;
+
+void ipv4_configure(const uint8_t* mac, const uint8_t* ip, const uint8_t* mask, const uint8_t* gw) {
+    memcpy(iface.mac, mac, 6);
+    memcpy(iface.ip, ip, 4);
+    memcpy(iface.mask, mask, 4);
+    memcpy(iface.gw, gw, 4);
+    iface.up = 1;
+    arp_set_local(mac, ip);
+    icmp_init();
+    arp_announce();
+}
+
+void ipv4_unconfigure(void) {
+    if (!iface.up) return;
+    iface.up = 0;
+    arp_clear_local();
+}
+
+struct net_iface* ipv4_iface(void) {
+    return iface.up ? &iface : 0;
+}
+
+int ipv4_next_hop_mac(const uint8_t* dst_ip, uint8_t* out_mac) {
+    int local = 1;
+    int bcast = 1;
+    for (int i = 0; i < 4; ++i) {
+        if ((dst_ip[i] & iface.mask[i]) != (iface.ip[i] & iface.mask[i])) local = 0;
+        if (dst_ip[i] != 0xFF && dst_ip[i] != (iface.ip[i] | (uint8_t)~iface.mask[i])) bcast = 0;
+    }
+    if (bcast) {
+        memset(out_mac, 0xFF, 6);
+        return 0;
+    }
+    return arp_resolve(iface.mac, iface.ip, local ? dst_ip : iface.gw, out_mac);
+}
+
+int ipv4_build_header(uint8_t* hdr, const uint8_t* src_ip, const uint8_t* dst_ip, uint8_t proto, int payload_len) {
+    int total = IPV4_HDR_LEN + payload_len;
+    memset(hdr, 0, IPV4_HDR_LEN);
+    hdr[0] = 0x45;
+    hdr[2] = total >> 8; hdr[3] = total & 0xFF;
+    hdr[4] = ipv4_ident >> 8; hdr[5] = ipv4_ident & 0xFF;
+    ipv4_ident++;
+    hdr[6] = 0x40;
+    hdr[8] = IPV4_DEFAULT_TTL;
+    hdr[9] = proto;
+    memcpy(hdr+12, src_ip, 4);
+    memcpy(hdr+16, dst_ip, 4);
+    uint16_t sum = net_checksum(hdr, IPV4_HDR_LEN);
+    hdr[10] = sum >> 8; hdr[11] = sum & 0xFF;
+    return IPV4_HDR_LEN;
+}
+
+// Consumes pb. pb->data holds the transport segment; the IP and Ethernet
+// headers go into its headroom so the payload is sent from where it was built.
+int ipv4_output_pbuf(const uint8_t* dst_ip, uint8_t proto, struct pbuf* pb) {
+    int len = pb->len;
+    int result = -1;
+    if (!iface.up || len > IPV4_MTU - IPV4_HDR_LEN) goto out;
+    uint8_t* ip = pbuf_push(pb, IPV4_HDR_LEN);
+    uint8_t* frame = pbuf_push(pb, ETH_HDR_LEN);
+    if (!ip || !frame) goto out;
+    ipv4_build_header(ip, iface.ip, dst_ip, proto, len);
+    if (ipv4_next_hop_mac(dst_ip, frame) != 0) goto out;
+    memcpy(frame+6, iface.mac, 6);
+    frame[12] = ETHERTYPE_IPV4 >> 8; frame[13] = ETHERTYPE_IPV4 & 0xFF;
+    if (pb->len < 60) {
+        int pad = 60 - pb->len;
+        memset(pbuf_put(pb, pad), 0, pad);
+    }
+    result = send_ethernet(pb->data, pb->len) < 0 ? -1 : 0;
+out:
+    pbuf_free(pb);
+    return result;
+}
+
+int ipv4_output(const uint8_t* dst_ip, uint8_t proto, const uint8_t* payload, int len) {
+    if (len < 0 || len > IPV4_MTU - IPV4_HDR_LEN) return -1;
+    struct pbuf* pb = pbuf_alloc();
+    if (!pb) return -1;
+    memcpy(pbuf_put(pb, len), payload, len);
+    return ipv4_output_pbuf(dst_ip, proto, pb);
+}
@@ -0,0 +1,26 @@
+#ifndef BLOODHORN_IPV4_H
+#define BLOODHORN_IPV4_H
+#include <stdint.h>
+#include "compat.h"
+#include "pbuf.h"
+
+#define IPV4_HDR_LEN 20
+#define IPV4_MTU 1500
+#define IPV4_DEFAULT_TTL 64
+
+struct net_iface {
+    uint8_t mac[6];
+    uint8_t ip[4];
+    uint8_t mask[4];
+    uint8_t gw[4];
+    int up;
+};
+
+void ipv4_configure(const uint8_t* mac, const uint8_t* ip, const uint8_t* mask, const uint8_t* gw);
+void ipv4_unconfigure(void);
+struct net_iface* ipv4_iface(void);
+int ipv4_next_hop_mac(const uint8_t* dst_ip, uint8_t* out_mac);
+int ipv4_build_header(uint8_t* hdr, const uint8_t* src_ip, const uint8_t* dst_ip, uint8_t proto, int payload_len);
+int ipv4_output(const uint8_t* dst_ip, uint8_t proto, const uint8_t* payload, int len);
+int ipv4_output_pbuf(const uint8_t* dst_ip, uint8_t proto, struct pbuf* pb);
+#endif
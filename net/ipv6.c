@@ -0,0 +1,157 @@
+#include "ipv6.h"
+#include "ndisc.h"
+#include "netpoll.h"
+#include "net_utils.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+
+static struct net6_iface iface6;
+
+// Modified EUI-64 (RFC 4291 appendix A): flip the U/L bit and put ff:fe in the middle.
+void ipv6_interface_id(const uint8_t* mac, uint8_t* out) {
+    out[0] = mac[0] ^ 0x02; out[1] = mac[1]; out[2] = mac[2];
+    out[3] = 0xFF; out[4] = 0xFE;
+    out[5] = mac[3]; out[6] = mac[4]; out[7] = mac[5];
+}
+
+// Brings up the link-local address. It is used without waiting for DAD;
+// a conflict there means a duplicate MAC, which SLAAC cannot fix anyway.
+void ipv6_configure(const uint8_t* mac) {
+    memset(&iface6, 0, sizeof(iface6));
+    memcpy(iface6.mac, mac, 6);
+    iface6.link_local[0] = 0xFE;
+    iface6.link_local[1] = 0x80;
+    ipv6_interface_id(mac, iface6.link_local + 8);
+    iface6.up = 1;
+    ndisc_init();
+}
+
+void ipv6_unconfigure(void) {
+    if (!iface6.up) return;
+    iface6.up = 0;
+    ndisc_shutdown();
+}
+
+struct net6_iface* ipv6_iface(void) {
+    return iface6.up ? &iface6 : 0;
+}
+
+int ipv6_set_address(const uint8_t* addr, int prefix_len) {
+    if (!iface6.up || prefix_len <= 0 || prefix_len > 128) return -1;
+    if (ndisc_dad(addr) != 0) return -1;
+    memcpy(iface6.addr, addr, 16);
+    memset(iface6.prefix, 0, 16);
+    for (int i = 0; i < prefix_len; ++i) iface6.prefix[i / 8] |= addr[i / 8] & (0x80 >> (i % 8));
+    iface6.prefix_len = prefix_len;
+    iface6.have_addr = 1;
+    return 0;
+}
+
+// Router solicitation, then a SLAAC address from the first autonomous /64
+// prefix. The RA's M/O bits are kept in ra_flags so the caller can decide
+// whether DHCPv6 still has to run.
+int ipv6_slaac(uint32_t timeout_ms) {
+    struct ndisc_router ra;
+    if (!iface6.up || ndisc_solicit_router(&ra, timeout_ms) != 0) return -1;
+    memcpy(iface6.router, ra.addr, 16);
+    iface6.have_router = ra.lifetime != 0;
+    iface6.ra_flags = ra.flags;
+    if (ra.have_dns) {
+        memcpy(iface6.dns, ra.dns, 16);
+        iface6.have_dns = 1;
+    }
+    if (!ra.autonomous || ra.prefix_len != 64) return 0;
+    uint8_t addr[16];
+    memcpy(addr, ra.prefix, 8);
+    ipv6_interface_id(iface6.mac, addr + 8);
+    return ipv6_set_address(addr, 64);
+}
+
+int ipv6_is_multicast(const uint8_t* ip) {
+    return ip[0] == 0xFF;
+}
+
+static int ipv6_is_link_scope(const uint8_t* ip) {
+    return (ip[0] == 0xFE && (ip[1] & 0xC0) == 0x80) || (ip[0] == 0xFF && (ip[1] & 0x0F) <= 2);
+}
+
+int ipv6_is_local(const uint8_t* ip) {
+    if (!iface6.up) return 0;
+    if (memcmp(ip, iface6.link_local, 16) == 0) return 1;
+    return iface6.have_addr && memcmp(ip, iface6.addr, 16) == 0;
+}
+
+static int ipv6_on_link(const uint8_t* ip) {
+    if (ipv6_is_link_scope(ip)) return 1;
+    if (!iface6.have_addr) return 0;
+    for (int i = 0; i < iface6.prefix_len; ++i) {
+        uint8_t bit = 0x80 >> (i % 8);
+        if ((ip[i / 8] & bit) != (iface6.prefix[i / 8] & bit)) return 0;
+    }
+    return 1;
+}
+
+const uint8_t* ipv6_source_for(const uint8_t* dst) {
+    if (!iface6.up) return 0;
+    if (ipv6_is_link_scope(dst) || !iface6.have_addr) return iface6.link_local;
+    return iface6.addr;
+}
+
+uint32_t ipv6_pseudo_sum(const uint8_t* src, const uint8_t* dst, uint8_t proto, uint32_t len) {
+    uint8_t tail[8] = { (uint8_t)(len >> 24), (uint8_t)(len >> 16), (uint8_t)(len >> 8), (uint8_t)len, 0, 0, 0, proto };
+    uint32_t sum = net_checksum_partial(0, src, 16);
+    sum = net_checksum_partial(sum, dst, 16);
+    return net_checksum_partial(sum, tail, 8);
+}
+
+int ipv6_next_hop_mac(const uint8_t* dst, uint8_t* out_mac) {
+    if (ipv6_is_multicast(dst)) {
+        ndisc_multicast_mac(dst, out_mac);
+        return 0;
+    }
+    if (ipv6_on_link(dst)) return ndisc_resolve(dst, out_mac);
+    if (!iface6.have_router) return -1;
+    return ndisc_resolve(iface6.router, out_mac);
+}
+
+// Consumes pb, like ipv4_output_pbuf. Neighbor discovery passes its own
+// source (:: during DAD) and hop limit 255; everything else goes through
+// ipv6_output_pbuf.
+int ipv6_send_pbuf(const uint8_t* src, const uint8_t* dst, uint8_t proto, uint8_t hops, struct pbuf* pb) {
+    int len = pb->len;
+    int result = -1;
+    if (!iface6.up || !src || len > IPV6_MTU - IPV6_HDR_LEN) goto out;
+    uint8_t* ip = pbuf_push(pb, IPV6_HDR_LEN);
+    uint8_t* frame = pbuf_push(pb, ETH_HDR_LEN);
+    if (!ip || !frame) goto out;
+    ip[0] = 0x60; ip[1] = 0; ip[2] = 0; ip[3] = 0;
+    ip[4] = len >> 8; ip[5] = len & 0xFF;
+    ip[6] = proto;
+    ip[7] = hops;
+    memcpy(ip+8, src, 16);
+    memcpy(ip+24, dst, 16);
+    if (ipv6_next_hop_mac(dst, frame) != 0) goto out;
+    memcpy(frame+6, iface6.mac, 6);
+    frame[12] = ETHERTYPE_IPV6 >> 8; frame[13] = ETHERTYPE_IPV6 & 0xFF;
+    if (pb->len < 60) {
+        int pad = 60 - pb->len;
+        memset(pbuf_put(pb, pad), 0, pad);
+    }
+    result = send_ethernet(pb->data, pb->len) < 0 ? -1 : 0;
+out:
+    pbuf_free(pb);
+    return result;
+}
+
+int ipv6_output_pbuf(const uint8_t* dst, uint8_t proto, struct pbuf* pb) {
+    return ipv6_send_pbuf(ipv6_source_for(dst), dst, proto, IPV6_DEFAULT_HOPS, pb);
+}
+
+int ipv6_output(const uint8_t* dst, uint8_t proto, const uint8_t* payload, int len) {
+    if (len < 0 || len > IPV6_MTU - IPV6_HDR_LEN) return -1;
+    struct pbuf* pb = pbuf_alloc();
+    if (!pb) return -1;
+    memcpy(pbuf_put(pb, len), payload, len);
+    return ipv6_output_pbuf(dst, proto, pb);
+}
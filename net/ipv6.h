@@ -0,0 +1,40 @@
+#ifndef BLOODHORN_IPV6_H
+#define BLOODHORN_IPV6_H
+#include <stdint.h>
+#include "compat.h"
+#include "pbuf.h"
+
+#define IPV6_HDR_LEN 40
+#define IPV6_MTU 1500
+#define IPV6_DEFAULT_HOPS 64
+
+struct net6_iface {
+    uint8_t mac[6];
+    uint8_t link_local[16];
+    uint8_t addr[16];
+    uint8_t prefix[16];
+    int prefix_len;
+    uint8_t router[16];
+    uint8_t dns[16];
+    uint8_t ra_flags;
+    int have_addr;
+    int have_router;
+    int have_dns;
+    int up;
+};
+
+void ipv6_configure(const uint8_t* mac);
+void ipv6_unconfigure(void);
+struct net6_iface* ipv6_iface(void);
+void ipv6_interface_id(const uint8_t* mac, uint8_t* out);
+int ipv6_set_address(const uint8_t* addr, int prefix_len);
+int ipv6_slaac(uint32_t timeout_ms);
+int ipv6_is_multicast(const uint8_t* ip);
+int ipv6_is_local(const uint8_t* ip);
+const uint8_t* ipv6_source_for(const uint8_t* dst);
+uint32_t ipv6_pseudo_sum(const uint8_t* src, const uint8_t* dst, uint8_t proto, uint32_t len);
+int ipv6_next_hop_mac(const uint8_t* dst, uint8_t* out_mac);
+int ipv6_send_pbuf(const uint8_t* src, const uint8_t* dst, uint8_t proto, uint8_t hops, struct pbuf* pb);
+int ipv6_output_pbuf(const uint8_t* dst, uint8_t proto, struct pbuf* pb);
+int ipv6_output(const uint8_t* dst, uint8_t proto, const uint8_t* payload, int len);
+#endif
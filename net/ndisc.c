@@ -0,0 +1,320 @@
+#include "ndisc.h"
+#include "ipv6.h"
+#include "netpoll.h"
+#include "net_utils.h"
+#include "icmp.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+
+// Neighbor cache, laid out like the ARP table: open addressing over a
+// bounded probe window, with expired or oldest slots recycled on insert.
+struct ndisc_entry {
+    uint8_t ip[16];
+    uint8_t mac[6];
+    uint8_t valid;
+    uint32_t expires;
+};
+static struct ndisc_entry ndisc_table[NDISC_TABLE_SIZE];
+static const uint8_t ndisc_all_nodes[16] = { 0xFF, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+static const uint8_t ndisc_all_routers[16] = { 0xFF, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2 };
+static const uint8_t ndisc_unspecified[16] = { 0 };
+
+// Router Advertisement and DAD state filled in by ndisc_input.
+static struct ndisc_router ndisc_ra;
+static int ndisc_ra_seen = 0;
+static int ndisc_ra_wanted = 0;
+static uint8_t ndisc_tentative[16];
+static int ndisc_dad_active = 0;
+static int ndisc_dad_conflict = 0;
+
+static uint32_t ndisc_hash(const uint8_t* ip) {
+    uint32_t h = ((uint32_t)ip[12] << 24) | ((uint32_t)ip[13] << 16) | ((uint32_t)ip[14] << 8) | ip[15];
+    h ^= ((uint32_t)ip[8] << 24) | ((uint32_t)ip[9] << 16) | ((uint32_t)ip[10] << 8) | ip[11];
+    h *= 0x9E3779B1u;
+    return h >> (32 - NDISC_TABLE_BITS);
+}
+
+static int ndisc_expired(const struct ndisc_entry* e, uint32_t now) {
+    return !e->valid || (int32_t)(e->expires - now) <= 0;
+}
+
+int ndisc_lookup(const uint8_t* ip, uint8_t* out_mac) {
+    uint32_t now = net_time_ms();
+    uint32_t idx = ndisc_hash(ip);
+    for (int i = 0; i < NDISC_PROBE_LIMIT; ++i) {
+        struct ndisc_entry* e = &ndisc_table[(idx + i) & (NDISC_TABLE_SIZE - 1)];
+        if (e->valid && memcmp(e->ip, ip, 16) == 0) {
+            if (ndisc_expired(e, now)) {
+                e->valid = 0;
+                return -1;
+            }
+            if (out_mac) memcpy(out_mac, e->mac, 6);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void ndisc_update(const uint8_t* ip, const uint8_t* mac) {
+    uint32_t now = net_time_ms();
+    uint32_t idx = ndisc_hash(ip);
+    struct ndisc_entry* slot = 0;
+    struct ndisc_entry* oldest = 0;
+    for (int i = 0; i < NDISC_PROBE_LIMIT; ++i) {
+        struct ndisc_entry* e = &ndisc_table[(idx + i) & (NDISC_TABLE_SIZE - 1)];
+        if (e->valid && memcmp(e->ip, ip, 16) == 0) {
+            slot = e;
+            break;
+        }
+        if (!slot && ndisc_expired(e, now)) slot = e;
+        if (!oldest || (int32_t)(e->expires - oldest->expires) < 0) oldest = e;
+    }
+    if (!slot) slot = oldest;
+    memcpy(slot->ip, ip, 16);
+    memcpy(slot->mac, mac, 6);
+    slot->valid = 1;
+    slot->expires = now + NDISC_ENTRY_TTL_MS;
+}
+
+void ndisc_flush(void) {
+    memset(ndisc_table, 0, sizeof(ndisc_table));
+}
+
+void ndisc_multicast_mac(const uint8_t* ip, uint8_t* out_mac) {
+    out_mac[0] = 0x33; out_mac[1] = 0x33;
+    memcpy(out_mac + 2, ip + 12, 4);
+}
+
+static void ndisc_solicited_node(const uint8_t* ip, uint8_t* out) {
+    memset(out, 0, 16);
+    out[0] = 0xFF; out[1] = 0x02;
+    out[11] = 0x01; out[12] = 0xFF;
+    memcpy(out + 13, ip + 13, 3);
+}
+
+// Checksums the ICMPv6 message in pb and sends it with hop limit 255, which
+// receivers use to reject off-link ND packets.
+static int ndisc_send(const uint8_t* src, const uint8_t* dst, struct pbuf* pb) {
+    uint8_t* msg = pb->data;
+    msg[2] = 0; msg[3] = 0;
+    uint16_t csum = ~net_checksum_partial(ipv6_pseudo_sum(src, dst, IP_PROTO_ICMPV6, pb->len), msg, pb->len);
+    msg[2] = csum >> 8; msg[3] = csum & 0xFF;
+    return ipv6_send_pbuf(src, dst, IP_PROTO_ICMPV6, 255, pb);
+}
+
+static uint8_t* ndisc_put_lla(struct pbuf* pb, uint8_t type) {
+    struct net6_iface* ifc = ipv6_iface();
+    uint8_t* opt = pbuf_put(pb, 8);
+    opt[0] = type;
+    opt[1] = 1;
+    memcpy(opt + 2, ifc->mac, 6);
+    return opt;
+}
+
+static int ndisc_send_ns(const uint8_t* src, const uint8_t* target) {
+    uint8_t dst[16];
+    struct pbuf* pb = pbuf_alloc();
+    if (!pb) return -1;
+    uint8_t* msg = pbuf_put(pb, 24);
+    memset(msg, 0, 24);
+    msg[0] = ICMPV6_NEIGHBOR_SOLICIT;
+    memcpy(msg + 8, target, 16);
+    // RFC 4861 7.2.2: no source link-layer option when the source is unspecified.
+    if (memcmp(src, ndisc_unspecified, 16) != 0) ndisc_put_lla(pb, 1);
+    ndisc_solicited_node(target, dst);
+    return ndisc_send(src, dst, pb);
+}
+
+static int ndisc_send_na(const uint8_t* target, const uint8_t* dst, int solicited) {
+    struct pbuf* pb = pbuf_alloc();
+    if (!pb) return -1;
+    uint8_t* msg = pbuf_put(pb, 24);
+    memset(msg, 0, 24);
+    msg[0] = ICMPV6_NEIGHBOR_ADVERT;
+    msg[4] = (solicited ? 0x40 : 0) | 0x20;
+    memcpy(msg + 8, target, 16);
+    ndisc_put_lla(pb, 2);
+    return ndisc_send(target, dst, pb);
+}
+
+static int ndisc_send_rs(void) {
+    struct net6_iface* ifc = ipv6_iface();
+    struct pbuf* pb = pbuf_alloc();
+    if (!pb) return -1;
+    uint8_t* msg = pbuf_put(pb, 8);
+    memset(msg, 0, 8);
+    msg[0] = ICMPV6_ROUTER_SOLICIT;
+    ndisc_put_lla(pb, 1);
+    return ndisc_send(ifc->link_local, ndisc_all_routers, pb);
+}
+
+static void ndisc_echo_reply(const struct netpoll_rx* rx) {
+    const uint8_t* dst = rx->l3 + 24;
+    if (!ipv6_is_local(dst)) return;
+    struct pbuf* pb = pbuf_alloc();
+    if (!pb) return;
+    uint8_t* msg = pbuf_put(pb, rx->l4_len);
+    memcpy(msg, rx->l4, rx->l4_len);
+    msg[0] = ICMPV6_ECHO_REPLY;
+    msg[2] = 0; msg[3] = 0;
+    uint16_t csum = ~net_checksum_partial(ipv6_pseudo_sum(dst, rx->l3 + 8, IP_PROTO_ICMPV6, rx->l4_len), msg, rx->l4_len);
+    msg[2] = csum >> 8; msg[3] = csum & 0xFF;
+    ipv6_send_pbuf(dst, rx->l3 + 8, IP_PROTO_ICMPV6, IPV6_DEFAULT_HOPS, pb);
+}
+
+// Walks the TLV options after an ND header of hdr_len bytes and returns the
+// link-layer address option of the given type, if any.
+static const uint8_t* ndisc_find_lla(const uint8_t* msg, int len, int hdr_len, uint8_t type) {
+    for (int i = hdr_len; i + 8 <= len;) {
+        int olen = msg[i + 1] * 8;
+        if (!olen || i + olen > len) break;
+        if (msg[i] == type && olen >= 8) return msg + i + 2;
+        i += olen;
+    }
+    return 0;
+}
+
+static void ndisc_router_advert(const uint8_t* src, const uint8_t* msg, int len) {
+    if (len < 16 || !ndisc_ra_wanted || ndisc_ra_seen) return;
+    struct ndisc_router* ra = &ndisc_ra;
+    memset(ra, 0, sizeof(*ra));
+    memcpy(ra->addr, src, 16);
+    ra->flags = msg[5];
+    ra->lifetime = (msg[6] << 8) | msg[7];
+    for (int i = 16; i + 8 <= len;) {
+        const uint8_t* opt = msg + i;
+        int olen = opt[1] * 8;
+        if (!olen || i + olen > len) break;
+        if (opt[0] == 1) {
+            memcpy(ra->mac, opt + 2, 6);
+            ndisc_update(src, opt + 2);
+        } else if (opt[0] == 3 && olen == 32 && (!ra->prefix_len || (!ra->autonomous && (opt[3] & 0x40)))) {
+            ra->prefix_len = opt[2];
+            ra->autonomous = (opt[3] & 0x40) != 0;
+            memcpy(ra->prefix, opt + 16, 16);
+        } else if (opt[0] == 5 && olen == 8) {
+            ra->mtu = ((uint32_t)opt[4] << 24) | ((uint32_t)opt[5] << 16) | (opt[6] << 8) | opt[7];
+        } else if (opt[0] == 25 && olen >= 24 && !ra->have_dns) {
+            memcpy(ra->dns, opt + 8, 16);
+            ra->have_dns = 1;
+        }
+        i += olen;
+    }
+    ndisc_ra_seen = 1;
+}
+
+void ndisc_input(const struct netpoll_rx* rx, void* ctx) {
+    (void)ctx;
+    if (rx->ip_version != 6 || rx->l4_len < 8) return;
+    const uint8_t* src = rx->l3 + 8;
+    const uint8_t* dst = rx->l3 + 24;
+    const uint8_t* msg = rx->l4;
+    int len = rx->l4_len;
+    if ((uint16_t)~net_checksum_partial(ipv6_pseudo_sum(src, dst, IP_PROTO_ICMPV6, len), msg, len) != 0) return;
+    if (msg[0] == ICMPV6_ECHO_REQUEST) {
+        ndisc_echo_reply(rx);
+        return;
+    }
+    if (msg[0] == ICMPV6_ECHO_REPLY) {
+        icmp6_echo_reply_input(rx);
+        return;
+    }
+    if (msg[0] < ICMPV6_ROUTER_SOLICIT || msg[0] > ICMPV6_NEIGHBOR_ADVERT || rx->l3[7] != 255 || msg[1] != 0) return;
+    if (msg[0] == ICMPV6_ROUTER_ADVERT) {
+        if (src[0] == 0xFE && (src[1] & 0xC0) == 0x80) ndisc_router_advert(src, msg, len);
+        return;
+    }
+    if (len < 24) return;
+    const uint8_t* target = msg + 8;
+    int from_unspec = memcmp(src, ndisc_unspecified, 16) == 0;
+    if (msg[0] == ICMPV6_NEIGHBOR_SOLICIT) {
+        if (ndisc_dad_active && from_unspec && memcmp(target, ndisc_tentative, 16) == 0) {
+            ndisc_dad_conflict = 1;
+            return;
+        }
+        if (!ipv6_is_local(target)) return;
+        const uint8_t* lla = ndisc_find_lla(msg, len, 24, 1);
+        if (from_unspec) {
+            ndisc_send_na(target, ndisc_all_nodes, 0);
+            return;
+        }
+        if (lla) ndisc_update(src, lla);
+        ndisc_send_na(target, src, 1);
+    } else if (msg[0] == ICMPV6_NEIGHBOR_ADVERT) {
+        if (ndisc_dad_active && memcmp(target, ndisc_tentative, 16) == 0) {
+            ndisc_dad_conflict = 1;
+            return;
+        }
+        const uint8_t* lla = ndisc_find_lla(msg, len, 24, 2);
+        if (lla) ndisc_update(target, lla);
+        else if (ndisc_lookup(target, 0) == 0) ndisc_update(target, rx->frame + 6);
+    }
+}
+
+void ndisc_init(void) {
+    netpoll_register_ip_proto(IP_PROTO_ICMPV6, ndisc_input, 0);
+}
+
+void ndisc_shutdown(void) {
+    netpoll_unregister(NETPOLL_ROUTE_IP_PROTO, IP_PROTO_ICMPV6);
+    ndisc_flush();
+}
+
+struct ndisc_wait { const uint8_t* ip; uint8_t* mac; };
+
+static int ndisc_resolved(void* ctx) {
+    struct ndisc_wait* w = (struct ndisc_wait*)ctx;
+    return ndisc_lookup(w->ip, w->mac) == 0;
+}
+
+int ndisc_resolve(const uint8_t* ip, uint8_t* out_mac) {
+    if (ndisc_lookup(ip, out_mac) == 0) return 0;
+    const uint8_t* src = ipv6_source_for(ip);
+    if (!src) return -1;
+    struct ndisc_wait w = { ip, out_mac };
+    for (int retry = 0; retry < NDISC_RESOLVE_RETRIES; ++retry) {
+        ndisc_send_ns(src, ip);
+        if (netpoll_wait(ndisc_resolved, &w, NDISC_RESOLVE_TIMEOUT_MS) == 0) return 0;
+    }
+    return -1;
+}
+
+static int ndisc_ra_arrived(void* ctx) {
+    (void)ctx;
+    return ndisc_ra_seen;
+}
+
+int ndisc_solicit_router(struct ndisc_router* out, uint32_t timeout_ms) {
+    if (!ipv6_iface()) return -1;
+    ndisc_ra_seen = 0;
+    ndisc_ra_wanted = 1;
+    int result = -1;
+    for (int retry = 0; retry < NDISC_RS_RETRIES; ++retry) {
+        ndisc_send_rs();
+        if (netpoll_wait(ndisc_ra_arrived, 0, timeout_ms) == 0) {
+            *out = ndisc_ra;
+            result = 0;
+            break;
+        }
+    }
+    ndisc_ra_wanted = 0;
+    return result;
+}
+
+static int ndisc_dad_failed(void* ctx) {
+    (void)ctx;
+    return ndisc_dad_conflict;
+}
+
+// Duplicate Address Detection (RFC 4862 5.4) with a single probe: returns 0
+// when nobody defends the address within NDISC_DAD_TIMEOUT_MS.
+int ndisc_dad(const uint8_t* tentative) {
+    memcpy(ndisc_tentative, tentative, 16);
+    ndisc_dad_conflict = 0;
+    ndisc_dad_active = 1;
+    ndisc_send_ns(ndisc_unspecified, tentative);
+    netpoll_wait(ndisc_dad_failed, 0, NDISC_DAD_TIMEOUT_MS);
+    ndisc_dad_active = 0;
+    return ndisc_dad_conflict ? -1 : 0;
+}
@@ -0,0 +1,50 @@
+#ifndef BLOODHORN_NDISC_H
+#define BLOODHORN_NDISC_H
+#include <stdint.h>
+#include "compat.h"
+#include "netpoll.h"
+
+#define NDISC_TABLE_BITS 5
+#define NDISC_TABLE_SIZE (1 << NDISC_TABLE_BITS)
+#define NDISC_PROBE_LIMIT 8
+#define NDISC_ENTRY_TTL_MS 30000
+#define NDISC_RESOLVE_TIMEOUT_MS 500
+#define NDISC_RESOLVE_RETRIES 3
+#define NDISC_RS_RETRIES 3
+#define NDISC_DAD_TIMEOUT_MS 1000
+
+#define ICMPV6_ECHO_REQUEST 128
+#define ICMPV6_ECHO_REPLY 129
+#define ICMPV6_ROUTER_SOLICIT 133
+#define ICMPV6_ROUTER_ADVERT 134
+#define ICMPV6_NEIGHBOR_SOLICIT 135
+#define ICMPV6_NEIGHBOR_ADVERT 136
+
+#define NDISC_RA_MANAGED 0x80
+#define NDISC_RA_OTHER 0x40
+
+// What the first usable Router Advertisement told us.
+struct ndisc_router {
+    uint8_t addr[16];
+    uint8_t mac[6];
+    uint8_t flags;
+    uint16_t lifetime;
+    uint8_t prefix[16];
+    int prefix_len;
+    int autonomous;
+    uint8_t dns[16];
+    int have_dns;
+    uint32_t mtu;
+};
+
+void ndisc_init(void);
+void ndisc_shutdown(void);
+void ndisc_multicast_mac(const uint8_t* ip, uint8_t* out_mac);
+int ndisc_lookup(const uint8_t* ip, uint8_t* out_mac);
+void ndisc_update(const uint8_t* ip, const uint8_t* mac);
+void ndisc_flush(void);
+int ndisc_resolve(const uint8_t* ip, uint8_t* out_mac);
+int ndisc_solicit_router(struct ndisc_router* out, uint32_t timeout_ms);
+int ndisc_dad(const uint8_t* tentative);
+void ndisc_input(const struct netpoll_rx* rx, void* ctx);
+#endif
@@ -1,17 +1,145 @@
 #include "net_utils.h"
 #include "compat.h"
 #include <stdint.h>
-uint16_t net_checksum(const uint8_t* data, int len) {
-    uint32_t sum = 0;
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <Library/UefiBootServicesTableLib.h>
+static uint64_t net_ticks_per_us = 0;
+// Ones-complement running sum, so a pseudo-header and payload that live in
+// different buffers can be summed without copying them together.
+uint32_t net_checksum_partial(uint32_t sum, const uint8_t* data, int len) {
     for (int i = 0; i < len; i += 2) {
-        sum += (data[i]<<8) | data[i+1];
+        sum += (data[i]<<8) | (i + 1 < len ? data[i+1] : 0);
         if (sum > 0xFFFF) sum -= 0xFFFF;
     }
-    return ~sum;
+    return sum;
+}
+uint16_t net_checksum(const uint8_t* data, int len) {
+    return ~net_checksum_partial(0, data, len);
 }
 void net_mac_copy(uint8_t* dst, const uint8_t* src) {
     for (int i = 0; i < 6; ++i) dst[i] = src[i];
 }
 void net_ip_copy(uint8_t* dst, const uint8_t* src) {
     for (int i = 0; i < 4; ++i) dst[i] = src[i];
-} 
\ No newline at end of file
+}
+int net_parse_ipv4(const char* s, uint8_t* ip) {
+    for (int i = 0; i < 4; ++i) {
+        int v = 0, digits = 0;
+        while (*s >= '0' && *s <= '9' && digits < 3) {
+            v = v * 10 + (*s++ - '0');
+            digits++;
+        }
+        if (!digits || v > 255) return -1;
+        ip[i] = (uint8_t)v;
+        if (i < 3 && *s++ != '.') return -1;
+    }
+    return *s ? -1 : 0;
+}
+static int net_hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+// RFC 4291 text form, with at most one "::". Embedded IPv4 tails are not accepted.
+int net_parse_ipv6(const char* s, uint8_t* ip) {
+    uint16_t head[8], tail[8];
+    int nhead = 0, ntail = 0, gap = 0;
+    if (s[0] == ':' && s[1] == ':') {
+        gap = 1;
+        s += 2;
+    }
+    while (*s) {
+        int v = 0, digits = 0, d;
+        while ((d = net_hex_digit(*s)) >= 0 && digits < 4) {
+            v = (v << 4) | d;
+            s++;
+            digits++;
+        }
+        if (!digits || nhead + ntail >= 8) return -1;
+        if (gap) tail[ntail++] = (uint16_t)v;
+        else head[nhead++] = (uint16_t)v;
+        if (!*s) break;
+        if (*s++ != ':') return -1;
+        if (*s == ':') {
+            if (gap) return -1;
+            gap = 1;
+            s++;
+        } else if (!*s) {
+            return -1;
+        }
+    }
+    if (gap ? nhead + ntail > 7 : nhead != 8) return -1;
+    memset(ip, 0, 16);
+    for (int i = 0; i < nhead; ++i) {
+        ip[2*i] = head[i] >> 8;
+        ip[2*i+1] = head[i] & 0xFF;
+    }
+    for (int i = 0; i < ntail; ++i) {
+        int k = 8 - ntail + i;
+        ip[2*k] = tail[i] >> 8;
+        ip[2*k+1] = tail[i] & 0xFF;
+    }
+    return 0;
+}
+// Compressed form: the longest run of two or more zero groups becomes "::".
+void net_format_ipv6(const uint8_t* ip, char* out, int maxlen) {
+    int best = -1, best_len = 0;
+    for (int i = 0; i < 8;) {
+        int j = i;
+        while (j < 8 && !ip[2*j] && !ip[2*j+1]) j++;
+        if (j - i > best_len && j - i >= 2) {
+            best = i;
+            best_len = j - i;
+        }
+        i = j > i ? j : i + 1;
+    }
+    int pos = 0;
+    for (int i = 0; i < 8 && pos < maxlen; ++i) {
+        if (i == best) {
+            pos += snprintf(out + pos, maxlen - pos, "::");
+            i += best_len - 1;
+            continue;
+        }
+        pos += snprintf(out + pos, maxlen - pos, "%s%x", (i && i != best + best_len) ? ":" : "", (ip[2*i] << 8) | ip[2*i+1]);
+    }
+    if (pos == 0 && maxlen > 0) out[0] = 0;
+}
+// Free-running CPU counter: TSC on x86, the generic timer on AArch64, the
+// time CSR on RISC-V. Only differences between two reads are meaningful.
+uint64_t net_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#elif defined(__riscv)
+    uint64_t v;
+    __asm__ __volatile__("rdtime %0" : "=r"(v));
+    return v;
+#else
+    return (uint64_t)clock();
+#endif
+}
+// Measures the counter against a 10 ms firmware stall. Cached after the first call.
+uint64_t net_ticks_calibrate(void) {
+    if (net_ticks_per_us) return net_ticks_per_us;
+    uint64_t start = net_ticks();
+    gBS->Stall(10000);
+    uint64_t ticks = net_ticks() - start;
+    net_ticks_per_us = ticks / 10000;
+    if (!net_ticks_per_us) net_ticks_per_us = 1;
+    return net_ticks_per_us;
+}
+uint64_t net_ticks_to_us(uint64_t ticks) {
+    return ticks / net_ticks_calibrate();
+}
+uint32_t net_time_ms(void) {
+    if (net_ticks_per_us) return (uint32_t)(net_ticks() / (net_ticks_per_us * 1000));
+    return (uint32_t)(((uint64_t)clock() * 1000) / CLOCKS_PER_SEC);
+}
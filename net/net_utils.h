@@ -2,7 +2,15 @@
 #define BLOODHORN_NET_UTILS_H
 #include <stdint.h>
 #include "compat.h"
+uint32_t net_checksum_partial(uint32_t sum, const uint8_t* data, int len);
 uint16_t net_checksum(const uint8_t* data, int len);
 void net_mac_copy(uint8_t* dst, const uint8_t* src);
 void net_ip_copy(uint8_t* dst, const uint8_t* src);
-#endif 
\ No newline at end of file
+int net_parse_ipv4(const char* s, uint8_t* ip);
+int net_parse_ipv6(const char* s, uint8_t* ip);
+void net_format_ipv6(const uint8_t* ip, char* out, int maxlen);
+uint64_t net_ticks(void);
+uint64_t net_ticks_calibrate(void);
+uint64_t net_ticks_to_us(uint64_t ticks);
+uint32_t net_time_ms(void);
+#endif
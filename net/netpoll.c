@@ -0,0 +1,234 @@
+#include "netpoll.h"
+#include "net_utils.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+// Network poll/dispatch engine. Consumers drain the NIC into a preallocated
+// RX descriptor ring and run it at TPL_APPLICATION; a periodic UEFI timer
+// drains it in the background at TPL_CALLBACK so frames are not lost while
+// nobody polls. Every frame is routed to exactly one handler, by UDP
+// destination port first, then IP protocol, then ethertype.
+struct netpoll_route { uint8_t kind; uint16_t key; netpoll_handler_t fn; void* ctx; };
+
+static struct netpoll_route routes[NETPOLL_MAX_ROUTES];
+static int route_count = 0;
+static netpoll_handler_t default_handler = 0;
+static void* default_ctx = 0;
+
+static struct pbuf* rx_ring[NETPOLL_RX_RING];
+static volatile uint32_t rx_head = 0;
+static volatile uint32_t rx_tail = 0;
+static struct netpoll_stats stats;
+
+static EFI_EVENT tick_event = NULL;
+
+static int netpoll_add_route(int kind, uint16_t key, netpoll_handler_t fn, void* ctx) {
+    for (int i = 0; i < route_count; ++i) {
+        if (routes[i].kind == kind && routes[i].key == key) {
+            routes[i].fn = fn;
+            routes[i].ctx = ctx;
+            return 0;
+        }
+    }
+    if (route_count >= NETPOLL_MAX_ROUTES) return -1;
+    routes[route_count].kind = (uint8_t)kind;
+    routes[route_count].key = key;
+    routes[route_count].fn = fn;
+    routes[route_count].ctx = ctx;
+    route_count++;
+    return 0;
+}
+
+int netpoll_register_ethertype(uint16_t ethertype, netpoll_handler_t fn, void* ctx) {
+    return netpoll_add_route(NETPOLL_ROUTE_ETHERTYPE, ethertype, fn, ctx);
+}
+
+int netpoll_register_ip_proto(uint8_t proto, netpoll_handler_t fn, void* ctx) {
+    return netpoll_add_route(NETPOLL_ROUTE_IP_PROTO, proto, fn, ctx);
+}
+
+int netpoll_register_udp_port(uint16_t port, netpoll_handler_t fn, void* ctx) {
+    return netpoll_add_route(NETPOLL_ROUTE_UDP_PORT, port, fn, ctx);
+}
+
+void netpoll_unregister(int kind, uint16_t key) {
+    for (int i = 0; i < route_count; ++i) {
+        if (routes[i].kind == kind && routes[i].key == key) {
+            routes[i] = routes[--route_count];
+            return;
+        }
+    }
+}
+
+void netpoll_set_default(netpoll_handler_t fn, void* ctx) {
+    default_handler = fn;
+    default_ctx = ctx;
+}
+
+static struct netpoll_route* netpoll_find_route(int kind, uint16_t key) {
+    for (int i = 0; i < route_count; ++i) {
+        if (routes[i].kind == kind && routes[i].key == key) return &routes[i];
+    }
+    return 0;
+}
+
+static void netpoll_dispatch(struct pbuf* pb) {
+    struct netpoll_rx rx;
+    struct netpoll_route* r = 0;
+    const uint8_t* frame = pb->data;
+    int len = pb->len;
+    if (len < ETH_HDR_LEN) return;
+    memset(&rx, 0, sizeof(rx));
+    rx.pb = pb;
+    rx.frame = frame;
+    rx.len = len;
+    rx.ethertype = (frame[12] << 8) | frame[13];
+    rx.l3 = frame + ETH_HDR_LEN;
+    rx.l3_len = len - ETH_HDR_LEN;
+    rx.payload = rx.l3;
+    rx.payload_len = rx.l3_len;
+    if (rx.ethertype == ETHERTYPE_IPV4 && rx.l3_len >= 20 && (rx.l3[0] >> 4) == 4) {
+        int ihl = (rx.l3[0] & 0x0F) * 4;
+        int total = (rx.l3[2] << 8) | rx.l3[3];
+        if (ihl >= 20 && total >= ihl && total <= rx.l3_len) {
+            rx.l3_len = total;
+            rx.ip_version = 4;
+            rx.ip_proto = rx.l3[9];
+            rx.l4 = rx.l3 + ihl;
+            rx.l4_len = total - ihl;
+        }
+    } else if (rx.ethertype == ETHERTYPE_IPV6 && rx.l3_len >= 40 && (rx.l3[0] >> 4) == 6) {
+        int total = 40 + ((rx.l3[4] << 8) | rx.l3[5]);
+        if (total <= rx.l3_len) {
+            uint8_t next = rx.l3[6];
+            int off = 40;
+            // Hop-by-hop, routing and destination options are skipped; a
+            // fragment header leaves the packet to the ethertype route.
+            while ((next == 0 || next == 43 || next == 60) && off + 8 <= total) {
+                next = rx.l3[off];
+                off += (rx.l3[off + 1] + 1) * 8;
+            }
+            if (off <= total && next != 0 && next != 43 && next != 44 && next != 60) {
+                rx.l3_len = total;
+                rx.ip_version = 6;
+                rx.ip_proto = next;
+                rx.l4 = rx.l3 + off;
+                rx.l4_len = total - off;
+            }
+        }
+    }
+    if (rx.l4) {
+        rx.payload = rx.l4;
+        rx.payload_len = rx.l4_len;
+        if (rx.ip_proto == IP_PROTO_UDP && rx.l4_len >= 8) {
+            rx.src_port = (rx.l4[0] << 8) | rx.l4[1];
+            rx.dst_port = (rx.l4[2] << 8) | rx.l4[3];
+            rx.payload = rx.l4 + 8;
+            rx.payload_len = rx.l4_len - 8;
+            r = netpoll_find_route(NETPOLL_ROUTE_UDP_PORT, rx.dst_port);
+        }
+        if (!r) r = netpoll_find_route(NETPOLL_ROUTE_IP_PROTO, rx.ip_proto);
+    }
+    if (!r) r = netpoll_find_route(NETPOLL_ROUTE_ETHERTYPE, rx.ethertype);
+    if (r) {
+        r->fn(&rx, r->ctx);
+    } else if (default_handler) {
+        default_handler(&rx, default_ctx);
+    } else {
+        stats.rx_unclaimed++;
+    }
+}
+
+// Producer side: pull everything the NIC holds straight into pool buffers.
+// Only inline drains stamp frames; the tick runs up to a period after a
+// frame lands, so its time would quantize an RTT to the tick.
+static int netpoll_fill_ring(int stamp) {
+    int filled = 0;
+    for (;;) {
+        struct pbuf* pb = (rx_head - rx_tail < NETPOLL_RX_RING) ? pbuf_alloc() : 0;
+        if (!pb) {
+            uint8_t scratch[NETPOLL_FRAME_MAX];
+            if (recv_ethernet(scratch, sizeof(scratch)) <= 0) break;
+            stats.rx_dropped++;
+            continue;
+        }
+        int n = recv_ethernet(pb->data, NETPOLL_FRAME_MAX);
+        if (n <= 0) {
+            pbuf_free(pb);
+            break;
+        }
+        pb->len = (uint16_t)n;
+        if (stamp) pb->stamp = net_ticks();
+        rx_ring[rx_head % NETPOLL_RX_RING] = pb;
+        rx_head++;
+        stats.rx_frames++;
+        filled++;
+    }
+    return filled;
+}
+
+static VOID EFIAPI netpoll_tick(EFI_EVENT Event, VOID* Context) {
+    (void)Event; (void)Context;
+    netpoll_fill_ring(0);
+}
+
+int netpoll_start(void) {
+    if (tick_event) return 0;
+    if (EFI_ERROR(gBS->CreateEvent(EVT_TIMER | EVT_NOTIFY_SIGNAL, TPL_CALLBACK, netpoll_tick, NULL, &tick_event))) {
+        tick_event = NULL;
+        return -1;
+    }
+    if (EFI_ERROR(gBS->SetTimer(tick_event, TimerPeriodic, NETPOLL_TICK_100NS))) {
+        netpoll_stop();
+        return -1;
+    }
+    return 0;
+}
+
+void netpoll_stop(void) {
+    if (tick_event) {
+        gBS->SetTimer(tick_event, TimerCancel, 0);
+        gBS->CloseEvent(tick_event);
+        tick_event = NULL;
+    }
+}
+
+// Consumer side: drain the NIC inline, then dispatch every queued
+// descriptor. While the timer runs the drain is done at TPL_CALLBACK so it
+// cannot interleave with the tick's.
+int netpoll_poll(void) {
+    int handled = 0;
+    if (tick_event) {
+        EFI_TPL old = gBS->RaiseTPL(TPL_CALLBACK);
+        netpoll_fill_ring(1);
+        gBS->RestoreTPL(old);
+    } else {
+        netpoll_fill_ring(1);
+    }
+    while (rx_tail != rx_head) {
+        struct pbuf* pb = rx_ring[rx_tail % NETPOLL_RX_RING];
+        rx_tail++;
+        netpoll_dispatch(pb);
+        pbuf_free(pb);
+        handled++;
+    }
+    return handled;
+}
+
+// Run the dispatcher until done(ctx) is true or timeout_ms elapses. The NIC
+// is polled inline on every pass, so a reply is handled as soon as it lands
+// rather than on the next timer tick.
+int netpoll_wait(int (*done)(void* ctx), void* ctx, uint32_t timeout_ms) {
+    uint32_t start = net_time_ms();
+    for (;;) {
+        netpoll_poll();
+        if (done && done(ctx)) return 0;
+        if ((uint32_t)(net_time_ms() - start) >= timeout_ms) return -1;
+    }
+}
+
+const struct netpoll_stats* netpoll_get_stats(void) {
+    return &stats;
+}
@@ -0,0 +1,69 @@
+#ifndef BLOODHORN_NETPOLL_H
+#define BLOODHORN_NETPOLL_H
+#include <stdint.h>
+#include "compat.h"
+#include "pbuf.h"
+
+#define ETH_HDR_LEN 14
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_ARP 0x0806
+#define ETHERTYPE_IPV6 0x86DD
+#define IP_PROTO_ICMP 1
+#define IP_PROTO_UDP 17
+#define IP_PROTO_ICMPV6 58
+
+#define NETPOLL_MAX_ROUTES 32
+#define NETPOLL_FRAME_MAX 1518
+#define NETPOLL_RX_RING 64
+#define NETPOLL_TICK_100NS 10000
+
+enum {
+    NETPOLL_ROUTE_ETHERTYPE = 1,
+    NETPOLL_ROUTE_IP_PROTO,
+    NETPOLL_ROUTE_UDP_PORT
+};
+
+// A received frame with its layers already located. l3/l4/payload are views
+// into pb; a handler that wants to keep them past its return takes a
+// reference with pbuf_ref() instead of copying. ip_version is 4 or 6 when
+// l4 was located, so one UDP port route serves both families.
+struct netpoll_rx {
+    struct pbuf* pb;
+    const uint8_t* frame;
+    int len;
+    uint16_t ethertype;
+    const uint8_t* l3;
+    int l3_len;
+    uint8_t ip_version;
+    uint8_t ip_proto;
+    const uint8_t* l4;
+    int l4_len;
+    uint16_t src_port;
+    uint16_t dst_port;
+    const uint8_t* payload;
+    int payload_len;
+};
+
+struct netpoll_stats {
+    uint64_t rx_frames;
+    uint64_t rx_dropped;
+    uint64_t rx_unclaimed;
+};
+
+typedef void (*netpoll_handler_t)(const struct netpoll_rx* rx, void* ctx);
+
+extern int send_ethernet(const uint8_t* frame, int len);
+extern int recv_ethernet(uint8_t* frame, int maxlen);
+
+int netpoll_register_ethertype(uint16_t ethertype, netpoll_handler_t fn, void* ctx);
+int netpoll_register_ip_proto(uint8_t proto, netpoll_handler_t fn, void* ctx);
+int netpoll_register_udp_port(uint16_t port, netpoll_handler_t fn, void* ctx);
+void netpoll_unregister(int kind, uint16_t key);
+void netpoll_set_default(netpoll_handler_t fn, void* ctx);
+int netpoll_start(void);
+void netpoll_stop(void);
+int netpoll_poll(void);
+int netpoll_wait(int (*done)(void* ctx), void* ctx, uint32_t timeout_ms);
+const struct netpoll_stats* netpoll_get_stats(void);
+
+#endif
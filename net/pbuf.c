@@ -0,0 +1,86 @@
+#include "pbuf.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+// The pool is shared between the netpoll timer (TPL_CALLBACK) and ordinary
+// code, so free-list updates run at TPL_NOTIFY.
+static struct pbuf pbuf_pool[PBUF_POOL_SIZE];
+static struct pbuf* pbuf_free_list = 0;
+static int pbuf_free_count = 0;
+static int pbuf_ready = 0;
+
+static void pbuf_pool_init(void) {
+    for (int i = PBUF_POOL_SIZE - 1; i >= 0; --i) {
+        pbuf_pool[i].next = pbuf_free_list;
+        pbuf_free_list = &pbuf_pool[i];
+    }
+    pbuf_free_count = PBUF_POOL_SIZE;
+    pbuf_ready = 1;
+}
+
+struct pbuf* pbuf_alloc(void) {
+    EFI_TPL old = gBS->RaiseTPL(TPL_NOTIFY);
+    if (!pbuf_ready) pbuf_pool_init();
+    struct pbuf* p = pbuf_free_list;
+    if (p) {
+        pbuf_free_list = p->next;
+        pbuf_free_count--;
+    }
+    gBS->RestoreTPL(old);
+    if (!p) return 0;
+    p->next = 0;
+    p->data = p->buf + PBUF_HEADROOM;
+    p->len = 0;
+    p->ref = 1;
+    p->stamp = 0;
+    return p;
+}
+
+struct pbuf* pbuf_ref(struct pbuf* p) {
+    EFI_TPL old = gBS->RaiseTPL(TPL_NOTIFY);
+    p->ref++;
+    gBS->RestoreTPL(old);
+    return p;
+}
+
+void pbuf_free(struct pbuf* p) {
+    if (!p) return;
+    EFI_TPL old = gBS->RaiseTPL(TPL_NOTIFY);
+    if (p->ref > 0 && --p->ref == 0) {
+        p->next = pbuf_free_list;
+        pbuf_free_list = p;
+        pbuf_free_count++;
+    }
+    gBS->RestoreTPL(old);
+}
+
+uint8_t* pbuf_push(struct pbuf* p, int n) {
+    if (n < 0 || p->data - p->buf < n) return 0;
+    p->data -= n;
+    p->len += n;
+    return p->data;
+}
+
+uint8_t* pbuf_pull(struct pbuf* p, int n) {
+    if (n < 0 || n > p->len) return 0;
+    p->data += n;
+    p->len -= n;
+    return p->data;
+}
+
+uint8_t* pbuf_put(struct pbuf* p, int n) {
+    if (n < 0 || n > pbuf_tailroom(p)) return 0;
+    uint8_t* tail = p->data + p->len;
+    p->len += n;
+    return tail;
+}
+
+int pbuf_tailroom(const struct pbuf* p) {
+    return (int)(p->buf + PBUF_BUF_SIZE - (p->data + p->len));
+}
+
+int pbuf_available(void) {
+    return pbuf_ready ? pbuf_free_count : PBUF_POOL_SIZE;
+}
@@ -0,0 +1,32 @@
+#ifndef BLOODHORN_PBUF_H
+#define BLOODHORN_PBUF_H
+#include <stdint.h>
+#include "compat.h"
+
+#define PBUF_POOL_SIZE 128
+#define PBUF_HEADROOM 64
+#define PBUF_BUF_SIZE 1600
+
+// Refcounted packet buffer. data/len describe the valid bytes; the space
+// between buf and data is headroom that lower layers push headers into, so
+// a payload is never moved once it has been written. stamp is the
+// net_ticks() value taken when an inline poll took the frame off the NIC,
+// or 0 when the background tick drained it.
+struct pbuf {
+    struct pbuf* next;
+    uint8_t* data;
+    uint16_t len;
+    uint16_t ref;
+    uint64_t stamp;
+    uint8_t buf[PBUF_BUF_SIZE];
+};
+
+struct pbuf* pbuf_alloc(void);
+struct pbuf* pbuf_ref(struct pbuf* p);
+void pbuf_free(struct pbuf* p);
+uint8_t* pbuf_push(struct pbuf* p, int n);
+uint8_t* pbuf_pull(struct pbuf* p, int n);
+uint8_t* pbuf_put(struct pbuf* p, int n);
+int pbuf_tailroom(const struct pbuf* p);
+int pbuf_available(void);
+#endif
@@ -1,63 +1,71 @@
 #include <stdint.h>
 #include "compat.h"
 #include <string.h>
+#include <stdio.h>
 #include "pxe.h"
+#include "netpoll.h"
+#include "dhcp.h"
+#include "ipv4.h"
+#include "icmp.h"
+#include "ipv6.h"
+#include "ndisc.h"
+#include "dhcp6.h"
+#include "tftp.h"
+#include "net_utils.h"
 #include "boot/Arch32/linux.h"
 #include "boot/Arch32/limine.h"
 #include "boot/Arch32/multiboot1.h"
 #include "boot/Arch32/multiboot2.h"
 #include "boot/Arch32/chainload.h"
-#include <time.h>
-#include <arpa/inet.h>
+#include "boot/Arch32/kfile.h"
+#include "boot/Arch32/memmap.h"
 
 extern int pxe_init(void);
 extern int pxe_dhcp_discover(void);
-extern int pxe_tftp_read(const char* filename, uint8_t* buffer, uint32_t size);
-extern int pxe_get_file_size(const char* filename);
 extern int pxe_cleanup(void);
-extern int pxe_udp_send(const char* dest_ip, uint16_t dest_port, const void* data, int len);
-extern int pxe_udp_recv(char* src_ip, uint16_t* src_port, void* buf, int maxlen, int timeout_ms);
-
-struct pxe_network_info {
-    uint32_t client_ip;
-    uint32_t server_ip;
-    uint32_t subnet_mask;
-    uint32_t router_ip;
-    uint32_t dns_server;
-    char tftp_server[64];
-    char boot_file[128];
-    char domain_name[64];
-    uint32_t broadcast_ip;
-    uint32_t ntp_server;
-    uint32_t time_offset;
-};
+extern int pxe_get_mac(uint8_t* mac);
+extern int pxe_get_cached_info(uint8_t* packet, int maxlen);
+
+#define PXE_SLAAC_TIMEOUT_MS 1000
+#define PXE_SINK_INITIAL (8 * 1024 * 1024)
 
 static struct pxe_network_info network_info;
 static int pxe_initialized = 0;
 
-struct icmp_echo {
-    uint8_t type;
-    uint8_t code;
-    uint16_t checksum;
-    uint16_t id;
-    uint16_t seq;
-    uint8_t payload[32];
-};
-
-static uint16_t icmp_checksum(const void* data, int len) {
-    uint32_t sum = 0;
-    const uint16_t* ptr = (const uint16_t*)data;
-    while (len > 1) {
-        sum += *ptr++;
-        len -= 2;
-    }
-    if (len == 1) sum += *(const uint8_t*)ptr;
-    sum = (sum >> 16) + (sum & 0xFFFF);
-    sum += (sum >> 16);
-    return ~sum;
+static void pxe_apply_lease(const struct dhcp_lease* lease) {
+    memset(&network_info, 0, sizeof(network_info));
+    memcpy(&network_info.client_ip, lease->ip, 4);
+    memcpy(&network_info.dhcp_server, lease->server_id, 4);
+    memcpy(&network_info.subnet_mask, lease->mask, 4);
+    memcpy(&network_info.router_ip, lease->gw, 4);
+    memcpy(&network_info.dns_server, lease->dns, 4);
+    memcpy(&network_info.broadcast_ip, lease->broadcast, 4);
+    memcpy(&network_info.ntp_server, lease->ntp, 4);
+    network_info.time_offset = lease->time_offset;
+    // Files come from siaddr, or from option 66 when it is an address
+    // literal; only a lease that names neither falls back to the DHCP server.
+    uint8_t tftp_ip[4];
+    static const uint8_t none[4];
+    if (net_parse_ipv4(lease->server_name, tftp_ip) != 0) {
+        memcpy(tftp_ip, memcmp(lease->server, none, 4) ? lease->server : lease->server_id, 4);
+    }
+    memcpy(&network_info.server_ip, tftp_ip, 4);
+    if (lease->server_name[0]) {
+        strncpy(network_info.tftp_server, lease->server_name, sizeof(network_info.tftp_server) - 1);
+    } else {
+        snprintf(network_info.tftp_server, sizeof(network_info.tftp_server), "%u.%u.%u.%u",
+                 tftp_ip[0], tftp_ip[1], tftp_ip[2], tftp_ip[3]);
+    }
+    strncpy(network_info.boot_file, lease->boot_file, sizeof(network_info.boot_file) - 1);
+    strncpy(network_info.domain_name, lease->domain, sizeof(network_info.domain_name) - 1);
 }
 
+// The PXE ROM runs DHCP; its cached ACK is what the native stack is
+// configured from. The interface comes up (ARP handler, gratuitous ARP,
+// ICMP) before the poll timer starts delivering frames to it.
 int pxe_network_init(void) {
+    uint8_t ack[DHCP_PACKET_MAX];
+    struct dhcp_lease lease;
     if (pxe_initialized) {
         return 0;
     }
@@ -68,58 +76,158 @@ int pxe_network_init(void) {
     }
     
     result = pxe_dhcp_discover();
-    if (result != 0) {
+    int len = result == 0 ? pxe_get_cached_info(ack, sizeof(ack)) : -1;
+    if (len <= 0 || dhcp_parse_ack(ack, len, &lease) != 0) {
         pxe_cleanup();
         return -1;
     }
     
+    pxe_apply_lease(&lease);
+    ipv4_configure(lease.mac, lease.ip, lease.mask, lease.gw);
+    netpoll_start();
     pxe_initialized = 1;
     return 0;
 }
 
-int pxe_load_kernel(const char* kernel_path, uint8_t** kernel_data, uint32_t* kernel_size) {
-    if (!pxe_initialized) {
-        return -1;
-    }
-    
-    *kernel_size = pxe_get_file_size(kernel_path);
-    if (*kernel_size == 0xFFFF) {
-        *kernel_size = 1024 * 1024; // Default 1MB if size unknown
+// IPv6-only provisioning: link-local, then SLAAC from the router's
+// advertisement, then DHCPv6 -- stateful if the RA set M or gave no usable
+// prefix, stateless otherwise -- for DNS and the boot file URL.
+int pxe_network_init6(void) {
+    uint8_t mac[6];
+    struct dhcp6_lease lease;
+    if (pxe_initialized) {
+        return 0;
     }
-    
-    *kernel_data = allocate_memory(*kernel_size);
-    if (!*kernel_data) {
+    if (pxe_get_mac(mac) != 0) {
         return -1;
     }
-    
-    int result = pxe_tftp_read(kernel_path, *kernel_data, *kernel_size);
-    if (result != 0) {
+    netpoll_start();
+    // icmp_init belongs to the IPv4 bring-up; ping and netperf still need
+    // the tick rate here.
+    net_ticks_calibrate();
+    ipv6_configure(mac);
+    struct net6_iface* ifc = ipv6_iface();
+    ipv6_slaac(PXE_SLAAC_TIMEOUT_MS);
+    int want_addr = !ifc->have_addr || (ifc->ra_flags & NDISC_RA_MANAGED);
+    if (dhcp6_configure(mac, want_addr, &lease) != 0 ||
+        (want_addr && !ifc->have_addr && ipv6_set_address(lease.addr, 128) != 0)) {
+        netpoll_stop();
+        ipv6_unconfigure();
         return -1;
     }
-    
+    if (lease.have_dns) {
+        memcpy(ifc->dns, lease.dns, 16);
+        ifc->have_dns = 1;
+    }
+
+    memset(&network_info, 0, sizeof(network_info));
+    network_info.ipv6 = 1;
+    memcpy(network_info.client_ip6, ifc->addr, 16);
+    memcpy(network_info.link_local6, ifc->link_local, 16);
+    network_info.prefix_len6 = ifc->prefix_len;
+    if (ifc->have_router) memcpy(network_info.router_ip6, ifc->router, 16);
+    if (ifc->have_dns) memcpy(network_info.dns_server6, ifc->dns, 16);
+    strncpy(network_info.boot_url, lease.boot_url, sizeof(network_info.boot_url) - 1);
+    int version;
+    const char* path;
+    if (tftp_parse_url(lease.boot_url, &version, network_info.server_ip6, &path) == 0 && version == 6) {
+        strncpy(network_info.boot_file, path, sizeof(network_info.boot_file) - 1);
+        net_format_ipv6(network_info.server_ip6, network_info.tftp_server, sizeof(network_info.tftp_server));
+    }
+    pxe_initialized = 1;
     return 0;
 }
 
-int pxe_load_initrd(const char* initrd_path, uint8_t** initrd_data, uint32_t* initrd_size) {
-    if (!pxe_initialized) {
+// Boot payloads land in pages placed from the memory map below 4 GiB,
+// where every buffer loader can take them; each DATA block is copied once,
+// out of the RX buffer. The region is sized from the server's tsize when
+// it sends one; otherwise it doubles as data arrives.
+struct pxe_sink {
+    uint8_t* dest;
+    uint64_t capacity;
+    uint32_t len;
+};
+
+// exact is set for an announced size, which needs no headroom.
+static int pxe_sink_reserve(struct pxe_sink* s, uint64_t size, int exact) {
+    if (size <= s->capacity) return 0;
+    uint64_t capacity = exact ? size : s->capacity ? s->capacity * 2 : PXE_SINK_INITIAL;
+    if (capacity < size) capacity = size;
+    capacity = (capacity + MEMMAP_PAGE_SIZE - 1) & ~(MEMMAP_PAGE_SIZE - 1);
+    uint8_t* dest = memmap_alloc(capacity, MEMMAP_PAGE_SIZE, 0xFFFFFFFF);
+    if (!dest) return -1;
+    if (s->dest) {
+        memcpy(dest, s->dest, s->len);
+        memmap_free((uintptr_t)s->dest, s->capacity);
+    }
+    s->dest = dest;
+    s->capacity = capacity;
+    return 0;
+}
+
+static int pxe_sink_write(void* ctx, uint32_t offset, const uint8_t* data, int len) {
+    struct pxe_sink* s = (struct pxe_sink*)ctx;
+    if (!data) return pxe_sink_reserve(s, offset, 1);
+    if (pxe_sink_reserve(s, (uint64_t)offset + len, 0) != 0) return -1;
+    memcpy(s->dest + offset, data, len);
+    s->len = offset + len;
+    return 0;
+}
+
+// Hands back the pages past the end of the file.
+static int pxe_sink_finish(struct pxe_sink* s, int result, uint8_t** data, uint32_t* size) {
+    uint64_t used = ((uint64_t)s->len + MEMMAP_PAGE_SIZE - 1) & ~(MEMMAP_PAGE_SIZE - 1);
+    if (result != 0 || !s->len) {
+        if (s->dest) memmap_free((uintptr_t)s->dest, s->capacity);
         return -1;
     }
-    
-    *initrd_size = pxe_get_file_size(initrd_path);
-    if (*initrd_size == 0xFFFF) {
+    if (used < s->capacity) memmap_free((uintptr_t)s->dest + used, s->capacity - used);
+    *data = s->dest;
+    *size = s->len;
+    return 0;
+}
+
+static int pxe_fetch(const char* path, uint8_t** data, uint32_t* size) {
+    struct pxe_sink sink = { 0 };
+    int r = network_info.ipv6 ?
+        tftp_fetch6(network_info.server_ip6, path, TFTP_MAX_BLKSIZE6, pxe_sink_write, &sink, size) :
+        tftp_fetch((const uint8_t*)&network_info.server_ip, path, TFTP_MAX_BLKSIZE, pxe_sink_write, &sink, size);
+    return pxe_sink_finish(&sink, r, data, size);
+}
+
+int pxe_load_kernel(const char* kernel_path, uint8_t** kernel_data, uint32_t* kernel_size) {
+    if (!pxe_initialized) {
         return -1;
     }
-    
-    *initrd_data = allocate_memory(*initrd_size);
-    if (!*initrd_data) {
+    return pxe_fetch(kernel_path, kernel_data, kernel_size);
+}
+
+int pxe_load_initrd(const char* initrd_path, uint8_t** initrd_data, uint32_t* initrd_size) {
+    if (!pxe_initialized) {
         return -1;
     }
-    
-    int result = pxe_tftp_read(initrd_path, *initrd_data, *initrd_size);
-    if (result != 0) {
+    return pxe_fetch(initrd_path, initrd_data, initrd_size);
+}
+
+static struct kfile pxe_kernel_file;
+
+// A kernel fetched as .gz/.zst/.lz4/.xz is unpacked into its own pages so
+// the format checks and buffer loaders below see the real image. The
+// fetched pages are given back once the image is unpacked.
+static int pxe_unpack_kernel(uint8_t** kernel_data, uint32_t* kernel_size) {
+    struct kfile* kf = &pxe_kernel_file;
+    if (kfile_open_mem(kf, *kernel_data, *kernel_size) != 0) return -1;
+    if (kf->packed == DECOMP_NONE) return 0;
+    if (kf->size > 0xFFFFFFFF) return -1;
+    uint8_t* data = memmap_alloc(kf->size, MEMMAP_PAGE_SIZE, 0xFFFFFFFF);
+    if (!data) return -1;
+    if (kfile_read(kf, 0, data, kf->size) != 0) {
+        memmap_free((uintptr_t)data, kf->size);
         return -1;
     }
-    
+    memmap_free((uintptr_t)*kernel_data, *kernel_size);
+    *kernel_data = data;
+    *kernel_size = (uint32_t)kf->size;
     return 0;
 }
 
@@ -129,11 +237,12 @@ int pxe_boot_kernel(const char* kernel_path, const char* initrd_path, const char
     uint8_t* initrd_data = NULL;
     uint32_t initrd_size = 0;
     
-    if (pxe_network_init() != 0) {
+    if (pxe_network_init() != 0 && pxe_network_init6() != 0) {
         return -1;
     }
     
-    if (pxe_load_kernel(kernel_path, &kernel_data, &kernel_size) != 0) {
+    if (pxe_load_kernel(kernel_path, &kernel_data, &kernel_size) != 0 ||
+        pxe_unpack_kernel(&kernel_data, &kernel_size) != 0) {
         return -1;
     }
     
@@ -166,6 +275,9 @@ int pxe_boot_kernel(const char* kernel_path, const char* initrd_path, const char
 
 int pxe_cleanup_network(void) {
     if (pxe_initialized) {
+        netpoll_stop();
+        ipv4_unconfigure();
+        ipv6_unconfigure();
         pxe_cleanup();
         pxe_initialized = 0;
     }
@@ -176,30 +288,19 @@ struct pxe_network_info* pxe_get_network_info(void) {
     return &network_info;
 } 
 
-// ICMP echo (ping) using PXE stack
+// ICMP echo (ping) to an IPv4 or IPv6 literal. rtt_us is measured from
+// just before transmit to the poll tick that pulled the reply off the NIC.
 // Returns 0 on success, -1 on failure
-int pxe_icmp_echo(const char* host, int* rtt_ms) {
-    struct icmp_echo req = {0};
-    req.type = 8; // Echo request
-    req.code = 0;
-    req.id = htons(0x1234);
-    req.seq = htons(1);
-    memset(req.payload, 0xAA, sizeof(req.payload));
-    req.checksum = 0;
-    req.checksum = icmp_checksum(&req, sizeof(req));
-
-    uint16_t dest_port = 33434; // Arbitrary unused port
-    uint32_t start = (uint32_t)clock();
-    if (pxe_udp_send(host, dest_port, &req, sizeof(req)) < 0) return -1;
-
-    char src_ip[16];
-    uint16_t src_port;
-    struct icmp_echo resp;
-    int timeout = 1000; // 1s
-    int n = pxe_udp_recv(src_ip, &src_port, &resp, sizeof(resp), timeout);
-    if (n < (int)sizeof(resp)) return -1;
-    if (resp.type != 0 || resp.id != req.id || resp.seq != req.seq) return -1;
-    uint32_t end = (uint32_t)clock();
-    *rtt_ms = (int)(((end - start) * 1000) / CLOCKS_PER_SEC);
+int pxe_icmp_echo(const char* host, uint16_t seq, uint32_t* rtt_us) {
+    uint8_t dst[16];
+    uint64_t ticks;
+    if (net_parse_ipv4(host, dst) == 0) {
+        if (icmp_echo(dst, 0xB10D, seq, 56, 1000, &ticks) != 0) return -1;
+    } else if (net_parse_ipv6(host, dst) == 0) {
+        if (icmp_echo6(dst, 0xB10D, seq, 56, 1000, &ticks) != 0) return -1;
+    } else {
+        return -1;
+    }
+    *rtt_us = (uint32_t)net_ticks_to_us(ticks);
     return 0;
-} 
\ No newline at end of file
+}
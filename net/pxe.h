@@ -6,6 +6,7 @@
 struct pxe_network_info {
     uint32_t client_ip;
     uint32_t server_ip;
+    uint32_t dhcp_server;
     uint32_t subnet_mask;
     uint32_t router_ip;
     uint32_t dns_server;
@@ -15,13 +16,23 @@ struct pxe_network_info {
     uint32_t broadcast_ip;
     uint32_t ntp_server;
     uint32_t time_offset;
+    int ipv6;
+    uint8_t client_ip6[16];
+    uint8_t link_local6[16];
+    int prefix_len6;
+    uint8_t router_ip6[16];
+    uint8_t dns_server6[16];
+    uint8_t server_ip6[16];
+    char boot_url[256];
 };
 
 int pxe_network_init(void);
+int pxe_network_init6(void);
 int pxe_load_kernel(const char* kernel_path, uint8_t** kernel_data, uint32_t* kernel_size);
 int pxe_load_initrd(const char* initrd_path, uint8_t** initrd_data, uint32_t* initrd_size);
 int pxe_boot_kernel(const char* kernel_path, const char* initrd_path, const char* cmdline);
 int pxe_cleanup_network(void);
 struct pxe_network_info* pxe_get_network_info(void);
+int pxe_icmp_echo(const char* host, uint16_t seq, uint32_t* rtt_us);
 
 #endif 
\ No newline at end of file
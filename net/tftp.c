@@ -1,42 +1,174 @@
 #include "tftp.h"
+#include "udp.h"
+#include "net_utils.h"
 #include "compat.h"
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-static int tftp_send_rrq(const char* filename, uint8_t* buf, int blksize) {
+static uint16_t tftp_next_port = TFTP_CLIENT_PORT;
+static int tftp_put_option(uint8_t* buf, int opt, const char* name, uint32_t value) {
+    int n = strlen(name);
+    memcpy(buf+opt, name, n); buf[opt+n] = 0;
+    char str[12];
+    int m = sprintf(str, "%u", value);
+    memcpy(buf+opt+n+1, str, m); buf[opt+n+1+m] = 0;
+    return opt+n+m+2;
+}
+static int tftp_send_rrq(const char* filename, uint8_t* buf, int blksize, int tsize) {
     buf[0] = 0; buf[1] = 1;
     int len = strlen(filename);
     memcpy(buf+2, filename, len); buf[2+len] = 0;
     memcpy(buf+3+len, "octet", 5); buf[8+len] = 0;
     int opt = 9+len;
-    if (blksize > 512) {
-        memcpy(buf+opt, "blksize", 7); buf[opt+7] = 0;
-        char blkstr[8];
-        int n = sprintf(blkstr, "%d", blksize);
-        memcpy(buf+opt+8, blkstr, n); buf[opt+8+n] = 0;
-        opt += 9+n;
-    }
-    buf[opt++] = 0;
+    if (blksize > 512) opt = tftp_put_option(buf, opt, "blksize", blksize);
+    if (tsize) opt = tftp_put_option(buf, opt, "tsize", 0);
     return opt;
 }
 int tftp_build_rrq(const char* filename, uint8_t* buf) {
-    return tftp_send_rrq(filename, buf, 512);
+    return tftp_send_rrq(filename, buf, 512, 0);
 }
-int tftp_parse_data(const uint8_t* buf, uint16_t* block, uint8_t* data, int* datalen) {
-    if (buf[1] != 3) return -1;
+// Returns a view of the payload inside buf; nothing is copied.
+int tftp_parse_data(const uint8_t* buf, int len, uint16_t* block, const uint8_t** data, int* datalen) {
+    if (len < 4 || buf[0] != 0 || buf[1] != 3) return -1;
     *block = (buf[2]<<8) | buf[3];
-    *datalen = (buf[4] == 0 && buf[5] == 0) ? 0 : 512;
-    memcpy(data, buf+4, *datalen);
+    *data = buf + 4;
+    *datalen = len - 4;
     return 0;
 }
-int tftp_parse_oack(const uint8_t* buf, int* blksize) {
+int tftp_parse_oack(const uint8_t* buf, int len, int* blksize, uint32_t* tsize) {
     int i = 2;
-    while (buf[i]) {
-        if (strcmp((char*)buf+i, "blksize") == 0) {
-            i += 8;
-            *blksize = atoi((char*)buf+i);
+    while (i < len && buf[i]) {
+        const char* name = (const char*)buf + i;
+        int nlen = strnlen(name, len - i);
+        if (i + nlen + 1 >= len) break;
+        const char* value = name + nlen + 1;
+        int vlen = strnlen(value, len - (i + nlen + 1));
+        if (strcmp(name, "blksize") == 0) *blksize = atoi(value);
+        else if (strcmp(name, "tsize") == 0) *tsize = (uint32_t)strtoul(value, NULL, 10);
+        i += nlen + vlen + 2;
+    }
+    return 0;
+}
+int tftp_sink_memory(void* ctx, uint32_t offset, const uint8_t* data, int len) {
+    struct tftp_mem_sink* sink = (struct tftp_mem_sink*)ctx;
+    if (!data) return offset > sink->capacity ? -1 : 0;
+    if (offset + (uint32_t)len > sink->capacity) return -1;
+    memcpy(sink->dest + offset, data, len);
+    return 0;
+}
+// The transfer loop is the same for both families; only the send call and
+// the width of the address compared against each reply differ.
+static int tftp_send(struct udp_sock* sock, int version, const uint8_t* server_ip, uint16_t port, const void* data, int len) {
+    if (version == 6) return udp_sendto6(sock, server_ip, port, data, len);
+    return udp_sendto(sock, server_ip, port, data, len);
+}
+static int tftp_send_ack(struct udp_sock* sock, int version, const uint8_t* server_ip, uint16_t port, uint16_t block) {
+    uint8_t ack[4] = { 0, 4, (uint8_t)(block >> 8), (uint8_t)block };
+    return tftp_send(sock, version, server_ip, port, ack, 4);
+}
+static int tftp_transfer(int version, const uint8_t* server_ip, const char* filename, int blksize, tftp_sink_t sink, void* ctx, uint32_t* out_size) {
+    struct udp_sock sock;
+    uint8_t rrq[600];
+    if (strlen(filename) > 512) return -1;
+    if (blksize <= 0) blksize = TFTP_DEFAULT_BLKSIZE;
+    if (blksize > TFTP_MAX_BLKSIZE) blksize = TFTP_MAX_BLKSIZE;
+    if (version == 6 && blksize > TFTP_MAX_BLKSIZE6) blksize = TFTP_MAX_BLKSIZE6;
+    uint16_t port = tftp_next_port++;
+    if (tftp_next_port < TFTP_CLIENT_PORT) tftp_next_port = TFTP_CLIENT_PORT;
+    if (udp_open(&sock, port) != 0) return -1;
+    int rrq_len = tftp_send_rrq(filename, rrq, blksize, 1);
+    uint16_t server_port = TFTP_SERVER_PORT;
+    int have_tid = 0;
+    int active_blksize = TFTP_DEFAULT_BLKSIZE;
+    uint16_t expected = 1;
+    uint32_t offset = 0;
+    int retries = 0;
+    int result = -1;
+    tftp_send(&sock, version, server_ip, TFTP_SERVER_PORT, rrq, rrq_len);
+    for (;;) {
+        struct udp_dgram d;
+        if (udp_recv_view(&sock, &d, TFTP_TIMEOUT_MS) < 0) {
+            if (++retries > TFTP_RETRIES) break;
+            if (!have_tid) tftp_send(&sock, version, server_ip, TFTP_SERVER_PORT, rrq, rrq_len);
+            else tftp_send_ack(&sock, version, server_ip, server_port, (uint16_t)(expected - 1));
+            continue;
+        }
+        if (d.ip_version != version || memcmp(d.src_ip, server_ip, version == 6 ? 16 : 4) != 0 || (have_tid && d.src_port != server_port) || d.len < 2) {
+            pbuf_free(d.pb);
+            continue;
+        }
+        if (!have_tid) {
+            server_port = d.src_port;
+            have_tid = 1;
+        }
+        retries = 0;
+        uint16_t op = (d.payload[0] << 8) | d.payload[1];
+        if (op == 6) {
+            uint32_t tsize = 0;
+            tftp_parse_oack(d.payload, d.len, &active_blksize, &tsize);
+            pbuf_free(d.pb);
+            if (tsize && expected == 1 && sink(ctx, tsize, NULL, 0) != 0) break;
+            tftp_send_ack(&sock, version, server_ip, server_port, 0);
+            continue;
+        }
+        if (op == 5) {
+            pbuf_free(d.pb);
+            break;
+        }
+        uint16_t block;
+        const uint8_t* data;
+        int datalen;
+        if (tftp_parse_data(d.payload, d.len, &block, &data, &datalen) != 0) {
+            pbuf_free(d.pb);
+            continue;
+        }
+        if (block != expected) {
+            pbuf_free(d.pb);
+            if (block == (uint16_t)(expected - 1)) tftp_send_ack(&sock, version, server_ip, server_port, block);
+            continue;
+        }
+        int rc = datalen > 0 ? sink(ctx, offset, data, datalen) : 0;
+        pbuf_free(d.pb);
+        if (rc != 0) break;
+        offset += datalen;
+        tftp_send_ack(&sock, version, server_ip, server_port, block);
+        expected++;
+        if (datalen < active_blksize) {
+            result = 0;
             break;
         }
-        while (buf[i++]);
     }
+    udp_close(&sock);
+    if (out_size) *out_size = offset;
+    return result;
+}
+int tftp_fetch(const uint8_t* server_ip, const char* filename, int blksize, tftp_sink_t sink, void* ctx, uint32_t* out_size) {
+    return tftp_transfer(4, server_ip, filename, blksize, sink, ctx, out_size);
+}
+int tftp_fetch6(const uint8_t* server_ip6, const char* filename, int blksize, tftp_sink_t sink, void* ctx, uint32_t* out_size) {
+    return tftp_transfer(6, server_ip6, filename, blksize, sink, ctx, out_size);
+}
+// Splits "tftp://host/path" where host is dotted IPv4 or a bracketed IPv6
+// literal, as DHCPv6 boot-file-url (RFC 5970) carries it. *path points into url.
+int tftp_parse_url(const char* url, int* version, uint8_t* server_ip, const char** path) {
+    char host[48];
+    if (strncmp(url, "tftp://", 7) != 0) return -1;
+    const char* p = url + 7;
+    const char* end;
+    if (*p == '[') {
+        end = strchr(++p, ']');
+        if (!end || end[1] != '/') return -1;
+        *version = 6;
+    } else {
+        end = strchr(p, '/');
+        if (!end) return -1;
+        *version = 4;
+    }
+    if (end - p >= (int)sizeof(host)) return -1;
+    memcpy(host, p, end - p);
+    host[end - p] = 0;
+    if (*version == 6 ? net_parse_ipv6(host, server_ip) : net_parse_ipv4(host, server_ip)) return -1;
+    *path = strchr(end, '/') + 1;
     return 0;
-} 
\ No newline at end of file
+}
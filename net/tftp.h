@@ -2,6 +2,31 @@
 #define BLOODHORN_TFTP_H
 #include <stdint.h>
 #include "compat.h"
+
+#define TFTP_SERVER_PORT 69
+#define TFTP_CLIENT_PORT 0xC100
+#define TFTP_DEFAULT_BLKSIZE 512
+#define TFTP_MAX_BLKSIZE 1468
+#define TFTP_MAX_BLKSIZE6 1448
+#define TFTP_TIMEOUT_MS 1000
+#define TFTP_RETRIES 5
+
+// Receives each DATA payload in order, straight out of the RX buffer.
+// Returning non-zero aborts the transfer. When the server announces the
+// file size (RFC 2349 tsize), the sink is first called once with data NULL,
+// len 0 and the size in offset, so it can reserve space up front.
+typedef int (*tftp_sink_t)(void* ctx, uint32_t offset, const uint8_t* data, int len);
+
+struct tftp_mem_sink {
+    uint8_t* dest;
+    uint32_t capacity;
+};
+
 int tftp_build_rrq(const char* filename, uint8_t* buf);
-int tftp_parse_data(const uint8_t* buf, uint16_t* block, uint8_t* data, int* datalen);
-#endif 
\ No newline at end of file
+int tftp_parse_data(const uint8_t* buf, int len, uint16_t* block, const uint8_t** data, int* datalen);
+int tftp_parse_oack(const uint8_t* buf, int len, int* blksize, uint32_t* tsize);
+int tftp_sink_memory(void* ctx, uint32_t offset, const uint8_t* data, int len);
+int tftp_fetch(const uint8_t* server_ip, const char* filename, int blksize, tftp_sink_t sink, void* ctx, uint32_t* out_size);
+int tftp_fetch6(const uint8_t* server_ip6, const char* filename, int blksize, tftp_sink_t sink, void* ctx, uint32_t* out_size);
+int tftp_parse_url(const char* url, int* version, uint8_t* server_ip, const char** path);
+#endif
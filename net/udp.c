@@ -0,0 +1,116 @@
+#include "udp.h"
+#include "ipv4.h"
+#include "ipv6.h"
+#include "net_utils.h"
+#include "netpoll.h"
+#include "compat.h"
+#include <stdint.h>
+#include <string.h>
+
+// Each socket owns a small datagram queue fed by the netpoll dispatcher, so
+// a DHCP reply that arrives while TFTP is waiting is kept, not dropped.
+static void udp_input(const struct netpoll_rx* rx, void* ctx) {
+    struct udp_sock* sock = (struct udp_sock*)ctx;
+    if (sock->head - sock->tail >= UDP_SOCK_QUEUE || rx->payload_len > UDP_DGRAM_MAX) {
+        sock->dropped++;
+        return;
+    }
+    struct udp_dgram* d = &sock->queue[sock->head % UDP_SOCK_QUEUE];
+    d->pb = pbuf_ref(rx->pb);
+    d->payload = rx->payload;
+    d->len = (uint16_t)rx->payload_len;
+    d->src_port = rx->src_port;
+    d->ip_version = rx->ip_version;
+    if (rx->ip_version == 6) memcpy(d->src_ip, rx->l3 + 8, 16);
+    else memcpy(d->src_ip, rx->l3 + 12, 4);
+    sock->head++;
+}
+
+int udp_open(struct udp_sock* sock, uint16_t local_port) {
+    memset(sock, 0, sizeof(*sock));
+    sock->local_port = local_port;
+    return netpoll_register_udp_port(local_port, udp_input, sock);
+}
+
+void udp_close(struct udp_sock* sock) {
+    netpoll_unregister(NETPOLL_ROUTE_UDP_PORT, sock->local_port);
+    while (sock->tail != sock->head) {
+        pbuf_free(sock->queue[sock->tail % UDP_SOCK_QUEUE].pb);
+        sock->tail++;
+    }
+}
+
+// Consumes pb, whose data is the UDP payload.
+int udp_send_pbuf(struct udp_sock* sock, const uint8_t* dst_ip, uint16_t dst_port, struct pbuf* pb) {
+    int total = UDP_HDR_LEN + pb->len;
+    uint8_t* seg = pbuf_push(pb, UDP_HDR_LEN);
+    if (!seg || total > UDP_HDR_LEN + UDP_DGRAM_MAX) {
+        pbuf_free(pb);
+        return -1;
+    }
+    seg[0] = sock->local_port >> 8; seg[1] = sock->local_port & 0xFF;
+    seg[2] = dst_port >> 8; seg[3] = dst_port & 0xFF;
+    seg[4] = total >> 8; seg[5] = total & 0xFF;
+    seg[6] = 0; seg[7] = 0;
+    return ipv4_output_pbuf(dst_ip, IP_PROTO_UDP, pb);
+}
+
+int udp_sendto(struct udp_sock* sock, const uint8_t* dst_ip, uint16_t dst_port, const void* data, int len) {
+    if (len < 0 || len > UDP_DGRAM_MAX) return -1;
+    struct pbuf* pb = pbuf_alloc();
+    if (!pb) return -1;
+    memcpy(pbuf_put(pb, len), data, len);
+    return udp_send_pbuf(sock, dst_ip, dst_port, pb);
+}
+
+// IPv6 makes the UDP checksum mandatory, so it is filled in over the
+// pseudo-header for whichever source address the IPv6 layer will pick.
+int udp_send_pbuf6(struct udp_sock* sock, const uint8_t* dst_ip6, uint16_t dst_port, struct pbuf* pb) {
+    int total = UDP_HDR_LEN + pb->len;
+    const uint8_t* src = ipv6_source_for(dst_ip6);
+    uint8_t* seg = pbuf_push(pb, UDP_HDR_LEN);
+    if (!seg || !src || total > UDP_HDR_LEN + UDP_DGRAM_MAX) {
+        pbuf_free(pb);
+        return -1;
+    }
+    seg[0] = sock->local_port >> 8; seg[1] = sock->local_port & 0xFF;
+    seg[2] = dst_port >> 8; seg[3] = dst_port & 0xFF;
+    seg[4] = total >> 8; seg[5] = total & 0xFF;
+    seg[6] = 0; seg[7] = 0;
+    uint16_t csum = ~net_checksum_partial(ipv6_pseudo_sum(src, dst_ip6, IP_PROTO_UDP, total), seg, total);
+    if (csum == 0) csum = 0xFFFF;
+    seg[6] = csum >> 8; seg[7] = csum & 0xFF;
+    return ipv6_output_pbuf(dst_ip6, IP_PROTO_UDP, pb);
+}
+
+int udp_sendto6(struct udp_sock* sock, const uint8_t* dst_ip6, uint16_t dst_port, const void* data, int len) {
+    if (len < 0 || len > UDP_DGRAM_MAX) return -1;
+    struct pbuf* pb = pbuf_alloc();
+    if (!pb) return -1;
+    memcpy(pbuf_put(pb, len), data, len);
+    return udp_send_pbuf6(sock, dst_ip6, dst_port, pb);
+}
+
+static int udp_readable(void* ctx) {
+    struct udp_sock* sock = (struct udp_sock*)ctx;
+    return sock->head != sock->tail;
+}
+
+// Zero-copy receive: the caller gets the queued view and must pbuf_free(out->pb).
+int udp_recv_view(struct udp_sock* sock, struct udp_dgram* out, uint32_t timeout_ms) {
+    if (netpoll_wait(udp_readable, sock, timeout_ms) != 0) return -1;
+    *out = sock->queue[sock->tail % UDP_SOCK_QUEUE];
+    sock->tail++;
+    return out->len;
+}
+
+int udp_recvfrom(struct udp_sock* sock, void* buf, int maxlen, uint8_t* src_ip, uint16_t* src_port, uint32_t timeout_ms) {
+    struct udp_dgram d;
+    if (udp_recv_view(sock, &d, timeout_ms) < 0) return -1;
+    int n = d.len < maxlen ? d.len : maxlen;
+    memcpy(buf, d.payload, n);
+    if (src_ip) memcpy(src_ip, d.src_ip, d.ip_version == 6 ? 16 : 4);
+    if (src_port) *src_port = d.src_port;
+    pbuf_free(d.pb);
+    return n;
+}
@@ -0,0 +1,39 @@
+#ifndef BLOODHORN_UDP_H
+#define BLOODHORN_UDP_H
+#include <stdint.h>
+#include "compat.h"
+#include "pbuf.h"
+
+#define UDP_HDR_LEN 8
+#define UDP_SOCK_QUEUE 16
+#define UDP_DGRAM_MAX 1472
+
+// Queued datagrams are references to the RX buffer they arrived in;
+// payload points into pb. src_ip holds 4 or 16 bytes depending on ip_version.
+struct udp_dgram {
+    struct pbuf* pb;
+    const uint8_t* payload;
+    uint16_t len;
+    uint16_t src_port;
+    uint8_t ip_version;
+    uint8_t src_ip[16];
+};
+
+struct udp_sock {
+    uint16_t local_port;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t dropped;
+    struct udp_dgram queue[UDP_SOCK_QUEUE];
+};
+
+int udp_open(struct udp_sock* sock, uint16_t local_port);
+void udp_close(struct udp_sock* sock);
+int udp_sendto(struct udp_sock* sock, const uint8_t* dst_ip, uint16_t dst_port, const void* data, int len);
+int udp_send_pbuf(struct udp_sock* sock, const uint8_t* dst_ip, uint16_t dst_port, struct pbuf* pb);
+int udp_sendto6(struct udp_sock* sock, const uint8_t* dst_ip6, uint16_t dst_port, const void* data, int len);
+int udp_send_pbuf6(struct udp_sock* sock, const uint8_t* dst_ip6, uint16_t dst_port, struct pbuf* pb);
+// src_ip must have room for 16 bytes if the port can receive IPv6 traffic.
+int udp_recvfrom(struct udp_sock* sock, void* buf, int maxlen, uint8_t* src_ip, uint16_t* src_port, uint32_t timeout_ms);
+int udp_recv_view(struct udp_sock* sock, struct udp_dgram* out, uint32_t timeout_ms);
+#endif
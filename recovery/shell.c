@@ -1,10 +1,13 @@
 #include <stdint.h>
 #include "compat.h"
 #include <string.h>
+#include <stdlib.h>
 #include "shell.h"
+#include "shell_net.h"
 
 #define MAX_CMD_LEN 256
 #define MAX_ARGS 16
+#define NET_OUT_LEN 1024
 
 static char cmd_buffer[MAX_CMD_LEN];
 static char* args[MAX_ARGS];
@@ -33,6 +36,9 @@ void shell_execute_command(void) {
         printf("  help     - Show this help\n");
         printf("  ls       - List files\n");
         printf("  cat <file> - Show file contents\n");
+        printf("  ping <ip> - Send ICMP echo\n");
+        printf("  ifconfig - Show network configuration\n");
+        printf("  netperf <ip> [file] [count] - RTT, loss and TFTP throughput\n");
         printf("  reboot   - Reboot system\n");
         printf("  clear    - Clear screen\n");
     } else if (strcmp(args[0], "ls") == 0) {
@@ -43,6 +49,26 @@ void shell_execute_command(void) {
         } else {
             printf("Usage: cat <filename>\n");
         }
+    } else if (strcmp(args[0], "ping") == 0) {
+        char out[NET_OUT_LEN];
+        if (arg_count > 1) {
+            shell_cmd_ping(args[1], out, sizeof(out));
+            printf("%s", out);
+        } else {
+            printf("Usage: ping <ip>\n");
+        }
+    } else if (strcmp(args[0], "ifconfig") == 0) {
+        char out[NET_OUT_LEN];
+        shell_cmd_ifconfig(out, sizeof(out));
+        printf("%s", out);
+    } else if (strcmp(args[0], "netperf") == 0) {
+        char out[NET_OUT_LEN];
+        if (arg_count > 1) {
+            shell_cmd_netperf(args[1], arg_count > 2 ? args[2] : NULL, arg_count > 3 ? atoi(args[3]) : 0, out, sizeof(out));
+            printf("%s", out);
+        } else {
+            printf("Usage: netperf <ip> [file] [count]\n");
+        }
     } else if (strcmp(args[0], "reboot") == 0) {
         printf("Rebooting...\n");
         // Call reboot function
@@ -4,16 +4,19 @@
 #include <stdio.h>
 #include <stdint.h>
 #include "net/pxe.h"
+#include "net/netpoll.h"
+#include "net/net_utils.h"
+#include "net/tftp.h"
+
+#define NETPERF_MAX_SAMPLES 256
+#define NETPERF_DEFAULT_COUNT 20
 
-// Minimal ICMP echo implementation using PXE stack (if supported)
 // Returns 0 on success, -1 on failure
 int shell_cmd_ping(const char* host, char* out, int maxlen) {
-    // This assumes PXE stack provides a function for ICMP echo (not standard, but can be extended)
-    extern int pxe_icmp_echo(const char* host, int* rtt_ms);
-    int rtt = 0;
-    int result = pxe_icmp_echo(host, &rtt);
+    uint32_t rtt = 0;
+    int result = pxe_icmp_echo(host, 1, &rtt);
     if (result == 0) {
-        snprintf(out, maxlen, "Reply from %s: time=%dms\n", host, rtt);
+        snprintf(out, maxlen, "Reply from %s: time=%u.%03ums\n", host, rtt / 1000, rtt % 1000);
         return 0;
     } else {
         snprintf(out, maxlen, "No reply from %s\n", host);
@@ -28,6 +31,20 @@ int shell_cmd_ifconfig(char* out, int maxlen) {
         snprintf(out, maxlen, "No network info available\n");
         return -1;
     }
+    if (info->ipv6) {
+        char addr[48], ll[48], gw[48], dns[48];
+        net_format_ipv6(info->client_ip6, addr, sizeof(addr));
+        net_format_ipv6(info->link_local6, ll, sizeof(ll));
+        net_format_ipv6(info->router_ip6, gw, sizeof(gw));
+        net_format_ipv6(info->dns_server6, dns, sizeof(dns));
+        snprintf(out, maxlen,
+            "eth0: inet6 %s/%d\n  link-local: %s\n  gateway: %s\n  dns: %s\n  tftp: %s\n  bootfile: %s\n  boot url: %s\n",
+            addr, info->prefix_len6, ll, gw, dns,
+            info->tftp_server,
+            info->boot_file,
+            info->boot_url);
+        return 0;
+    }
     uint8_t* ip = (uint8_t*)&info->client_ip;
     uint8_t* mask = (uint8_t*)&info->subnet_mask;
     uint8_t* gw = (uint8_t*)&info->router_ip;
@@ -42,4 +59,77 @@ int shell_cmd_ifconfig(char* out, int maxlen) {
         info->boot_file,
         info->domain_name);
     return 0;
-} 
\ No newline at end of file
+}
+
+static int netperf_discard(void* ctx, uint32_t offset, const uint8_t* data, int len) {
+    (void)ctx; (void)offset; (void)data; (void)len;
+    return 0;
+}
+
+static uint32_t netperf_percentile(const uint32_t* sorted, int n, int pct) {
+    int idx = (n * pct + 99) / 100 - 1;
+    if (idx < 0) idx = 0;
+    return sorted[idx];
+}
+
+// RTT distribution and loss over count echoes, then TFTP throughput for
+// tftp_file (skipped when NULL) fetched into a discard sink.
+int shell_cmd_netperf(const char* host, const char* tftp_file, int count, char* out, int maxlen) {
+    static uint32_t samples[NETPERF_MAX_SAMPLES];
+    uint8_t server[16];
+    int n = 0, pos = 0, v6 = 0;
+    uint64_t sum = 0;
+    if (net_parse_ipv4(host, server) != 0) {
+        if (net_parse_ipv6(host, server) != 0) {
+            snprintf(out, maxlen, "Bad address: %s\n", host);
+            return -1;
+        }
+        v6 = 1;
+    }
+    if (count <= 0) count = NETPERF_DEFAULT_COUNT;
+    if (count > NETPERF_MAX_SAMPLES) count = NETPERF_MAX_SAMPLES;
+    const struct netpoll_stats* st = netpoll_get_stats();
+    uint64_t dropped0 = st->rx_dropped;
+    uint64_t unclaimed0 = st->rx_unclaimed;
+
+    for (int i = 0; i < count; ++i) {
+        uint32_t rtt;
+        if (pxe_icmp_echo(host, (uint16_t)(i + 1), &rtt) != 0) continue;
+        int j = n++;
+        while (j > 0 && samples[j - 1] > rtt) {
+            samples[j] = samples[j - 1];
+            j--;
+        }
+        samples[j] = rtt;
+        sum += rtt;
+    }
+    pos += snprintf(out + pos, maxlen - pos, "ping %s: %d sent, %d received, %d%% loss\n",
+        host, count, n, (count - n) * 100 / count);
+    if (n > 0 && pos < maxlen) {
+        pos += snprintf(out + pos, maxlen - pos,
+            "  rtt us: min %u avg %u p50 %u p90 %u p99 %u max %u\n",
+            samples[0], (uint32_t)(sum / n),
+            netperf_percentile(samples, n, 50), netperf_percentile(samples, n, 90),
+            netperf_percentile(samples, n, 99), samples[n - 1]);
+    }
+
+    if (tftp_file && pos < maxlen) {
+        uint32_t size = 0;
+        uint64_t start = net_ticks();
+        int r = v6 ? tftp_fetch6(server, tftp_file, TFTP_MAX_BLKSIZE6, netperf_discard, 0, &size)
+                   : tftp_fetch(server, tftp_file, TFTP_MAX_BLKSIZE, netperf_discard, 0, &size);
+        uint64_t us = net_ticks_to_us(net_ticks() - start);
+        if (r != 0) {
+            pos += snprintf(out + pos, maxlen - pos, "tftp %s: failed\n", tftp_file);
+        } else {
+            uint32_t kbps = us ? (uint32_t)(((uint64_t)size * 1000000 / us) / 1024) : 0;
+            pos += snprintf(out + pos, maxlen - pos, "tftp %s: %u bytes in %u ms, %u KiB/s\n",
+                tftp_file, size, (uint32_t)(us / 1000), kbps);
+        }
+    }
+    if (pos < maxlen) {
+        snprintf(out + pos, maxlen - pos, "  rx dropped %u, unclaimed %u\n",
+            (uint32_t)(st->rx_dropped - dropped0), (uint32_t)(st->rx_unclaimed - unclaimed0));
+    }
+    return n > 0 ? 0 : -1;
+}
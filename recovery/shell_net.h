@@ -2,4 +2,5 @@
 #define BLOODHORN_SHELL_NET_H
 int shell_cmd_ping(const char* host, char* out, int maxlen);
 int shell_cmd_ifconfig(char* out, int maxlen);
-#endif 
\ No newline at end of file
+int shell_cmd_netperf(const char* host, const char* tftp_file, int count, char* out, int maxlen);
+#endif 
@@ -55,41 +55,80 @@ static uint32_t gamma1(uint32_t x) {
     return rotr(x, 17) ^ rotr(x, 19) ^ (x >> 10);
 }
 
-void sha256_hash(const uint8_t* data, uint32_t len, uint8_t* hash) {
-    uint32_t h[8];
-    memcpy(h, sha256_h, sizeof(h));
+static void sha256_block(uint32_t* h, const uint8_t* p) {
     uint32_t w[64];
     uint32_t a, b, c, d, e, f, g, h_val;
     uint32_t temp1, temp2;
-    uint64_t bitlen = len * 8;
-    uint32_t blocks = (len + 64) / 64;
-    for (uint32_t i = 0; i < blocks; i++) {
-        for (int j = 0; j < 16; j++) {
-            w[j] = (data[i*64 + j*4] << 24) | (data[i*64 + j*4 + 1] << 16) |
-                   (data[i*64 + j*4 + 2] << 8) | data[i*64 + j*4 + 3];
-        }
-        for (int j = 16; j < 64; j++) {
-            w[j] = gamma1(w[j-2]) + w[j-7] + gamma0(w[j-15]) + w[j-16];
-        }
-        a = h[0]; b = h[1]; c = h[2]; d = h[3];
-        e = h[4]; f = h[5]; g = h[6]; h_val = h[7];
-        for (int j = 0; j < 64; j++) {
-            temp1 = h_val + sigma1(e) + ch(e, f, g) + sha256_k[j] + w[j];
-            temp2 = sigma0(a) + maj(a, b, c);
-            h_val = g; g = f; f = e; e = d + temp1;
-            d = c; c = b; b = a; a = temp1 + temp2;
+    for (int j = 0; j < 16; j++) {
+        w[j] = ((uint32_t)p[j*4] << 24) | ((uint32_t)p[j*4 + 1] << 16) |
+               ((uint32_t)p[j*4 + 2] << 8) | p[j*4 + 3];
+    }
+    for (int j = 16; j < 64; j++) {
+        w[j] = gamma1(w[j-2]) + w[j-7] + gamma0(w[j-15]) + w[j-16];
+    }
+    a = h[0]; b = h[1]; c = h[2]; d = h[3];
+    e = h[4]; f = h[5]; g = h[6]; h_val = h[7];
+    for (int j = 0; j < 64; j++) {
+        temp1 = h_val + sigma1(e) + ch(e, f, g) + sha256_k[j] + w[j];
+        temp2 = sigma0(a) + maj(a, b, c);
+        h_val = g; g = f; f = e; e = d + temp1;
+        d = c; c = b; b = a; a = temp1 + temp2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += h_val;
+}
+
+void sha256_init(struct sha256_ctx* ctx) {
+    memcpy(ctx->h, sha256_h, sizeof(ctx->h));
+    ctx->len = 0;
+}
+
+// Whole blocks are hashed in place; only a partial tail is buffered.
+void sha256_update(struct sha256_ctx* ctx, const uint8_t* data, uint64_t len) {
+    uint32_t used = (uint32_t)(ctx->len & 63);
+    ctx->len += len;
+    if (used) {
+        uint32_t n = 64 - used;
+        if (len < n) {
+            memcpy(ctx->buf + used, data, len);
+            return;
         }
-        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
-        h[4] += e; h[5] += f; h[6] += g; h[7] += h_val;
+        memcpy(ctx->buf + used, data, n);
+        sha256_block(ctx->h, ctx->buf);
+        data += n;
+        len -= n;
+    }
+    for (; len >= 64; data += 64, len -= 64) sha256_block(ctx->h, data);
+    memcpy(ctx->buf, data, len);
+}
+
+void sha256_final(struct sha256_ctx* ctx, uint8_t* hash) {
+    uint64_t bitlen = ctx->len * 8;
+    uint32_t used = (uint32_t)(ctx->len & 63);
+    ctx->buf[used++] = 0x80;
+    if (used > 56) {
+        memset(ctx->buf + used, 0, 64 - used);
+        sha256_block(ctx->h, ctx->buf);
+        used = 0;
     }
+    memset(ctx->buf + used, 0, 56 - used);
+    for (int i = 0; i < 8; i++) ctx->buf[56 + i] = (uint8_t)(bitlen >> (56 - i * 8));
+    sha256_block(ctx->h, ctx->buf);
     for (int i = 0; i < 8; i++) {
-        hash[i*4] = (h[i] >> 24) & 0xFF;
-        hash[i*4 + 1] = (h[i] >> 16) & 0xFF;
-        hash[i*4 + 2] = (h[i] >> 8) & 0xFF;
-        hash[i*4 + 3] = h[i] & 0xFF;
+        hash[i*4] = (ctx->h[i] >> 24) & 0xFF;
+        hash[i*4 + 1] = (ctx->h[i] >> 16) & 0xFF;
+        hash[i*4 + 2] = (ctx->h[i] >> 8) & 0xFF;
+        hash[i*4 + 3] = ctx->h[i] & 0xFF;
     }
 }
 
+void sha256_hash(const uint8_t* data, uint32_t len, uint8_t* hash) {
+    struct sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, hash);
+}
+
 static int mod_exp(const uint8_t* base, const uint8_t* exp, int exp_len, const uint8_t* mod, int mod_len, uint8_t* out, int out_len) {
     uint8_t result[512] = {0};
     result[out_len - 1] = 1;
@@ -3,6 +3,15 @@
 #include <stdint.h>
 #include "compat.h"
 
+struct sha256_ctx {
+    uint32_t h[8];
+    uint64_t len;
+    uint8_t buf[64];
+};
+
+void sha256_init(struct sha256_ctx* ctx);
+void sha256_update(struct sha256_ctx* ctx, const uint8_t* data, uint64_t len);
+void sha256_final(struct sha256_ctx* ctx, uint8_t* hash);
 void sha256_hash(const uint8_t* data, uint32_t len, uint8_t* hash);
 int verify_signature(const uint8_t* data, uint32_t len, const uint8_t* signature, const uint8_t* public_key);
 